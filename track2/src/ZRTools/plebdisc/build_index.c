@@ -11,10 +11,13 @@
 #include "dotkws.h"
 #include "score_matches.h"
 #include "signature.h"
+#include "index.h"
 
 // -----------------------------------
 // Index structure
 // -----------------------------------
+// Written in the versioned, page aligned layout described in index.h.
+// plebkws still reads indexes in the original interleaved layout:
 // SIG_NUM_BYTES: 1 int
 // Nfiles: 1 int
 // for i = 1 to Nfiles:
@@ -44,11 +47,13 @@ int S = 32;
 int maxframes = 0;
 char *filelist = NULL;
 char *indexfile = NULL;
+char *manifest = NULL;
 
 void usage()
 {
   fatal("usage: build_index [-filelist <str> (REQUIRED)]\
 \n\t[-indexfile <str> (REQUIRED)]\
+\n\t[-manifest <str> (add indexfile as a segment of this manifest)]\
 \n\t[-P <n> (defaults to 4)]\
 \n\t[-S <n> (defaults to 32)]\n");
 }
@@ -60,6 +65,7 @@ void parse_args(int argc, char **argv)
   {
      if( strcmp(argv[i], "-filelist") == 0 ) filelist = argv[++i];
      else if ( strcmp(argv[i], "-indexfile") == 0 ) indexfile = argv[++i];
+     else if ( strcmp(argv[i], "-manifest") == 0 ) manifest = argv[++i];
      else if ( strcmp(argv[i], "-P") == 0 ) P = atoi(argv[++i]);
      else if ( strcmp(argv[i], "-S") == 0 ) S = atoi(argv[++i]);
      else {
@@ -78,13 +84,16 @@ void parse_args(int argc, char **argv)
      fatal("\nERROR: indexfile arg is required");
   }
 
+  if ( manifest && strlen(indexfile) >= MANIFEST_MAXCHAR )
+     fatal("\nERROR: indexfile name is too long for a manifest");
+
   fprintf(stderr, "\nRun Parameters\n--------------\n \
 filelist = %s, \n \
 indexfile = %s, \n \
 P = %d, S = %d,\n\n ",
 	  filelist, indexfile, P, S);
 
-  SIG_NUM_BYTES = S/8;
+  set_signature_bits(S);
 }
 
 void randperm(struct signature **allfeats, frameind Ntot) 
@@ -126,19 +135,6 @@ int main(int argc, char **argv)
    fclose(fptr);
    fprintf(stderr, "Finished. %f s\n",toc());
 
-   // Write number of bytes per signature to file
-   fwrite( &SIG_NUM_BYTES, sizeof(int), 1, fout );
-
-   // Write input file info to index
-   fprintf(stderr,"Dumping filenames to index: "); tic();
-   fwrite( &Nfiles, sizeof(int), 1, fout );
-   for ( int i = 0; i < Nfiles; i++ ) {
-      int nchars = strlen(files[i])+1;
-      fwrite( &nchars, sizeof(int), 1, fout );
-      fwrite( files[i], sizeof(char), strlen(files[i])+1, fout );
-   }
-   fprintf(stderr, "%f s\n",toc());
-
    // Read the signature files
    fprintf(stderr,"Reading the signature files: \n"); tic();
 
@@ -163,19 +159,39 @@ int main(int argc, char **argv)
 
    fprintf(stderr, "Total signatures to index: %d\n",Ntot);
       
-   // Write input file lengths (in frames) and signatures to index
-   fprintf(stderr,"Dumping file lengths and signatures to index: "); tic();
-   fwrite( &Ntot, sizeof(frameind), 1, fout );
-   fwrite( Narr, sizeof(int), Nfiles, fout );
+   // Lay out the index and write the header, file and signature sections
+   fprintf(stderr,"Dumping file info and signatures to index: "); tic();
+   IndexHeader hdr;
+   IndexSection sections[INDEX_NSECTIONS];
+   index_layout(&hdr, sections, files, Nfiles, Ntot, P);
+   fwrite( &hdr, sizeof(IndexHeader), 1, fout );
+   fwrite( sections, sizeof(IndexSection), INDEX_NSECTIONS, fout );
+
+   size_t off = 0;
+   for ( int i = 0; i < Nfiles; i++ ) {
+      write_index_section( fout, sections, IDX_FILES, off, files[i], strlen(files[i])+1 );
+      off += strlen(files[i])+1;
+   }
+   write_index_section( fout, sections, IDX_NARR, 0, Narr, sizeof(int)*Nfiles );
 
+   size_t stride = hdr.sigstride;
+   int *ids = (int *) MALLOC( sizeof(int)*(Ntot+1) );
+   int *fids = (int *) MALLOC( sizeof(int)*(Ntot+1) );
+   off = 0;
    for ( int i = 0; i < Nfiles; i++ ) {
+      // each file's signatures are one contiguous block at the padded stride
+      if ( Narr[i] > 0 )
+	 write_index_section( fout, sections, IDX_SIGS, stride*off, 
+			      feats[i][0].byte_, stride*Narr[i] );
       for ( int j = 0; j < Narr[i]; j++ ) {
-	 struct signature *sptr = &feats[i][j];
-	 fwrite( &sptr->id, sizeof(int), 1, fout );
-	 fwrite( sptr->byte_, sizeof(byte), SIG_NUM_BYTES, fout );
-	 fwrite( &sptr->fid, sizeof(int), 1, fout );
+	 ids[off] = feats[i][j].id;
+	 fids[off++] = feats[i][j].fid;
       }
-   }   
+   }
+   write_index_section( fout, sections, IDX_IDS, 0, ids, sizeof(int)*Ntot );
+   write_index_section( fout, sections, IDX_FIDS, 0, fids, sizeof(int)*Ntot );
+   FREE(ids);
+   FREE(fids);
    fprintf(stderr, "%f s\n",toc());
 
    fprintf(stderr,"Constructing the pointer array: "); tic();
@@ -195,27 +211,40 @@ int main(int argc, char **argv)
    // Build the index and write to file on the fly
    fprintf(stderr,"Constructing and writing the sorted lists: \n"); tic();
 
-   fwrite( &P, sizeof(int), 1, fout ); // Write P to file
+   frameind *order = (frameind *) MALLOC( sizeof(frameind)*(Ntot+1) );
+   uint64_t *keys = (uint64_t *) MALLOC( sizeof(uint64_t)*(Ntot+1) );
    for (int i = 0; i < P; i++) {
       //randperm(allfeats, Ntot);
 
       // Write ith permutation to file
-      fwrite( PERMUTE_, sizeof(int), SIG_NUM_BYTES, fout ); 
+      write_index_section( fout, sections, IDX_PERMUTE, sizeof(int)*SIG_NUM_BYTES*i, 
+			   PERMUTE_, sizeof(int)*SIG_NUM_BYTES );
       
       // Sort the pointer array
-      qsort(allfeats, Ntot, sizeof(struct signature*), 
-	    signature_ptr_greater);
+      sort_signature_ptrs(allfeats, Ntot, PERMUTE_, keys);
 
       for ( int j = 0; j < Ntot; j++ ) {
-	 fwrite( &allfeats[j]->indexid, sizeof(frameind), 1, fout );
+	 order[j] = allfeats[j]->indexid;
       }
+      write_index_section( fout, sections, IDX_ORDER, sizeof(frameind)*(size_t)Ntot*i, 
+			   order, sizeof(frameind)*Ntot );
+      write_index_section( fout, sections, IDX_KEYS, sizeof(uint64_t)*(size_t)Ntot*i, 
+			   keys, sizeof(uint64_t)*Ntot );
       permute();
    }
+   FREE(order);
+   FREE(keys);
    fprintf(stderr, "Finished. %f s\n",toc());
 
    // Close the index file
    fclose(fout);
 
+   // Publish the new segment
+   if ( manifest ) {
+      append_manifest(manifest, indexfile);
+      fprintf(stderr, "Added %s to manifest %s\n", indexfile, manifest);
+   }
+
    // Free the heap
    FREE(PERMUTE_);
 
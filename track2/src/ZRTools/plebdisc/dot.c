@@ -5,12 +5,15 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <omp.h>
 #include "util.h"
 #include "dot.h"
 
 #define RHOSKIP 50
 #define MAXMATCHES 100000
 #define PSILTHR 0.5
+#define MF_TILE 1024 // Rows per median filter work unit
+#define SORT_SMALLROW 32 // Rows up to this size are insertion sorted
 
 int Dot_compare(const void *A, const void *B) 
 {
@@ -28,109 +31,243 @@ int DotXV_compare(const void *A, const void *B)
    else return 0;
 }
 
-void hist_feats(int *hist, float *feats, int nframes, int nphonemes, float threshold)
+void dotbuf_init(DotBuffer *buf, int nrows)
 {
-  for(int frame=0;frame<nframes;frame++)
-    for(int phoneme=0; phoneme<nphonemes; phoneme++, feats++)
-      if(*feats > threshold) hist[phoneme]++;
+   buf->blocks = NULL;
+   buf->nblocks = 0;
+   buf->maxblocks = 0;
+   buf->cnt = 0;
+   buf->nrows = nrows;
+   buf->rowcnts = NULL;
+   if ( nrows > 0 )
+      buf->rowcnts = (int *) CALLOC(nrows, sizeof(int));
 }
 
-void radix_sorty(int N, Dot *dotlist, int dotcnt, DotXV *sorted_dots, int *cumsum)
+// Makes room for one more block descriptor
+static void dotbuf_reserve(DotBuffer *buf)
 {
-  int *rowcnts = (int *)MALLOC(N*sizeof(int));
-  memset(rowcnts, 0, sizeof(*rowcnts) * N);
+   if ( buf->nblocks < buf->maxblocks )
+      return;
+
+   int maxblocks = MAX(16, 2*buf->maxblocks);
+   DotBlock *blocks = (DotBlock *) MALLOC(maxblocks*sizeof(DotBlock));
+   if ( buf->blocks ) {
+      memcpy(blocks, buf->blocks, buf->nblocks*sizeof(DotBlock));
+      FREE(buf->blocks);
+   }
+   buf->blocks = blocks;
+   buf->maxblocks = maxblocks;
+}
 
-  for(int ind = 0; ind<dotcnt; ind++)
-    rowcnts[dotlist[ind].yp]++;
+DotBlock *dotbuf_grow(DotBuffer *buf)
+{
+   dotbuf_reserve(buf);
 
-  make_cumhist_signed(cumsum, rowcnts, N);
+   int cap = DOTBUF_MINBLOCK;
+   if ( buf->nblocks > 0 )
+      cap = MIN(DOTBUF_MAXBLOCK, 2*buf->blocks[buf->nblocks-1].cap);
 
-  memset(rowcnts, 0, sizeof(*rowcnts) * N);
+   DotBlock *b = buf->blocks + buf->nblocks++;
+   b->dots = (Dot *) MALLOC(cap*sizeof(Dot));
+   b->cnt = 0;
+   b->cap = cap;
+   return b;
+}
 
-  Dot *start = dotlist;
-  Dot *end = dotlist + dotcnt;
+void dotbuf_append(DotBuffer *dst, DotBuffer *src)
+{
+   for ( int i = 0; i < src->nblocks; i++ ) {
+      DotBlock *b = src->blocks + i;
+      if ( b->cnt == 0 ) {
+	 FREE(b->dots);
+	 continue;
+      }
 
-  for(; start < end; start++) {
-    int yp = start->yp;
-    DotXV *d = &sorted_dots[cumsum[yp]+rowcnts[yp]];
-    d->xp = start->xp;
-    d->val = start->val;
-    rowcnts[yp]++;
-  }
-  FREE(rowcnts);
+      if ( dst->rowcnts )
+	 for ( int j = 0; j < b->cnt; j++ )
+	    dst->rowcnts[b->dots[j].yp]++;
+
+      dotbuf_reserve(dst);
+      dst->blocks[dst->nblocks++] = *b;
+      dst->cnt += b->cnt;
+   }
+
+   if ( src->blocks ) FREE(src->blocks);
+   if ( src->rowcnts ) memset(src->rowcnts, 0, src->nrows*sizeof(int));
+   src->blocks = NULL;
+   src->nblocks = 0;
+   src->maxblocks = 0;
+   src->cnt = 0;
 }
 
-void quick_sortx(int N, DotXV *radixdots, int dotcnt, int *cumsum )
+void dotbuf_free(DotBuffer *buf)
 {
-   for (int yp=0; yp<N; yp++)
-      qsort(&radixdots[cumsum[yp]], cumsum[yp+1]-cumsum[yp], sizeof(DotXV), &DotXV_compare);
+   for ( int i = 0; i < buf->nblocks; i++ )
+      FREE(buf->blocks[i].dots);
+   if ( buf->blocks ) FREE(buf->blocks);
+   if ( buf->rowcnts ) FREE(buf->rowcnts);
+   buf->blocks = NULL;
+   buf->nblocks = 0;
+   buf->maxblocks = 0;
+   buf->cnt = 0;
+   buf->rowcnts = NULL;
 }
 
-int compress_dotlist(Dot *dotlist, int prime, float thr)
+void hist_feats(int *hist, float *feats, int nframes, int nphonemes, float threshold)
 {
-   int wpos = 0;
-   int rpos = 1;
+  for(int frame=0;frame<nframes;frame++)
+    for(int phoneme=0; phoneme<nphonemes; phoneme++, feats++)
+      if(*feats > threshold) hist[phoneme]++;
+}
 
-   for(; wpos<prime; wpos++) {
-      if(wpos==rpos) rpos++;
+// Sorts a row of n dots by xp (nonnegative): insertion sort for short rows,
+// otherwise an LSD radix sort through tmp, one byte per pass, skipping the
+// passes where every xp shares the digit. Returns whichever of a and tmp
+// holds the result.
+static DotXV *sort_row_xp(DotXV *a, DotXV *tmp, int n)
+{
+   if ( n <= SORT_SMALLROW ) {
+      for ( int i = 1; i < n; i++ ) {
+	 DotXV d = a[i];
+	 int j = i;
+	 for ( ; j > 0 && a[j-1].xp > d.xp; j-- )
+	    a[j] = a[j-1];
+	 a[j] = d;
+      }
+      return a;
+   }
 
-      if(dotlist[wpos].val<=thr) {
-	 while(rpos<prime && dotlist[rpos].val<=thr) rpos++;
-	 if(rpos==prime) return wpos;
+   int count[4][256];
+   memset(count, 0, sizeof(count));
+   for ( int i = 0; i < n; i++ )
+      for ( int d = 0; d < 4; d++ )
+	 count[d][(a[i].xp >> (8*d)) & 0xff]++;
 
-	 dotlist[wpos].val = 1;
-	 dotlist[wpos].xp = dotlist[rpos].xp;
-	 dotlist[wpos].yp = dotlist[rpos].yp;
-	 dotlist[rpos].val = 0;
+   for ( int d = 0; d < 4; d++ ) {
+      if ( count[d][(a[0].xp >> (8*d)) & 0xff] == n )
+	 continue;
+      int sum = 0;
+      for ( int v = 0; v < 256; v++ ) {
+	 int c = count[d][v];
+	 count[d][v] = sum;
+	 sum += c;
       }
-   } 
-
-   return wpos;
+      for ( int i = 0; i < n; i++ )
+	 tmp[count[d][(a[i].xp >> (8*d)) & 0xff]++] = a[i];
+      DotXV *t = a; a = tmp; tmp = t;
+   }
+   return a;
 }
 
-int dot_dedup(DotXV *dotlist, int *cumsum, int nrows, float thr)
+int radix_sort_dots(int N, DotBuffer *dots, DotXV *sorted_dots, int *cumsum)
 {
-   int initcnt = cumsum[nrows];
+  int nthreads = 1;
+  int *offsets = NULL;
+  int *rowstart = (int *)MALLOC((N+1)*sizeof(int));
+  int *rowcnt = (int *)MALLOC(N*sizeof(int));
+  DotXV *tmp = (DotXV *)MALLOC((dots->cnt+1)*sizeof(DotXV));
+
+#pragma omp parallel
+  {
+    // One count array per thread of the actual team, which is a single
+    // thread when called from a worker of plebdisc's batch mode
+#pragma omp single
+    {
+      nthreads = omp_get_num_threads();
+      offsets = (int *)CALLOC((long)nthreads*N, sizeof(int));
+    }
+    int *offset = offsets + (long)omp_get_thread_num()*N;
+
+    // Count each thread's blocks by row, then lay out the rows with the
+    // threads' shares of a row in thread order
+#pragma omp for schedule(static)
+    for(int b = 0; b < dots->nblocks; b++)
+      for(int ind = 0; ind < dots->blocks[b].cnt; ind++)
+	offset[dots->blocks[b].dots[ind].yp]++;
+
+#pragma omp single
+    {
+      int sum = 0;
+      for(int yp = 0; yp < N; yp++) {
+	rowstart[yp] = sum;
+	for(int t = 0; t < nthreads; t++) {
+	  int c = offsets[(long)t*N+yp];
+	  offsets[(long)t*N+yp] = sum;
+	  sum += c;
+	}
+      }
+      rowstart[N] = sum;
+    }
 
-   int *rowcnt = (int *) MALLOC( sizeof(int)*nrows );
+    // The same static schedule hands each thread the blocks it counted
+#pragma omp for schedule(static)
+    for(int b = 0; b < dots->nblocks; b++) {
+      Dot *start = dots->blocks[b].dots;
+      Dot *end = start + dots->blocks[b].cnt;
+      for(; start < end; start++) {
+	DotXV *d = &tmp[offset[start->yp]++];
+	d->xp = start->xp;
+	d->val = start->val;
+      }
+    }
 
-   for ( int i = 0; i < nrows; i++ )
-   {
-      //fprintf(stderr,"i: %d, rowcnt: \n", i);
-      rowcnt[i] = cumsum[i+1]-cumsum[i];
-      //fprintf(stderr,"i: %d, rowcnt: %d ", i, rowcnt[i]);
-      int start = (i == 0) ? 0 : cumsum[i];
-      for ( int j = start+1; j < cumsum[i+1]; j++ ) {
-	 if ( dotlist[j].xp == dotlist[j-1].xp ) {
-	    dotlist[j].val = -1e6;
-	    rowcnt[i]--;
-	 }	 
+    // Sort each row by xp and drop repeated dots (equal xp and yp mean the
+    // same frame pair, hence the same value)
+    DotXV *scratch = NULL;
+    int scap = 0;
+#pragma omp for schedule(dynamic,256)
+    for(int yp = 0; yp < N; yp++) {
+      DotXV *row = tmp + rowstart[yp];
+      int n = rowstart[yp+1] - rowstart[yp];
+      if ( n > scap ) {
+	if ( scratch ) FREE(scratch);
+	scap = MAX(n, 2*scap);
+	scratch = (DotXV *)MALLOC(scap*sizeof(DotXV));
       }
-   }
+      DotXV *sorted = sort_row_xp(row, scratch, n);
+      int u = 0;
+      for(int i = 0; i < n; i++)
+	if ( u == 0 || sorted[i].xp != row[u-1].xp )
+	  row[u++] = sorted[i];
+      rowcnt[yp] = u;
+    }
+    if ( scratch ) FREE(scratch);
 
-   for ( int i = 0; i < nrows; i++ )
-   {
-      cumsum[i+1] = cumsum[i]+rowcnt[i];
-   }
+#pragma omp single
+    make_cumhist_signed(cumsum, rowcnt, N);
 
-   FREE(rowcnt);
+#pragma omp for schedule(dynamic,256)
+    for(int yp = 0; yp < N; yp++)
+      memcpy(sorted_dots + cumsum[yp], tmp + rowstart[yp], rowcnt[yp]*sizeof(DotXV));
+  }
+
+  FREE(offsets);
+  FREE(rowstart);
+  FREE(rowcnt);
+  FREE(tmp);
+
+  return cumsum[N];
+}
 
+int compress_dotlist(Dot *dotlist, int prime, float thr)
+{
    int wpos = 0;
    int rpos = 1;
 
-   for(; wpos<initcnt; wpos++) {
+   for(; wpos<prime; wpos++) {
       if(wpos==rpos) rpos++;
 
-      if(dotlist[wpos].val < thr) {
-	 while(rpos < initcnt && dotlist[rpos].val < thr) rpos++;
-	 if(rpos==initcnt) return wpos;
+      if(dotlist[wpos].val<=thr) {
+	 while(rpos<prime && dotlist[rpos].val<=thr) rpos++;
+	 if(rpos==prime) return wpos;
 
-	 dotlist[wpos].val = dotlist[rpos].val;
+	 dotlist[wpos].val = 1;
 	 dotlist[wpos].xp = dotlist[rpos].xp;
-	 dotlist[rpos].val = -1e6;
+	 dotlist[wpos].yp = dotlist[rpos].yp;
+	 dotlist[rpos].val = 0;
       }
    } 
-   
+
    return wpos;
 }
 
@@ -200,82 +337,90 @@ int compute_dotplot_sparse(float *feats1, int N1, float *feats2, int N2, int D,
    return compress_dotlist(dotlist, prime, 1-2*distthr);   
 }
 
-int count_dots_before(int pos, DotXV *arr, int n)
-{
-   // Do binary search down to a range of 10 or less dots
-   if(pos < arr[0].xp) return 0;
-   if(pos > arr[n-1].xp) return n;
-   int low = 0;
-   int high = n;
-   while(high - low > 10) {
-      int mid = low + (high - low)/2;
-      int p = arr[mid].xp;
-      if(pos == p) return mid;
-      else if(p < pos) low = mid;
-      else high = mid;
-   }
-   
-   // Do linear pass through remaining dots
-   while(low < high) {
-      int p = arr[low].xp;
-      if(pos == p) return low;
-      else if(p < pos) low++;
-      else return low;
-   }
-      
-   return high;
-}
+typedef struct DotXVList {
+   DotXV *dots;
+   int cnt, cap;
+} DotXVList;
 
-int count_dots_interval(int start, int end, DotXV *arr, int cnt)
+static void dotxv_add(DotXVList *l, int xp, float val)
 {
-   return count_dots_before(end, arr, cnt) - count_dots_before(start, arr, cnt);
+   if ( l->cnt == l->cap ) {
+      int cap = MAX(DOTBUF_MINBLOCK, 2*l->cap);
+      DotXV *dots = (DotXV *) MALLOC(cap*sizeof(DotXV));
+      if ( l->dots ) {
+	 memcpy(dots, l->dots, l->cnt*sizeof(DotXV));
+	 FREE(l->dots);
+      }
+      l->dots = dots;
+      l->cap = cap;
+   }
+   l->dots[l->cnt].xp = xp;
+   l->dots[l->cnt++].val = val;
 }
 
-int careful_add_dots(int xp1, int xp2, int yp, Dot *outlist, int sumthr, int dx, DotXV *arr, int cnt)
+// Median filters one sorted, deduplicated row: adds a dot at each visited
+// column with more than sumthr dots within dx. The visited columns never
+// decrease, so the window [lo,hi) of arr is advanced instead of searched.
+static void median_filt_row(DotXV *arr, int cnt, int dx, int sumthr, DotXVList *out)
 {
-   Dot *o = outlist;
-   for(int i=xp1; i<xp2; i++) {
-      if ( count_dots_interval(i-dx, i+dx+1, arr, cnt) > sumthr ) {
-	 o->val = 1;
-	 o->xp = i;
-	 o->yp = yp;
-	 o++;
+   int window = 2*dx+1;
+   int done_so_far = 0;
+   int lo = 0, hi = 0;
+   DotXV *end = arr + cnt;
+   DotXV *head = arr-1;
+   DotXV *tail = arr;
+   while(head < end-1 && head - tail < sumthr) {
+      head++;
+      while(head - tail >= sumthr) {
+	 if(head->xp - tail->xp <= window) {
+	    int xp1 = MAX(tail->xp-dx-1, done_so_far);
+	    int xp2 = MAX(done_so_far + 1, head->xp + dx + 2);
+	    for(int i=xp1; i<xp2; i++) {
+	       while ( lo < cnt && arr[lo].xp < i-dx ) lo++;
+	       while ( hi < cnt && arr[hi].xp < i+dx+1 ) hi++;
+	       if ( hi - lo > sumthr )
+		  dotxv_add(out, i, 1);
+	    }
+	    done_so_far = head->xp + dx + 2;
+	 }
+	 tail++;
       }
    }
-   
-   return o - outlist;
 }
-    
-int median_filtx(int N, DotXV *inlist, int incnt, int *cumsum, int dx, float medthr, Dot *outlist)
+
+int median_filtx(int N, DotXV *inlist, int incnt, int *cumsum, int dx, float medthr, 
+		 DotXV **outlist, int *outcumsum)
 {
    int window = 2*dx+1;
    int sumthr = medthr*window/2;
 
-   int outcnt = 0;
-   
-  for(int yp=0;yp<N;yp++) {
-    int done_so_far = 0;
-    DotXV *arr = inlist + cumsum[yp];
-    DotXV *end = inlist + cumsum[yp+1];
-    int cnt = end - arr;
-    DotXV *head = arr-1;
-    DotXV *tail = arr;
-    while(head < end-1 && head - tail < sumthr) {
-      head++;
-      while(head - tail >= sumthr) {
-	if(head->xp - tail->xp <= window) {
-	   int newcnt = careful_add_dots(MAX(tail->xp-dx-1, done_so_far), 
-					 MAX(done_so_far + 1, head->xp + dx + 2), 
-					 yp, outlist + outcnt, sumthr, dx, arr, cnt);
-	  outcnt += newcnt;
-	  done_so_far = head->xp + dx + 2;
-	}
-	tail++;
+   int ntiles = (N + MF_TILE - 1)/MF_TILE;
+   DotXVList *tiles = (DotXVList *) CALLOC(ntiles, sizeof(DotXVList));
+   int *rowcnt = (int *) MALLOC(N*sizeof(int));
+
+#pragma omp parallel for schedule(dynamic,1)
+   for ( int t = 0; t < ntiles; t++ ) {
+      for ( int yp = t*MF_TILE; yp < MIN(N, (t+1)*MF_TILE); yp++ ) {
+	 int start = tiles[t].cnt;
+	 median_filt_row(inlist + cumsum[yp], cumsum[yp+1]-cumsum[yp], dx, sumthr, &tiles[t]);
+	 rowcnt[yp] = tiles[t].cnt - start;
       }
-    }
-  }
+   }
 
-  return outcnt;
+   make_cumhist_signed(outcumsum, rowcnt, N);
+   int outcnt = outcumsum[N];
+   *outlist = (DotXV *) MALLOC((outcnt+1)*sizeof(DotXV));
+   for ( int t = 0; t < ntiles; t++ ) {
+      if ( tiles[t].dots ) {
+	 memcpy(*outlist + outcumsum[t*MF_TILE], tiles[t].dots, tiles[t].cnt*sizeof(DotXV));
+	 FREE(tiles[t].dots);
+      }
+   }
+
+   FREE(tiles);
+   FREE(rowcnt);
+
+   return outcnt;
 }
 
 int brute_median_filtx(int N, DotXV * inlist, int incnt, int * cumsum, int dx, float medthr, Dot * outlist)
@@ -343,6 +488,7 @@ void hough_gaussy(int N, int dotcnt, int *cumsum, int dy, int diffspeech, float
 	 Fy[n] = (3.0/dy)*(1/sqrt(2*M_PI))*exp(-y*y/2);
       }
       
+#pragma omp parallel for schedule(static)
       for(int y0=0; y0<N; y0++) {
 	 hough[y0] = 0;
 
@@ -436,6 +582,75 @@ int compute_matchlist_simple(int N, DotXV *dotlist, int dotcnt, int *cumsum,
   return matchcnt;
 }
 
+// Appends the matches of the rho y0 to out. Only the columns spanned by the
+// dots of its band are cleared and scanned; columns outside stay zero in act.
+static void rho_matches(int N, DotXV *dotlist, int *cumsum, int y0, float rhoampl, 
+			int dx, int dy, int diffspeech, float *Fy, float *act, 
+			Match **out, int *outcnt)
+{
+  int N2 = 2*N;
+  int cy0 = y0 - diffspeech*N;
+  
+  int ypA = (y0-dy < 0) ? 0 : y0-dy;
+  int ypB = (y0+dy < (diffspeech+1)*N) ? y0+dy+1 : (diffspeech+1)*N;
+
+  int xmin = N2, xmax = -1;
+  for(int yp=ypA; yp<ypB; yp++) {
+    int cnt = cumsum[yp+1]-cumsum[yp];
+    if ( cnt == 0 ) continue;
+    xmin = MIN(xmin, dotlist[cumsum[yp]].xp);
+    xmax = MAX(xmax, dotlist[cumsum[yp]+cnt-1].xp);
+  }
+  xmin = MAX(xmin, 0);
+  xmax = MIN(xmax, N2-1);
+  if ( xmax < xmin ) return;
+
+  memset(act+xmin, 0, (xmax-xmin+1)*sizeof(*act)); 
+      
+  for(int yp=ypA; yp<ypB; yp++) {
+    DotXV *arr = &dotlist[cumsum[yp]];
+    int cnt = cumsum[yp+1]-cumsum[yp];
+    for(int ind=0; ind<cnt; ind++) {
+      int xp = arr[ind].xp;
+      if ( xp >= 0 && xp < N2 )
+	act[xp] += Fy[yp-y0+dy];
+    }
+  }
+
+  threshold_vector(act+xmin, xmax-xmin+1, 0.1);
+
+  int runlen = (xmin == 0) ? act[0] : 0;
+  int indstart = 0;
+  for(int xp=MAX(1,xmin); xp<=MIN(N2,xmax+1); xp++) {
+    if(xp<=xmax && act[xp]) {
+      if(runlen==0) indstart=xp;
+      runlen++;
+    }
+    else {
+      if(runlen > dx/2) {
+	int xpA = indstart;
+	int xpB = xp-1;
+	
+	if ( *outcnt % 16 == 0 ) {
+	  Match *grown = (Match *) MALLOC((*outcnt+16)*sizeof(Match));
+	  if ( *out ) {
+	    memcpy(grown, *out, *outcnt*sizeof(Match));
+	    FREE(*out);
+	  }
+	  *out = grown;
+	}
+	Match *m = *out + (*outcnt)++;
+	m->xA = (xpA-cy0)/2;
+	m->xB = (xpB-cy0)/2;
+	m->yA = (xpA+cy0)/2;
+	m->yB = (xpB+cy0)/2;
+	m->rhoampl = rhoampl;
+      }
+      runlen = 0;
+    }
+  }
+}
+
 int compute_matchlist(int N, DotXV *dotlist, int dotcnt, int *cumsum, 
 		      int *rholist, float *rhoampl, int rhocnt, int dx, int dy, int diffspeech, Match *matchlist)
 {
@@ -452,61 +667,33 @@ int compute_matchlist(int N, DotXV *dotlist, int dotcnt, int *cumsum,
     Fy[n] = funky_constant*exp(-y*y/2);
   }
 
-  float *act = (float *)MALLOC(N2*sizeof(float)); 
+  // The rhos are independent; their matches are gathered in rho order
+  Match **rhomatches = (Match **)CALLOC(rhocnt, sizeof(Match *));
+  int *rhomatchcnt = (int *)CALLOC(rhocnt, sizeof(int));
+
+#pragma omp parallel
+  {
+    float *act = (float *)MALLOC(N2*sizeof(float)); 
+#pragma omp for schedule(dynamic,16)
+    for(int r=0; r<rhocnt; r++)
+      rho_matches(N, dotlist, cumsum, rholist[r], rhoampl[r], dx, dy, diffspeech, 
+		  Fy, act, &rhomatches[r], &rhomatchcnt[r]);
+    FREE(act);
+  }
+
   int matchcnt = 0;
   for(int r=0; r<rhocnt; r++) {
-    int y0 = rholist[r];
-    int cy0 = y0 - diffspeech*N;
-  
-    int ypA = (y0-dy < 0) ? 0 : y0-dy;
-    int ypB = (y0+dy < (diffspeech+1)*N) ? y0+dy+1 : (diffspeech+1)*N;
-
-    memset(act, 0, N2*sizeof(*act)); 
-      
-    for(int yp=ypA; yp<ypB; yp++) {
-      DotXV *arr = &dotlist[cumsum[yp]];
-      int cnt = cumsum[yp+1]-cumsum[yp];
-      for(int ind=0; ind<cnt; ind++) {
-	int xp = arr[ind].xp;
-	act[xp] += Fy[yp-y0+dy];
-      }
-    }
-
-    threshold_vector(act, N2, 0.1);
-      
-    int runlen = act[0];
-    int indstart = 0;
-    for(int xp=1; xp<=N2; xp++) {
-       if(xp<N2 && act[xp]) {
-	  if(runlen==0) indstart=xp;
-	  runlen++;
-       }
-       else {
-	  if(runlen > dx/2) {
-	     int xpA = indstart;
-	     int xpB = xp-1;
-	     
-	     int xA = (xpA-cy0)/2;
-	     int xB = (xpB-cy0)/2;
-	     int yA = (xpA+cy0)/2;
-	     int yB = (xpB+cy0)/2;
-	     
-	     if(matchcnt < MAXMATCHES) {
-		matchlist[matchcnt].xA = xA;
-		matchlist[matchcnt].xB = xB;
-		matchlist[matchcnt].yA = yA;
-		matchlist[matchcnt].yB = yB;
-		matchlist[matchcnt].rhoampl = rhoampl[r];
-		matchcnt++;
-	     }
-	  }
-	  runlen = 0;
-       }
+    int cnt = MIN(rhomatchcnt[r], MAXMATCHES-matchcnt);
+    if ( cnt > 0 ) {
+      memcpy(matchlist+matchcnt, rhomatches[r], cnt*sizeof(Match));
+      matchcnt += cnt;
     }
+    if ( rhomatches[r] ) FREE(rhomatches[r]);
   }
   
   FREE(Fy);
-  FREE(act);
+  FREE(rhomatches);
+  FREE(rhomatchcnt);
 
   return matchcnt;
 }
@@ -562,10 +749,10 @@ int merge_matchlist(Match *matchlist, int matchcnt, int mergetol)
   return compress_matchlist(matchlist, matchcnt);
 }
 
-void dump_matchlist( Match *matchlist, int matchcnt, int xOffset, int yOffset )
+void dump_matchlist( FILE *fp, Match *matchlist, int matchcnt, int xOffset, int yOffset )
 {
    for(int n=0; n<matchcnt; n++) {
-      fprintf(stdout,"%d %d %d %d %f %f\n",
+      fprintf(fp,"%d %d %d %d %f %f\n",
 	      matchlist[n].xA+xOffset,
 	      matchlist[n].xB+xOffset, 
 	      matchlist[n].yA+yOffset,
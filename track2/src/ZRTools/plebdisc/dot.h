@@ -5,6 +5,8 @@
 #ifndef DOT_H
 #define DOT_H
 
+#include <stdio.h>
+
 typedef int frameind;
 
 typedef struct Dot {
@@ -23,13 +25,57 @@ typedef struct Match {
       float score;
 } Match;
 
+#define DOTBUF_MINBLOCK 1024 // Dots in the first DotBuffer block
+#define DOTBUF_MAXBLOCK 1048576 // Largest DotBuffer block
+
+typedef struct DotBlock {
+  Dot *dots;
+  int cnt, cap;
+} DotBlock;
+
+// Growable dot list kept in blocks that double in size up to
+// DOTBUF_MAXBLOCK, so memory follows the number of dots produced.
+// If nrows > 0 the dots per row (yp) are counted as they arrive.
+typedef struct DotBuffer {
+  DotBlock *blocks;
+  int nblocks, maxblocks;
+  long cnt;
+  int nrows;
+  int *rowcnts;
+} DotBuffer;
+
+void dotbuf_init(DotBuffer *buf, int nrows);
+
+DotBlock *dotbuf_grow(DotBuffer *buf);
+
+static inline void dotbuf_add(DotBuffer *buf, int xp, int yp, float val)
+{
+  DotBlock *b;
+  if ( buf->nblocks == 0 || buf->blocks[buf->nblocks-1].cnt == buf->blocks[buf->nblocks-1].cap )
+     b = dotbuf_grow(buf);
+  else
+     b = buf->blocks + buf->nblocks - 1;
+  Dot *d = b->dots + b->cnt++;
+  d->xp = xp;
+  d->yp = yp;
+  d->val = val;
+  buf->cnt++;
+  if ( buf->rowcnts ) buf->rowcnts[yp]++;
+}
+
+// Moves all dots of src to the end of dst, leaving src empty
+void dotbuf_append(DotBuffer *dst, DotBuffer *src);
+
+void dotbuf_free(DotBuffer *buf);
+
 int Dot_compare(const void *A, const void *B);
 
 int DotXV_compare(const void *A, const void *B);
 
-void radix_sorty(int N, Dot *dotlist, int dotcnt, DotXV *sorted_dots, int *cumsum);
-
-void quick_sortx(int N, DotXV *radixdots, int dotcnt, int *cumsum);
+// Sorts the buffered dots by row and then column into sorted_dots, in
+// parallel, keeping one dot per (xp,yp); cumsum gets the N+1 row offsets.
+// Returns the number of dots kept.
+int radix_sort_dots(int N, DotBuffer *dots, DotXV *sorted_dots, int *cumsum);
 
 int compute_dotplot_dense(int N, float *feats, int D, int *cntlist, int **occlist, float *silence, 
 			   float distthr, float **M);
@@ -38,13 +84,15 @@ int dense_to_sparse(int N, float **M, float distthr, Dot *dotlist);
 
 int compress_dotlist(Dot *dotlist, int prime, float thr);
 
-int dot_dedup(DotXV *dotlist, int *cumsum, int nrows, float thr);
-
 int compute_dotplot_sparse(float *feats1, int N1, float *feats2, int N2, int D, int sildim, float *silence1, float *silence2, int diffspeech, 
 			   int *postings1, int *postings1_index, int *postings2, int *postings2_index, int prime, float distthr, Dot *dotlist);
 
 
-int median_filtx(int N, DotXV *inlist, int incnt, int *cumsum, int dx, float medthr, Dot *outlist);
+// Median filters each row of the row-bucketed inlist in the X direction,
+// in parallel over row tiles; outlist receives the filtered dots already
+// bucketed by row and sorted by xp, with N+1 row offsets in outcumsum
+int median_filtx(int N, DotXV *inlist, int incnt, int *cumsum, int dx, float medthr, 
+		 DotXV **outlist, int *outcumsum);
 
 int brute_median_filtx(int N, DotXV * inlist, int incnt, int * cumsum, int dx, float medthr, Dot * outlist);
 
@@ -62,7 +110,7 @@ int compute_matchlist(int N, DotXV *dotlist, int dotcnt, int *cumsum,
 
 int merge_matchlist(Match *matchlist, int matchcnt, int mergetol);
 
-void dump_matchlist(Match *matchlist, int matchcnt, int xOffset, int yOffset);
+void dump_matchlist(FILE *fp, Match *matchlist, int matchcnt, int xOffset, int yOffset);
 
 void hist_feats(int *hist, float *feats, int nframes, int nphonemes, float threshold);
 
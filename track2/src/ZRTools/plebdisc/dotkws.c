@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <stdint.h>
 #include "util.h"
 #include "dotkws.h"
 
@@ -27,6 +28,88 @@ int DotXV_compare(const void *A, const void *B)
    else return 0;
 }
 
+void dotbuf_init(DotBuffer *buf, int nrows)
+{
+   buf->blocks = NULL;
+   buf->nblocks = 0;
+   buf->maxblocks = 0;
+   buf->cnt = 0;
+   buf->nrows = nrows;
+   buf->rowcnts = NULL;
+   if ( nrows > 0 )
+      buf->rowcnts = (int *) CALLOC(nrows, sizeof(int));
+}
+
+// Makes room for one more block descriptor
+static void dotbuf_reserve(DotBuffer *buf)
+{
+   if ( buf->nblocks < buf->maxblocks )
+      return;
+
+   int maxblocks = MAX(16, 2*buf->maxblocks);
+   DotBlock *blocks = (DotBlock *) MALLOC(maxblocks*sizeof(DotBlock));
+   if ( buf->blocks ) {
+      memcpy(blocks, buf->blocks, buf->nblocks*sizeof(DotBlock));
+      FREE(buf->blocks);
+   }
+   buf->blocks = blocks;
+   buf->maxblocks = maxblocks;
+}
+
+DotBlock *dotbuf_grow(DotBuffer *buf)
+{
+   dotbuf_reserve(buf);
+
+   int cap = DOTBUF_MINBLOCK;
+   if ( buf->nblocks > 0 )
+      cap = MIN(DOTBUF_MAXBLOCK, 2*buf->blocks[buf->nblocks-1].cap);
+
+   DotBlock *b = buf->blocks + buf->nblocks++;
+   b->dots = (Dot *) MALLOC(cap*sizeof(Dot));
+   b->cnt = 0;
+   b->cap = cap;
+   return b;
+}
+
+void dotbuf_append(DotBuffer *dst, DotBuffer *src)
+{
+   for ( int i = 0; i < src->nblocks; i++ ) {
+      DotBlock *b = src->blocks + i;
+      if ( b->cnt == 0 ) {
+	 FREE(b->dots);
+	 continue;
+      }
+
+      if ( dst->rowcnts )
+	 for ( int j = 0; j < b->cnt; j++ )
+	    dst->rowcnts[b->dots[j].yp]++;
+
+      dotbuf_reserve(dst);
+      dst->blocks[dst->nblocks++] = *b;
+      dst->cnt += b->cnt;
+   }
+
+   if ( src->blocks ) FREE(src->blocks);
+   if ( src->rowcnts ) memset(src->rowcnts, 0, src->nrows*sizeof(int));
+   src->blocks = NULL;
+   src->nblocks = 0;
+   src->maxblocks = 0;
+   src->cnt = 0;
+}
+
+void dotbuf_free(DotBuffer *buf)
+{
+   for ( int i = 0; i < buf->nblocks; i++ )
+      FREE(buf->blocks[i].dots);
+   if ( buf->blocks ) FREE(buf->blocks);
+   if ( buf->rowcnts ) FREE(buf->rowcnts);
+   buf->blocks = NULL;
+   buf->nblocks = 0;
+   buf->maxblocks = 0;
+   buf->cnt = 0;
+   buf->rowcnts = NULL;
+}
+
 void hist_feats(int *hist, float *feats, int nframes, int nphonemes, float threshold)
 {
   for(int frame=0;frame<nframes;frame++)
@@ -34,37 +117,83 @@ void hist_feats(int *hist, float *feats, int nframes, int nphonemes, float thres
       if(*feats > threshold) hist[phoneme]++;
 }
 
-int radix_sorty(Dot *dotlist, int dotcnt, DotXV *sorted_dots, frameind *cumsum, frameind *cumsumind)
+typedef struct DotKey {
+   uint64_t key;
+   float val;
+} DotKey;
+
+int radix_sort_dots(DotBuffer *dots, DotXV *sorted_dots, frameind *cumsum, frameind *cumsumind)
 {
-   // Sort the dots by yp
-   qsort(dotlist, dotcnt, sizeof(Dot), &Dot_compare);
-   
-   // Loop over the dots, fill sorted_dots and maintain counts for each row
-   int yp_count = 0;
-   frameind lastyp = -1;
-   for(int ind = 0; ind<dotcnt; ind++) {
-      if ( dotlist[ind].yp != lastyp ) {
-	 cumsumind[yp_count] = dotlist[ind].yp;
-	 lastyp = dotlist[ind].yp;
-	 yp_count++;
+   long dotcnt = dots->cnt;
+   cumsum[0] = 0;
+   if ( dotcnt == 0 ) return 0;
+
+   // Pack (yp,xp) into one key relative to their minima
+   frameind xmin = dots->blocks[0].dots[0].xp, xmax = xmin;
+   frameind ymin = dots->blocks[0].dots[0].yp, ymax = ymin;
+   for ( int b = 0; b < dots->nblocks; b++ ) {
+      for ( int i = 0; i < dots->blocks[b].cnt; i++ ) {
+	 Dot *d = dots->blocks[b].dots + i;
+	 xmin = MIN(xmin, d->xp); xmax = MAX(xmax, d->xp);
+	 ymin = MIN(ymin, d->yp); ymax = MAX(ymax, d->yp);
+      }
+   }
+   int xbits = 0;
+   while ( xbits < 32 && ((uint64_t)(xmax-xmin) >> xbits) ) xbits++;
+   int keybits = xbits;
+   while ( keybits < 64 && ((uint64_t)(ymax-ymin) << xbits >> keybits) ) keybits++;
+
+   DotKey *a = (DotKey *) MALLOC( dotcnt*sizeof(DotKey) );
+   DotKey *tmp = (DotKey *) MALLOC( dotcnt*sizeof(DotKey) );
+   long pos = 0;
+   for ( int b = 0; b < dots->nblocks; b++ ) {
+      for ( int i = 0; i < dots->blocks[b].cnt; i++, pos++ ) {
+	 Dot *d = dots->blocks[b].dots + i;
+	 a[pos].key = ((uint64_t)(d->yp-ymin) << xbits) | (uint64_t)(d->xp-xmin);
+	 a[pos].val = d->val;
       }
+   }
 
-      cumsum[yp_count]++;
-      sorted_dots[ind].xp = dotlist[ind].xp;
-      sorted_dots[ind].val = dotlist[ind].val;
+   // LSD radix sort of the keys, one byte per pass
+   int count[256];
+   for ( int shift = 0; shift < keybits; shift += 8 ) {
+      memset(count, 0, sizeof(count));
+      for ( long i = 0; i < dotcnt; i++ )
+	 count[(a[i].key >> shift) & 0xff]++;
+      if ( count[(a[0].key >> shift) & 0xff] == dotcnt )
+	 continue;
+      long sum = 0;
+      for ( int v = 0; v < 256; v++ ) {
+	 long c = count[v];
+	 count[v] = sum;
+	 sum += c;
+      }
+      for ( long i = 0; i < dotcnt; i++ )
+	 tmp[count[(a[i].key >> shift) & 0xff]++] = a[i];
+      DotKey *t = a; a = tmp; tmp = t;
    }
-   
-   for ( int i = 1; i <= yp_count; i++ )
-      cumsum[i] += cumsum[i-1];
-   
-   return yp_count;
-}
 
-void quick_sortx(DotXV *radixdots, int dotcnt, frameind *cumsum, frameind *cumsumind, int ncumsum )
-{
-   for ( int i = 0; i < ncumsum; i++ ) {
-      qsort(&radixdots[cumsum[i]], cumsum[i+1]-cumsum[i], sizeof(DotXV), &DotXV_compare);
+   // Write one dot per key (equal xp and yp mean the same frame pair, hence
+   // the same value) and the offsets of the nonempty rows
+   uint64_t xmask = ((uint64_t)1 << xbits) - 1;
+   int yp_count = 0;
+   long outcnt = 0;
+   for ( long i = 0; i < dotcnt; i++ ) {
+      if ( i > 0 && a[i].key == a[i-1].key )
+	 continue;
+      frameind yp = (a[i].key >> xbits) + ymin;
+      if ( yp_count == 0 || cumsumind[yp_count-1] != yp ) {
+	 cumsumind[yp_count] = yp;
+	 cumsum[yp_count++] = outcnt;
+      }
+      sorted_dots[outcnt].xp = (a[i].key & xmask) + xmin;
+      sorted_dots[outcnt++].val = a[i].val;
    }
+   cumsum[yp_count] = outcnt;
+
+   FREE(a);
+   FREE(tmp);
+   return yp_count;
 }
 
 int compress_dotlist(Dot *dotlist, int prime, float thr)
@@ -110,127 +239,88 @@ int compress_dotlistXV(DotXV *dotlist, int prime, float thr)
    return wpos;
 }
 
-int dot_dedup(DotXV *dotlist, frameind *cumsum, frameind *cumsumind, int ncumsum, float thr)
-{
-   frameind initcnt = cumsum[ncumsum];
-   int *rowcnt = (int *) MALLOC( sizeof(int)*ncumsum );
-   for ( int i = 0; i < ncumsum; i++ )
-   {
-      rowcnt[i] = cumsum[i+1]-cumsum[i];
-      frameind start = (i == 0) ? 0 : cumsum[i];
-      for ( frameind j = start+1; j < cumsum[i+1]; j++ ) {
-	 if ( dotlist[j].xp == dotlist[j-1].xp ) {
-	    dotlist[j].val = -1e6;
-	    rowcnt[i]--;
-	 }	 
-      }
-   }
-
-   for ( frameind i = 0; i < ncumsum; i++ )
-   {
-      cumsum[i+1] = cumsum[i]+rowcnt[i];
-   }
-
-   FREE(rowcnt);
+typedef struct DotXVList {
+   DotXV *dots;
+   int cnt, cap;
+} DotXVList;
 
-   frameind wpos = 0;
-   frameind rpos = 1;
-
-   for(; wpos<initcnt; wpos++) {
-      if(wpos==rpos) rpos++;
-
-      if(dotlist[wpos].val < thr) {
-	 while(rpos < initcnt && dotlist[rpos].val < thr) rpos++;
-	 if(rpos==initcnt) return wpos;
-
-	 dotlist[wpos].val = dotlist[rpos].val;
-	 dotlist[wpos].xp = dotlist[rpos].xp;
-	 dotlist[rpos].val = -1e6;
-      }
-   } 
-   
-   return wpos;
-}
-
-int count_dots_before(frameind pos, DotXV *arr, int n)
+static void dotxv_add(DotXVList *l, frameind xp, float val)
 {
-   // Do binary search down to a range of 10 or less dots
-   if(pos < arr[0].xp) return 0;
-   if(pos > arr[n-1].xp) return n;
-   int low = 0;
-   int high = n;
-   while(high - low > 10) {
-      int mid = low + (high - low)/2;
-      frameind p = arr[mid].xp;
-      if(pos == p) return mid;
-      else if(p < pos) low = mid;
-      else high = mid;
-   }
-   
-   // Do linear pass through remaining dots
-   while(low < high) {
-      frameind p = arr[low].xp;
-      if(pos == p) return low;
-      else if(p < pos) low++;
-      else return low;
+   if ( l->cnt == l->cap ) {
+      int cap = MAX(DOTBUF_MINBLOCK, 2*l->cap);
+      DotXV *dots = (DotXV *) MALLOC(cap*sizeof(DotXV));
+      if ( l->dots ) {
+	 memcpy(dots, l->dots, l->cnt*sizeof(DotXV));
+	 FREE(l->dots);
+      }
+      l->dots = dots;
+      l->cap = cap;
    }
-      
-   return high;
+   l->dots[l->cnt].xp = xp;
+   l->dots[l->cnt++].val = val;
 }
 
-int count_dots_interval(frameind start, frameind end, DotXV *arr, int cnt)
+// Median filters one sorted, deduplicated row, visiting columns in
+// [xlo,xhi): adds a dot at each visited column with more than sumthr dots
+// within dx. The visited columns never decrease, so the window [lo,hi) of
+// arr is advanced instead of searched.
+static void median_filt_row(DotXV *arr, int cnt, int dx, int sumthr, 
+			    frameind xlo, frameind xhi, DotXVList *out)
 {
-   return count_dots_before(end, arr, cnt) - count_dots_before(start, arr, cnt);
-}
-
-int careful_add_dots(frameind xp1, frameind xp2, frameind yp, Dot *outlist, int sumthr, int dx, DotXV *arr, int cnt)
-{
-   Dot *o = outlist;
-   for ( frameind i = xp1; i < xp2; i++ ) {
-      if ( count_dots_interval(i-dx, i+dx+1, arr, cnt) > sumthr ) {
-	 o->val = 1;
-	 o->xp = i;
-	 o->yp = yp;
-	 o++;
+   int window = 2*dx+1;
+   int done_so_far = 0;
+   int lo = 0, hi = 0;
+   DotXV *end = arr + cnt;
+   DotXV *head = arr-1;
+   DotXV *tail = arr;
+   while(head < end-1 && head - tail < sumthr) {
+      head++;
+      while(head - tail >= sumthr) {
+	 if(head->xp - tail->xp <= window) {
+	    frameind xp1 = MAX(MAX(tail->xp-dx-1, done_so_far), xlo);
+	    frameind xp2 = MIN(MAX(done_so_far+1, head->xp+dx+2), xhi);
+	    for ( frameind i = xp1; i < xp2; i++ ) {
+	       while ( lo < cnt && arr[lo].xp < i-dx ) lo++;
+	       while ( hi < cnt && arr[hi].xp < i+dx+1 ) hi++;
+	       if ( hi - lo > sumthr )
+		  dotxv_add(out, i, 1);
+	    }
+	    done_so_far = head->xp + dx + 2;
+	 }
+	 tail++;
       }
    }
-   
-   return o - outlist;
 }
-    
+
 int median_filtx(frameind Ntest, frameind Nq, DotXV *inlist, int incnt, 
-		 frameind *cumsum, frameind *cumsumind, int ncumsum, int dx, float medthr, Dot *outlist)
+		 frameind *cumsum, frameind *cumsumind, int ncumsum, int dx, float medthr, 
+		 DotXV **outlist, frameind *outcumsum, frameind *outcumsumind, int *noutcumsum)
 {
    int window = 2*dx+1;
    int sumthr = medthr*window/2;
-   
-   int outcnt = 0;
+
+   DotXVList out = { NULL, 0, 0 };
+   int nout = 0;
+   outcumsum[0] = 0;
    
    for ( int i = 0; i < ncumsum; i++ ) {
-      int done_so_far = 0;
-      DotXV *arr = inlist + cumsum[i];
-      DotXV *end = inlist + cumsum[i+1];
       frameind yp = cumsumind[i];
-      int cnt = end - arr;
-      DotXV *head = arr-1;
-      DotXV *tail = arr;
-      while(head < end-1 && head - tail < sumthr) {
-	 head++;
-	 while(head - tail >= sumthr) {
-	    if(head->xp - tail->xp <= window) {
-	       int newcnt = careful_add_dots(MAX(MAX(tail->xp-dx-1, done_so_far), Ntest-yp+1), 
-					     MIN(MAX(done_so_far+1, head->xp+dx+2), 2*Nq-yp+Ntest-1), 
-					     yp, outlist + outcnt, sumthr, dx, arr, cnt);
-
-	       outcnt += newcnt;
-	       done_so_far = head->xp + dx + 2;
-	    }
-	    tail++;
-	 }
+      median_filt_row(inlist + cumsum[i], cumsum[i+1]-cumsum[i], dx, sumthr, 
+		      Ntest-yp+1, 2*Nq-yp+Ntest-1, &out);
+      if ( out.cnt > outcumsum[nout] ) {
+	 outcumsumind[nout] = yp;
+	 outcumsum[++nout] = out.cnt;
       }
    }
    
-   return outcnt;
+   *outlist = (DotXV *) MALLOC((out.cnt+1)*sizeof(DotXV));
+   if ( out.dots ) {
+      memcpy(*outlist, out.dots, out.cnt*sizeof(DotXV));
+      FREE(out.dots);
+   }
+   *noutcumsum = nout;
+
+   return out.cnt;
 }
 
 int hough_gaussy(frameind N, int dotcnt, frameind *cumsum, frameind *cumsumind, int ncumsum, int dy, float *hough, frameind *houghind)
@@ -248,10 +338,6 @@ int hough_gaussy(frameind N, int dotcnt, frameind *cumsum, frameind *cumsumind,
 	 Fy[n] = (3.0/dy)*(1/sqrt(2*M_PI))*exp(-y*y/2);
       }
 
-      int *rowcnt = (int *) MALLOC(ncumsum*sizeof(int));
-      for ( int i = 0; i < ncumsum; i++ ) 
-	 rowcnt[i] = cumsum[i+1] - cumsum[i];
-
       // Initialize elements for all rows that will have nonzero hough
       int nhough = 0;
       for ( int i = 0; i < ncumsum; i++ ) {
@@ -262,23 +348,19 @@ int hough_gaussy(frameind N, int dotcnt, frameind *cumsum, frameind *cumsumind,
 	 }
       }
 
-      // For each row with nonzero hough, compute the transform value
-      int laststartind = 0;
+      // For each row with nonzero hough, sum the dot rows of its window;
+      // both lists are sorted, so the first row of the window only advances
+      int first = 0;
       for ( int i = 0; i < nhough; i++ ) {
+	 frameind ypA = MAX(0,houghind[i]-dy);
+	 frameind ypB = MIN(N-1,houghind[i]+dy);
+	 while ( first < ncumsum && cumsumind[first] < ypA ) first++;
+
 	 hough[i] = 0;
-	 for ( int yp = MAX(0,houghind[i]-dy); yp <= MIN( N-1, houghind[i]+dy); yp++ ) {
-	    for ( int j = laststartind; j < ncumsum && cumsumind[j] <= yp; j++ ) {
-	       if ( cumsumind[j] == yp ) {
-		  hough[i] += rowcnt[j]*Fy[yp-houghind[i]+dy];
-		  if ( yp == MAX(0,houghind[i]-dy) )
-		     laststartind = j;
-		  break;
-	       } 
-	    }
-	 }
+	 for ( int j = first; j < ncumsum && cumsumind[j] <= ypB; j++ )
+	    hough[i] += (cumsum[j+1]-cumsum[j])*Fy[cumsumind[j]-houghind[i]+dy];
       }
 
-      FREE(rowcnt);
       FREE(Fy);
       return nhough;
    }
@@ -415,6 +497,8 @@ int compute_matchlist_sparse( frameind Ntest, frameind Nq, DotXV *dotlist, int d
       Fy[n] = funky_constant*exp(-y*y/2);
    }
 
+   int *pos = (int *)MALLOC(ywindow*sizeof(int));
+   int indA = 0;
    int matchcnt = 0;
    for ( int r = 0; r < rhocnt; r++ ) {
       frameind y0 = rholist[r];
@@ -422,49 +506,42 @@ int compute_matchlist_sparse( frameind Ntest, frameind Nq, DotXV *dotlist, int d
       frameind ypA = MAX(y0-dy,0);
       frameind ypB = MIN(Ntest+Nq-1,y0+dy);
 
-      // Collect all the dots in the band of rows of height 2*dy+1,
-      // weighted by the kernel Fy(distance from y0)
-
-      int indA = 0;
-      while ( cumsumind[indA] < ypA ) indA++; 
+      // Find the rows of the band of height 2*dy+1; rhos ascend, so the
+      // first row only advances
+      while ( indA < ncumsum && cumsumind[indA] < ypA ) indA++; 
       int indB = indA;
       while ( indB < ncumsum && cumsumind[indB] <= ypB ) indB++; 
       
+      // Merge the sorted rows by column (xp), summing the dots of a column
+      // in row order weighted by the kernel Fy(distance from y0), and keep
+      // the columns whose sum exceeds 0.1
       int totaldots = cumsum[indB]-cumsum[indA];
-      DotXV *banddots = (DotXV *) MALLOC( sizeof(DotXV)*totaldots );
+      DotXV *banddots = (DotXV *) MALLOC( sizeof(DotXV)*(totaldots+1) );
+      for ( int j = indA; j < indB; j++ )
+	 pos[j-indA] = cumsum[j];
 
       int banddotcnt = 0;
-      int currind = 0;
-      for ( frameind yp = ypA; yp <= ypB; yp++ ) {
-	 while ( currind < ncumsum && cumsumind[currind] < yp ) currind++; 
-	 if ( cumsumind[currind] != yp ) continue;
-
-	 int cnt = cumsum[currind+1]-cumsum[currind];
-	 for ( int i = 0; i < cnt; i++ ) {
-	    banddots[banddotcnt].xp = dotlist[i+cumsum[currind]].xp;
-	    banddots[banddotcnt++].val = Fy[yp-y0+dy]*dotlist[i+cumsum[currind]].val;
+      while ( 1 ) {
+	 int found = 0;
+	 frameind xp = 0;
+	 for ( int j = indA; j < indB; j++ ) {
+	    if ( pos[j-indA] < cumsum[j+1] && ( !found || dotlist[pos[j-indA]].xp < xp ) ) {
+	       xp = dotlist[pos[j-indA]].xp;
+	       found = 1;
+	    }
 	 }
-      }
-
-      // Sort all the dots in the band by column (xp)
-      qsort(banddots, banddotcnt, sizeof(DotXV), &DotXV_compare);
-
-      // Merge duplicate dots (sum the dot values)
-      frameind lastxp = -1;
-      frameind lastind = 0;
-      for ( int i = 0; i < banddotcnt; i++ ) {
-	 if ( banddots[i].xp == lastxp ) {
-	    banddots[lastind].val += banddots[i].val;
-	    banddots[i].val = 0;
-	 } else { 
-	    lastxp = banddots[i].xp;
-	    lastind = i;
+	 if ( !found ) break;
+
+	 float val = 0;
+	 for ( int j = indA; j < indB; j++ )
+	    while ( pos[j-indA] < cumsum[j+1] && dotlist[pos[j-indA]].xp == xp )
+	       val += Fy[cumsumind[j]-y0+dy]*dotlist[pos[j-indA]++].val;
+	 if ( val > 0.1 ) {
+	    banddots[banddotcnt].xp = xp;
+	    banddots[banddotcnt++].val = val;
 	 }
       }
 
-      // Remove small-valued dots
-      banddotcnt = compress_dotlistXV(banddots, banddotcnt, 0.1);
-
       // Compute the runs
       int runlen = 0;
       frameind indstart = 0;
@@ -498,6 +575,7 @@ int compute_matchlist_sparse( frameind Ntest, frameind Nq, DotXV *dotlist, int d
       FREE(banddots);
    }
    
+   FREE(pos);
    FREE(Fy);
    
    return matchcnt;
@@ -524,14 +602,14 @@ int compress_matchlist(Match *matchlist, int matchcnt)
    return matchcnt;
 }
 
-void dump_matchlist( char **files, Match *matchlist, int matchcnt, frameind *xOffsets, frameind yOffset, char *queryfile, char *querytype )
+void dump_matchlist( FILE *fp, char **files, Match *matchlist, int matchcnt, frameind *xOffsets, frameind yOffset, char *queryfile, char *querytype )
 {
    for(int n=0; n<matchcnt; n++) {
       int fid = 0;
       while ( xOffsets[fid++] < matchlist[n].xA );
       fid-=2;
 
-      fprintf(stdout,"%s %s %s %d %d %d %d %f %f\n",
+      fprintf(fp,"%s %s %s %d %d %d %d %f %f\n",
 	      querytype, files[fid], queryfile,
 	      matchlist[n].xA-xOffsets[fid],
 	      matchlist[n].xB-xOffsets[fid], 
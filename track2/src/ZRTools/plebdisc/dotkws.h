@@ -5,6 +5,8 @@
 #ifndef DOT_H
 #define DOT_H
 
+#include <stdio.h>
+
 typedef unsigned int frameind;
 
 typedef struct Dot {
@@ -23,20 +25,67 @@ typedef struct Match {
       float score;
 } Match;
 
+#define DOTBUF_MINBLOCK 1024 // Dots in the first DotBuffer block
+#define DOTBUF_MAXBLOCK 1048576 // Largest DotBuffer block
+
+typedef struct DotBlock {
+  Dot *dots;
+  int cnt, cap;
+} DotBlock;
+
+// Growable dot list kept in blocks that double in size up to
+// DOTBUF_MAXBLOCK, so memory follows the number of dots produced.
+// If nrows > 0 the dots per row (yp) are counted as they arrive.
+typedef struct DotBuffer {
+  DotBlock *blocks;
+  int nblocks, maxblocks;
+  long cnt;
+  int nrows;
+  int *rowcnts;
+} DotBuffer;
+
+void dotbuf_init(DotBuffer *buf, int nrows);
+
+DotBlock *dotbuf_grow(DotBuffer *buf);
+
+static inline void dotbuf_add(DotBuffer *buf, frameind xp, frameind yp, float val)
+{
+  DotBlock *b;
+  if ( buf->nblocks == 0 || buf->blocks[buf->nblocks-1].cnt == buf->blocks[buf->nblocks-1].cap )
+     b = dotbuf_grow(buf);
+  else
+     b = buf->blocks + buf->nblocks - 1;
+  Dot *d = b->dots + b->cnt++;
+  d->xp = xp;
+  d->yp = yp;
+  d->val = val;
+  buf->cnt++;
+  if ( buf->rowcnts ) buf->rowcnts[yp]++;
+}
+
+// Moves all dots of src to the end of dst, leaving src empty
+void dotbuf_append(DotBuffer *dst, DotBuffer *src);
+
+void dotbuf_free(DotBuffer *buf);
+
 int Dot_compare(const void *A, const void *B);
 
 int DotXV_compare(const void *A, const void *B);
 
-int radix_sorty(Dot *dotlist, int dotcnt, DotXV *sorted_dots, frameind *cumsum, frameind *cumsumind);
-
-void quick_sortx(DotXV *radixdots, int dotcnt, frameind *cumsum, frameind *cumsumind, int ncumsum);
+// Sorts the buffered dots by row and then column into sorted_dots with an
+// LSD radix sort of packed (yp,xp) keys, keeping one dot per (xp,yp).
+// Returns the number of nonempty rows, whose indices go to cumsumind and
+// whose offsets go to cumsum (cumsum[ncumsum] is the number of dots kept).
+int radix_sort_dots(DotBuffer *dots, DotXV *sorted_dots, frameind *cumsum, frameind *cumsumind);
 
 int compress_dotlist(Dot *dotlist, int prime, float thr);
 
-int dot_dedup(DotXV *dotlist, frameind *cumsum, frameind *cumsumind, int ncumsum, float thr);
-
+// Median filters each row in the X direction; outlist receives the filtered
+// dots already bucketed by row and sorted by xp, with the offsets and
+// indices of its noutcumsum nonempty rows in outcumsum and outcumsumind
 int median_filtx(frameind Ntest, frameind Nq, DotXV *inlist, int incnt, 
-		 frameind *cumsum, frameind *cumsumind, int ncumsum, int dx, float medthr, Dot *outlist);
+		 frameind *cumsum, frameind *cumsumind, int ncumsum, int dx, float medthr, 
+		 DotXV **outlist, frameind *outcumsum, frameind *outcumsumind, int *noutcumsum);
 
 int hough_gaussy(frameind N, int dotcnt, frameind *cumsum, frameind *cumsumind, 
 		 int ncumsum, int dy, float *hough, frameind *houghind);
@@ -59,7 +108,7 @@ int compute_matchlist_sparse(frameind Ntest, frameind Nq, DotXV *dotlist, int do
 			     frameind *rholist, float *rhoampl, int rhocnt,  
 			     int dx, int dy, Match *matchlist);
 
-void dump_matchlist(char **files, Match *matchlist, int matchcnt, frameind *xOffsets, frameind yOffset, char *queryfile, char *querytype);
+void dump_matchlist(FILE *fp, char **files, Match *matchlist, int matchcnt, frameind *xOffsets, frameind yOffset, char *queryfile, char *querytype);
 
 void hist_feats(int *hist, float *feats, int nframes, int nphonemes, float threshold);
 
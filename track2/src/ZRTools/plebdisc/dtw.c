@@ -0,0 +1,306 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <limits.h>
+#include "util.h"
+#include "icsilog.h"
+#include "framedist.h"
+#include "dtw.h"
+
+#define MAXCOST 1e10
+
+void dtw_params_init(DtwParams *p)
+{
+   p->maxrun = INT_MAX;
+   p->kldiv = 0;
+   p->sym = 0;
+   p->wmvn = 0;
+   p->sakoe = 0;
+   p->nbits_log = 14;
+   p->log_table = (float*) MALLOC(((int) pow(2,p->nbits_log))*sizeof(float));
+   fill_icsi_log_table(p->nbits_log,p->log_table); 
+}
+
+void dtw_params_free(DtwParams *p)
+{
+   FREE(p->log_table);
+   p->log_table = NULL;
+}
+
+void dtw_scratch_init(DtwScratch *ws)
+{
+   ws->cap = 0;
+   ws->simcap = 0;
+   ws->featcap = 0;
+   ws->simmx = NULL;
+   ws->costmx = NULL;
+   ws->aacntmx = NULL;
+   ws->lenmx = NULL;
+   ws->feats = NULL;
+}
+
+void dtw_scratch_free(DtwScratch *ws)
+{
+   if ( ws->cap > 0 ) {
+      FREE(ws->costmx);
+      FREE(ws->aacntmx);
+      FREE(ws->lenmx);
+   }
+   if ( ws->simcap > 0 ) FREE(ws->simmx);
+   if ( ws->featcap > 0 ) FREE(ws->feats);
+   dtw_scratch_init(ws);
+}
+
+// Makes room for three rows of N2+1 path entries, 2*FD_ROWS rows of N2
+// distances and the cosine copies of the N1 x D and N2 x D segments
+static void dtw_scratch_reserve(DtwScratch *ws, int N1, int N2, int D)
+{
+   long need = 3*(long)(N2+1);
+   if ( need > ws->cap ) {
+      long cap = MAX(need, 2*ws->cap);
+      if ( ws->cap > 0 ) {
+	 FREE(ws->costmx);
+	 FREE(ws->aacntmx);
+	 FREE(ws->lenmx);
+      }
+      ws->costmx = (float *) MALLOC( cap*sizeof(float) );
+      ws->aacntmx = (int *) MALLOC( cap*sizeof(int) );
+      ws->lenmx = (int *) MALLOC( cap*sizeof(int) );
+      ws->cap = cap;
+   }
+
+   need = 2*FD_ROWS*(long)N2;
+   if ( need > ws->simcap ) {
+      long cap = MAX(need, 2*ws->simcap);
+      if ( ws->simcap > 0 ) FREE(ws->simmx);
+      ws->simmx = (float *) MALLOC( cap*sizeof(float) );
+      ws->simcap = cap;
+   }
+
+   need = (long)(N1+N2+frames_stride(N2))*D + N1+N2;
+   if ( need > ws->featcap ) {
+      long cap = MAX(need, 2*ws->featcap);
+      if ( ws->featcap > 0 ) FREE(ws->feats);
+      ws->feats = (float *) MALLOC( cap*sizeof(float) );
+      ws->featcap = cap;
+   }
+}
+
+// KL divergences from frame x of X1 to the N2 frames of X2
+static void frame_kldivs(float *sim, float *x, float *X2, int N2, int D, DtwParams *p)
+{
+   float *LOOKUP_TABLE = p->log_table;
+   int nbits_log = p->nbits_log;
+
+   if ( p->sym ) {
+      for ( int j = 0; j < N2; j++ ) {
+	 sim[j] = 0;
+	 for ( int d = 0; d < D; d++ ) {
+	    sim[j] += 
+	       0.5*x[d]*icsi_log(x[d]/X2[j*D+d],
+				 LOOKUP_TABLE,nbits_log) +
+	       0.5*X2[j*D+d]*icsi_log(X2[j*D+d]/x[d],
+				      LOOKUP_TABLE,nbits_log);
+	 }
+      } 
+   } else {
+      for ( int j = 0; j < N2; j++ ) {
+	 sim[j] = 0;
+	 for ( int d = 0; d < D; d++ ) {
+	    sim[j] += 
+	       x[d]*icsi_log(x[d]/X2[j*D+d],
+			     LOOKUP_TABLE,nbits_log);
+	 }
+      } 
+   }
+}
+
+float feat_dtw(float *X1, int N1, float *X2, int N2, int D, DtwParams *p, DtwScratch *ws)
+{  
+   dtw_scratch_reserve(ws, N1, N2, D);
+   int maxrun = p->maxrun;
+
+   float norm1[D][2];
+   float norm2[D][2];
+   for ( int d = 0; d < D; d++ ) {
+      norm1[d][0] = 0;
+      norm1[d][1] = 1;
+      norm2[d][0] = 0;
+      norm2[d][1] = 1;
+   }
+   
+   if ( p->wmvn ) {
+      for ( int d = 0; d < D; d++ ) {
+	 norm1[d][1] = 0;
+	 for ( int j = 0; j < N1; j++ ) {
+	    float f = X1[j*D+d];
+	    norm1[d][0] += f;
+	    norm1[d][1] += f*f;
+	 }
+	 norm1[d][0] = norm1[d][0]/N1;
+	 norm1[d][1] = sqrt(norm1[d][1]/N1 - norm1[d][0]*norm1[d][0]);
+
+	 norm2[d][1] = 0;
+	 for ( int j = 0; j < N2; j++ ) {
+	    float f = X2[j*D+d];
+	    norm2[d][0] += f;
+	    norm2[d][1] += f*f;
+	 }
+	 norm2[d][0] = norm2[d][0]/N2;
+	 norm2[d][1] = sqrt(norm2[d][1]/N2 - norm2[d][0]*norm2[d][0]);
+
+      }
+   }
+
+   // For the cosine distance, the normalized segments (X2 also transposed
+   // for frames_dot) and the squared norms of their frames
+   float *X1n = ws->feats;
+   float *X2n = X1n + (long)N1*D;
+   float *X2T = X2n + (long)N2*D;
+   float *lenx = X2T + (long)frames_stride(N2)*D;
+   float *leny = lenx + N1;
+   if ( !p->kldiv ) {
+      for ( int i = 0; i < N1; i++ ) {
+	 lenx[i] = 0;
+	 for ( int d = 0; d < D; d++ ) {
+	    float x = (X1[i*D+d]-norm1[d][0])/norm1[d][1];
+	    X1n[i*D+d] = x;
+	    lenx[i] += x*x;
+	 }
+      }
+      for ( int j = 0; j < N2; j++ ) {
+	 leny[j] = 0;
+	 for ( int d = 0; d < D; d++ ) {
+	    float y = (X2[j*D+d]-norm2[d][0])/norm2[d][1];
+	    X2n[j*D+d] = y;
+	    leny[j] += y*y;
+	 }
+      }
+      frames_transpose(X2T, X2n, N2, D);
+   }
+
+   // Row i of the cost, run and length matrices lives in row i%3 of the
+   // scratch (the slope constrained recursion looks back two rows). The
+   // distances of frame f of X1 are in row f%(2*FD_ROWS) of simmx,
+   // computed FD_ROWS frames at a time.
+   int nsim = 2*FD_ROWS;
+   N1++;
+   N2++;
+   float *costmx[3];
+   int *aacntmx[3], *lenmx[3];
+   for ( int r = 0; r < 3; r++ ) {
+      costmx[r] = ws->costmx + r*N2;
+      aacntmx[r] = ws->aacntmx + r*N2;
+      lenmx[r] = ws->lenmx + r*N2;
+   }
+
+   for ( int j = 0; j < N2; j++ ) {
+      aacntmx[0][j] = j;
+      lenmx[0][j] = j;
+      if ( j == 0 )
+	 costmx[0][j] = 0;      
+      else
+	 costmx[0][j] = MAXCOST;
+   }
+
+   for ( int i = 1; i < N1; i++ ) {
+      float *c = costmx[i%3], *c1 = costmx[(i-1)%3], *c2 = costmx[(i+1)%3];
+      int *a = aacntmx[i%3], *a1 = aacntmx[(i-1)%3];
+      int *l = lenmx[i%3], *l1 = lenmx[(i-1)%3];
+
+      int f = i-1;
+      if ( f % FD_ROWS == 0 ) {
+	 int nr = MIN(FD_ROWS, N1-1-f);
+	 float *sim = ws->simmx + (f%nsim)*(N2-1);
+	 if ( p->kldiv ) {
+	    for ( int r = 0; r < nr; r++ )
+	       frame_kldivs(sim + r*(N2-1), X1+(f+r)*D, X2, N2-1, D, p);
+	 } else {
+	    frames_dot(sim, N2-1, X1n+f*D, nr, X2T, N2-1, D);
+	    for ( int r = 0; r < nr; r++ )
+	       for ( int j = 0; j < N2-1; j++ )
+		  sim[r*(N2-1)+j] = 1-sim[r*(N2-1)+j]/sqrt(lenx[f+r]*leny[j]);
+	 }
+      }
+      float *s = ws->simmx + (f%nsim)*(N2-1);
+      float *s1 = ws->simmx + ((f+nsim-1)%nsim)*(N2-1);
+
+      c[0] = MAXCOST;
+      a[0] = i;
+      l[0] = i;
+
+      if ( !p->sakoe ) {
+	 for ( int j = 1; j < N2; j++ ) {
+	    float dcost = c1[j-1] + s[j-1];
+	    float vcost = c1[j] + s[j-1];
+	    float hcost = c[j-1] + s[j-1];
+	    
+	    if ( a1[j] + 1 >= maxrun )
+	       vcost = MAXCOST;
+	    
+	    if ( a[j-1] + 1 >= maxrun )
+	       hcost = MAXCOST;
+	    
+	    c[j] = MIN( dcost, MIN(vcost, hcost) );
+	    
+	    if ( dcost <= vcost && dcost <= hcost ) {
+	       l[j] = l1[j-1] + 1;
+	    } else if ( vcost <= hcost ) {
+	       l[j] = l1[j] + 1;
+	    } else {
+	       l[j] = l[j-1] + 1;
+	    }
+	    
+	    a[j] = 0;
+	    if ( vcost < dcost || hcost < dcost ) {
+	       if ( vcost < hcost ) {
+		  a[j] = a1[j] + 1;
+	       } else {
+		  a[j] = a[j-1] + 1;
+	       }
+	    } 
+	 }
+      } else {
+	 // s1 and c2 hold row i-2 (only read for i > 1)
+	 for ( int j = 1; j < N2; j++ ) {
+	    if ( i == 1 || j == 1 ) {
+	       float dcost = c1[j-1] + s[j-1];
+	       float vcost = c1[j] + s[j-1];
+	       float hcost = c[j-1] + s[j-1];
+	       
+	       c[j] = MIN( dcost, MIN(vcost, hcost) );
+	    } else {
+	       float dcost = c1[j-1] + 2*s[j-1];
+	       float vcost = c2[j-1] + 2*s1[j-1] + s[j-1];
+	       float hcost = c1[j-2] + 2*s[j-2] + s[j-1];
+	       
+	       c[j] = MIN( dcost, MIN(vcost, hcost) );
+	    }
+	 }
+      } 
+   }
+
+   return costmx[(N1-1)%3][N2-1]/(N1+N2-2);
+}
+
+float rescore_match(float *X1, int N1, float *X2, int N2, int D,
+		    int xA, int xB, int yA, int yB, DtwParams *p, DtwScratch *ws)
+{
+   int a1 = MAX(xA, 0), b1 = MIN(xB, N1-1);
+   int a2 = MAX(yA, 0), b2 = MIN(yB, N2-1);
+   if ( a1 > b1 || a2 > b2 ) return NAN;
+
+   float dtwdist = feat_dtw( X1 + (long)a1*D, b1-a1+1, 
+			     X2 + (long)a2*D, b2-a2+1, D, p, ws );
+
+   if ( !p->kldiv && dtwdist > 2 ) return NAN;
+
+   if ( p->kldiv ) dtwdist /= 10;
+
+   return 1-dtwdist/2;
+}
@@ -0,0 +1,50 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#ifndef DTW_H
+#define DTW_H
+
+// Frame distance and path options of feat_dtw
+typedef struct DtwParams {
+   int maxrun; // longest run of vertical or horizontal steps
+   int kldiv; // KL divergence between posteriorgrams instead of cosine
+   int sym; // symmetrize the KL divergence
+   int wmvn; // mean/variance normalize each segment (cosine only)
+   int sakoe; // symmetric slope-constrained (Sakoe-Chiba P=1) recursion
+   int nbits_log; // precision of the icsi_log table
+   float *log_table; // icsi_log table (built by dtw_params_init)
+} DtwParams;
+
+// Rolling rows of the distance and cost matrices of feat_dtw and copies
+// of the segments, grown on demand (one per thread)
+typedef struct DtwScratch {
+   long cap, simcap, featcap;
+   float *simmx;
+   float *costmx;
+   int *aacntmx;
+   int *lenmx;
+   float *feats;
+} DtwScratch;
+
+// Sets the defaults (cosine, no run limit, no normalization) and builds
+// the log table
+void dtw_params_init(DtwParams *p);
+void dtw_params_free(DtwParams *p);
+
+void dtw_scratch_init(DtwScratch *ws);
+void dtw_scratch_free(DtwScratch *ws);
+
+// Average frame distance along the best alignment of the N1 x D segment
+// X1 with the N2 x D segment X2 (cosine distance is in [0,2])
+float feat_dtw(float *X1, int N1, float *X2, int N2, int D, DtwParams *p, DtwScratch *ws);
+
+// Similarity 1-dist/2 of the match [xA,xB] x [yA,yB] in 0-based frames,
+// clamped to the N1 frames of X1 and the N2 frames of X2 (the KL
+// divergence is scaled by 1/10 first). NAN when the match is empty or
+// its cosine distance exceeds 2. Shared by plebdisc -featfile1 and
+// rescore_singlepair_dtw so both score a match list alike.
+float rescore_match(float *X1, int N1, float *X2, int N2, int D,
+		    int xA, int xB, int yA, int yB, DtwParams *p, DtwScratch *ws);
+
+#endif
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <stdlib.h>
 #include "feat.h"
 #include "util.h"
 
@@ -81,3 +82,156 @@ void feat_normalize(float *feats, int N, int D, float *nfeats)
     for(; f<fend;nf++,f++) *nf = *f/norm;
   }
 }
+
+int feat_readvad(char *vadfile, int **vadA, int **vadB)
+{
+   *vadA = NULL;
+   *vadB = NULL;
+   
+   assert_file_exist( vadfile );
+   FILE *fptr = fopen(vadfile,"r");
+
+   // Count entries in vad file
+   int c; int lines = 0;
+   while ((c = fgetc(fptr)) != EOF) {
+      if ( c == '\n' ) lines++;
+   }
+   if ( fseek(fptr,-1,SEEK_END) == 0 && fgetc(fptr) != '\n' )
+      lines++;
+
+   // Fill vad arrays
+   if ( lines > 0 ) {
+      fseek(fptr,0,SEEK_SET);
+
+      *vadA = (int *) MALLOC( lines*sizeof(int) );
+      *vadB = (int *) MALLOC( lines*sizeof(int) );
+	 
+      // Stop at the first line that is not a pair (e.g. a blank last line)
+      int cnt = 0;
+      while ( cnt < lines && fscanf(fptr, "%d%d", &(*vadA)[cnt], &(*vadB)[cnt]) == 2 ) 
+	 cnt++;
+      lines = cnt;
+   } 
+
+   fclose(fptr);
+
+   if ( lines == 0 && *vadA ) {
+      FREE(*vadA); *vadA = NULL;
+      FREE(*vadB); *vadB = NULL;
+   }
+   return lines;
+}
+
+int feat_vadstats(float *feats, int N, int D, int *vadA, int *vadB, int vadcnt, 
+		  float *mean, float *std)
+{
+   int framecnt = 0;
+
+   for ( int d = 0; d < D; d++ ) {
+      mean[d] = 0;
+      std[d] = 0;
+   }
+
+   for ( int v = 0; v < vadcnt; v++ ) {
+      for ( int n = vadA[v]; n < MIN(N,vadB[v]+1); n++ ) {
+	 framecnt++;
+	 for ( int d = 0; d < D; d++ ) {
+	    mean[d] += feats[n*D+d];
+	    std[d] += feats[n*D+d]*feats[n*D+d];
+	 }
+      }
+   }
+	       
+   for ( int d = 0; d < D; d++ ) {
+      mean[d] /= framecnt;
+      std[d] /= framecnt;
+      std[d] = sqrtf(std[d] - mean[d]*mean[d]);
+   }
+
+   return framecnt;
+}
+
+void feat_lshproj(float *feats, int n, int D, float *Tt, int S, char *skip, unsigned int *sigs)
+{
+   int W = S/32;
+
+#pragma omp parallel
+   {
+      float *acc = (float *) MALLOC( LSH_TILE*LSH_SBLOCK*sizeof(float) );
+
+#pragma omp for schedule(static)
+      for ( int f0 = 0; f0 < n; f0 += LSH_TILE ) {
+	 int nf = MIN(LSH_TILE, n-f0);
+	 for ( int s0 = 0; s0 < S; s0 += LSH_SBLOCK ) {
+	    int ns = MIN(LSH_SBLOCK, S-s0);
+
+	    // Tile of the feats x Tt product; each sum runs over d in order,
+	    // as the scalar dot product did
+	    for ( int f = 0; f < nf; f++ ) {
+	       float *a = acc + f*LSH_SBLOCK;
+	       float *x = feats + (long)(f0+f)*D;
+	       for ( int s = 0; s < ns; s++ )
+		  a[s] = 0;
+	       for ( int d = 0; d < D; d++ ) {
+		  float xd = x[d];
+		  float *t = Tt + (long)d*S + s0;
+		  for ( int s = 0; s < ns; s++ )
+		     a[s] += xd * t[s];
+	       }
+	    }
+
+	    // Pack the signs, 32 projections per word
+	    for ( int f = 0; f < nf; f++ ) {
+	       float *a = acc + f*LSH_SBLOCK;
+	       unsigned int *sig = sigs + (long)(f0+f)*W + s0/32;
+	       if ( skip && skip[f0+f] ) {
+		  memset(sig, 0, ns/8);
+		  continue;
+	       }
+	       for ( int w = 0; w < ns/32; w++ ) {
+		  unsigned int bits = 0;
+		  for ( int b = 0; b < 32; b++ )
+		     bits |= (unsigned int)(a[32*w+b] >= 0) << b;
+		  sig[w] = bits;
+	       }
+	    }
+	 }
+      }
+
+      FREE(acc);
+   }
+}
+
+int feat_vadskip(long start, int n, int *vadA, int *vadB, int vadcnt, int currV, char *skip)
+{
+   for ( int i = 0; i < n; i++ ) {
+      skip[i] = 0;
+      if ( vadcnt == 0 ) continue;
+
+      if ( currV < vadcnt && start+i+1 > vadB[currV] )
+	 currV++;
+	 
+      skip[i] = currV >= vadcnt || start+i+1 < vadA[currV];
+   }
+   return currV;
+}
+
+void feat_readstats(char *statsfile, int D, float *mean, float *std)
+{
+   int defnegA = -1;
+   int defnegB = -1;
+   int nlines;
+   double *stats = readfeats_file_d( statsfile, D, &defnegA, &defnegB, 
+				     &nlines );
+   if ( nlines != 80 ) {
+      fprintf(stderr,"Improperly formatted stats file\n");
+      exit(1);
+   }
+      
+   for ( int d = 0; d < D; d++ ) {
+      std[d] = (float) sqrt(stats[d*80+d]);
+      mean[d] = (float) stats[d*80+D];
+   }
+
+   FREE(stats);
+}
@@ -11,4 +11,31 @@ void feat_gettraj(int N, float * feats, int D, int d, float * traj);
 int feat_postings(int N, float * feats, int D, float pthr, int * cntlist, int ** occlist);
 void feat_normalize(float *feats, int N, int D, float *nfeats);
 
+#define LSH_TILE 32 // Frames projected together by feat_lshproj
+#define LSH_SBLOCK 256 // Projections per panel of the projection matrix
+
+// Reads the (start, end) frame pairs of a vad file into newly allocated
+// vadA and vadB; returns the number of pairs (0 leaves both NULL)
+int feat_readvad(char *vadfile, int **vadA, int **vadB);
+
+// Reads the mean and standard deviation vectors from an 80 line stats file
+void feat_readstats(char *statsfile, int D, float *mean, float *std);
+
+// Per-dimension mean and standard deviation over the frames of the vad
+// regions [vadA, vadB] (0-based, inclusive); returns the frame count
+int feat_vadstats(float *feats, int N, int D, int *vadA, int *vadB, int vadcnt, 
+		  float *mean, float *std);
+
+// Marks in skip the frames start..start+n-1 that fall outside the vad
+// regions [vadA, vadB] (1-based, inclusive, as lsh has always read them);
+// nothing is skipped when vadcnt is 0. currV is the region reached so far
+// (0 on the first call) and the updated value is returned.
+int feat_vadskip(long start, int n, int *vadA, int *vadB, int vadcnt, int currV, char *skip);
+
+// Projects the n frames of feats onto the S columns of Tt (the projection
+// matrix transposed to D x S) and writes S/32 words per frame to sigs, bit b
+// of word w set when projection 32w+b is nonnegative. Frames with skip set
+// (if skip is not NULL) get a zero signature. S must be a multiple of 32.
+void feat_lshproj(float *feats, int n, int D, float *Tt, int S, char *skip, unsigned int *sigs);
+
 #endif
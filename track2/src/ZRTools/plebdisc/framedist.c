@@ -0,0 +1,82 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#include <string.h>
+#include "framedist.h"
+
+// GCC vector of four floats (SSE on x86, NEON on ARM)
+typedef float v4sf __attribute__ ((vector_size (16)));
+
+#define FD_VECS (FD_COLS/4)
+
+int frames_stride(int N)
+{
+   return (N+FD_COLS-1)/FD_COLS*FD_COLS;
+}
+
+void frames_transpose(float *XT, float *X, int N, int D)
+{
+   int ld = frames_stride(N);
+   for ( int d = 0; d < D; d++ ) {
+      for ( int j = 0; j < N; j++ )
+	 XT[(long)d*ld+j] = X[(long)j*D+d];
+      for ( int j = N; j < ld; j++ )
+	 XT[(long)d*ld+j] = 0;
+   }
+}
+
+// sq is a constant at both call sites, so each gets its own copy of the
+// loop. The padding of X2T and the repeated rows of a short last block
+// are computed too but not stored.
+static inline void frames_block(float *sim, int ld, float *X1, int nrows, 
+				float *X2T, int N2, int D, int sq)
+{
+   int ldt = frames_stride(N2);
+
+   for ( int r0 = 0; r0 < nrows; r0 += FD_ROWS ) {
+      int nr = nrows-r0 < FD_ROWS ? nrows-r0 : FD_ROWS;
+      float *x[FD_ROWS];
+      for ( int r = 0; r < FD_ROWS; r++ )
+	 x[r] = X1 + (long)(r0 + (r < nr ? r : 0))*D;
+
+      for ( int j0 = 0; j0 < N2; j0 += FD_COLS ) {
+	 int nc = N2-j0 < FD_COLS ? N2-j0 : FD_COLS;
+	 v4sf acc[FD_ROWS][FD_VECS];
+	 for ( int r = 0; r < FD_ROWS; r++ )
+	    for ( int v = 0; v < FD_VECS; v++ )
+	       acc[r][v] = (v4sf) {0, 0, 0, 0};
+
+	 for ( int d = 0; d < D; d++ ) {
+	    v4sf y[FD_VECS];
+	    memcpy(y, X2T + (long)d*ldt + j0, sizeof(y));
+	    for ( int r = 0; r < FD_ROWS; r++ ) {
+	       float a = x[r][d];
+	       for ( int v = 0; v < FD_VECS; v++ ) {
+		  if ( sq ) {
+		     v4sf t = a - y[v];
+		     acc[r][v] += t*t;
+		  } else {
+		     acc[r][v] += a*y[v];
+		  }
+	       }
+	    }
+	 }
+
+	 float tile[FD_ROWS][FD_COLS];
+	 memcpy(tile, acc, sizeof(tile));
+	 for ( int r = 0; r < nr; r++ )
+	    memcpy(sim + (long)(r0+r)*ld + j0, tile[r], nc*sizeof(float));
+      }
+   }
+}
+
+void frames_dot(float *sim, int ld, float *X1, int nrows, float *X2T, int N2, int D)
+{
+   frames_block(sim, ld, X1, nrows, X2T, N2, D, 0);
+}
+
+void frames_sqdist(float *sim, int ld, float *X1, int nrows, float *X2T, int N2, int D)
+{
+   frames_block(sim, ld, X1, nrows, X2T, N2, D, 1);
+}
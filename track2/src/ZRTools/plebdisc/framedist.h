@@ -0,0 +1,33 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#ifndef FRAMEDIST_H
+#define FRAMEDIST_H
+
+// Blocks of frame inner products and squared distances for DTW
+//
+// The kernels take the second segment transposed (see frames_transpose)
+// and work on FD_ROWS frames of X1 against FD_COLS frames of X2 at a time,
+// with the sums held in vector registers across the frames of X2. Every
+// entry is still summed over d in order, so the results equal those of
+// the plain per-pair loop. Shared by plebdisc (dtw.c) and samediff
+// (wordsim.c).
+
+#define FD_ROWS 4
+#define FD_COLS 8
+
+// Row length of a transposed segment of N frames (N rounded up to a
+// whole number of FD_COLS); it takes D*frames_stride(N) floats
+int frames_stride(int N);
+
+// XT[d*frames_stride(N)+j] = X[j*D+d], zero past frame N
+void frames_transpose(float *XT, float *X, int N, int D);
+
+// sim[r*ld+j] = sum_d X1[r*D+d]*X2[j*D+d] for r < nrows, j < N2
+void frames_dot(float *sim, int ld, float *X1, int nrows, float *X2T, int N2, int D);
+
+// sim[r*ld+j] = sum_d (X1[r*D+d]-X2[j*D+d])^2 for r < nrows, j < N2
+void frames_sqdist(float *sim, int ld, float *X1, int nrows, float *X2T, int N2, int D);
+
+#endif
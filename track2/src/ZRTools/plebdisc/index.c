@@ -0,0 +1,579 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include "index.h"
+#include "util.h"
+
+static size_t align_up (size_t n) {
+   return (n + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+}
+
+void index_layout (IndexHeader *hdr, IndexSection *toc, char **files, int Nfiles, 
+		   frameind Ntot, int P) {
+   memset(hdr, 0, sizeof(IndexHeader));
+   memcpy(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic));
+   hdr->version = INDEX_VERSION;
+   hdr->SIG_NUM_BYTES = SIG_NUM_BYTES;
+   hdr->sigstride = SIG_NUM_WORDS * sizeof(uint64_t);
+   hdr->Nfiles = Nfiles;
+   hdr->Ntot = Ntot;
+   hdr->P = P;
+   hdr->nsections = INDEX_NSECTIONS;
+
+   size_t nchars = 0;
+   for ( int i = 0; i < Nfiles; i++ )
+      nchars += strlen(files[i]) + 1;
+
+   uint64_t length[INDEX_NSECTIONS] = {
+      nchars,
+      sizeof(int) * (uint64_t)Nfiles,
+      hdr->sigstride * (uint64_t)Ntot,
+      sizeof(int) * (uint64_t)Ntot,
+      sizeof(int) * (uint64_t)Ntot,
+      sizeof(int) * (uint64_t)P * SIG_NUM_BYTES,
+      sizeof(frameind) * (uint64_t)P * Ntot,
+      sizeof(uint64_t) * (uint64_t)P * Ntot
+   };
+
+   size_t pos = align_up(sizeof(IndexHeader) + INDEX_NSECTIONS*sizeof(IndexSection));
+   for ( int i = 0; i < INDEX_NSECTIONS; i++ ) {
+      memset(&toc[i], 0, sizeof(IndexSection));
+      toc[i].id = IDX_FILES + i;
+      toc[i].offset = pos;
+      toc[i].length = length[i];
+      pos = align_up(pos + length[i]);
+   }
+}
+
+void write_index_section (FILE *fout, IndexSection *toc, int id, size_t off, 
+			  const void *buf, size_t len) {
+   IndexSection *sec = &toc[id - IDX_FILES];
+   if ( off + len > sec->length )
+      fatal("\nERROR: write past the end of an index section");
+   if ( fseek(fout, (long)(sec->offset + off), SEEK_SET) != 0 ||
+	fwrite(buf, 1, len, fout) != len )
+      fatal("\nERROR: failed writing the index file");
+}
+
+// copies n bytes at the read position into dst and advances it
+static void index_get (void *dst, size_t n, char *map, size_t len, size_t *pos) {
+   if ( *pos + n > len )
+      fatal("\nERROR: Index file is truncated");
+   memcpy(dst, map + *pos, n);
+   *pos += n;
+}
+
+// Fills the keys of a single index from its signatures and order arrays
+static void compute_keys (struct signature_index *index, int P) {
+   index->keys = (uint64_t **) MALLOC( sizeof(uint64_t *)*P );
+   index->keys_owned = true;
+   for ( int p = 0; p < P; p++ ) {
+      uint64_t *keys = (uint64_t *) MALLOC( sizeof(uint64_t)*(index->Ntot+1) );
+      frameind *order = index->order[p];
+      int *perm = index->PERMUTE[p];
+#pragma omp parallel for schedule(static)
+      for ( frameind i = 0; i < index->Ntot; i++ )
+	 keys[i] = signature_lead_key(&index->allfeats[order[i]], perm);
+      index->keys[p] = keys;
+   }
+}
+
+// Reads the original interleaved layout
+static void read_index_legacy (char *map, size_t len, int P, struct signature_index *index) {
+   size_t pos = 0;
+
+   index_get(&index->SIG_NUM_BYTES, sizeof(int), map, len, &pos);
+   fprintf(stderr, "SIG_NUM_BYTES = %d, ", index->SIG_NUM_BYTES);
+   index_get(&index->Nfiles, sizeof(int), map, len, &pos);
+   fprintf(stderr, "Nfiles = %d, ", index->Nfiles);
+
+   if ( index->SIG_NUM_BYTES != SIG_NUM_BYTES ) {
+      fatal("\nERROR: Requested signature size does not match index");
+   }
+
+   // File names are used in place (each is stored with its \0)
+   index->Nchars = (int *) MALLOC( sizeof(int)*index->Nfiles );
+   index->files = (char **) MALLOC( sizeof(char *)*index->Nfiles );
+   for ( int i = 0; i < index->Nfiles; i++ ) {
+      index_get(&index->Nchars[i], sizeof(int), map, len, &pos);
+      if ( pos + index->Nchars[i] > len || index->Nchars[i] < 1 )
+	 fatal("\nERROR: Index file is truncated");
+      index->files[i] = map + pos;
+      pos += index->Nchars[i];
+   }
+
+   index_get(&index->Ntot, sizeof(frameind), map, len, &pos);
+   fprintf(stderr, "Ntot = %d, ", index->Ntot);
+   index->Narr = (int *) MALLOC( sizeof(int)*index->Nfiles );
+   index_get(index->Narr, sizeof(int)*index->Nfiles, map, len, &pos);
+
+   // Signature records are id, byte_, fid; byte_ is used in place when it
+   // needs no padding (hamming reads it with unaligned loads)
+   size_t recsize = 2*sizeof(int) + SIG_NUM_BYTES;
+   if ( pos + recsize*index->Ntot > len )
+      fatal("\nERROR: Index file is truncated");
+   index->allfeats =
+      (struct signature *) MALLOC( sizeof(struct signature)*index->Ntot );
+   bool sigs_mapped = ( SIG_NUM_BYTES == SIG_NUM_WORDS * sizeof(uint64_t) );
+   index->sigblock = NULL;
+   if ( !sigs_mapped && index->Ntot > 0 ) {
+      new_signatures(index->allfeats, index->Ntot);
+      index->sigblock = index->allfeats[0].byte_;
+   }
+   for ( frameind i = 0; i < index->Ntot; i++ ) {
+      char *rec = map + pos + recsize*i;
+      struct signature *sig = &index->allfeats[i];
+      memcpy(&sig->id, rec, sizeof(int));
+      if ( sigs_mapped )
+	 sig->byte_ = (byte *) rec + sizeof(int);
+      else
+	 memcpy(sig->byte_, rec + sizeof(int), SIG_NUM_BYTES);
+      memcpy(&sig->fid, rec + sizeof(int) + SIG_NUM_BYTES, sizeof(int));
+      sig->indexid = i;
+   }
+   pos += recsize*index->Ntot;
+
+   index_get(&index->P, sizeof(int), map, len, &pos);
+   if ( P > index->P ) {
+      fatal("\nERROR: Requested permutations exceeds amount in index");
+   }
+   fprintf(stderr, "P = %d", index->P);
+
+   // Only the first P permutations are touched. Every order array starts at
+   // the same alignment, so they are either all used in place or all copied.
+   size_t permsize = sizeof(int)*SIG_NUM_BYTES;
+   size_t ordersize = sizeof(frameind)*index->Ntot;
+   if ( pos + (permsize + ordersize)*P > len )
+      fatal("\nERROR: Index file is truncated");
+   index->order_mapped = ( (pos + permsize) % sizeof(frameind) == 0 );
+   index->PERMUTE = (int **) MALLOC( sizeof(int *)*P );
+   index->order = (frameind **) MALLOC( sizeof(frameind *)*P );
+   for ( int i = 0; i < P; i++ ) {
+      index->PERMUTE[i] = (int *) MALLOC( permsize );
+      index_get(index->PERMUTE[i], permsize, map, len, &pos);
+      if ( index->order_mapped ) {
+	 index->order[i] = (frameind *) (map + pos);
+	 pos += ordersize;
+      } else {
+	 index->order[i] = (frameind *) MALLOC( ordersize );
+	 index_get(index->order[i], ordersize, map, len, &pos);
+      }
+   }
+   compute_keys(index, P);
+}
+
+// true if a version 1 index has section id
+static bool index_has_section (char *map, int id) {
+   IndexHeader *hdr = (IndexHeader *) map;
+   IndexSection *toc = (IndexSection *) (map + sizeof(IndexHeader));
+   for ( uint32_t i = 0; i < hdr->nsections; i++ )
+      if ( toc[i].id == id ) 
+	 return true;
+   return false;
+}
+
+// returns the start of section id of a version 1 index, checking its bounds
+static char *index_section (char *map, size_t len, int id, uint64_t expected) {
+   IndexHeader *hdr = (IndexHeader *) map;
+   IndexSection *toc = (IndexSection *) (map + sizeof(IndexHeader));
+   for ( uint32_t i = 0; i < hdr->nsections; i++ ) {
+      if ( toc[i].id != id ) 
+	 continue;
+      if ( toc[i].length != expected || toc[i].offset % INDEX_ALIGN != 0 ||
+	   toc[i].offset > len || toc[i].length > len - toc[i].offset ) {
+	 fprintf(stderr, "\nERROR: Bad index section %d\n", id);
+	 fatal("\nERROR: Index file is corrupt");
+      }
+      return map + toc[i].offset;
+   }
+   fprintf(stderr, "\nERROR: Index section %d is missing\n", id);
+   fatal("\nERROR: Index file is corrupt");
+   return NULL;
+}
+
+// Reads a version 1 index; all arrays are used in place
+static void read_index_v1 (char *map, size_t len, int P, struct signature_index *index) {
+   IndexHeader *hdr = (IndexHeader *) map;
+   if ( hdr->version != INDEX_VERSION ) {
+      fprintf(stderr, "\nERROR: Unsupported index version %u\n", hdr->version);
+      fatal("\nERROR: Cannot read index");
+   }
+   if ( sizeof(IndexHeader) + (uint64_t)hdr->nsections*sizeof(IndexSection) > len )
+      fatal("\nERROR: Index file is truncated");
+
+   index->SIG_NUM_BYTES = hdr->SIG_NUM_BYTES;
+   fprintf(stderr, "SIG_NUM_BYTES = %d, ", index->SIG_NUM_BYTES);
+   index->Nfiles = hdr->Nfiles;
+   fprintf(stderr, "Nfiles = %d, ", index->Nfiles);
+   if ( index->SIG_NUM_BYTES != SIG_NUM_BYTES ) {
+      fatal("\nERROR: Requested signature size does not match index");
+   }
+   if ( hdr->sigstride != SIG_NUM_WORDS * sizeof(uint64_t) )
+      fatal("\nERROR: Index signature stride does not match this build");
+   index->Ntot = hdr->Ntot;
+   fprintf(stderr, "Ntot = %d, ", index->Ntot);
+   index->P = hdr->P;
+   if ( P > index->P ) {
+      fatal("\nERROR: Requested permutations exceeds amount in index");
+   }
+   fprintf(stderr, "P = %d", index->P);
+
+   // The file name section holds exactly Nfiles \0 terminated names
+   size_t nchars = 0;
+   IndexSection *toc = (IndexSection *) (map + sizeof(IndexHeader));
+   for ( uint32_t i = 0; i < hdr->nsections; i++ )
+      if ( toc[i].id == IDX_FILES ) nchars = toc[i].length;
+   char *names = index_section(map, len, IDX_FILES, nchars);
+   index->Nchars = (int *) MALLOC( sizeof(int)*index->Nfiles );
+   index->files = (char **) MALLOC( sizeof(char *)*index->Nfiles );
+   size_t pos = 0;
+   for ( int i = 0; i < index->Nfiles; i++ ) {
+      char *end = pos < nchars ? memchr(names + pos, '\0', nchars - pos) : NULL;
+      if ( end == NULL )
+	 fatal("\nERROR: Index file is corrupt");
+      index->files[i] = names + pos;
+      index->Nchars[i] = end - index->files[i] + 1;
+      pos += index->Nchars[i];
+   }
+
+   int *narr = (int *) index_section(map, len, IDX_NARR, sizeof(int)*(uint64_t)index->Nfiles);
+   index->Narr = (int *) MALLOC( sizeof(int)*index->Nfiles );
+   memcpy(index->Narr, narr, sizeof(int)*index->Nfiles);
+
+   byte *sigs = (byte *) index_section(map, len, IDX_SIGS, hdr->sigstride*(uint64_t)index->Ntot);
+   int *ids = (int *) index_section(map, len, IDX_IDS, sizeof(int)*(uint64_t)index->Ntot);
+   int *fids = (int *) index_section(map, len, IDX_FIDS, sizeof(int)*(uint64_t)index->Ntot);
+   index->allfeats =
+      (struct signature *) MALLOC( sizeof(struct signature)*index->Ntot );
+   index->sigblock = NULL;
+   for ( frameind i = 0; i < index->Ntot; i++ ) {
+      struct signature *sig = &index->allfeats[i];
+      sig->id = ids[i];
+      sig->byte_ = sigs + (size_t)hdr->sigstride*i;
+      sig->fid = fids[i];
+      sig->indexid = i;
+   }
+
+   // Only the first P permutations are touched
+   int *perms = (int *) index_section(map, len, IDX_PERMUTE, 
+				      sizeof(int)*(uint64_t)index->P*SIG_NUM_BYTES);
+   frameind *order = (frameind *) index_section(map, len, IDX_ORDER, 
+						sizeof(frameind)*(uint64_t)index->P*index->Ntot);
+   index->order_mapped = true;
+   index->PERMUTE = (int **) MALLOC( sizeof(int *)*P );
+   index->order = (frameind **) MALLOC( sizeof(frameind *)*P );
+   for ( int i = 0; i < P; i++ ) {
+      index->PERMUTE[i] = (int *) MALLOC( sizeof(int)*SIG_NUM_BYTES );
+      memcpy(index->PERMUTE[i], perms + (size_t)i*SIG_NUM_BYTES, sizeof(int)*SIG_NUM_BYTES);
+      index->order[i] = order + (size_t)i*index->Ntot;
+   }
+
+   if ( index_has_section(map, IDX_KEYS) ) {
+      uint64_t *keys = (uint64_t *) index_section(map, len, IDX_KEYS, 
+						  sizeof(uint64_t)*(uint64_t)index->P*index->Ntot);
+      index->keys = (uint64_t **) MALLOC( sizeof(uint64_t *)*P );
+      index->keys_owned = false;
+      for ( int i = 0; i < P; i++ )
+	 index->keys[i] = keys + (size_t)i*index->Ntot;
+   } else
+      compute_keys(index, P);
+}
+
+// Reads a single index file
+static void read_index_file (char *indexfile, int P, struct signature_index *index) {
+   assert_file_exist( indexfile );
+   index->map = mmap_file(indexfile, &index->maplen);
+
+   fprintf(stderr, "indexfile = %s; ", indexfile);
+   if ( index->maplen >= sizeof(IndexHeader) && 
+	memcmp(index->map, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 )
+      read_index_v1(index->map, index->maplen, P, index);
+   else {
+      fprintf(stderr, "(legacy format) ");
+      read_index_legacy(index->map, index->maplen, P, index);
+   }
+
+   index->Nsegs = 1;
+   index->segstart = (frameind *) MALLOC( sizeof(frameind)*2 );
+   index->segstart[0] = 0;
+   index->segstart[1] = index->Ntot;
+   index->segs = NULL;
+}
+
+// Reads every segment of a manifest and joins them into one index whose
+// signatures and files are the segments' in manifest order
+static void read_segments (char *manifest, int P, struct signature_index *index) {
+   int Nsegs;
+   char **segfiles = read_manifest(manifest, &Nsegs);
+   if ( Nsegs == 0 )
+      fatal("\nERROR: Index manifest lists no segments");
+
+   fprintf(stderr, "manifest = %s; Nsegs = %d\n", manifest, Nsegs);
+   struct signature_index *segs = 
+      (struct signature_index *) MALLOC( sizeof(struct signature_index)*Nsegs );
+   index->SIG_NUM_BYTES = SIG_NUM_BYTES;
+   index->Nfiles = 0;
+   index->Ntot = 0;
+   index->P = 0;
+   for ( int s = 0; s < Nsegs; s++ ) {
+      fprintf(stderr, "   ");
+      read_index_file(segfiles[s], P, &segs[s]);
+      fprintf(stderr, "\n");
+      for ( int p = 0; p < P; p++ )
+	 if ( !same_vectors(segs[s].PERMUTE[p], SIG_NUM_BYTES, segs[0].PERMUTE[p], SIG_NUM_BYTES) )
+	    fatal("\nERROR: Index segments were built with different permutations");
+      index->Nfiles += segs[s].Nfiles;
+      index->Ntot += segs[s].Ntot;
+      if ( s == 0 || segs[s].P < index->P )
+	 index->P = segs[s].P;
+   }
+
+   index->Nsegs = Nsegs;
+   index->segs = segs;
+   index->segstart = (frameind *) MALLOC( sizeof(frameind)*(Nsegs+1) );
+   index->Nchars = (int *) MALLOC( sizeof(int)*index->Nfiles );
+   index->files = (char **) MALLOC( sizeof(char *)*index->Nfiles );
+   index->Narr = (int *) MALLOC( sizeof(int)*index->Nfiles );
+   index->allfeats = 
+      (struct signature *) MALLOC( sizeof(struct signature)*index->Ntot );
+   index->order = (frameind **) MALLOC( sizeof(frameind *)*P*Nsegs );
+   index->keys = (uint64_t **) MALLOC( sizeof(uint64_t *)*P*Nsegs );
+
+   // Segment signature structs move into the joined array (their byte_
+   // storage stays with the segment) with file ids offset to match
+   int fbase = 0;
+   frameind base = 0;
+   for ( int s = 0; s < Nsegs; s++ ) {
+      index->segstart[s] = base;
+      for ( int i = 0; i < segs[s].Nfiles; i++ ) {
+	 index->Nchars[fbase+i] = segs[s].Nchars[i];
+	 index->files[fbase+i] = segs[s].files[i];
+	 index->Narr[fbase+i] = segs[s].Narr[i];
+      }
+      for ( frameind i = 0; i < segs[s].Ntot; i++ ) {
+	 index->allfeats[base+i] = segs[s].allfeats[i];
+	 index->allfeats[base+i].fid += fbase;
+	 index->allfeats[base+i].indexid = base+i;
+      }
+      FREE(segs[s].allfeats);
+      segs[s].allfeats = NULL;
+      for ( int p = 0; p < P; p++ ) {
+	 index->order[p*Nsegs+s] = segs[s].order[p];
+	 index->keys[p*Nsegs+s] = segs[s].keys[p];
+      }
+      fbase += segs[s].Nfiles;
+      base += segs[s].Ntot;
+   }
+   index->segstart[Nsegs] = base;
+
+   index->PERMUTE = (int **) MALLOC( sizeof(int *)*P );
+   for ( int p = 0; p < P; p++ ) {
+      index->PERMUTE[p] = (int *) MALLOC( sizeof(int)*SIG_NUM_BYTES );
+      memcpy(index->PERMUTE[p], segs[0].PERMUTE[p], sizeof(int)*SIG_NUM_BYTES);
+   }
+
+   // the segments own the order and key arrays, mappings and signature storage
+   index->map = NULL;
+   index->maplen = 0;
+   index->sigblock = NULL;
+   index->order_mapped = true;
+   index->keys_owned = false;
+
+   fprintf(stderr, "Nfiles = %d, Ntot = %d, P = %d", index->Nfiles, index->Ntot, index->P);
+
+   for ( int s = 0; s < Nsegs; s++ ) FREE(segfiles[s]);
+   FREE(segfiles);
+}
+
+void read_index (char *indexfile, int P, struct signature_index *index) {
+   if ( is_manifest(indexfile) )
+      read_segments(indexfile, P, index);
+   else
+      read_index_file(indexfile, P, index);
+}
+
+// permutations stored in one index file, from its header (or, in the
+// legacy layout, after the signature records)
+static int index_file_permutations (char *indexfile) {
+   assert_file_exist( indexfile );
+   size_t len;
+   char *map = mmap_file(indexfile, &len);
+   int P;
+   if ( len >= sizeof(IndexHeader) && memcmp(map, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 ) {
+      P = ((IndexHeader *) map)->P;
+   } else {
+      size_t pos = 0;
+      int sigbytes, Nfiles, nchars;
+      frameind Ntot;
+      index_get(&sigbytes, sizeof(int), map, len, &pos);
+      index_get(&Nfiles, sizeof(int), map, len, &pos);
+      for ( int i = 0; i < Nfiles; i++ ) {
+	 index_get(&nchars, sizeof(int), map, len, &pos);
+	 pos += nchars;
+      }
+      index_get(&Ntot, sizeof(frameind), map, len, &pos);
+      pos += sizeof(int)*(size_t)Nfiles + (2*sizeof(int) + sigbytes)*(size_t)Ntot;
+      index_get(&P, sizeof(int), map, len, &pos);
+   }
+   munmap_file(map, len);
+   return P;
+}
+
+int index_permutations (char *indexfile) {
+   if ( !is_manifest(indexfile) )
+      return index_file_permutations(indexfile);
+
+   int Nsegs, P = 0;
+   char **segfiles = read_manifest(indexfile, &Nsegs);
+   for ( int s = 0; s < Nsegs; s++ ) {
+      int Pseg = index_file_permutations(segfiles[s]);
+      if ( s == 0 || Pseg < P ) P = Pseg;
+      FREE(segfiles[s]);
+   }
+   FREE(segfiles);
+   return P;
+}
+
+void free_index (struct signature_index *index, int P) {
+   FREE(index->Nchars);
+   FREE(index->files);
+   FREE(index->Narr);
+
+   if ( index->sigblock )
+      FREE(index->sigblock);
+   if ( index->allfeats )
+      FREE(index->allfeats);
+
+   for ( int i = 0; i < P; i++ )
+      FREE(index->PERMUTE[i]);
+   if ( !index->order_mapped )
+      for ( int i = 0; i < P*index->Nsegs; i++ )
+	 FREE(index->order[i]);
+   if ( index->keys_owned )
+      for ( int i = 0; i < P*index->Nsegs; i++ )
+	 FREE(index->keys[i]);
+   FREE(index->PERMUTE);
+   FREE(index->order);
+   FREE(index->keys);
+   FREE(index->segstart);
+
+   if ( index->segs ) {
+      for ( int s = 0; s < index->Nsegs; s++ )
+	 free_index(&index->segs[s], P);
+      FREE(index->segs);
+   }
+
+   munmap_file(index->map, index->maplen);
+}
+
+bool is_manifest (char *filename) {
+   char head[sizeof(MANIFEST_MAGIC)] = "";
+   assert_file_exist( filename );
+   FILE *fp = fopen(filename, "r");
+   size_t n = fread(head, 1, sizeof(MANIFEST_MAGIC)-1, fp);
+   fclose(fp);
+   return n == sizeof(MANIFEST_MAGIC)-1 && 
+      strncmp(head, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)-1) == 0;
+}
+
+char **read_manifest (char *manifest, int *nsegs) {
+   assert_file_exist( manifest );
+   int nlines = file_line_count( manifest );
+   char **segfiles = (char **) MALLOC( sizeof(char *)*(nlines+1) );
+   char line[MANIFEST_MAXCHAR];
+
+   *nsegs = 0;
+   FILE *fp = fopen(manifest, "r");
+   while ( *nsegs <= nlines && fscanf(fp, "%1023s", line) == 1 ) {
+      if ( line[0] == '#' ) {
+	 // comment (or the magic line): skip the rest of it
+	 int c;
+	 while ( (c = fgetc(fp)) != EOF && c != '\n' );
+	 continue;
+      }
+      segfiles[*nsegs] = (char *) MALLOC( strlen(line)+1 );
+      strcpy(segfiles[(*nsegs)++], line);
+   }
+   fclose(fp);
+   return segfiles;
+}
+
+// copies path to entry, made absolute against the working directory, so
+// the manifest reads the same from any directory
+static void manifest_entry (char *entry, char *path) {
+   if ( path[0] == '/' ) {
+      if ( strlen(path) >= MANIFEST_MAXCHAR )
+	 fatal("\nERROR: segment name is too long for a manifest");
+      strcpy(entry, path);
+      return;
+   }
+   char cwd[MANIFEST_MAXCHAR];
+   if ( getcwd(cwd, sizeof(cwd)) == NULL ||
+	strlen(cwd) + 1 + strlen(path) >= MANIFEST_MAXCHAR )
+      fatal("\nERROR: segment name is too long for a manifest");
+   sprintf(entry, "%s/%s", cwd, path);
+}
+
+int manifest_lock (char *manifest) {
+   char lockfn[MANIFEST_MAXCHAR+8];
+   snprintf(lockfn, sizeof(lockfn), "%s.lock", manifest);
+   int fd = open(lockfn, O_RDWR | O_CREAT, 0666);
+   if ( fd < 0 || flock(fd, LOCK_EX) != 0 ) {
+      fprintf(stderr, "ERROR: cannot lock %s\n", lockfn);
+      exit(1);
+   }
+   return fd;
+}
+
+void manifest_unlock (int fd) {
+   flock(fd, LOCK_UN);
+   close(fd);
+}
+
+void write_manifest (char *manifest, char **segfiles, int nsegs) {
+   // write a temporary file and rename it, so readers never see a partial list
+   char tmp[MANIFEST_MAXCHAR+8];
+   snprintf(tmp, sizeof(tmp), "%s.tmp", manifest);
+   FILE *fp = fopen(tmp, "w");
+   if ( fp == NULL ) {
+      fprintf(stderr, "ERROR: cannot write %s\n", tmp);
+      exit(1);
+   }
+   fprintf(fp, "%s %d\n", MANIFEST_MAGIC, MANIFEST_VERSION);
+   char entry[MANIFEST_MAXCHAR];
+   for ( int s = 0; s < nsegs; s++ ) {
+      manifest_entry(entry, segfiles[s]);
+      fprintf(fp, "%s\n", entry);
+   }
+   if ( fclose(fp) != 0 || rename(tmp, manifest) != 0 ) {
+      fprintf(stderr, "ERROR: cannot replace %s\n", manifest);
+      exit(1);
+   }
+}
+
+void append_manifest (char *manifest, char *indexfile) {
+   int lock = manifest_lock(manifest);
+   FILE *fp = fopen(manifest, "r");
+   bool exists = ( fp != NULL );
+   if ( fp ) fclose(fp);
+
+   if ( !exists ) {
+      write_manifest(manifest, &indexfile, 1);
+      manifest_unlock(lock);
+      return;
+   }
+   if ( !is_manifest(manifest) ) {
+      fprintf(stderr, "ERROR: %s is not an index manifest\n", manifest);
+      exit(1);
+   }
+   char entry[MANIFEST_MAXCHAR];
+   manifest_entry(entry, indexfile);
+   fp = fopen(manifest, "a");
+   fprintf(fp, "%s\n", entry);
+   fclose(fp);
+   manifest_unlock(lock);
+}
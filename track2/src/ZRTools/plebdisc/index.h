@@ -0,0 +1,110 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "signature.h"
+
+// -----------------------------------
+// Index file format (version 1)
+// -----------------------------------
+// IndexHeader, followed by nsections IndexSection table of contents
+// entries. Every section starts on an INDEX_ALIGN boundary:
+//    IDX_FILES: Nfiles \0 terminated file names, back to back
+//    IDX_NARR: Nfiles int (frames per file)
+//    IDX_SIGS: Ntot signatures, sigstride bytes each (zero padded)
+//    IDX_IDS: Ntot int (frame of each signature within its file)
+//    IDX_FIDS: Ntot int (file of each signature)
+//    IDX_PERMUTE: P x SIG_NUM_BYTES int (byte permutations)
+//    IDX_ORDER: P x Ntot frameind (sorted signature order per permutation)
+//    IDX_KEYS: P x Ntot uint64 (leading sort key at each sorted position)
+// Readers skip sections they do not know, and compute the keys of indexes
+// written without IDX_KEYS. Files without the magic are read
+// with the original interleaved layout (see build_index.c).
+// -----------------------------------
+
+#define INDEX_MAGIC "ZRINDEX" // 8 bytes with the \0
+#define INDEX_VERSION 1
+#define INDEX_ALIGN 4096
+
+enum { IDX_FILES = 1, IDX_NARR, IDX_SIGS, IDX_IDS, IDX_FIDS, IDX_PERMUTE, IDX_ORDER, IDX_KEYS };
+#define INDEX_NSECTIONS 8
+
+typedef struct IndexHeader {
+   char magic[8];
+   uint32_t version;
+   int32_t SIG_NUM_BYTES;
+   int32_t sigstride;
+   int32_t Nfiles;
+   uint32_t Ntot;
+   int32_t P;
+   uint32_t nsections;
+   uint32_t reserved;
+} IndexHeader;
+
+typedef struct IndexSection {
+   uint32_t id;
+   uint32_t reserved;
+   uint64_t offset;
+   uint64_t length;
+} IndexSection;
+
+// Fills hdr and toc (INDEX_NSECTIONS entries) with the version 1 layout
+void index_layout (IndexHeader *hdr, IndexSection *toc, char **files, int Nfiles, 
+		   frameind Ntot, int P);
+
+// Writes len bytes at offset off within section id of an index being built
+void write_index_section (FILE *fout, IndexSection *toc, int id, size_t off, 
+			  const void *buf, size_t len);
+
+// -----------------------------------
+// Segment manifest
+// -----------------------------------
+// A text file whose first line is MANIFEST_MAGIC and a version, followed by
+// one index file (segment) per line; lines starting with # are skipped.
+// build_index -manifest appends each new segment, merge_index replaces
+// segments with their merge. Each segment is sorted separately, so queries
+// search every segment with its own beam.
+// -----------------------------------
+
+#define MANIFEST_MAGIC "#ZRSEGMENTS"
+#define MANIFEST_VERSION 1
+#define MANIFEST_MAXCHAR 1024
+
+// Maps an index written by build_index read-only and fills index. Signatures
+// and the order arrays of the first P permutations are used in place when
+// their layout allows, so concurrent readers share the page cache copy.
+// indexfile may also be a manifest, whose segments are read and joined.
+void read_index (char *indexfile, int P, struct signature_index *index);
+
+// Permutations stored in indexfile without reading the rest of it (the
+// fewest of any segment for a manifest)
+int index_permutations (char *indexfile);
+
+// Releases everything read_index set up for the first P permutations
+void free_index (struct signature_index *index, int P);
+
+// true if filename starts with MANIFEST_MAGIC
+bool is_manifest (char *filename);
+
+// returns the nsegs segment files listed in manifest (free each and the array)
+char **read_manifest (char *manifest, int *nsegs);
+
+// Segment names are written as absolute paths, so a manifest reads the
+// same from any working directory.
+
+// replaces manifest with a list of nsegs segments
+void write_manifest (char *manifest, char **segfiles, int nsegs);
+
+// adds indexfile to manifest, creating the manifest if needed (under the
+// manifest lock)
+void append_manifest (char *manifest, char *indexfile);
+
+// takes an exclusive lock on <manifest>.lock, which serializes appends with
+// the rewrite of a merge; returns the descriptor for manifest_unlock
+int manifest_lock (char *manifest);
+void manifest_unlock (int fd);
+
+#endif
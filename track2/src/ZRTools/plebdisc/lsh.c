@@ -20,15 +20,16 @@ char *vadfile = NULL;
 int D = 39;
 int S = 32;
 
+#define LSH_CHUNK 4096 // Frames read and written per pass
 
 void usage()
 {
   fatal("usage: lsh [-projfile <str> (REQUIRED)]\
-\n\t[-featfile <str> (REQUIRED)]\
+\n\t[-featfile <str> (REQUIRED, - reads stdin)]\
 \n\t[-sigfile <str> (REQUIRED)]\
 \n\t[-vadfile <str>]\
 \n\t[-D <n> (defaults to 39)]\
-\n\t[-S <n> (defaults to 32)]");
+\n\t[-S <n> (multiple of 32, defaults to 32)]");
 }
 
 void parse_args(int argc, char **argv)
@@ -63,7 +64,7 @@ void parse_args(int argc, char **argv)
      fatal("\nERROR: sigfile arg is required");
   }
 
-  if ( S != 32 && S != 64 ) {
+  if ( S <= 0 || S % 32 != 0 ) {
      usage();
      fatal("\nERROR: unsupported number of bits");
   }
@@ -81,16 +82,9 @@ int main(int argc, char **argv)
 { 
    parse_args(argc, argv);
 
-   // Read the feature matrix
+   // Read the projection matrix
    int defnegA = -1;
    int defnegB = -1;
-   int N;
-   float *feats = readfeats_file(featfile, D, &defnegA, &defnegB, &N);
-   fprintf(stderr, "featfile = %s; N = %d frames\n", featfile, N);
-
-   // Read the projection matrix
-   defnegA = -1;
-   defnegB = -1;
    int Sfile;
    float *T = readfeats_file(projfile, D, &defnegA, &defnegB, &Sfile);
    if ( S != Sfile ) {
@@ -103,115 +97,58 @@ int main(int argc, char **argv)
    int *vadA = NULL;
    int *vadB = NULL;
    int vadcnt = 0;
-
-   if ( vadfile ) {
-      assert_file_exist( vadfile );
-      FILE *fptr = fopen(vadfile,"r");
-
-      // Count entries in vad file
-      char c; int lines = 0;
-      while ((c = fgetc(fptr)) != EOF) {
-	 if ( c == '\n' ) lines++;
-      }
-      fseek(fptr,-1,SEEK_END);
-      if ( fgetc(fptr) != '\n' )
-	 lines++;
-
-      // Fill vad arrays
-      if ( lines > 0 ) {
-	 fseek(fptr,0,SEEK_SET);
-
-	 vadA = (int *) MALLOC( lines*sizeof(int) );
-	 vadB = (int *) MALLOC( lines*sizeof(int) );
-	 vadcnt = lines;
-	 
-	 for ( int i = 0; i < lines; i++ ) {
-	    fscanf(fptr, "%d%d", &vadA[i], &vadB[i]);
-	 }
-      } 
-
-      fclose(fptr);
-   } 
-
-   // If no vad info was specified process the whole file
-   if ( vadcnt == 0 ) {
-      vadA = (int *) MALLOC( sizeof(int) );
-      vadB = (int *) MALLOC( sizeof(int) );
-      vadA[0] = 1;
-      vadB[0] = N;
-      vadcnt = 1;
+   if ( vadfile ) vadcnt = feat_readvad(vadfile, &vadA, &vadB);
+
+   // Transpose the projections so each feature dimension is a contiguous row
+   float *Tt = (float *) MALLOC( D*S*sizeof(float) );
+   for ( int b = 0; b < S; b++ )
+      for ( int d = 0; d < D; d++ )
+	 Tt[d*S+b] = T[b*D+d];
+
+   // Stream the features through in chunks, writing each chunk's signatures
+   // before reading the next (frames outside the vad regions get zeros)
+   FILE *fin = stdin;
+   if ( strcmp(featfile, "-") != 0 ) {
+      assert_file_exist( featfile );
+      fin = fopen(featfile, "r");
+   }
+   FILE *fout = fopen( sigfile, "w" );
+   if ( !fout ) fatal("ERROR: unable to open sigfile\n");
+
+   size_t framebytes = D*sizeof(float);
+   float *feats = (float *) MALLOC( LSH_CHUNK*framebytes );
+   unsigned int *sigs = (unsigned int *) MALLOC( LSH_CHUNK*(S/8) );
+   char *skip = (char *) MALLOC( LSH_CHUNK );
+
+   long N = 0;
+   int currV = 0;
+   for (;;) {
+      size_t nbytes = fread(feats, 1, LSH_CHUNK*framebytes, fin);
+      if ( nbytes % framebytes != 0 )
+	 fatal("ERROR: Feature dimension inconsistent with file\n");
+      int n = nbytes/framebytes;
+      if ( n == 0 ) break;
+
+      currV = feat_vadskip(N, n, vadA, vadB, vadcnt, currV, skip);
+      feat_lshproj(feats, n, D, Tt, S, skip, sigs);
+
+      if ( fwrite(sigs, S/8, n, fout) != n )
+	 fatal("ERROR: failed writing sigfile\n");
+      N += n;
    }
 
-   // Compute the LSH signatures and write to file
-   if ( S == 32 ) {
-      unsigned int *sigs = (unsigned int *) MALLOC( N*sizeof(unsigned int) );
-
-      int currV = 0;
-      for ( int i = 0; i < N; i++ ) {
-	 sigs[i] = 0;
-	 
-	 if ( currV < vadcnt && i+1 > vadB[currV] )
-	    currV++;
-	 
-	 if ( currV >= vadcnt || i+1 < vadA[currV] )
-	    continue;
-	 
-	 for ( int b = 0; b < S; b++ ) {
-	    float proj = 0;
-	    for ( int d = 0; d < D; d++ ) {
-	       proj += feats[i*D+d] * T[b*D+d];
-	    }
-	    sigs[i] += (proj >= 0) << b;
-	 }
-      }
-      
-      FILE *fptr = fopen( sigfile, "w" );
-      N = fwrite(sigs, sizeof(unsigned int), N, fptr);
-      fclose(fptr);
-      fprintf(stderr, "Wrote %d signatures to %s\n", N, sigfile);
-
-      FREE(sigs);
-   } else if ( S == 64 ) {
-      unsigned int *sigs = (unsigned int *) MALLOC( 2*N*sizeof(unsigned int) );
-
-      int currV = 0;
-      for ( int i = 0; i < N; i++ ) {
-	 sigs[2*i] = 0;
-	 sigs[2*i+1] = 0;
-	 
-	 if ( currV < vadcnt && i+1 > vadB[currV] )
-	    currV++;
-	 
-	 if ( currV >= vadcnt || i+1 < vadA[currV] )
-	    continue;
-	 
-	 for ( int b = 0; b < S/2; b++ ) {
-	    float proj = 0;
-	    for ( int d = 0; d < D; d++ ) {
-	       proj += feats[i*D+d] * T[b*D+d];
-	    }
-	    sigs[2*i] += (proj >= 0) << b;
-
-	    proj = 0;
-	    for ( int d = 0; d < D; d++ ) {
-	       proj += feats[i*D+d] * T[(b+S/2)*D+d];
-	    }
-	    sigs[2*i+1] += (proj >= 0) << b;
-	 }
-      }
-      
-      FILE *fptr = fopen( sigfile, "w" );
-      N = fwrite(sigs, sizeof(unsigned int), 2*N, fptr);
-      fclose(fptr);
-      fprintf(stderr, "Wrote %d signatures to %s\n", N/2, sigfile);
-
-      FREE(sigs);
-   } else {
-      fatal("ERROR: unsupported number of bits\n");
+   if ( fin != stdin ) fclose(fin);
+   fclose(fout);
+   fprintf(stderr, "featfile = %s; N = %ld frames\n", featfile, N);
+   fprintf(stderr, "Wrote %ld signatures to %s\n", N, sigfile);
+
+   FREE(sigs);
+   FREE(skip);
+   FREE(Tt);
+   if ( vadcnt > 0 ) {
+      FREE(vadA);
+      FREE(vadB);
    }
-   
-   FREE(vadA);
-   FREE(vadB);
    FREE(feats);
    FREE(T);
 
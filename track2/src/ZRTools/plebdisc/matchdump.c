@@ -0,0 +1,165 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "util.h"
+#include "matchio.h"
+
+#define MAXLINE (3*MATCHIO_MAXNAME+512)
+
+float minscore = -INFINITY;
+float maxrho = INFINITY;
+int mindur = -1;
+int nfloat = MATCHIO_MAXFLTS;
+int compact = 0;
+
+char **infiles = NULL;
+int ninfiles = 0;
+
+void usage()
+{
+  fatal("usage: matchdump [-minscore <f> (keep score > f)]\
+\n\t[-maxrho <f> (keep rho < f)]\
+\n\t[-mindur <n> (keep matches longer than n frames on both sides)]\
+\n\t[-nfloat <n> (print at most n score columns)]\
+\n\t[-compact <n> (1 = drop empty pair headers and repeated lines)]\
+\n\t<matchfile> ...");
+}
+
+void parse_args(int argc, char **argv)
+{
+  infiles = (char **) MALLOC( MAX(argc,1)*sizeof(char *) );
+  for( int i = 1; i < argc; i++ )
+  {
+     if( strcmp(argv[i], "-minscore") == 0 ) minscore = atof(argv[++i]);
+     else if ( strcmp(argv[i], "-maxrho") == 0 ) maxrho = atof(argv[++i]);
+     else if ( strcmp(argv[i], "-mindur") == 0 ) mindur = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-nfloat") == 0 ) nfloat = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-compact") == 0 ) compact = atoi(argv[++i]);
+     else if ( argv[i][0] != '-' ) infiles[ninfiles++] = argv[i];
+     else {
+       fprintf(stderr, "unknown arg: %s\n", argv[i]);
+       usage();
+     }
+  }
+
+  if ( ninfiles == 0 ) {
+     usage();
+     fatal("\nERROR: at least one match file is required");
+  }
+}
+
+// The value a text reader sees once v is printed with %f
+double as_printed( float v )
+{
+   char buf[64];
+   snprintf(buf, sizeof(buf), "%f", v);
+   return atof(buf);
+}
+
+int keep_record( MatchReader *r, MatchRecord *rec )
+{
+   int32_t *iv = rec->ival;
+   if ( mindur >= 0 && ( iv[1]-iv[0] <= mindur || iv[3]-iv[2] <= mindur ) )
+      return 0;
+   if ( r->nflt > 0 && minscore > -INFINITY && !(as_printed(rec->fval[0]) > minscore) )
+      return 0;
+   if ( r->nflt > 1 && maxrho < INFINITY && !(as_printed(rec->fval[1]) < maxrho) )
+      return 0;
+   return 1;
+}
+
+int main(int argc, char **argv)
+{
+   parse_args(argc, argv);
+
+   MatchBlock blk;
+   matchio_block_init(&blk);
+   char line[MAXLINE], lastline[MAXLINE] = "";
+   char header[2*MATCHIO_MAXNAME+2] = "";
+   int pending = 0;
+   long nprinted = 0;
+
+   for ( int f = 0; f < ninfiles; f++ ) {
+      MatchReader r;
+      matchio_open_read(&r, infiles[f]);
+      int nflt = MIN(nfloat, r.nflt);
+
+      // With -compact a block whose best score fails -minscore prints
+      // nothing, so the index lets us skip it without decoding
+      MatchIndexEntry *index = NULL;
+      int nblocks = -1;
+      if ( compact && minscore > -INFINITY && r.nflt > 0 ) {
+	 char idxfn[MATCHIO_MAXNAME+8];
+	 snprintf(idxfn, sizeof(idxfn), "%s.idx", infiles[f]);
+	 FILE *fp = fopen(idxfn, "rb");
+	 if ( fp ) {
+	    fclose(fp);
+	    nblocks = matchio_read_index(infiles[f], &index);
+	 }
+      }
+
+      for ( int b = 0; ; b++ ) {
+	 if ( nblocks >= 0 ) {
+	    if ( b == nblocks ) break;
+	    if ( !(as_printed(index[b].maxscore) > minscore) ) {
+	       // A skipped block still starts a new header run (see below)
+	       if ( r.layout == MATCH_LAYOUT_PAIR && !index[b].cont ) {
+		  snprintf(header, sizeof(header), "%s %s", index[b].name1, index[b].name2);
+		  pending = 1;
+		  lastline[0] = '\0';
+	       }
+	       continue;
+	    }
+	    matchio_seek(&r, index[b].offset);
+	 }
+	 if ( !matchio_read_block(&r, &blk) ) break;
+
+	 // Group headers (file pairs of plebdisc output); a continuation
+	 // block belongs to the header already printed
+	 if ( r.layout == MATCH_LAYOUT_PAIR && !blk.cont ) {
+	    snprintf(header, sizeof(header), "%s %s", blk.name1, blk.name2);
+	    if ( compact ) {
+	       pending = 1;
+	    } else {
+	       printf("%s\n", header);
+	    }
+	    lastline[0] = '\0';
+	 }
+
+	 for ( uint32_t i = 0; i < blk.nrec; i++ ) {
+	    if ( !keep_record(&r, blk.recs+i) ) continue;
+
+	    matchio_format(line, MAXLINE, r.layout, nflt, &blk, blk.recs+i);
+	    if ( compact ) {
+	       if ( pending ) {
+		  printf("%s\n", header);
+		  pending = 0;
+	       } else if ( strcmp(line, lastline) == 0 ) {
+		  continue;
+	       }
+	       strcpy(lastline, line);
+	    }
+	    printf("%s\n", line);
+	    nprinted++;
+	 }
+      }
+
+      if ( index ) matchio_free_index(index, nblocks);
+      matchio_close_read(&r);
+   }
+
+   fprintf(stderr, "Wrote %ld matches\n", nprinted);
+
+   matchio_block_free(&blk);
+   FREE(infiles);
+
+   int mc = get_malloc_count();
+   if(mc != 0) fprintf(stderr,"WARNING: %d malloc'd items not free'd\n", mc);
+
+   return 0;
+}
@@ -0,0 +1,601 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "util.h"
+#include "matchio.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Builds the match graph, clusters it and dedups the clusters in one
+// process. Reads plebdisc match output (text, or binary match files) and
+// writes <output>.nodes, .edges, .clusters and .dedups exactly as
+// scripts/build_graph.py, conncomp_dfs.py and dedup_clusters.py do.
+
+#define MAXLINE (3*MATCHIO_MAXNAME+512)
+#define MAXDEDUP 10000 // Larger clusters are written without deduping
+
+char *listfile = NULL;
+char *outbase = NULL;
+double probthr = 0.5;
+double olapthr = 0.95;
+double dedupthr = 0.9;
+int thresh = 0;
+int nthreads = 0;
+
+char **infiles = NULL;
+int ninfiles = 0;
+
+void usage()
+{
+  fatal("usage: matchgraph [-output <str> (graph output base, REQUIRED)]\
+\n\t[-list <str> (file basename list, defaults to the names in the matches)]\
+\n\t[-probthr <f> (match probability threshold, defaults to 0.5)]\
+\n\t[-olapthr <f> (overlap edge threshold, defaults to 0.95)]\
+\n\t[-thresh <n> (min edge weight for clustering, defaults to 0)]\
+\n\t[-dedupthr <f> (overlap threshold for dups, defaults to 0.9)]\
+\n\t[-nthreads <n> (defaults to OMP_NUM_THREADS)]\
+\n\t<matchfile> ...");
+}
+
+void parse_args(int argc, char **argv)
+{
+  infiles = (char **) MALLOC( MAX(argc,1)*sizeof(char *) );
+  for( int i = 1; i < argc; i++ )
+  {
+     if( strcmp(argv[i], "-output") == 0 ) outbase = argv[++i];
+     else if ( strcmp(argv[i], "-list") == 0 ) listfile = argv[++i];
+     else if ( strcmp(argv[i], "-probthr") == 0 ) probthr = atof(argv[++i]);
+     else if ( strcmp(argv[i], "-olapthr") == 0 ) olapthr = atof(argv[++i]);
+     else if ( strcmp(argv[i], "-thresh") == 0 ) thresh = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-dedupthr") == 0 ) dedupthr = atof(argv[++i]);
+     else if ( strcmp(argv[i], "-nthreads") == 0 ) nthreads = atoi(argv[++i]);
+     else if ( argv[i][0] != '-' ) infiles[ninfiles++] = argv[i];
+     else {
+       fprintf(stderr, "unknown arg: %s\n", argv[i]);
+       usage();
+     }
+  }
+
+  if ( !outbase ) {
+     usage();
+     fatal("\nERROR: output arg is required");
+  }
+
+  if ( ninfiles == 0 ) {
+     usage();
+     fatal("\nERROR: at least one match file is required");
+  }
+
+  fprintf(stderr, "\nRun Parameters\n--------------\n\
+output = %s, list = %s\n\
+probthr = %f, olapthr = %f, thresh = %d, dedupthr = %f\n\n",
+	  outbase, listfile, probthr, olapthr, thresh, dedupthr);
+}
+
+// Returns arr (n elements used) copied into a new array of cap elements
+void *grow_array( void *arr, long n, long cap, size_t sz )
+{
+   void *grown = MALLOC( cap*sz );
+   if ( n > 0 ) memcpy(grown, arr, n*sz);
+   if ( arr ) FREE(arr);
+   return grown;
+}
+
+// File names seen in the match headers, interned to ids
+typedef struct NameTable {
+   char **names;
+   int n, cap;
+   int *slots; // open addressing, -1 = empty
+   int nslots;
+} NameTable;
+
+unsigned long name_hash( const char *s )
+{
+   unsigned long h = 14695981039346656037UL;
+   for ( ; *s; s++ ) h = (h ^ (unsigned char)*s) * 1099511628211UL;
+   return h;
+}
+
+void names_init( NameTable *t )
+{
+   t->n = 0;
+   t->cap = 256;
+   t->names = (char **) MALLOC( t->cap*sizeof(char *) );
+   t->nslots = 1024;
+   t->slots = (int *) MALLOC( t->nslots*sizeof(int) );
+   for ( int s = 0; s < t->nslots; s++ ) t->slots[s] = -1;
+}
+
+void names_free( NameTable *t )
+{
+   for ( int i = 0; i < t->n; i++ ) FREE(t->names[i]);
+   FREE(t->names);
+   FREE(t->slots);
+}
+
+int names_intern( NameTable *t, const char *name )
+{
+   if ( 2*(t->n+1) > t->nslots ) {
+      FREE(t->slots);
+      t->nslots *= 2;
+      t->slots = (int *) MALLOC( t->nslots*sizeof(int) );
+      for ( int s = 0; s < t->nslots; s++ ) t->slots[s] = -1;
+      for ( int i = 0; i < t->n; i++ ) {
+	 int s = name_hash(t->names[i]) & (t->nslots-1);
+	 while ( t->slots[s] >= 0 ) s = (s+1) & (t->nslots-1);
+	 t->slots[s] = i;
+      }
+   }
+
+   int s = name_hash(name) & (t->nslots-1);
+   while ( t->slots[s] >= 0 ) {
+      if ( strcmp(t->names[t->slots[s]], name) == 0 ) return t->slots[s];
+      s = (s+1) & (t->nslots-1);
+   }
+
+   if ( t->n == t->cap ) {
+      t->names = (char **) grow_array(t->names, t->n, 2*t->cap, sizeof(char *));
+      t->cap *= 2;
+   }
+   t->names[t->n] = (char *) MALLOC( strlen(name)+1 );
+   strcpy(t->names[t->n], name);
+   t->slots[s] = t->n;
+   return t->n++;
+}
+
+// A match above probthr; text holds its "prob\trho" columns as read
+typedef struct GraphMatch {
+   int f1, f2;
+   int xA, xB, yA, yB;
+   double prob;
+   long text;
+} GraphMatch;
+
+typedef struct GraphEdge {
+   int a, b, w;
+} GraphEdge;
+
+// A node for the overlap sweep: sorted by file, then start, then id
+typedef struct NodeRef {
+   int fid, start, end, id;
+} NodeRef;
+
+int NodeRef_compare( const void *A, const void *B )
+{
+   const NodeRef *a = (const NodeRef *) A, *b = (const NodeRef *) B;
+   if ( a->fid != b->fid ) return a->fid < b->fid ? -1 : 1;
+   if ( a->start != b->start ) return a->start < b->start ? -1 : 1;
+   return a->id < b->id ? -1 : a->id > b->id;
+}
+
+int string_compare( const void *A, const void *B )
+{
+   return strcmp(*(char * const *)A, *(char * const *)B);
+}
+
+// The matches read so far
+GraphMatch *matches = NULL;
+long nmatches = 0, maxmatches = 0;
+char *pool = NULL;
+long poollen = 0, poolcap = 0;
+
+void add_match( int f1, int f2, char **tok )
+{
+   double prob = atof(tok[4]);
+   if ( prob < probthr ) return;
+
+   if ( nmatches == maxmatches ) {
+      long cap = MAX(1024, 2*maxmatches);
+      matches = (GraphMatch *) grow_array(matches, nmatches, cap, sizeof(GraphMatch));
+      maxmatches = cap;
+   }
+   long len = strlen(tok[4]) + strlen(tok[5]) + 2;
+   if ( poollen + len > poolcap ) {
+      long cap = MAX(65536, 2*(poollen+len));
+      pool = (char *) grow_array(pool, poollen, cap, 1);
+      poolcap = cap;
+   }
+
+   GraphMatch *m = matches + nmatches++;
+   m->f1 = f1;
+   m->f2 = f2;
+   m->xA = atoi(tok[0]);
+   m->xB = atoi(tok[1]);
+   m->yA = atoi(tok[2]);
+   m->yB = atoi(tok[3]);
+   m->prob = prob;
+   m->text = poollen;
+   poollen += sprintf(pool+poollen, "%s\t%s", tok[4], tok[5]) + 1;
+}
+
+// Splits line on whitespace; returns the token count (at most maxtok)
+int split_line( char *line, char **tok, int maxtok )
+{
+   int n = 0;
+   for ( char *t = strtok(line, " \t\r\n"); t && n < maxtok; t = strtok(NULL, " \t\r\n") )
+      tok[n++] = t;
+   return n;
+}
+
+// Reads the header lines and matches of a text or binary match file
+void read_matches( char *fn, NameTable *names )
+{
+   char line[MAXLINE];
+   char *tok[8];
+   int f1 = -1, f2 = -1;
+
+   if ( matchio_is_binary(fn) ) {
+      MatchReader r;
+      MatchBlock blk;
+      matchio_open_read(&r, fn);
+      if ( r.layout != MATCH_LAYOUT_PAIR || r.nflt < 2 )
+	 fatal("ERROR: matchgraph needs plebdisc match files\n");
+      matchio_block_init(&blk);
+      while ( matchio_read_block(&r, &blk) ) {
+	 if ( !blk.cont ) {
+	    f1 = names_intern(names, blk.name1);
+	    f2 = names_intern(names, blk.name2);
+	 }
+	 // Parse the records as printed, so both inputs behave the same
+	 for ( uint32_t i = 0; i < blk.nrec; i++ ) {
+	    matchio_format(line, MAXLINE, r.layout, 2, &blk, blk.recs+i);
+	    split_line(line, tok, 8);
+	    add_match(f1, f2, tok);
+	 }
+      }
+      matchio_block_free(&blk);
+      matchio_close_read(&r);
+      return;
+   }
+
+   assert_file_exist( fn );
+   FILE *fp = fopen(fn, "r");
+   while ( fgets(line, MAXLINE, fp) ) {
+      int ntok = split_line(line, tok, 8);
+      if ( ntok == 0 ) continue;
+      if ( ntok == 2 ) {
+	 f1 = names_intern(names, tok[0]);
+	 f2 = names_intern(names, tok[1]);
+      } else if ( ntok >= 6 && f1 >= 0 ) {
+	 add_match(f1, f2, tok);
+      } else {
+	 fprintf(stderr, "ERROR: bad match line in %s\n", fn);
+	 exit(1);
+      }
+   }
+   fclose(fp);
+}
+
+// The file index (1-based position in the sorted file set) of every name
+int *file_indices( NameTable *names )
+{
+   int *fid = (int *) MALLOC( MAX(names->n,1)*sizeof(int) );
+
+   if ( !listfile ) {
+      char **sorted = (char **) MALLOC( MAX(names->n,1)*sizeof(char *) );
+      memcpy(sorted, names->names, names->n*sizeof(char *));
+      qsort(sorted, names->n, sizeof(char *), string_compare);
+      for ( int i = 0; i < names->n; i++ ) {
+	 int lo = 0, hi = names->n;
+	 while ( lo < hi ) {
+	    int mid = (lo+hi)/2;
+	    if ( strcmp(sorted[mid], names->names[i]) < 0 ) lo = mid+1;
+	    else hi = mid;
+	 }
+	 fid[i] = lo+1;
+      }
+      FREE(sorted);
+      return fid;
+   }
+
+   // The first column of the list, sorted; a name maps to its first entry
+   int nlist = 0, cap = 1024;
+   char **list = (char **) MALLOC( cap*sizeof(char *) );
+   char line[MAXLINE];
+   char *tok[1];
+   assert_file_exist( listfile );
+   FILE *fp = fopen(listfile, "r");
+   while ( fgets(line, MAXLINE, fp) ) {
+      if ( split_line(line, tok, 1) == 0 ) continue;
+      if ( nlist == cap ) {
+	 list = (char **) grow_array(list, nlist, 2*cap, sizeof(char *));
+	 cap *= 2;
+      }
+      list[nlist] = (char *) MALLOC( strlen(tok[0])+1 );
+      strcpy(list[nlist++], tok[0]);
+   }
+   fclose(fp);
+   qsort(list, nlist, sizeof(char *), string_compare);
+
+   for ( int i = 0; i < names->n; i++ ) {
+      int lo = 0, hi = nlist;
+      while ( lo < hi ) {
+	 int mid = (lo+hi)/2;
+	 if ( strcmp(list[mid], names->names[i]) < 0 ) lo = mid+1;
+	 else hi = mid;
+      }
+      if ( lo == nlist || strcmp(list[lo], names->names[i]) != 0 ) {
+	 fprintf(stderr, "ERROR: %s is not in %s\n", names->names[i], listfile);
+	 exit(1);
+      }
+      fid[i] = lo+1;
+   }
+
+   for ( int i = 0; i < nlist; i++ ) FREE(list[i]);
+   FREE(list);
+   return fid;
+}
+
+// Lock-free union-find: the larger root is linked under the smaller, so
+// every root is the smallest node of its component
+int uf_find( int *parent, int x )
+{
+   int p;
+   while ( (p = __atomic_load_n(&parent[x], __ATOMIC_RELAXED)) != x ) x = p;
+   return x;
+}
+
+void uf_union( int *parent, int a, int b )
+{
+   for ( ;; ) {
+      a = uf_find(parent, a);
+      b = uf_find(parent, b);
+      if ( a == b ) return;
+      if ( a < b ) { int t = a; a = b; b = t; }
+      if ( __sync_bool_compare_and_swap(&parent[a], a, b) ) return;
+   }
+}
+
+// Drops the later members of a cluster that overlap an earlier member of
+// the same file by at least dedupthr; returns the new member count
+int dedup_cluster( int *members, int n, NodeRef *nodes )
+{
+   for ( int i = 0; i < n; i++ ) {
+      NodeRef *a = nodes + members[i]-1;
+      int k = i+1;
+      for ( int j = i+1; j < n; j++ ) {
+	 NodeRef *b = nodes + members[j]-1;
+	 if ( a->fid == b->fid ) {
+	    int num = b->end-b->start + a->end-a->start;
+	    int den = MAX(a->end,b->end) - MIN(a->start,b->start);
+	    double folap = MAX(0, ((double) num)/den-1);
+	    if ( folap >= dedupthr ) continue;
+	 }
+	 members[k++] = members[j];
+      }
+      n = k;
+   }
+   return n;
+}
+
+FILE *open_output( char *suffix )
+{
+   char fn[MAXLINE];
+   snprintf(fn, MAXLINE, "%s%s", outbase, suffix);
+   FILE *fp = fopen(fn, "w");
+   if ( !fp ) {
+      fprintf(stderr, "ERROR: cannot write %s\n", fn);
+      exit(1);
+   }
+   return fp;
+}
+
+int main(int argc, char **argv)
+{
+   parse_args(argc, argv);
+
+#ifdef _OPENMP
+   if ( nthreads > 0 ) omp_set_num_threads(nthreads);
+#endif
+
+   fprintf(stderr, "Reading matches: "); tic();
+   NameTable names;
+   names_init(&names);
+   for ( int f = 0; f < ninfiles; f++ )
+      read_matches(infiles[f], &names);
+   int *fid = file_indices(&names);
+   fprintf(stderr, "%f s\n",toc());
+   fprintf(stderr, "    %ld matches above probthr, %d files\n", nmatches, names.n);
+
+   // Nodes and type 1 (match) edges. As in build_graph.py a match edge
+   // joins the last two node ids even when a side was too short to
+   // become a node.
+   fprintf(stderr, "Generating nodes and match edges: "); tic();
+   FILE *vout = open_output(".nodes");
+   NodeRef *nodes = (NodeRef *) MALLOC( (2*nmatches+1)*sizeof(NodeRef) );
+   long nedges = 0, maxedges = nmatches+1024;
+   GraphEdge *edges = (GraphEdge *) MALLOC( maxedges*sizeof(GraphEdge) );
+   int vcount = 0;
+   for ( long i = 0; i < nmatches; i++ ) {
+      GraphMatch *m = matches + i;
+      if ( m->xB > m->xA ) {
+	 NodeRef v = { fid[m->f1], m->xA, m->xB, ++vcount };
+	 nodes[vcount-1] = v;
+	 fprintf(vout, "%s\t%d\t%d\t%s\t%d\n", names.names[m->f1], m->xA, m->xB, pool+m->text, v.fid);
+      }
+      if ( m->yB > m->yA ) {
+	 NodeRef v = { fid[m->f2], m->yA, m->yB, ++vcount };
+	 nodes[vcount-1] = v;
+	 fprintf(vout, "%s\t%d\t%d\t%s\t%d\n", names.names[m->f2], m->yA, m->yB, pool+m->text, v.fid);
+      }
+      GraphEdge e = { vcount-1, vcount, (int) (m->prob*1000) };
+      edges[nedges++] = e;
+   }
+   fclose(vout);
+   fprintf(stderr, "%f s\n",toc());
+   fprintf(stderr, "    Original nodes: %d, original edges: %ld\n", vcount, nedges);
+
+   // Overlap edges: sweep each file's nodes by start frame. Like
+   // build_graph.py, the sweep starts at the second node overall and
+   // leaves out the last node of every file.
+   fprintf(stderr, "Adding overlap edges: "); tic();
+   NodeRef *sorted = (NodeRef *) MALLOC( (vcount+1)*sizeof(NodeRef) );
+   memcpy(sorted, nodes, vcount*sizeof(NodeRef));
+   qsort(sorted, vcount, sizeof(NodeRef), NodeRef_compare);
+
+   int ngroups = 0;
+   int *groups = (int *) MALLOC( (vcount+2)*sizeof(int) );
+   for ( int pos = 1; pos < vcount; ) {
+      groups[ngroups++] = pos;
+      while ( pos < vcount && sorted[pos].fid == sorted[groups[ngroups-1]].fid ) pos++;
+   }
+   groups[ngroups] = vcount;
+
+   GraphEdge **gedges = (GraphEdge **) CALLOC( ngroups+1, sizeof(GraphEdge *) );
+   int *gcnt = (int *) CALLOC( ngroups+1, sizeof(int) );
+
+#pragma omp parallel for schedule(dynamic,1)
+   for ( int g = 0; g < ngroups; g++ ) {
+      int last = groups[g+1]-1;
+      int cnt = 0, cap = 0;
+      GraphEdge *ge = NULL;
+      for ( int n = groups[g]; n < last; n++ ) {
+	 NodeRef *a = sorted + n;
+	 for ( int m = n+1; m < last; m++ ) {
+	    NodeRef *b = sorted + m;
+	    if ( b->start > a->end ) break;
+	    int num = a->end-a->start + b->end-b->start;
+	    int den = MAX(a->end,b->end) - MIN(a->start,b->start);
+	    double olap = MAX(0, ((double) num)/den-1);
+	    if ( olap >= olapthr ) {
+	       if ( cnt == cap ) {
+#pragma omp critical (alloc)
+		  ge = (GraphEdge *) grow_array(ge, cnt, MAX(64, 2*cap), sizeof(GraphEdge));
+		  cap = MAX(64, 2*cap);
+	       }
+	       GraphEdge e = { a->id, b->id, (int) (olap*1000) };
+	       ge[cnt++] = e;
+	    }
+	 }
+      }
+      gedges[g] = ge;
+      gcnt[g] = cnt;
+   }
+
+   for ( int g = 0; g < ngroups; g++ ) {
+      if ( nedges + gcnt[g] > maxedges ) {
+	 long cap = MAX(2*maxedges, nedges + gcnt[g]);
+	 edges = (GraphEdge *) grow_array(edges, nedges, cap, sizeof(GraphEdge));
+	 maxedges = cap;
+      }
+      memcpy(edges+nedges, gedges[g], gcnt[g]*sizeof(GraphEdge));
+      nedges += gcnt[g];
+      if ( gedges[g] ) FREE(gedges[g]);
+   }
+   FREE(gedges);
+   FREE(gcnt);
+   FREE(groups);
+   FREE(sorted);
+
+   FILE *eout = open_output(".edges");
+   for ( long e = 0; e < nedges; e++ )
+      fprintf(eout, "%d\t%d\t%d\n", edges[e].a, edges[e].b, edges[e].w);
+   fclose(eout);
+   fprintf(stderr, "%f s\n",toc());
+   fprintf(stderr, "    Total edges: %ld\n", nedges);
+
+   // Connected components over the edges of weight >= thresh. The node
+   // count is the largest id on such an edge (ids below 1 wrap around
+   // from the end, as Python list indexing does in conncomp_dfs.py).
+   fprintf(stderr, "Clustering: "); tic();
+   int numnodes = 0;
+   for ( long e = 0; e < nedges; e++ )
+      if ( edges[e].w >= thresh )
+	 numnodes = MAX(numnodes, MAX(edges[e].a, edges[e].b));
+
+   int *parent = (int *) MALLOC( (numnodes+1)*sizeof(int) );
+   for ( int v = 0; v < numnodes; v++ ) parent[v] = v;
+
+#pragma omp parallel for schedule(static)
+   for ( long e = 0; e < nedges; e++ ) {
+      if ( edges[e].w < thresh ) continue;
+      int a = edges[e].a-1, b = edges[e].b-1;
+      if ( a < 0 ) a += numnodes;
+      if ( b < 0 ) b += numnodes;
+      uf_union(parent, a, b);
+   }
+   FREE(edges);
+
+   // Clusters in order of their smallest node, members ascending. A
+   // parent is always smaller than its child, so one step per node in
+   // ascending order compresses every path.
+   int *cstart = (int *) CALLOC( numnodes+1, sizeof(int) );
+   for ( int v = 0; v < numnodes; v++ ) {
+      parent[v] = parent[parent[v]];
+      cstart[parent[v]]++;
+   }
+   int nclusters = 0;
+   for ( int v = 0, sum = 0; v < numnodes; v++ ) {
+      int cnt = cstart[v];
+      if ( cnt > 0 ) nclusters++;
+      cstart[v] = sum;
+      sum += cnt;
+   }
+   cstart[numnodes] = numnodes;
+   int *members = (int *) MALLOC( (numnodes+1)*sizeof(int) );
+   int *fill = (int *) MALLOC( (numnodes+1)*sizeof(int) );
+   memcpy(fill, cstart, numnodes*sizeof(int));
+   for ( int v = 0; v < numnodes; v++ )
+      members[fill[parent[v]]++] = v+1;
+   FREE(fill);
+
+   // Compact to the nonempty clusters
+   int *clusters = (int *) MALLOC( (nclusters+1)*sizeof(int) );
+   int *clen = (int *) MALLOC( (nclusters+1)*sizeof(int) );
+   for ( int v = 0, k = 0; v < numnodes; v++ ) {
+      if ( parent[v] != v ) continue;
+      clusters[k] = cstart[v];
+      clen[k++] = cstart[v+1] - cstart[v];
+   }
+   FREE(cstart);
+   FREE(parent);
+
+   FILE *cout = open_output(".clusters");
+   for ( int k = 0; k < nclusters; k++ ) {
+      if ( k > 0 ) fprintf(cout, "\n");
+      for ( int i = 0; i < clen[k]; i++ )
+	 fprintf(cout, "%d ", members[clusters[k]+i]);
+   }
+   fprintf(cout, "\n");
+   fclose(cout);
+   fprintf(stderr, "%f s\n",toc());
+   fprintf(stderr, "    %d nodes in %d clusters\n", numnodes, nclusters);
+
+   // Dedup every cluster below MAXDEDUP members
+   fprintf(stderr, "Dedup clusters: "); tic();
+#pragma omp parallel for schedule(dynamic,16)
+   for ( int k = 0; k < nclusters; k++ )
+      if ( clen[k] < MAXDEDUP )
+	 clen[k] = dedup_cluster(members+clusters[k], clen[k], nodes);
+
+   FILE *dout = open_output(".dedups");
+   for ( int k = 0; k < nclusters; k++ ) {
+      fprintf(dout, "%d", members[clusters[k]]);
+      for ( int i = 1; i < clen[k]; i++ )
+	 fprintf(dout, " %d", members[clusters[k]+i]);
+      fprintf(dout, "\n");
+   }
+   fclose(dout);
+   fprintf(stderr, "%f s\n",toc());
+
+   FREE(members);
+   FREE(clusters);
+   FREE(clen);
+   FREE(nodes);
+   FREE(fid);
+   if ( matches ) FREE(matches);
+   if ( pool ) FREE(pool);
+   names_free(&names);
+   FREE(infiles);
+
+   int mc = get_malloc_count();
+   if(mc != 0) fprintf(stderr,"WARNING: %d malloc'd items not free'd\n", mc);
+
+   return 0;
+}
@@ -0,0 +1,469 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "matchio.h"
+
+#define MATCHIO_MAXHEADER (24+3*MATCHIO_MAXNAME)
+
+static void put_u16(unsigned char *p, uint32_t v)
+{
+   p[0] = v & 0xff;
+   p[1] = (v >> 8) & 0xff;
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+   for ( int i = 0; i < 4; i++ ) p[i] = (v >> (8*i)) & 0xff;
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+   for ( int i = 0; i < 8; i++ ) p[i] = (v >> (8*i)) & 0xff;
+}
+
+static uint32_t get_u16(const unsigned char *p)
+{
+   return p[0] | ((uint32_t)p[1] << 8);
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+   uint32_t v = 0;
+   for ( int i = 0; i < 4; i++ ) v |= (uint32_t)p[i] << (8*i);
+   return v;
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+   uint64_t v = 0;
+   for ( int i = 0; i < 8; i++ ) v |= (uint64_t)p[i] << (8*i);
+   return v;
+}
+
+static uint32_t float_bits(float f)
+{
+   uint32_t v;
+   memcpy(&v, &f, sizeof(v));
+   return v;
+}
+
+static float bits_float(uint32_t v)
+{
+   float f;
+   memcpy(&f, &v, sizeof(f));
+   return f;
+}
+
+static void read_exact(FILE *fp, void *buf, size_t n)
+{
+   if ( fread(buf, 1, n, fp) != n )
+      fatal("ERROR: truncated match file\n");
+}
+
+static void write_exact(FILE *fp, const void *buf, size_t n)
+{
+   if ( fwrite(buf, 1, n, fp) != n )
+      fatal("ERROR: failed writing match file\n");
+}
+
+// Copies a name, which must fit in MATCHIO_MAXNAME with its terminator
+static void set_name(char *dst, const char *src)
+{
+   if ( !src ) src = "";
+   if ( strlen(src) >= MATCHIO_MAXNAME )
+      fatal("ERROR: match file name field too long\n");
+   strcpy(dst, src);
+}
+
+// Writes the three names as u16 lengths followed by the bytes; returns
+// the bytes used
+static int put_names(unsigned char *p, const char *name1, const char *name2, const char *tag)
+{
+   int l1 = strlen(name1), l2 = strlen(name2), l3 = strlen(tag);
+   put_u16(p, l1);
+   put_u16(p+2, l2);
+   put_u16(p+4, l3);
+   memcpy(p+6, name1, l1);
+   memcpy(p+6+l1, name2, l2);
+   memcpy(p+6+l1+l2, tag, l3);
+   return 6+l1+l2+l3;
+}
+
+static void get_names(FILE *fp, char *name1, char *name2, char *tag)
+{
+   unsigned char lens[6];
+   read_exact(fp, lens, 6);
+   char *dst[3] = { name1, name2, tag };
+   for ( int i = 0; i < 3; i++ ) {
+      uint32_t len = get_u16(lens+2*i);
+      if ( len >= MATCHIO_MAXNAME )
+	 fatal("ERROR: corrupt match file name field\n");
+      read_exact(fp, dst[i], len);
+      dst[i][len] = '\0';
+   }
+}
+
+// Reference value each integer column is coded against
+static inline int64_t column_ref(int c, const int32_t *rec, const int32_t *prev)
+{
+   if ( c == 1 ) return rec[0];
+   if ( c == 3 ) return rec[2];
+   return prev[c];
+}
+
+void matchio_open_write(MatchWriter *w, char *fn, int layout, int nint, int nflt)
+{
+   if ( nint < 4 || nint > MATCHIO_MAXINTS || nflt < 0 || nflt > MATCHIO_MAXFLTS )
+      fatal("ERROR: unsupported match record size\n");
+
+   w->fp = fopen(fn, "wb");
+   if ( !w->fp ) {
+      fprintf(stderr, "ERROR: cannot write %s\n", fn);
+      exit(1);
+   }
+   w->fn = (char *) MALLOC( strlen(fn)+1 );
+   strcpy(w->fn, fn);
+   w->layout = layout;
+   w->nint = nint;
+   w->nflt = nflt;
+   w->name1[0] = w->name2[0] = w->tag[0] = '\0';
+   w->open = 0;
+   w->cont = 0;
+   memset(w->prev, 0, sizeof(w->prev));
+   w->bufcap = 65536;
+   w->buf = (unsigned char *) MALLOC( w->bufcap );
+   w->buflen = 0;
+   w->nrec = 0;
+   w->maxscore = 0;
+   w->nblocks = 0;
+   w->maxblocks = 256;
+   w->index = (MatchIndexEntry *) MALLOC( w->maxblocks*sizeof(MatchIndexEntry) );
+
+   unsigned char hdr[12];
+   memcpy(hdr, "ZRMF", 4);
+   put_u16(hdr+4, MATCHIO_VERSION);
+   put_u16(hdr+6, layout);
+   put_u16(hdr+8, nint);
+   put_u16(hdr+10, nflt);
+   write_exact(w->fp, hdr, 12);
+   w->offset = 12;
+}
+
+// Writes the buffered block of the open group and records it in the index
+static void flush_block(MatchWriter *w)
+{
+   if ( !w->open ) return;
+
+   unsigned char hdr[MATCHIO_MAXHEADER];
+   memcpy(hdr, "ZRMB", 4);
+   put_u32(hdr+4, w->nrec);
+   put_u32(hdr+8, w->buflen);
+   hdr[12] = w->cont;
+   hdr[13] = 0;
+   int hlen = 14 + put_names(hdr+14, w->name1, w->name2, w->tag);
+   write_exact(w->fp, hdr, hlen);
+   write_exact(w->fp, w->buf, w->buflen);
+
+   if ( w->nblocks == w->maxblocks ) {
+      MatchIndexEntry *index = (MatchIndexEntry *) MALLOC( 2*w->maxblocks*sizeof(MatchIndexEntry) );
+      memcpy(index, w->index, w->nblocks*sizeof(MatchIndexEntry));
+      FREE(w->index);
+      w->index = index;
+      w->maxblocks *= 2;
+   }
+   MatchIndexEntry *e = w->index + w->nblocks++;
+   e->offset = w->offset;
+   e->nrec = w->nrec;
+   e->maxscore = w->maxscore;
+   e->cont = w->cont;
+   int l1 = strlen(w->name1), l2 = strlen(w->name2);
+   e->name1 = (char *) MALLOC( l1+l2+strlen(w->tag)+3 );
+   e->name2 = e->name1 + l1 + 1;
+   e->tag = e->name2 + l2 + 1;
+   strcpy(e->name1, w->name1);
+   strcpy(e->name2, w->name2);
+   strcpy(e->tag, w->tag);
+
+   w->offset += hlen + w->buflen;
+   w->buflen = 0;
+   w->nrec = 0;
+   w->maxscore = 0;
+   memset(w->prev, 0, sizeof(w->prev));
+}
+
+void matchio_set_names(MatchWriter *w, char *name1, char *name2, char *tag)
+{
+   flush_block(w);
+   set_name(w->name1, name1);
+   set_name(w->name2, name2);
+   set_name(w->tag, tag);
+   w->open = 1;
+   w->cont = 0;
+}
+
+void matchio_write(MatchWriter *w, MatchRecord *rec)
+{
+   if ( !w->open ) matchio_set_names(w, NULL, NULL, NULL);
+   if ( w->nrec == MATCHIO_BLOCKRECS ) {
+      flush_block(w);
+      w->cont = 1;
+   }
+
+   // Room for the varints (at most 10 bytes each) and the floats
+   long need = w->buflen + 10*w->nint + 4*w->nflt;
+   if ( need > w->bufcap ) {
+      long cap = 2*need;
+      unsigned char *buf = (unsigned char *) MALLOC( cap );
+      memcpy(buf, w->buf, w->buflen);
+      FREE(w->buf);
+      w->buf = buf;
+      w->bufcap = cap;
+   }
+
+   unsigned char *p = w->buf + w->buflen;
+   for ( int c = 0; c < w->nint; c++ ) {
+      int64_t diff = (int64_t)rec->ival[c] - column_ref(c, rec->ival, w->prev);
+      uint64_t zz = ((uint64_t)diff << 1) ^ (uint64_t)(diff >> 63);
+      while ( zz >= 0x80 ) {
+	 *p++ = (zz & 0x7f) | 0x80;
+	 zz >>= 7;
+      }
+      *p++ = zz;
+   }
+   for ( int c = 0; c < w->nflt; c++ ) {
+      put_u32(p, float_bits(rec->fval[c]));
+      p += 4;
+   }
+   w->buflen = p - w->buf;
+
+   if ( w->nflt > 0 && (w->nrec == 0 || rec->fval[0] > w->maxscore) )
+      w->maxscore = rec->fval[0];
+   memcpy(w->prev, rec->ival, w->nint*sizeof(int32_t));
+   w->nrec++;
+}
+
+void matchio_close_write(MatchWriter *w)
+{
+   flush_block(w);
+   fclose(w->fp);
+
+   // The sidecar index
+   char *idxfn = (char *) MALLOC( strlen(w->fn)+5 );
+   sprintf(idxfn, "%s.idx", w->fn);
+   FILE *fp = fopen(idxfn, "wb");
+   if ( !fp ) {
+      fprintf(stderr, "ERROR: cannot write %s\n", idxfn);
+      exit(1);
+   }
+   unsigned char hdr[MATCHIO_MAXHEADER];
+   memcpy(hdr, "ZRMI", 4);
+   put_u16(hdr+4, MATCHIO_VERSION);
+   put_u16(hdr+6, 0);
+   put_u32(hdr+8, w->nblocks);
+   write_exact(fp, hdr, 12);
+   for ( int b = 0; b < w->nblocks; b++ ) {
+      MatchIndexEntry *e = w->index + b;
+      put_u64(hdr, e->offset);
+      put_u32(hdr+8, e->nrec);
+      put_u32(hdr+12, float_bits(e->maxscore));
+      hdr[16] = e->cont;
+      hdr[17] = 0;
+      int hlen = 18 + put_names(hdr+18, e->name1, e->name2, e->tag);
+      write_exact(fp, hdr, hlen);
+      FREE(e->name1);
+   }
+   fclose(fp);
+
+   FREE(idxfn);
+   FREE(w->index);
+   FREE(w->buf);
+   FREE(w->fn);
+}
+
+int matchio_is_binary(char *fn)
+{
+   char magic[4];
+   FILE *fp = fopen(fn, "rb");
+   if ( !fp ) return 0;
+   int ok = fread(magic, 1, 4, fp) == 4 && memcmp(magic, "ZRMF", 4) == 0;
+   fclose(fp);
+   return ok;
+}
+
+void matchio_open_read(MatchReader *r, char *fn)
+{
+   assert_file_exist( fn );
+   r->fp = fopen(fn, "rb");
+   unsigned char hdr[12];
+   read_exact(r->fp, hdr, 12);
+   if ( memcmp(hdr, "ZRMF", 4) != 0 ) {
+      fprintf(stderr, "ERROR: %s is not a match file\n", fn);
+      exit(1);
+   }
+   if ( get_u16(hdr+4) != MATCHIO_VERSION ) {
+      fprintf(stderr, "ERROR: %s has unsupported match file version %d\n", fn, get_u16(hdr+4));
+      exit(1);
+   }
+   r->layout = get_u16(hdr+6);
+   r->nint = get_u16(hdr+8);
+   r->nflt = get_u16(hdr+10);
+   if ( r->nint < 4 || r->nint > MATCHIO_MAXINTS || r->nflt > MATCHIO_MAXFLTS )
+      fatal("ERROR: corrupt match file header\n");
+   r->bufcap = 65536;
+   r->buf = (unsigned char *) MALLOC( r->bufcap );
+}
+
+void matchio_block_init(MatchBlock *blk)
+{
+   blk->nrec = 0;
+   blk->reccap = 0;
+   blk->recs = NULL;
+}
+
+void matchio_block_free(MatchBlock *blk)
+{
+   if ( blk->recs ) FREE(blk->recs);
+   matchio_block_init(blk);
+}
+
+int matchio_read_block(MatchReader *r, MatchBlock *blk)
+{
+   unsigned char hdr[14];
+   size_t n = fread(hdr, 1, 14, r->fp);
+   if ( n == 0 ) return 0;
+   if ( n != 14 || memcmp(hdr, "ZRMB", 4) != 0 )
+      fatal("ERROR: corrupt match file block\n");
+
+   blk->nrec = get_u32(hdr+4);
+   long paylen = get_u32(hdr+8);
+   blk->cont = hdr[12];
+   get_names(r->fp, blk->name1, blk->name2, blk->tag);
+
+   if ( paylen > r->bufcap ) {
+      FREE(r->buf);
+      r->bufcap = 2*paylen;
+      r->buf = (unsigned char *) MALLOC( r->bufcap );
+   }
+   read_exact(r->fp, r->buf, paylen);
+
+   if ( blk->nrec > blk->reccap ) {
+      if ( blk->recs ) FREE(blk->recs);
+      blk->reccap = MAX(blk->nrec, 2*blk->reccap);
+      blk->recs = (MatchRecord *) MALLOC( blk->reccap*sizeof(MatchRecord) );
+   }
+
+   int32_t prev[MATCHIO_MAXINTS] = {0};
+   const unsigned char *p = r->buf, *end = r->buf + paylen;
+   for ( uint32_t i = 0; i < blk->nrec; i++ ) {
+      MatchRecord *rec = blk->recs + i;
+      for ( int c = 0; c < r->nint; c++ ) {
+	 uint64_t zz = 0;
+	 int shift = 0;
+	 do {
+	    if ( p == end || shift > 63 ) fatal("ERROR: corrupt match file payload\n");
+	    zz |= (uint64_t)(*p & 0x7f) << shift;
+	    shift += 7;
+	 } while ( *p++ & 0x80 );
+	 int64_t diff = (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+	 rec->ival[c] = column_ref(c, rec->ival, prev) + diff;
+      }
+      if ( end - p < 4*r->nflt ) fatal("ERROR: corrupt match file payload\n");
+      for ( int c = 0; c < r->nflt; c++ ) {
+	 rec->fval[c] = bits_float(get_u32(p));
+	 p += 4;
+      }
+      memcpy(prev, rec->ival, r->nint*sizeof(int32_t));
+   }
+   if ( p != end ) fatal("ERROR: corrupt match file payload\n");
+
+   return 1;
+}
+
+void matchio_seek(MatchReader *r, uint64_t offset)
+{
+   if ( fseek(r->fp, (long)offset, SEEK_SET) != 0 )
+      fatal("ERROR: seek failed in match file\n");
+}
+
+void matchio_close_read(MatchReader *r)
+{
+   fclose(r->fp);
+   FREE(r->buf);
+}
+
+int matchio_read_index(char *fn, MatchIndexEntry **entries)
+{
+   char *idxfn = (char *) MALLOC( strlen(fn)+5 );
+   sprintf(idxfn, "%s.idx", fn);
+   assert_file_exist( idxfn );
+   FILE *fp = fopen(idxfn, "rb");
+   FREE(idxfn);
+
+   unsigned char hdr[18];
+   read_exact(fp, hdr, 12);
+   if ( memcmp(hdr, "ZRMI", 4) != 0 || get_u16(hdr+4) != MATCHIO_VERSION )
+      fatal("ERROR: unsupported match index file\n");
+   int n = get_u32(hdr+8);
+
+   *entries = (MatchIndexEntry *) MALLOC( MAX(n,1)*sizeof(MatchIndexEntry) );
+   char name1[MATCHIO_MAXNAME], name2[MATCHIO_MAXNAME], tag[MATCHIO_MAXNAME];
+   for ( int b = 0; b < n; b++ ) {
+      MatchIndexEntry *e = *entries + b;
+      read_exact(fp, hdr, 18);
+      e->offset = get_u64(hdr);
+      e->nrec = get_u32(hdr+8);
+      e->maxscore = bits_float(get_u32(hdr+12));
+      e->cont = hdr[16];
+      get_names(fp, name1, name2, tag);
+      int l1 = strlen(name1), l2 = strlen(name2);
+      e->name1 = (char *) MALLOC( l1+l2+strlen(tag)+3 );
+      e->name2 = e->name1 + l1 + 1;
+      e->tag = e->name2 + l2 + 1;
+      strcpy(e->name1, name1);
+      strcpy(e->name2, name2);
+      strcpy(e->tag, tag);
+   }
+   fclose(fp);
+
+   return n;
+}
+
+void matchio_free_index(MatchIndexEntry *entries, int n)
+{
+   for ( int b = 0; b < n; b++ )
+      FREE(entries[b].name1);
+   FREE(entries);
+}
+
+int matchio_format(char *buf, int len, int layout, int nflt, MatchBlock *blk, MatchRecord *rec)
+{
+   int32_t *iv = rec->ival;
+   int n;
+   switch ( layout ) {
+   case MATCH_LAYOUT_KWS:
+      n = snprintf(buf, len, "%s %s %s %d %d %d %d", blk->tag, blk->name1, blk->name2, 
+		   iv[0], iv[1], iv[2], iv[3]);
+      break;
+   case MATCH_LAYOUT_SRAILS:
+      n = snprintf(buf, len, "%d %d %d %d %d %d", iv[4], iv[5], iv[0], iv[1], iv[2], iv[3]);
+      break;
+   default:
+      n = snprintf(buf, len, "%d %d %d %d", iv[0], iv[1], iv[2], iv[3]);
+      break;
+   }
+   for ( int c = 0; c < nflt && n < len; c++ )
+      n += snprintf(buf+n, len-n, " %f", rec->fval[c]);
+   return n;
+}
+
+void matchio_print(FILE *fp, int layout, int nflt, MatchBlock *blk, MatchRecord *rec)
+{
+   char line[3*MATCHIO_MAXNAME+512];
+   matchio_format(line, sizeof(line), layout, nflt, blk, rec);
+   fprintf(fp, "%s\n", line);
+}
@@ -0,0 +1,128 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#ifndef MATCHIO_H
+#define MATCHIO_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Binary match files
+//
+// A match file is a header followed by blocks. The header holds the magic
+// "ZRMF", the format version, the record layout and the number of integer
+// and float columns per record. Each block holds the records of one
+// (name1, name2, tag) group: the block header carries the magic "ZRMB",
+// the record count, the payload size, a continuation flag (the previous
+// block was cut at MATCHIO_BLOCKRECS records of the same group) and the
+// three names. The payload packs each integer column as a zigzag varint
+// of its difference from a reference (column 1 from column 0 and column
+// 3 from column 2 of the same record, every other column from the same
+// column of the previous record), followed by the raw float columns.
+//
+// Alongside <file> the writer leaves <file>.idx ("ZRMI"), listing the
+// offset, record count, best first float column, continuation flag and
+// names of every block, so readers can select blocks without decoding
+// the payloads.
+//
+// All integers are little endian.
+
+#define MATCHIO_VERSION 1
+#define MATCHIO_MAXINTS 8
+#define MATCHIO_MAXFLTS 4
+#define MATCHIO_BLOCKRECS 4096 // Most records per block
+#define MATCHIO_MAXNAME 1024
+
+// Record layouts; the layout decides how the records print as text
+enum {
+   MATCH_LAYOUT_PAIR = 1, // plebdisc: xA xB yA yB | score rho [firstpass score]
+   MATCH_LAYOUT_KWS = 2, // plebkws: xA xB yA yB | score rho (name1 = file, name2 = query, tag = type)
+   MATCH_LAYOUT_SRAILS = 3 // srails_disc: xA xB yA yB seg1 seg2 | score
+};
+
+typedef struct MatchRecord {
+   int32_t ival[MATCHIO_MAXINTS]; // xA, xB, yA, yB, then layout specific
+   float fval[MATCHIO_MAXFLTS];
+} MatchRecord;
+
+typedef struct MatchIndexEntry {
+   uint64_t offset; // file offset of the block header
+   uint32_t nrec;
+   float maxscore; // largest fval[0] in the block
+   int cont; // the block continues the previous one
+   char *name1, *name2, *tag;
+} MatchIndexEntry;
+
+typedef struct MatchWriter {
+   FILE *fp;
+   char *fn;
+   int layout, nint, nflt;
+   char name1[MATCHIO_MAXNAME], name2[MATCHIO_MAXNAME], tag[MATCHIO_MAXNAME];
+   int open; // a group has been started (its block may hold no records)
+   int cont; // the buffered block continues the previous one
+   unsigned char *buf; // encoded payload of the buffered block
+   long buflen, bufcap;
+   uint32_t nrec;
+   float maxscore;
+   int32_t prev[MATCHIO_MAXINTS];
+   uint64_t offset; // bytes written so far
+   MatchIndexEntry *index;
+   int nblocks, maxblocks;
+} MatchWriter;
+
+typedef struct MatchReader {
+   FILE *fp;
+   int layout, nint, nflt;
+   unsigned char *buf;
+   long bufcap;
+} MatchReader;
+
+// One decoded block
+typedef struct MatchBlock {
+   char name1[MATCHIO_MAXNAME], name2[MATCHIO_MAXNAME], tag[MATCHIO_MAXNAME];
+   int cont;
+   uint32_t nrec;
+   MatchRecord *recs;
+   long reccap;
+} MatchBlock;
+
+// Creates fn (and fn.idx at close) for records of nint integer and nflt
+// float columns
+void matchio_open_write(MatchWriter *w, char *fn, int layout, int nint, int nflt);
+
+// Starts a new group of records; a NULL name or tag is stored as ""
+void matchio_set_names(MatchWriter *w, char *name1, char *name2, char *tag);
+
+void matchio_write(MatchWriter *w, MatchRecord *rec);
+
+// Flushes the last block and writes the sidecar index
+void matchio_close_write(MatchWriter *w);
+
+// Returns 1 if fn starts with the match file magic
+int matchio_is_binary(char *fn);
+
+void matchio_open_read(MatchReader *r, char *fn);
+
+// Decodes the next block into blk; returns 0 at the end of the file
+int matchio_read_block(MatchReader *r, MatchBlock *blk);
+
+// Positions the reader at a block offset taken from the index
+void matchio_seek(MatchReader *r, uint64_t offset);
+
+void matchio_close_read(MatchReader *r);
+
+void matchio_block_init(MatchBlock *blk);
+void matchio_block_free(MatchBlock *blk);
+
+// Reads fn.idx; returns the number of entries (free with matchio_free_index)
+int matchio_read_index(char *fn, MatchIndexEntry **entries);
+void matchio_free_index(MatchIndexEntry *entries, int n);
+
+// Formats a record (without the newline) the way the tool of the layout
+// prints it as text, with at most nflt float columns; returns the length
+int matchio_format(char *buf, int len, int layout, int nflt, MatchBlock *blk, MatchRecord *rec);
+
+void matchio_print(FILE *fp, int layout, int nflt, MatchBlock *blk, MatchRecord *rec);
+
+#endif
@@ -0,0 +1,271 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "dotkws.h"
+#include "signature.h"
+#include "index.h"
+
+// Merges the segments of an index manifest into one segment. Each
+// permutation's sorted order is a k-way merge of the segments' sorted
+// runs, so the result is identical to running build_index over all of the
+// segments' files at once. The manifest is then rewritten to list only the
+// merged segment; the old segment files are left for the caller to remove.
+// Segments that build_index -manifest appends while the merge runs are kept
+// after the merged one: the manifest lock serializes the appends with the
+// rewrite, which re-reads the manifest first.
+
+#define MERGE_CHUNK 65536 // Signatures staged per write
+
+// PLEB parameters
+int P = 0; // 0 = every permutation of the segments
+int S = 32;
+
+// Everything else
+char *manifest = NULL;
+char *indexfile = NULL;
+
+void usage()
+{
+  fatal("usage: merge_index [-manifest <str> (REQUIRED)]\
+\n\t[-indexfile <str> (REQUIRED)]\
+\n\t[-P <n> (defaults to all in the segments)]\
+\n\t[-S <n> (defaults to 32)]\n");
+}
+
+void parse_args(int argc, char **argv)
+{
+  int i;
+  for( i = 1; i < argc; i++ ) 
+  {
+     if( strcmp(argv[i], "-manifest") == 0 ) manifest = argv[++i];
+     else if ( strcmp(argv[i], "-indexfile") == 0 ) indexfile = argv[++i];
+     else if ( strcmp(argv[i], "-P") == 0 ) P = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-S") == 0 ) S = atoi(argv[++i]);
+     else {
+       fprintf(stderr, "unknown arg: %s\n", argv[i]);
+       usage();
+     }
+  }
+
+  if ( !manifest ) {
+     usage();
+     fatal("\nERROR: manifest arg is required");
+  }
+
+  if ( !indexfile ) {
+     usage();
+     fatal("\nERROR: indexfile arg is required");
+  }
+
+  if ( strlen(indexfile) >= MANIFEST_MAXCHAR )
+     fatal("\nERROR: indexfile name is too long");
+
+  fprintf(stderr, "\nRun Parameters\n--------------\n \
+manifest = %s, \n \
+indexfile = %s, \n \
+P = %d, S = %d,\n\n ",
+	  manifest, indexfile, P, S);
+
+  set_signature_bits(S);
+}
+
+// true if the head of segment a sorts after the head of segment b
+static bool head_after (struct signature_index *index, int p, frameind *head, int a, int b) 
+{
+   uint64_t ka = index->keys[p*index->Nsegs+a][head[a]];
+   uint64_t kb = index->keys[p*index->Nsegs+b][head[b]];
+   int diff = ka > kb ? 1 : ( ka < kb ? -1 : 0 );
+   if ( diff == 0 && SIG_NUM_BYTES > 8 ) {
+      struct signature *sa = 
+	 &index->allfeats[index->segstart[a] + index->order[p*index->Nsegs+a][head[a]]];
+      struct signature *sb = 
+	 &index->allfeats[index->segstart[b] + index->order[p*index->Nsegs+b][head[b]]];
+      diff = signature_greater(sa, sb);
+   }
+   return diff > 0 || ( diff == 0 && a > b );
+}
+
+static void sift_down (struct signature_index *index, int p, frameind *head, 
+		       int *heap, int n, int i) 
+{
+   while ( 2*i+1 < n ) {
+      int c = 2*i+1;
+      if ( c+1 < n && head_after(index, p, head, heap[c], heap[c+1]) ) c++;
+      if ( !head_after(index, p, head, heap[i], heap[c]) ) break;
+      int t = heap[i]; heap[i] = heap[c]; heap[c] = t;
+      i = c;
+   }
+}
+
+// merges the segments' sorted runs for permutation p into order and keys
+static void merge_order (struct signature_index *index, int p, frameind *order, uint64_t *keys) 
+{
+   int Nsegs = index->Nsegs;
+   frameind *head = (frameind *) CALLOC( Nsegs, sizeof(frameind) );
+   int *heap = (int *) MALLOC( sizeof(int)*Nsegs );
+   int n = 0;
+
+   for ( int s = 0; s < Nsegs; s++ )
+      if ( index->segstart[s+1] > index->segstart[s] ) heap[n++] = s;
+   for ( int i = n/2-1; i >= 0; i-- )
+      sift_down(index, p, head, heap, n, i);
+
+   frameind pos = 0;
+   while ( n > 0 ) {
+      int s = heap[0];
+      keys[pos] = index->keys[p*Nsegs+s][head[s]];
+      order[pos++] = index->segstart[s] + index->order[p*Nsegs+s][head[s]++];
+      if ( head[s] == index->segstart[s+1] - index->segstart[s] )
+	 heap[0] = heap[--n];
+      sift_down(index, p, head, heap, n, 0);
+   }
+
+   FREE(head);
+   FREE(heap);
+}
+
+int main(int argc, char **argv)
+{ 
+   parse_args(argc, argv);
+
+   if ( !is_manifest(manifest) )
+      fatal("\nERROR: manifest is not an index manifest");
+
+   // The segments to merge are the ones listed now; read them under the
+   // lock so an append can not slip in between the list and the index
+   int lock = manifest_lock(manifest);
+   int Nsegs;
+   char **segfiles = read_manifest(manifest, &Nsegs);
+
+   // The merge replaces the segments, so permutations it leaves out are lost
+   int Pall = index_permutations(manifest);
+   if ( P <= 0 ) {
+      P = Pall;
+      fprintf(stderr, "Merging all %d permutations\n", P);
+   } else if ( P < Pall ) {
+      fprintf(stderr,"WARNING: Keeping first %d permutations from %d total in the segments.\n",P,Pall);
+   }
+
+   // Read all segments
+   fprintf(stderr,"Reading the index segments: \n"); tic();
+   struct signature_index index;
+   read_index(manifest, P, &index);
+   manifest_unlock(lock);
+   fprintf(stderr, " (Load time: %f sec)\n",toc());
+   frameind Ntot = index.Ntot;
+
+   // The segments stay mapped while the merge is written
+   struct stat st, segst;
+   if ( stat(indexfile, &st) == 0 ) {
+      for ( int s = 0; s < Nsegs; s++ )
+	 if ( stat(segfiles[s], &segst) == 0 && 
+	      segst.st_dev == st.st_dev && segst.st_ino == st.st_ino )
+	    fatal("\nERROR: indexfile is a segment of the manifest");
+   }
+
+   // write a temporary file and rename it once complete
+   char tmpfn[MANIFEST_MAXCHAR+8];
+   snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", indexfile);
+   FILE *fout = fopen(tmpfn, "w");
+   if ( fout == NULL )
+      fatal("\nERROR: cannot open indexfile for writing");
+
+   // Lay out the merged index and write the file and signature sections
+   fprintf(stderr,"Dumping file info and signatures to index: "); tic();
+   IndexHeader hdr;
+   IndexSection sections[INDEX_NSECTIONS];
+   index_layout(&hdr, sections, index.files, index.Nfiles, Ntot, P);
+   fwrite( &hdr, sizeof(IndexHeader), 1, fout );
+   fwrite( sections, sizeof(IndexSection), INDEX_NSECTIONS, fout );
+
+   size_t off = 0;
+   for ( int i = 0; i < index.Nfiles; i++ ) {
+      write_index_section( fout, sections, IDX_FILES, off, index.files[i], index.Nchars[i] );
+      off += index.Nchars[i];
+   }
+   write_index_section( fout, sections, IDX_NARR, 0, index.Narr, sizeof(int)*index.Nfiles );
+
+   size_t stride = hdr.sigstride;
+   byte *sigbuf = (byte *) CALLOC( MERGE_CHUNK, stride );
+   int *idbuf = (int *) MALLOC( sizeof(int)*MERGE_CHUNK );
+   int *fidbuf = (int *) MALLOC( sizeof(int)*MERGE_CHUNK );
+   for ( frameind i = 0; i < Ntot; i += MERGE_CHUNK ) {
+      frameind n = MIN(MERGE_CHUNK, Ntot-i);
+      for ( frameind j = 0; j < n; j++ ) {
+	 memcpy(sigbuf + stride*j, index.allfeats[i+j].byte_, SIG_NUM_BYTES);
+	 idbuf[j] = index.allfeats[i+j].id;
+	 fidbuf[j] = index.allfeats[i+j].fid;
+      }
+      write_index_section( fout, sections, IDX_SIGS, stride*i, sigbuf, stride*n );
+      write_index_section( fout, sections, IDX_IDS, sizeof(int)*(size_t)i, idbuf, sizeof(int)*n );
+      write_index_section( fout, sections, IDX_FIDS, sizeof(int)*(size_t)i, fidbuf, sizeof(int)*n );
+   }
+   FREE(sigbuf);
+   FREE(idbuf);
+   FREE(fidbuf);
+   fprintf(stderr, "%f s\n",toc());
+
+   // Merge the sorted runs of each permutation
+   fprintf(stderr,"Merging and writing the sorted lists: \n"); tic();
+   initialize_permute();
+   frameind *order = (frameind *) MALLOC( sizeof(frameind)*(Ntot+1) );
+   uint64_t *keys = (uint64_t *) MALLOC( sizeof(uint64_t)*(Ntot+1) );
+   for ( int p = 0; p < P; p++ ) {
+      memcpy(PERMUTE_, index.PERMUTE[p], sizeof(int)*SIG_NUM_BYTES);
+      write_index_section( fout, sections, IDX_PERMUTE, sizeof(int)*SIG_NUM_BYTES*p, 
+			   PERMUTE_, sizeof(int)*SIG_NUM_BYTES );
+      merge_order(&index, p, order, keys);
+      write_index_section( fout, sections, IDX_ORDER, sizeof(frameind)*(size_t)Ntot*p, 
+			   order, sizeof(frameind)*Ntot );
+      write_index_section( fout, sections, IDX_KEYS, sizeof(uint64_t)*(size_t)Ntot*p, 
+			   keys, sizeof(uint64_t)*Ntot );
+   }
+   FREE(order);
+   FREE(keys);
+   FREE(PERMUTE_);
+   fprintf(stderr, "Finished. %f s\n",toc());
+
+   if ( fclose(fout) != 0 || rename(tmpfn, indexfile) != 0 )
+      fatal("\nERROR: failed writing the index file");
+
+   // The merged segment replaces the segments it was built from, ahead of
+   // any appended since
+   lock = manifest_lock(manifest);
+   int Nnow;
+   char **segnow = read_manifest(manifest, &Nnow);
+   bool prefix = ( Nnow >= Nsegs );
+   for ( int s = 0; prefix && s < Nsegs; s++ )
+      prefix = ( strcmp(segnow[s], segfiles[s]) == 0 );
+   if ( !prefix )
+      fatal("\nERROR: manifest was rewritten during the merge; left it as is");
+
+   char **merged = (char **) MALLOC( sizeof(char *)*(Nnow-Nsegs+1) );
+   merged[0] = indexfile;
+   for ( int s = Nsegs; s < Nnow; s++ )
+      merged[s-Nsegs+1] = segnow[s];
+   write_manifest(manifest, merged, Nnow-Nsegs+1);
+   manifest_unlock(lock);
+   fprintf(stderr, "Merged %d segments (%d frames) into %s", index.Nsegs, Ntot, indexfile);
+   if ( Nnow > Nsegs )
+      fprintf(stderr, ", kept %d appended since", Nnow-Nsegs);
+   fprintf(stderr, "\n");
+
+   FREE(merged);
+   for ( int s = 0; s < Nnow; s++ ) FREE(segnow[s]);
+   FREE(segnow);
+   for ( int s = 0; s < Nsegs; s++ ) FREE(segfiles[s]);
+   FREE(segfiles);
+
+   free_index(&index, P);
+
+   int mc = get_malloc_count();
+   if(mc != 0) fprintf(stderr,"WARNING: %d malloc'd items not free'd\n", mc);
+
+   return 0;
+}
@@ -11,9 +11,14 @@
 #include "dot.h"
 #include "score_matches.h"
 #include "signature.h"
+#include "dtw.h"
+#include "matchio.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-#define MAXDOTS_MF 50000000
 #define MAXMATCHES 100000
+#define MAXCHAR 1024
 #define PRIMEFACT 2.5
 
 // PLEB parameters
@@ -38,20 +43,42 @@ double rhothr = 0.0;
 float medthr = 0.5;
 int twopass = 1;
 int diffspeech = 0;
-int compfact = 1;
 int dtwscore = 1;
+int dtwband = 0;
+float dtwthr = 0;
 int kws = 0;
+int nthreads = 0;
 
 float castthr = 7;
 int R = 10; 
 float trimthr = 0.25;
 
 char *dump_matchlistf = NULL;
+char *matchfile = NULL;
+
+// In-process DTW rescoring over feature files
+char *dtwfile1 = NULL;
+char *dtwfile2 = NULL;
+int featD = 39;
+DtwParams dtwp;
+
+// Batch mode
+char *filelist = NULL;
+char *featlist = NULL;
+char *pairlist = NULL;
+char *outprefix = NULL;
+int binary = 0;
 
 void usage()
 {
-  fatal("usage: plebdisc [-file1 <str> (REQUIRED)]\
+  fatal("usage: plebdisc [-file1 <str> (REQUIRED unless -filelist)]\
 \n\t[-file2 <str>]\
+\n\t[-filelist <str> (signature files for batch mode)]\
+\n\t[-featlist <str> (feature files, line by line with filelist, to rescore matches by DTW)]\
+\n\t[-pairlist <str> (base name pairs, defaults to all pairs)]\
+\n\t[-outprefix <str> (batch output, one <str>.<n> per worker)]\
+\n\t[-binary <n> (1 = batch output in binary match files <str>.<n>.zrm)]\
+\n\t[-matchfile <str> (write the matches to a binary match file)]\
 \n\t[-P <n> (defaults to 4)]\
 \n\t[-B <n> (defaults to 100)]\
 \n\t[-T <n> (defaults to 0.5)]\
@@ -72,7 +99,18 @@ void usage()
 \n\t[-twopass <n> (defaults to 1)] ]\
 \n\t[-Tscore <n> (defaults to 0.75)] ]\
 \n\t[-dtwscore <n> (defaults to 1)] ]\
-\n\t[-kws <n> (defaults to 0)] ]\n");
+\n\t[-dtwband <n> (DTW band halfwidth, defaults to 0 = none)] ]\
+\n\t[-dtwthr <n> (stop DTW scoring below this score, defaults to 0)] ]\
+\n\t[-kws <n> (defaults to 0)] ]\
+\n\t[-featfile1 <str> (features of file1 to rescore matches by DTW)] ]\
+\n\t[-featfile2 <str> (features of file2, defaults to featfile1)] ]\
+\n\t[-featD <n> (feature dimension, defaults to 39)] ]\
+\n\t[-maxrun <n> (rescoring, defaults to INT_MAX)] ]\
+\n\t[-sakoe <n> (rescoring, defaults to 0)] ]\
+\n\t[-kldiv <n> (rescoring, defaults to 0=cosine)] ]\
+\n\t[-sym <n> (rescoring, defaults to 0=not symmetrized)] ]\
+\n\t[-wmvn <n> (rescoring, defaults to 0=not word-level mvn)] ]\
+\n\t[-nthreads <n> (defaults to OMP_NUM_THREADS)] ]\n");
 }
 
 void parse_args(int argc, char **argv)
@@ -102,7 +140,24 @@ void parse_args(int argc, char **argv)
      else if ( strcmp(argv[i], "-R") == 0 ) R = atoi(argv[++i]);
      else if ( strcmp(argv[i], "-twopass") == 0 ) twopass = atoi(argv[++i]);
      else if ( strcmp(argv[i], "-dtwscore") == 0 ) dtwscore = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-dtwband") == 0 ) dtwband = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-dtwthr") == 0 ) dtwthr = atof(argv[++i]);
      else if ( strcmp(argv[i], "-kws") == 0 ) kws = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-nthreads") == 0 ) nthreads = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-filelist") == 0 ) filelist = argv[++i];
+     else if ( strcmp(argv[i], "-featlist") == 0 ) featlist = argv[++i];
+     else if ( strcmp(argv[i], "-pairlist") == 0 ) pairlist = argv[++i];
+     else if ( strcmp(argv[i], "-outprefix") == 0 ) outprefix = argv[++i];
+     else if ( strcmp(argv[i], "-binary") == 0 ) binary = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-matchfile") == 0 ) matchfile = argv[++i];
+     else if ( strcmp(argv[i], "-featfile1") == 0 ) dtwfile1 = argv[++i];
+     else if ( strcmp(argv[i], "-featfile2") == 0 ) dtwfile2 = argv[++i];
+     else if ( strcmp(argv[i], "-featD") == 0 ) featD = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-maxrun") == 0 ) dtwp.maxrun = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-sakoe") == 0 ) dtwp.sakoe = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-kldiv") == 0 ) dtwp.kldiv = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-sym") == 0 ) dtwp.sym = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-wmvn") == 0 ) dtwp.wmvn = atoi(argv[++i]);
      else if ( strcmp(argv[i], "-dump-matchlist") == 0 ) {
        dump_matchlistf = argv[++i];
      }
@@ -112,12 +167,24 @@ void parse_args(int argc, char **argv)
      }
   }
 
-  if ( !featfile1 ) {
+  if ( filelist ) {
+     if ( featfile1 || featfile2 )
+	fatal("\nERROR: file1/file2 and filelist args are exclusive");
+     if ( !outprefix )
+	fatal("\nERROR: outprefix arg is required with filelist");
+     if ( xA != -1 || xB != -1 || yA != -1 || yB != -1 )
+	fatal("\nERROR: xA/xB/yA/yB are not supported with filelist");
+     if ( matchfile )
+	fatal("\nERROR: matchfile is not supported with filelist (use -binary 1)");
+     featfile1 = featfile2 = filelist;
+  } else if ( !featfile1 ) {
      usage();
      fatal("\nERROR: file1 arg is required");
   }
 
-  if ( featfile2 && strcmp(featfile2,featfile1) != 0 ) {
+  if ( filelist ) {
+     // diffspeech is decided per pair
+  } else if ( featfile2 && strcmp(featfile2,featfile1) != 0 ) {
      diffspeech = 1;
   } else {
      if ( !featfile2 ) {
@@ -129,11 +196,21 @@ void parse_args(int argc, char **argv)
      }
   }
 
-  compfact = diffspeech + 1;
-
   if ( twopass < 0 || twopass > 1 )
      fatal("\nERROR: Invalid value for twopass\n");
 
+  if ( dtwfile2 && !dtwfile1 )
+     fatal("\nERROR: featfile2 requires featfile1");
+  if ( dtwfile1 && filelist )
+     fatal("\nERROR: featfile1/featfile2 are not supported with filelist (use featlist)");
+  if ( featlist && !filelist )
+     fatal("\nERROR: featlist requires filelist");
+  if ( dtwfile1 && !dtwfile2 ) {
+     if ( diffspeech && strcmp(featfile2,featfile1) != 0 )
+	fatal("\nERROR: featfile2 is required when file2 differs from file1");
+     dtwfile2 = dtwfile1;
+  }
+
   fprintf(stderr, "\nRun Parameters\n--------------\n \
 file1 = %s, (xA,xB) = (%d,%d)\n \
 file2 = %s, (yA,yB) = (%d,%d)\n \
@@ -141,106 +218,132 @@ maxframes = %d, \n \
 P = %d, B = %d, T = %f, D = %d, S = %d,\n \
 dx = %d, dy = %d, medthr = %f, \n \
 castthr = %f, trimthr = %f, R = %d,\n \
-rhothr = %f, twopass = %d, dtwscore = %d, Tscore = %f\n\n",
+rhothr = %f, twopass = %d, dtwscore = %d, Tscore = %f,\n \
+dtwband = %d, dtwthr = %f\n \
+featfile1 = %s, featfile2 = %s, featD = %d\n\n",
 	  featfile1, xA, xB, featfile2, 
 	  yA, yB, maxframes,   
 	  P, B, T, D, S,
 	  dx, dy, medthr, castthr, trimthr, R, rhothr, 
-	  twopass, dtwscore, Tscore);
+	  twopass, dtwscore, Tscore, dtwband, dtwthr,
+	  dtwfile1, dtwfile2, featD);
 
   dx *= 2;
   dy *= 2;
 
-  SIG_NUM_BYTES = S/8;
+  set_signature_bits(S);
 }
 
-int main(int argc, char **argv)
-{ 
-   parse_args(argc, argv);
+// Rescores the matches by DTW between the feature frames they span (match
+// frames plus the offsets index the feature files). rescore[n] receives
+// the rescore_match similarity, or NAN when the match is skipped.
+void rescore_matches( Match *matchlist, int matchcnt, int xOffset, int yOffset,
+		      float *ffeats1, int NF1, float *ffeats2, int NF2, float *rescore )
+{
+#pragma omp parallel
+   {
+      DtwScratch ws;
+      dtw_scratch_init(&ws);
+
+#pragma omp for schedule(dynamic,4)
+      for ( int n = 0; n < matchcnt; n++ ) {
+	 rescore[n] = rescore_match( ffeats1, NF1, ffeats2, NF2, featD, 
+				     matchlist[n].xA + xOffset, matchlist[n].xB + xOffset, 
+				     matchlist[n].yA + yOffset, matchlist[n].yB + yOffset, 
+				     &dtwp, &ws );
+      }
 
-   int N1, N2, Nmax;
-   if ( maxframes > 0 ) N1 = maxframes;
-   else N1 = 0;
+      dtw_scratch_free(&ws);
+   }
+}
 
-   struct signature *feats1 = (struct signature *)readsigs_file(featfile1, &xA, &xB, &N1);
-   fprintf(stderr, "featfile1 = %s; N1 = %d frames\n", featfile1, N1);
+// Like dump_matchlist, with the rescored similarity in place of the score
+// and the original score appended (the rescore_singlepair_dtw format)
+void dump_rescored( FILE *fp, Match *matchlist, float *rescore, int matchcnt, 
+		    int xOffset, int yOffset )
+{
+   for ( int n = 0; n < matchcnt; n++ ) {
+      if ( isnan(rescore[n]) ) continue;
+      fprintf(fp,"%d %d %d %d %f %f %f\n",
+	      matchlist[n].xA+xOffset,
+	      matchlist[n].xB+xOffset, 
+	      matchlist[n].yA+yOffset,
+	      matchlist[n].yB+yOffset,
+	      rescore[n],
+	      matchlist[n].rhoampl,
+	      matchlist[n].score);
+   }
+}
 
-   struct signature *feats2 = feats1;
-   if ( diffspeech ) {
-      if ( maxframes > 0 ) N2 = maxframes;
-      else N2 = 0;
-      feats2 = (struct signature *)readsigs_file(featfile2, &yA, &yB, &N2);
-      fprintf(stderr, "featfile2 = %s; N2 = %d frames\n", featfile2, N2);
-   } else {
-      N2 = N1;
-      yA = xA;
-      yB = xB;
+// Binary counterpart of dump_matchlist/dump_rescored: the score (or the
+// rescored similarity) and rho, plus the original score if rescore is set
+void write_matches( MatchWriter *mw, Match *matchlist, float *rescore, int matchcnt, 
+		    int xOffset, int yOffset )
+{
+   MatchRecord rec;
+   for ( int n = 0; n < matchcnt; n++ ) {
+      if ( rescore && isnan(rescore[n]) ) continue;
+      rec.ival[0] = matchlist[n].xA+xOffset;
+      rec.ival[1] = matchlist[n].xB+xOffset;
+      rec.ival[2] = matchlist[n].yA+yOffset;
+      rec.ival[3] = matchlist[n].yB+yOffset;
+      rec.fval[0] = rescore ? rescore[n] : matchlist[n].score;
+      rec.fval[1] = matchlist[n].rhoampl;
+      rec.fval[2] = matchlist[n].score;
+      matchio_write(mw, &rec);
    }
-   Nmax = max(N1,N2);
+}
+
+// Runs the discovery pipeline on one pair of signature arrays and
+// writes the matches to mw if it is not NULL, else as text to fp (frame
+// offsets added to the output). If ffeats1 is not NULL the matches are
+// rescored by DTW over ffeats1 and ffeats2 before they are written.
+void discover( struct signature *feats1, int N1, struct signature *feats2, int N2,
+	       int diffspeech, int xOffset, int yOffset, 
+	       float *ffeats1, int NF1, float *ffeats2, int NF2, 
+	       FILE *fp, MatchWriter *mw )
+{
+   int Nmax = max(N1,N2);
 
    // Initialize the pleb permutations
    initialize_permute();
 
-   // Compute the rotated dot plot
-   long maxdots;
-   if ( kws ) 
-      maxdots = P*B*N2*(D+1);
-   else
-      maxdots = P*B*(Nmax)*(2*D+1);
+   int compfact = diffspeech + 1;
 
-   fprintf(stderr,"Computing sparse dot plot (Max Dots = %ld) ...\n", maxdots); tic();
+   // Compute the rotated dot plot
+   fprintf(stderr,"Computing sparse dot plot ...\n"); tic();
 
-   Dot *dotlist = (Dot *) MALLOC(maxdots*sizeof(Dot));
-   memset(dotlist, 0, maxdots*sizeof(Dot));
+   DotBuffer dots;
+   dotbuf_init(&dots, compfact*Nmax);
 
    int dotcnt;
    if ( kws ) {
       dotcnt = plebkws( feats1, N1, feats2, N2, diffspeech, 
-			P, B, T, D, dotlist );
+			P, B, T, D, &dots );
    } else {
       dotcnt = pleb( feats1, N1, feats2, N2, diffspeech, 
-		     P, B, T, D, dotlist );
+		     P, B, T, D, &dots );
    }
 
    fprintf(stderr, "    Total elements in thresholded sparse: %d\n", dotcnt);
    fprintf(stderr, "Finished: %f sec.\n",toc());
 
-   // Sort dots by row
+   // Sort dots by row and column, removing duplicates
    fprintf(stderr, "Applying radix sort of dotlist: "); tic();
    DotXV *radixdots = (DotXV *)MALLOC( dotcnt*sizeof(DotXV));
    int *cumsum = (int*)MALLOC((compfact*Nmax+1)*sizeof(int));
-   radix_sorty(compfact*Nmax, dotlist, dotcnt, radixdots, cumsum);
-   fprintf(stderr, "%f s\n",toc());
-
-   // Sort rows by column
-   fprintf(stderr, "Applying qsort of radix bins: "); tic();
-   quick_sortx(compfact*Nmax, radixdots, dotcnt, cumsum);
-   fprintf(stderr, "%f s\n",toc());
-
-   // Remove duplicate dots in each row
-   fprintf(stderr, "Removing duplicate dots from radix bins: "); tic();
-   dotcnt = dot_dedup(radixdots, cumsum, compfact*Nmax, T);
+   dotcnt = radix_sort_dots(compfact*Nmax, &dots, radixdots, cumsum);
+   dotbuf_free(&dots);
    fprintf(stderr, "%f s\n",toc());
    fprintf(stderr, "    Total elements after dedup: %d\n", dotcnt);
 
-   // Apply the median filter in the X direction
+   // Apply the median filter in the X direction (output stays bucketed by row)
    fprintf(stderr, "Applying median filter to sparse matrix: "); tic();
-   Dot *dotlist_mf = (Dot *) MALLOC(MAXDOTS_MF*sizeof(DotXV));
-   dotcnt = median_filtx(compfact*Nmax, radixdots, dotcnt, cumsum, dx, medthr, dotlist_mf);
-   fprintf(stderr, "%f s\n",toc());
-   fprintf(stderr, "    Total elements in filtered sparse: %d\n", dotcnt);
-
-   // Sort mf dots by row
-   fprintf(stderr,"Applying radix sort of dotlist_mf: "); tic();
-   DotXV *radixdots_mf = (DotXV *)MALLOC(dotcnt*sizeof(DotXV));
+   DotXV *radixdots_mf;
    int *cumsum_mf = (int *)MALLOC((compfact*Nmax+1)*sizeof(int));
-   radix_sorty(compfact*Nmax, dotlist_mf, dotcnt, radixdots_mf, cumsum_mf);
-   fprintf(stderr, "%f s\n",toc());
-
-   // Sort mf rows by column
-   fprintf(stderr,"Applying qsort of radix_mf bins: "); tic();
-   quick_sortx(compfact*Nmax, radixdots_mf, dotcnt, cumsum_mf);
+   dotcnt = median_filtx(compfact*Nmax, radixdots, dotcnt, cumsum, dx, medthr, &radixdots_mf, cumsum_mf);
    fprintf(stderr, "%f s\n",toc());
+   fprintf(stderr, "    Total elements in filtered sparse: %d\n", dotcnt);
 
    // Compute the Hough transform
    fprintf(stderr,"Computing hough transform: "); tic();
@@ -264,17 +367,11 @@ int main(int argc, char **argv)
 
    if ( dump_matchlistf ) {
      fprintf(stderr, "Writing matchlist: "); tic();
-     FILE *matchlist_fileptr;
-     matchlist_fileptr = fopen(dump_matchlistf, "wb");
-     for (int i = 0; i < matchcnt; i++ ) {
-       fwrite(&matchlist[i].xA, sizeof(int), 1, matchlist_fileptr);
-       fwrite(&matchlist[i].xB, sizeof(int), 1, matchlist_fileptr);
-       fwrite(&matchlist[i].yA, sizeof(int), 1, matchlist_fileptr);
-       fwrite(&matchlist[i].yB, sizeof(int), 1, matchlist_fileptr);
-       fwrite(&matchlist[i].rhoampl, sizeof(float), 1,matchlist_fileptr);
-       fwrite(&matchlist[i].score, sizeof(float), 1,matchlist_fileptr);
-     }
-     fclose(matchlist_fileptr);
+     MatchWriter dumpw;
+     matchio_open_write(&dumpw, dump_matchlistf, MATCH_LAYOUT_PAIR, 4, 2);
+     write_matches(&dumpw, matchlist, NULL, matchcnt, 0, 0);
+     matchio_close_write(&dumpw);
+     fprintf(stderr, "%f s\n",toc());
    }
 
    int lastmc = matchcnt;
@@ -308,13 +405,14 @@ int main(int argc, char **argv)
       }
    }
 
+   bool *isdot = dtwscore ? NULL : dot_table(Tscore);
    for ( int n = 0; n < lastmc; n++ )
    {
       if ( dtwscore ) {
 	 matchlist[n].score = 1.0 - 
 	    dtw_score(feats1, feats2, N1, N2,  
 		      matchlist[n].xA, matchlist[n].xB, 
-		      matchlist[n].yA, matchlist[n].yB );
+		      matchlist[n].yA, matchlist[n].yB, dtwband, 1-dtwthr );
       } else {
 	 int totdots;
 	 int pathcnt;
@@ -322,28 +420,37 @@ int main(int argc, char **argv)
 	 
 	 score_match( feats1, feats2, N1, N2, 
 		      matchlist[n].xA, matchlist[n].xB, matchlist[n].yA, 
-		      matchlist[n].yB, Tscore, &pathcnt, &totdots, dotvec);
+		      matchlist[n].yB, isdot, &pathcnt, &totdots, dotvec);
 	 matchlist[n].score = logreg_score_ken( totdots, pathcnt, dotvec );
 	 
       }
    }
+   if ( isdot ) FREE(isdot);
    
-   fprintf(stderr,"    Dumping %d matches\n",lastmc);
-   if ( xA == -1 ) xA = 0;
-   if ( yA == -1 ) yA = 0;
-   dump_matchlist(matchlist, lastmc, xA, yA);
-
-   // Free the heap
-   free_signatures(feats1,N1);
+   if ( ffeats1 ) {
+      fprintf(stderr, "Rescoring matches by DTW: "); tic();
+      float *rescore = (float *) MALLOC( MAX(lastmc,1)*sizeof(float) );
+      rescore_matches(matchlist, lastmc, xOffset, yOffset, 
+		      ffeats1, NF1, ffeats2, NF2, rescore);
+      fprintf(stderr, "%f s\n",toc());
 
-   if ( diffspeech ) {
-      free_signatures(feats2,N2);
+      fprintf(stderr,"    Dumping %d matches\n",lastmc);
+      if ( mw )
+	 write_matches(mw, matchlist, rescore, lastmc, xOffset, yOffset);
+      else
+	 dump_rescored(fp, matchlist, rescore, lastmc, xOffset, yOffset);
+      FREE(rescore);
+   } else {
+      fprintf(stderr,"    Dumping %d matches\n",lastmc);
+      if ( mw )
+	 write_matches(mw, matchlist, NULL, lastmc, xOffset, yOffset);
+      else
+	 dump_matchlist(fp, matchlist, lastmc, xOffset, yOffset);
    }
 
-   FREE(dotlist);
+   // Free the heap
    FREE(radixdots);
    FREE(cumsum);
-   FREE(dotlist_mf);
    FREE(radixdots_mf);
    FREE(cumsum_mf);
 
@@ -352,6 +459,263 @@ int main(int argc, char **argv)
    FREE(rholist);
    FREE(rhoampl);
    FREE(matchlist);
+}
+
+// Base name of a signature file: last path component up to the first '.'
+char *file_base( char *path )
+{
+   char *start = strrchr(path, '/');
+   start = start ? start+1 : path;
+   int len = strcspn(start, ".");
+   char *base = (char *) MALLOC( (len+1)*sizeof(char) );
+   memcpy(base, start, len);
+   base[len] = '\0';
+   return base;
+}
+
+typedef struct FileBase {
+   char *base;
+   int ind;
+} FileBase;
+
+int FileBase_compare( const void *A, const void *B )
+{
+   return strcmp(((FileBase *)A)->base, ((FileBase *)B)->base);
+}
+
+// Batch mode: keeps every signature file resident and runs the pair
+// list on a pool of workers, each writing <outprefix>.<n> (or the binary
+// match file <outprefix>.<n>.zrm). With featlist the feature files are
+// resident too and every match is rescored by DTW before it is written.
+void discover_batch()
+{
+   fprintf(stderr,"Reading the signature files: \n"); tic();
+
+   int Nfiles = file_line_count( filelist );
+   char **files = (char **) MALLOC( sizeof(char*)*Nfiles );
+   char **bases = (char **) MALLOC( sizeof(char*)*Nfiles );
+   int *Narr = (int *) MALLOC( sizeof(int)*Nfiles );
+   struct signature **feats = 
+      (struct signature **) MALLOC( sizeof(struct signature *)*Nfiles );
+
+   assert_file_exist( filelist );
+   FILE *fptr = fopen(filelist, "r");
+   for ( int i = 0; i < Nfiles; i++ ) {
+      files[i] = (char *) MALLOC( MAXCHAR*sizeof(char) );
+      if ( fscanf(fptr, "%s", files[i]) != 1 )
+	 fatal("\nERROR: short read from filelist");
+      bases[i] = file_base(files[i]);
+   }
+   fclose(fptr);
+
+   for ( int i = 0; i < Nfiles; i++ ) {
+      int fA = -1, fB = -1;
+      Narr[i] = maxframes;
+      feats[i] = (struct signature *)readsigs_file(files[i], &fA, &fB, &Narr[i]);
+   }
+   fprintf(stderr, "Loaded %d files. %f s\n", Nfiles, toc());
+
+   float **ffeats = NULL;
+   int *NF = NULL;
+   if ( featlist ) {
+      fprintf(stderr,"Reading the feature files: \n"); tic();
+      if ( file_line_count( featlist ) != Nfiles )
+	 fatal("\nERROR: featlist and filelist differ in length");
+      ffeats = (float **) MALLOC( sizeof(float *)*Nfiles );
+      NF = (int *) MALLOC( sizeof(int)*Nfiles );
+
+      char name[MAXCHAR];
+      fptr = fopen(featlist, "r");
+      for ( int i = 0; i < Nfiles; i++ ) {
+	 if ( fscanf(fptr, "%s", name) != 1 )
+	    fatal("\nERROR: short read from featlist");
+	 int fA = -1, fB = -1;
+	 assert_file_exist( name );
+	 ffeats[i] = readfeats_file(name, featD, &fA, &fB, &NF[i]);
+      }
+      fclose(fptr);
+      fprintf(stderr, "Loaded %d files. %f s\n", Nfiles, toc());
+   }
+
+   // Build the pair list
+   int npairs;
+   int *pairs;
+   if ( pairlist ) {
+      FileBase *lookup = (FileBase *) MALLOC( sizeof(FileBase)*Nfiles );
+      for ( int i = 0; i < Nfiles; i++ ) {
+	 lookup[i].base = bases[i];
+	 lookup[i].ind = i;
+      }
+      qsort(lookup, Nfiles, sizeof(FileBase), FileBase_compare);
+
+      npairs = file_line_count( pairlist );
+      pairs = (int *) MALLOC( sizeof(int)*2*npairs );
+      assert_file_exist( pairlist );
+      fptr = fopen(pairlist, "r");
+      char name[MAXCHAR];
+      for ( int n = 0; n < 2*npairs; n++ ) {
+	 if ( fscanf(fptr, "%s", name) != 1 )
+	    fatal("\nERROR: short read from pairlist");
+	 FileBase key = { name, 0 };
+	 FileBase *hit = (FileBase *) bsearch(&key, lookup, Nfiles, sizeof(FileBase), FileBase_compare);
+	 if ( !hit ) {
+	    fprintf(stderr, "ERROR: %s from pairlist is not in filelist\n", name);
+	    exit(1);
+	 }
+	 pairs[n] = hit->ind;
+      }
+      fclose(fptr);
+      FREE(lookup);
+   } else {
+      npairs = Nfiles*(Nfiles+1)/2;
+      pairs = (int *) MALLOC( sizeof(int)*2*npairs );
+      int n = 0;
+      for ( int i = 0; i < Nfiles; i++ ) {
+	 for ( int j = i; j < Nfiles; j++ ) {
+	    pairs[n++] = i;
+	    pairs[n++] = j;
+	 }
+      }
+   }
+   fprintf(stderr, "Processing %d file pairs\n", npairs);
+
+#pragma omp parallel
+   {
+      int worker = 1;
+#ifdef _OPENMP
+      worker = omp_get_thread_num() + 1;
+#endif
+      char outfile[MAXCHAR];
+      FILE *fout = NULL;
+      MatchWriter mw;
+      if ( binary ) {
+	 snprintf(outfile, MAXCHAR, "%s.%d.zrm", outprefix, worker);
+	 matchio_open_write(&mw, outfile, MATCH_LAYOUT_PAIR, 4, featlist ? 3 : 2);
+      } else {
+	 snprintf(outfile, MAXCHAR, "%s.%d", outprefix, worker);
+	 fout = fopen(outfile, "w");
+	 if ( !fout ) {
+	    fprintf(stderr, "ERROR: cannot write %s\n", outfile);
+	    exit(1);
+	 }
+      }
+
+#pragma omp for schedule(dynamic,1)
+      for ( int n = 0; n < npairs; n++ ) {
+	 int i = pairs[2*n], j = pairs[2*n+1];
+	 float *ffeats1 = ffeats ? ffeats[i] : NULL, *ffeats2 = ffeats ? ffeats[j] : NULL;
+	 int NF1 = NF ? NF[i] : 0, NF2 = NF ? NF[j] : 0;
+	 if ( binary ) {
+	    matchio_set_names(&mw, bases[i], bases[j], NULL);
+	    discover( feats[i], Narr[i], feats[j], Narr[j], i != j, 0, 0, 
+		      ffeats1, NF1, ffeats2, NF2, NULL, &mw );
+	 } else {
+	    fprintf(fout, "%s %s\n", bases[i], bases[j]);
+	    discover( feats[i], Narr[i], feats[j], Narr[j], i != j, 0, 0, 
+		      ffeats1, NF1, ffeats2, NF2, fout, NULL );
+	    fflush(fout);
+	 }
+      }
+
+      if ( binary ) matchio_close_write(&mw);
+      else fclose(fout);
+   }
+
+   FREE(pairs);
+   if ( ffeats ) {
+      for ( int i = 0; i < Nfiles; i++ )
+	 FREE(ffeats[i]);
+      FREE(ffeats);
+      FREE(NF);
+   }
+   for ( int i = 0; i < Nfiles; i++ ) {
+      free_signatures(feats[i], Narr[i]);
+      FREE(files[i]);
+      FREE(bases[i]);
+   }
+   FREE(feats);
+   FREE(files);
+   FREE(bases);
+   FREE(Narr);
+}
+
+int main(int argc, char **argv)
+{ 
+   dtw_params_init(&dtwp);
+   parse_args(argc, argv);
+
+#ifdef _OPENMP
+   if ( nthreads > 0 ) omp_set_num_threads(nthreads);
+#endif
+
+   if ( filelist ) {
+      discover_batch();
+   } else {
+      int N1, N2;
+      if ( maxframes > 0 ) N1 = maxframes;
+      else N1 = 0;
+
+      struct signature *feats1 = (struct signature *)readsigs_file(featfile1, &xA, &xB, &N1);
+      fprintf(stderr, "featfile1 = %s; N1 = %d frames\n", featfile1, N1);
+
+      struct signature *feats2 = feats1;
+      if ( diffspeech ) {
+	 if ( maxframes > 0 ) N2 = maxframes;
+	 else N2 = 0;
+	 feats2 = (struct signature *)readsigs_file(featfile2, &yA, &yB, &N2);
+	 fprintf(stderr, "featfile2 = %s; N2 = %d frames\n", featfile2, N2);
+      } else {
+	 N2 = N1;
+	 yA = xA;
+	 yB = xB;
+      }
+
+      // Read the features for rescoring
+      float *ffeats1 = NULL, *ffeats2 = NULL;
+      int NF1 = 0, NF2 = 0;
+      if ( dtwfile1 ) {
+	 int fA = -1, fB = -1;
+	 assert_file_exist( dtwfile1 );
+	 ffeats1 = readfeats_file(dtwfile1, featD, &fA, &fB, &NF1);
+	 fprintf(stderr, "featfile1 = %s; NF1 = %d frames\n", dtwfile1, NF1);
+
+	 ffeats2 = ffeats1;
+	 NF2 = NF1;
+	 if ( strcmp(dtwfile2,dtwfile1) != 0 ) {
+	    fA = -1; fB = -1;
+	    assert_file_exist( dtwfile2 );
+	    ffeats2 = readfeats_file(dtwfile2, featD, &fA, &fB, &NF2);
+	    fprintf(stderr, "featfile2 = %s; NF2 = %d frames\n", dtwfile2, NF2);
+	 }
+      }
+
+      if ( matchfile ) {
+	 // Group the matches under the base names, as the batch mode does
+	 MatchWriter mw;
+	 matchio_open_write(&mw, matchfile, MATCH_LAYOUT_PAIR, 4, ffeats1 ? 3 : 2);
+	 char *base1 = file_base(featfile1), *base2 = file_base(featfile2);
+	 matchio_set_names(&mw, base1, base2, NULL);
+	 discover( feats1, N1, feats2, N2, diffspeech, xA, yA, 
+		   ffeats1, NF1, ffeats2, NF2, NULL, &mw );
+	 matchio_close_write(&mw);
+	 FREE(base1);
+	 FREE(base2);
+      } else {
+	 discover( feats1, N1, feats2, N2, diffspeech, xA, yA, 
+		   ffeats1, NF1, ffeats2, NF2, stdout, NULL );
+      }
+
+      if ( ffeats2 && ffeats2 != ffeats1 ) FREE(ffeats2);
+      if ( ffeats1 ) FREE(ffeats1);
+
+      free_signatures(feats1,N1);
+
+      if ( diffspeech ) {
+	 free_signatures(feats2,N2);
+      }
+   }
+
+   dtw_params_free(&dtwp);
 
    int mc = get_malloc_count();
    if(mc != 0) fprintf(stderr,"WARNING: %d malloc'd items not free'd\n", mc);
@@ -2,6 +2,8 @@
 // Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
 //
 
+#define _POSIX_C_SOURCE 200809L // open_memstream
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -11,9 +13,14 @@
 #include "dotkws.h"
 #include "score_matches.h"
 #include "signature.h"
+#include "index.h"
+#include "matchio.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-#define MAXDOTS_MF 150000000
 #define MAXMATCHES 1000000
+#define MAXCHAR 1024
 #define PRIMEFACT 2.5
 
 // PLEB parameters
@@ -37,8 +44,12 @@ float medthr = 0.5;
 int twopass = 1;
 int matchfeat = 0;
 int dtwscore = 1;
+int dtwband = 0;
+float dtwthr = 0;
 int submatch = 0;
 int singlequery = 0;
+int nthreads = 0;
+char *matchfile = NULL;
 
 float castthr = 7;
 int R = 10; 
@@ -48,7 +59,7 @@ void usage()
 {
   fatal("usage: plebkws [-querylist <str>]\
 \n\t[-queryfile <str>]\
-\n\t[-indexfile <str> (REQUIRED)]\
+\n\t[-indexfile <str> (index or segment manifest, REQUIRED)]\
 \n\t[-P <n> (defaults to 4)]\
 \n\t[-B <n> (defaults to 100)]\
 \n\t[-T <n> (defaults to 0.5)]\
@@ -65,8 +76,12 @@ void usage()
 \n\t[-rhothr <n> (defalts to 0)]\
 \n\t[-twopass <n> (defaults to 1)] ]\
 \n\t[-dtwscore <n> (defaults to 1)] ]\
+\n\t[-dtwband <n> (DTW band halfwidth, defaults to 0 = none)] ]\
+\n\t[-dtwthr <n> (stop DTW scoring below this score, defaults to 0)] ]\
 \n\t[-submatch <n> (defaults to 0)] ]\
-\n\t[-matchfeat <n> (defaults to 0)] ]\n");
+\n\t[-matchfeat <n> (defaults to 0)] ]\
+\n\t[-matchfile <str> (write the matches to a binary match file)] ]\
+\n\t[-nthreads <n> (defaults to OMP_NUM_THREADS)] ]\n");
 }
 
 void parse_args(int argc, char **argv)
@@ -93,8 +108,12 @@ void parse_args(int argc, char **argv)
      else if ( strcmp(argv[i], "-R") == 0 ) R = atoi(argv[++i]);
      else if ( strcmp(argv[i], "-twopass") == 0 ) twopass = atoi(argv[++i]);
      else if ( strcmp(argv[i], "-dtwscore") == 0 ) dtwscore = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-dtwband") == 0 ) dtwband = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-dtwthr") == 0 ) dtwthr = atof(argv[++i]);
      else if ( strcmp(argv[i], "-submatch") == 0 ) submatch = atoi(argv[++i]);
      else if ( strcmp(argv[i], "-matchfeat") == 0 ) matchfeat = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-nthreads") == 0 ) nthreads = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-matchfile") == 0 ) matchfile = argv[++i];
      else {
        fprintf(stderr, "unknown arg: %s\n", argv[i]);
        usage();
@@ -130,11 +149,11 @@ P = %d, B = %d, T = %f, D = %d, S = %d,\n\
 dx = %d, dy = %d, medthr = %f, \n\
 castthr = %f, trimthr = %f, R = %d,\n\
 rhothr = %f, twopass = %d,\n\
-dtwscore = %d, submatch = %d\n\n",
+dtwscore = %d, submatch = %d, dtwband = %d, dtwthr = %f\n\n",
 	  querylist, indexfile, 
 	  P, B, T, D, S,
 	  dx, dy, medthr, castthr, trimthr, R, rhothr, 
-	  twopass, dtwscore, submatch);
+	  twopass, dtwscore, submatch, dtwband, dtwthr);
   } else {
      fprintf(stderr, "\nRun Parameters\n--------------\n\
 queryfile = %s, qA = %d, qB = %d,\n\
@@ -143,302 +162,367 @@ P = %d, B = %d, T = %f, D = %d, S = %d,\n\
 dx = %d, dy = %d, medthr = %f, \n\
 castthr = %f, trimthr = %f, R = %d,\n\
 rhothr = %f, twopass = %d,\n\
-dtwscore = %d, submatch = %d\n\n",
+dtwscore = %d, submatch = %d, dtwband = %d, dtwthr = %f\n\n",
 	     queryfile, qA, qB, indexfile, 
 	     P, B, T, D, S,
 	     dx, dy, medthr, castthr, trimthr, R, rhothr, 
-	     twopass, dtwscore, submatch);
+	     twopass, dtwscore, submatch, dtwband, dtwthr);
   }
   
   dx *= 2;
   dy *= 2;
 
-  SIG_NUM_BYTES = S/8;
+  set_signature_bits(S);
 }
 
-int main(int argc, char **argv)
-{ 
-   parse_args(argc, argv);
-
-   // Read the index
-   tic();
-   assert_file_exist( indexfile );
-   FILE *fptr = fopen(indexfile,"r");
-   struct signature_index index;
-   
-   fprintf(stderr, "indexfile = %s; ", indexfile);
-   fread(&index.SIG_NUM_BYTES, sizeof(int), 1, fptr);
-   fprintf(stderr, "SIG_NUM_BYTES = %d, ", index.SIG_NUM_BYTES);
-   fread(&index.Nfiles, sizeof(int), 1, fptr);
-   fprintf(stderr, "Nfiles = %d, ", index.Nfiles);
-   
-   if ( index.SIG_NUM_BYTES != SIG_NUM_BYTES ) {
-      fatal("\nERROR: Requested signature size does not match index");
-   }
-   
-   index.Nchars = (int *) MALLOC( sizeof(int)*index.Nfiles );
-   index.files = (char **) MALLOC( sizeof(char *)*index.Nfiles );
-   for ( int i = 0; i < index.Nfiles; i++ ) {
-      fread(&index.Nchars[i], sizeof(int), 1, fptr);
-      index.files[i] = (char *) MALLOC( sizeof(char)*index.Nchars[i] );
-      fread(index.files[i], sizeof(char), index.Nchars[i], fptr);
-   }
-   
-   fread(&index.Ntot, sizeof(frameind), 1, fptr);
-   fprintf(stderr, "Ntot = %d, ", index.Ntot);
-   index.Narr = (int *) MALLOC( sizeof(int)*index.Nfiles );
-   fread(index.Narr, sizeof(int), index.Nfiles, fptr);
-   
-   index.allfeats = 
-      (struct signature *) MALLOC( sizeof(struct signature)*index.Ntot );
-   for ( int i = 0; i < index.Ntot; i++ ) {
-      fread(&index.allfeats[i].id, sizeof(int), 1, fptr);
-      index.allfeats[i].byte_ = 
-	 (byte *) MALLOC( sizeof(byte)*SIG_NUM_BYTES );
-      fread(index.allfeats[i].byte_, sizeof(byte), SIG_NUM_BYTES, fptr);
-      fread(&index.allfeats[i].fid, sizeof(int), 1, fptr);
-   }
-   
-   fread(&index.P, sizeof(int), 1, fptr);
-   if ( P > index.P ) {
-      fatal("\nERROR: Requested permutations exceeds amount in index");
-   }
-   
-   fprintf(stderr, "P = %d", index.P);
-   index.PERMUTE = (int **) MALLOC( sizeof(int *)*P );
-   index.order = 
-      (frameind **) MALLOC( sizeof(frameind *)*P );
-   for ( int i = 0; i < P; i++ ) {
-      index.PERMUTE[i] = (int *) MALLOC( sizeof(int)*index.SIG_NUM_BYTES );
-      fread(index.PERMUTE[i], sizeof(int), index.SIG_NUM_BYTES, fptr);
-      index.order[i] = 
-	 (frameind *) MALLOC( sizeof(frameind)*index.Ntot );
-      fread(index.order[i], sizeof(frameind), index.Ntot, fptr);
-   }
-   
-   frameind *fileranges = (frameind*)MALLOC((index.Nfiles+1)*sizeof(frameind));
-   make_cumhist( fileranges, index.Narr, index.Nfiles );
-   
-   fclose(fptr);
-   fprintf(stderr, " (Load time: %f sec)\n",toc());
-   if ( P < index.P ) {
-      fprintf(stderr,"WARNING: Using first %d permutations from %d total in index.\n",P,index.P);
-   }
-   
-   // Process the queries
-   int numqueries = 0;
-   FILE *fptr_qlist = NULL;
-
+// Everything needed to run one query
+typedef struct Query {
+   char type[100];
+   char file[MAXCHAR];
+   int qA, qB;
+   float scorefactor;
+   int hasfactor;
+} Query;
+
+// A query's final matches, kept for the binary match file
+typedef struct QueryMatches {
+   Match *matchlist;
+   int matchcnt;
+   int yOffset;
+} QueryMatches;
+
+// Reads the querylist (or the single -queryfile query); returns the count
+int read_queries( Query **queries )
+{
    if ( singlequery ) {
-      numqueries = 1;
-   } else {
-      numqueries = file_line_count( querylist );
-      assert_file_exist( querylist );
-      fptr_qlist = fopen(querylist,"r");
-      queryfile = (char *) MALLOC( 255*sizeof(char) );
+      Query *q = (Query *) MALLOC( sizeof(Query) );
+      strcpy(q->type, "UNKNOWN");
+      snprintf(q->file, MAXCHAR, "%s", queryfile);
+      q->qA = qA;
+      q->qB = qB;
+      q->scorefactor = 1;
+      q->hasfactor = 0;
+      *queries = q;
+      return 1;
    }
 
-   fprintf(stderr, "\nProcessing %d queries:\n", numqueries);
-
-   for ( int iq = 0; iq < numqueries; iq++ ) {
-      // Initialize the pleb permutations
-      initialize_permute();
+   assert_file_exist( querylist );
+   int numqueries = file_line_count( querylist );
+   Query *q = (Query *) MALLOC( (numqueries+1)*sizeof(Query) );
+   FILE *fptr_qlist = fopen(querylist,"r");
+   int nq = 0;
+   while ( nq < numqueries && 
+	   fscanf(fptr_qlist,"%99s %1023s %d %d",q[nq].type,q[nq].file,&q[nq].qA,&q[nq].qB) == 4 ) {
+      q[nq].scorefactor = 1;
+      q[nq].hasfactor = 0;
+
+      int c = fgetc(fptr_qlist);
+      ungetc(c, fptr_qlist);
+      if ( c != '\n' && c != EOF )
+	 q[nq].hasfactor = ( fscanf(fptr_qlist,"%f",&q[nq].scorefactor) == 1 );
+      nq++;
+   }
+   fclose(fptr_qlist);
 
-      // If not single query, read the query and the query signatures
-      char querytype[100];
-      strcpy(querytype,"UNKNOWN");
-      float scorefactor = 1;
+   *queries = q;
+   return nq;
+}
 
-      if ( !singlequery ) {
-	 fscanf(fptr_qlist,"%s %s %d %d",querytype,queryfile,&qA,&qB);
+// Binary counterpart of dump_matchlist: starts a new group whenever the
+// (file, query, type) triple changes
+void write_matchlist( MatchWriter *mw, char **files, Match *matchlist, int matchcnt, 
+		      frameind *xOffsets, frameind yOffset, char *queryfile, char *querytype )
+{
+   MatchRecord rec;
+   for ( int n = 0; n < matchcnt; n++ ) {
+      int fid = 0;
+      while ( xOffsets[fid++] < matchlist[n].xA );
+      fid-=2;
+
+      if ( !mw->open || strcmp(mw->name1, files[fid]) != 0 || 
+	   strcmp(mw->name2, queryfile) != 0 || strcmp(mw->tag, querytype) != 0 )
+	 matchio_set_names(mw, files[fid], queryfile, querytype);
+
+      rec.ival[0] = matchlist[n].xA-xOffsets[fid];
+      rec.ival[1] = matchlist[n].xB-xOffsets[fid];
+      rec.ival[2] = matchlist[n].yA+yOffset;
+      rec.ival[3] = matchlist[n].yB+yOffset;
+      rec.fval[0] = matchlist[n].score;
+      rec.fval[1] = matchlist[n].rhoampl;
+      matchio_write(mw, &rec);
+   }
+}
 
-	 int c = fgetc(fptr_qlist);
-	 ungetc(c, fptr_qlist);
-	 
-	 if ( c == '\n' )
-	    fprintf(stderr, "\nQuery %d/%d: %s %s %d %d\n", iq+1, numqueries, querytype, queryfile, qA, qB);
-	 else {
-	    fscanf(fptr_qlist,"%f",&scorefactor);
-	    fprintf(stderr, "\nQuery %d/%d: %s %s %d %d %f\n", iq+1, numqueries, querytype, queryfile, qA, qB, scorefactor);
-	 }
-      } else {
-	    fprintf(stderr, "\nQuery %d/%d: %s %s %d %d\n", iq+1, numqueries, querytype, queryfile, qA, qB);
-      }
+// Runs one query against the index, writing matches to out (or handing
+// them back in keep if it is not NULL) and progress to log
+void run_query( struct signature_index *index, frameind *fileranges, Query *q, 
+		int iq, int numqueries, FILE *out, FILE *log, QueryMatches *keep )
+{
+   // Initialize the pleb permutations
+   initialize_permute();
+
+   int qA = q->qA, qB = q->qB;
+   float scorefactor = q->scorefactor;
+   if ( q->hasfactor )
+      fprintf(log, "\nQuery %d/%d: %s %s %d %d %f\n", iq+1, numqueries, q->type, q->file, qA, qB, scorefactor);
+   else
+      fprintf(log, "\nQuery %d/%d: %s %s %d %d\n", iq+1, numqueries, q->type, q->file, qA, qB);
       
-      int Nq = 0;
-      struct signature *queryfeats = (struct signature *)readsigs_file(queryfile, &qA, &qB, &Nq);
+   int Nq = 0;
+   struct signature *queryfeats = (struct signature *)readsigs_file(q->file, &qA, &qB, &Nq);
       
-      // Compute the rotated dot plot
-      unsigned long maxdots = ((unsigned long)P)*B*Nq*(2*D+1);
-      fprintf(stderr,"Computing sparse dot plot (Max Dots = %ld = P*B*Nq*(D+1)) ...\n", maxdots); tic();
+   // Compute the rotated dot plot
+   fprintf(log,"Computing sparse dot plot ...\n"); tic();
       
-      Dot *dotlist = (Dot *) CALLOC(maxdots,sizeof(Dot));
-      unsigned long dotcnt = plebindex( &index, queryfeats, Nq, P, B, T, D, dotlist );
-      unsigned long cslen = dotcnt;
+   DotBuffer dots;
+   dotbuf_init(&dots, 0);
+   unsigned long dotcnt = plebindex( index, queryfeats, Nq, P, B, T, D, &dots );
+   unsigned long cslen = dotcnt+1;
 
-      fprintf(stderr, "    Total elements in thresholded sparse: %ld\n", dotcnt);
-      fprintf(stderr, "Finished: %f sec.\n",toc());
-      
-      // Sort dots by row
-      fprintf(stderr, "Applying radix sort of dotlist: "); tic();
-      DotXV *radixdots = (DotXV *)MALLOC( dotcnt*sizeof(DotXV));
-      frameind *cumsum = (frameind*)CALLOC(cslen,sizeof(frameind));
-      frameind *cumsumind = (frameind*)MALLOC(cslen*sizeof(frameind));
-      int ncumsum = radix_sorty(dotlist, dotcnt, radixdots, cumsum, cumsumind);
-      fprintf(stderr, "%f s\n",toc());
-      
-      // Sort rows by column
-      fprintf(stderr, "Applying qsort of radix bins: "); tic();
-      quick_sortx(radixdots, dotcnt, cumsum, cumsumind, ncumsum);
-      fprintf(stderr, "%f s\n",toc());
+   fprintf(log, "    Total elements in thresholded sparse: %ld\n", dotcnt);
+   fprintf(log, "Finished: %f sec.\n",toc());
       
-      // Remove duplicate dots in each row
-      fprintf(stderr, "Removing duplicate dots from radix bins: "); tic();
-      dotcnt = dot_dedup(radixdots, cumsum, cumsumind, ncumsum, T);
-      fprintf(stderr, "%f s\n",toc());
-      fprintf(stderr, "    Total elements after dedup: %ld\n", dotcnt);
+   // Sort dots by row and column, removing duplicates
+   fprintf(log, "Applying radix sort of dotlist: "); tic();
+   DotXV *radixdots = (DotXV *)MALLOC( cslen*sizeof(DotXV));
+   frameind *cumsum = (frameind*)MALLOC(cslen*sizeof(frameind));
+   frameind *cumsumind = (frameind*)MALLOC(cslen*sizeof(frameind));
+   int ncumsum = radix_sort_dots(&dots, radixdots, cumsum, cumsumind);
+   dotcnt = cumsum[ncumsum];
+   dotbuf_free(&dots);
+   fprintf(log, "%f s\n",toc());
+   fprintf(log, "    Total elements after dedup: %ld\n", dotcnt);
       
-      // Apply the median filter in the X direction
-      fprintf(stderr, "Applying median filter to sparse matrix: "); tic();
-      Dot *dotlist_mf = (Dot *) MALLOC(MAXDOTS_MF*sizeof(Dot));
-      dotcnt = median_filtx(index.Ntot, Nq, radixdots, dotcnt, cumsum, cumsumind, ncumsum, dx, medthr, dotlist_mf);
-      fprintf(stderr, "%f s\n",toc());
-      fprintf(stderr, "    Total elements in filtered sparse: %ld\n", dotcnt);
+   // Apply the median filter in the X direction (output stays bucketed by row)
+   fprintf(log, "Applying median filter to sparse matrix: "); tic();
+   DotXV *radixdots_mf;
+   frameind *cumsum_mf = (frameind*)MALLOC(cslen*sizeof(frameind));
+   frameind *cumsumind_mf = (frameind*)MALLOC(cslen*sizeof(frameind));
+   dotcnt = median_filtx(index->Ntot, Nq, radixdots, dotcnt, cumsum, cumsumind, ncumsum, dx, medthr, 
+			 &radixdots_mf, cumsum_mf, cumsumind_mf, &ncumsum);
+   FREE(cumsum);
+   FREE(cumsumind);
+   cumsum = cumsum_mf;
+   cumsumind = cumsumind_mf;
+   fprintf(log, "%f s\n",toc());
+   fprintf(log, "    Total elements in filtered sparse: %ld\n", dotcnt);
+
+   // Compute the Hough transform
+   fprintf(log,"Computing hough transform: "); tic();
+   float *hough = (float*)MALLOC((dotcnt+1)*(2*dy+1)*sizeof(float));
+   frameind *houghind = (frameind*)MALLOC((dotcnt+1)*(2*dy+1)*sizeof(frameind));
+   int nhough = hough_gaussy(index->Ntot+Nq, dotcnt, cumsum, cumsumind, ncumsum, dy, hough, houghind);
+   fprintf(log, "%f s\n",toc());
       
-      // Sort mf dots by row
-      fprintf(stderr,"Applying radix sort of dotlist_mf: "); tic();
-      DotXV *radixdots_mf = (DotXV *)MALLOC(dotcnt*sizeof(DotXV));
-      memset(cumsum, 0, sizeof(frameind) * cslen);
-      memset(cumsumind, 0, sizeof(frameind) * cslen);
-      ncumsum = radix_sorty(dotlist_mf, dotcnt, radixdots_mf, cumsum, cumsumind);
-      fprintf(stderr, "%f s\n",toc());
-      FREE(dotlist);
+   // Compute rho list
+   fprintf(log, "Computing rholist: "); tic();
+   int rhocnt = count_rholist(hough,houghind,nhough,rhothr);
+   frameind *rholist = (frameind *)MALLOC((rhocnt+1)*sizeof(frameind));
+   float *rhoampl = (float *)MALLOC((rhocnt+1)*sizeof(float));
+   rhocnt = compute_rholist(hough,houghind,nhough,rhothr,rholist,rhoampl);
+   fprintf(log, "%f s\n",toc());
+
+   // Compute the matchlist
+   fprintf(log, "Computing matchlist: "); tic();
+   Match * matchlist = (Match*) MALLOC(MAXMATCHES*sizeof(Match));
+   int matchcnt = compute_matchlist_sparse( index->Ntot, Nq, radixdots_mf, dotcnt, 
+					    cumsum, cumsumind, ncumsum,
+					    rholist, rhoampl, rhocnt, dx, dy, matchlist );
+   fprintf(log, "%f s\n",toc());
       
-      // Sort mf rows by column
-      fprintf(stderr,"Applying qsort of radix_mf bins: "); tic();
-      quick_sortx(radixdots_mf, dotcnt, cumsum, cumsumind, ncumsum);
-      fprintf(stderr, "%f s\n",toc());
-
-      // Compute the Hough transform
-      fprintf(stderr,"Computing hough transform: "); tic();
-      float *hough = (float*)MALLOC(dotcnt*(2*dy+1)*sizeof(float));
-      frameind *houghind = (frameind*)MALLOC(dotcnt*(2*dy+1)*sizeof(frameind));
-      int nhough = hough_gaussy(index.Ntot+Nq, dotcnt, cumsum, cumsumind, ncumsum, dy, hough, houghind);
-      fprintf(stderr, "%f s\n",toc());
+   int lastmc = matchcnt;
+   fprintf(log,"    Found %d matches in first pass\n",lastmc);
       
-      // Compute rho list
-      fprintf(stderr, "Computing rholist: "); tic();
-      int rhocnt = count_rholist(hough,houghind,nhough,rhothr);
-      frameind *rholist = (frameind *)MALLOC(rhocnt*sizeof(frameind));
-      float *rhoampl = (float *)MALLOC(rhocnt*sizeof(float));
-      rhocnt = compute_rholist(hough,houghind,nhough,rhothr,rholist,rhoampl);
-      fprintf(stderr, "%f s\n",toc());
-
-      // Compute the matchlist
-      fprintf(stderr, "Computing matchlist: "); tic();
-      Match * matchlist = (Match*) MALLOC(MAXMATCHES*sizeof(Match));
-      int matchcnt = compute_matchlist_sparse( index.Ntot, Nq, radixdots_mf, dotcnt, 
-					       cumsum, cumsumind, ncumsum,
-					       rholist, rhoampl, rhocnt, dx, dy, matchlist );
-      fprintf(stderr, "%f s\n",toc());
-      
-      int lastmc = matchcnt;
-      fprintf(stderr,"    Found %d matches in first pass\n",lastmc);
-      
-      fprintf(stderr, "Filtering by first-pass duration: "); tic();
-      lastmc = duration_filter(matchlist, lastmc, 0.);
-      fprintf(stderr, "%f s\n",toc());
-      fprintf(stderr,"    %d matches left after duration filter\n",lastmc);
+   fprintf(log, "Filtering by first-pass duration: "); tic();
+   lastmc = duration_filter(matchlist, lastmc, 0.);
+   fprintf(log, "%f s\n",toc());
+   fprintf(log,"    %d matches left after duration filter\n",lastmc);
       
       
-      // Run the second pass DTW search
-      if ( twopass ) {
-	 if ( submatch ) {
-	    fprintf(stderr, "Applying submatch second pass: "); tic();
-	    sig_secondpass(matchlist, lastmc, index.allfeats, (int) index.Ntot, queryfeats, Nq, R, castthr, trimthr);
-	    fprintf(stderr, "%f s\n",toc());
-	 } else {
-	    fprintf(stderr, "Applying kws second pass: "); tic();
-	    sig_kwspass(matchlist, lastmc, index.allfeats, index.Ntot, queryfeats, Nq, R);
-	    fprintf(stderr, "%f s\n",toc());
-	 }
-	 
-	 fprintf(stderr, "Filtering by second-pass duration: "); tic();
-	 lastmc = duration_filter(matchlist, lastmc, 0.);
-	 fprintf(stderr, "%f s\n",toc());
-	 fprintf(stderr,"    %d matches left after duration filter\n",lastmc);      
+   // Run the second pass DTW search
+   if ( twopass ) {
+      if ( submatch ) {
+	 fprintf(log, "Applying submatch second pass: "); tic();
+	 sig_secondpass(matchlist, lastmc, index->allfeats, (int) index->Ntot, queryfeats, Nq, R, castthr, trimthr);
+	 fprintf(log, "%f s\n",toc());
+      } else {
+	 fprintf(log, "Applying kws second pass: "); tic();
+	 sig_kwspass(matchlist, lastmc, index->allfeats, index->Ntot, queryfeats, Nq, R);
+	 fprintf(log, "%f s\n",toc());
       }
+	 
+      fprintf(log, "Filtering by second-pass duration: "); tic();
+      lastmc = duration_filter(matchlist, lastmc, 0.);
+      fprintf(log, "%f s\n",toc());
+      fprintf(log,"    %d matches left after duration filter\n",lastmc);      
+   }
       
-      // Score the matches
-      fprintf(stderr, "Computing scores: "); tic();
-      for ( int n = 0; n < lastmc; n++ )
-      {
+   // Score the matches
+   fprintf(log, "Computing scores: "); tic();
+   bool *isdot = dtwscore ? NULL : dot_table(Tscore);
+   for ( int n = 0; n < lastmc; n++ )
+   {
+      if ( scorefactor > 0 )
+	 matchlist[n].rhoampl = scorefactor;
+      if ( dtwscore ) {
 	 matchlist[n].score = 1.0 - 
-	    dtw_score(index.allfeats, queryfeats, index.Ntot, Nq,  
+	    dtw_score(index->allfeats, queryfeats, index->Ntot, Nq,  
 		      matchlist[n].xA, matchlist[n].xB, 
-		      matchlist[n].yA, matchlist[n].yB );
-	 if ( scorefactor > 0 )
-	    matchlist[n].rhoampl = scorefactor;
-	 if ( !dtwscore ) {
-	    int totdots;
-	    int pathcnt;
-	    int dotvec[20];
-	    score_match( index.allfeats, queryfeats, index.Ntot, Nq, 
-			 matchlist[n].xA, matchlist[n].xB, matchlist[n].yA, 
-			 matchlist[n].yB, Tscore, &pathcnt, &totdots, dotvec);
-	    matchlist[n].score = logreg_score_ken( totdots, pathcnt, dotvec );
-	 }
+		      matchlist[n].yA, matchlist[n].yB, dtwband, 1-dtwthr );
+      } else {
+	 int totdots;
+	 int pathcnt;
+	 int dotvec[20];
+	 score_match( index->allfeats, queryfeats, index->Ntot, Nq, 
+		      matchlist[n].xA, matchlist[n].xB, matchlist[n].yA, 
+		      matchlist[n].yB, isdot, &pathcnt, &totdots, dotvec);
+	 matchlist[n].score = logreg_score_ken( totdots, pathcnt, dotvec );
       }
-      fprintf(stderr, "%f s\n",toc());
+   }
+   if ( isdot ) FREE(isdot);
+   fprintf(log, "%f s\n",toc());
       
-      fprintf(stderr,"    Dumping %d matches\n",lastmc);
-      dump_matchlist(index.files, matchlist, lastmc, fileranges, 
-		     qA, queryfile, querytype);
+   fprintf(log,"    Dumping %d matches\n",lastmc);
+   if ( keep ) {
+      // Kept until the earlier queries are written, so only lastmc entries
+      keep->matchlist = (Match *) MALLOC( MAX(lastmc,1)*sizeof(Match) );
+      memcpy(keep->matchlist, matchlist, lastmc*sizeof(Match));
+      keep->matchcnt = lastmc;
+      keep->yOffset = qA;
+   } else {
+      dump_matchlist(out, index->files, matchlist, lastmc, fileranges, 
+		     qA, q->file, q->type);
+   }
 
-      // Free the query-specific heap
-      free_signatures(queryfeats,Nq);
+   // Free the query-specific heap
+   free_signatures(queryfeats,Nq);
       
-      FREE(radixdots);
-      FREE(cumsum);
-      FREE(cumsumind);
-      FREE(dotlist_mf);
-      FREE(radixdots_mf);
+   FREE(radixdots);
+   FREE(cumsum);
+   FREE(cumsumind);
+   FREE(radixdots_mf);
       
-      FREE(hough);
-      FREE(houghind);
+   FREE(hough);
+   FREE(houghind);
       
-      FREE(rholist);
-      FREE(rhoampl);
-      FREE(matchlist);
-   }
+   FREE(rholist);
+   FREE(rhoampl);
+   FREE(matchlist);
+}
 
-   if ( !singlequery ) {
-      fclose(fptr_qlist);
-      FREE(queryfile);
-   }
+// Writes a query's kept matches to the binary match file and frees them
+void flush_matches( MatchWriter *mw, struct signature_index *index, frameind *fileranges, 
+		    Query *q, QueryMatches *keep )
+{
+   write_matchlist(mw, index->files, keep->matchlist, keep->matchcnt, fileranges, 
+		   keep->yOffset, q->file, q->type);
+   FREE(keep->matchlist);
+}
 
+// Output and log of a query, buffered in memory until it is written out
+typedef struct QueryOutput {
+   char *out, *log;
+   size_t outlen, loglen;
+   int done;
+} QueryOutput;
 
-   fprintf(stderr, "Freeing index: "); tic();
-   // Free the index
-   FREE(index.Nchars);
-   for ( int i = 0; i < index.Nfiles; i++ ) {
-      FREE(index.files[i]);
-   }
-   FREE(index.files);
+// Writes a finished query's buffered output to dst and frees it
+void flush_query( char *buf, size_t len, FILE *dst )
+{
+   fwrite(buf, 1, len, dst);
+   free(buf);
+   fflush(dst);
+}
+
+int main(int argc, char **argv)
+{ 
+   parse_args(argc, argv);
+
+#ifdef _OPENMP
+   if ( nthreads > 0 ) omp_set_num_threads(nthreads);
+#endif
+
+   // Read the index
+   tic();
+   assert_file_exist( indexfile );
+   struct signature_index index;
+   read_index(indexfile, P, &index);
    
-   FREE(index.Narr);
+   frameind *fileranges = (frameind*)MALLOC((index.Nfiles+1)*sizeof(frameind));
+   make_cumhist( fileranges, index.Narr, index.Nfiles );
    
-   for ( int i = 0; i < index.Ntot; i++ ) {
-      FREE(index.allfeats[i].byte_);
+   fprintf(stderr, " (Load time: %f sec)\n",toc());
+   if ( P < index.P ) {
+      fprintf(stderr,"WARNING: Using first %d permutations from %d total in index.\n",P,index.P);
    }
-   FREE(index.allfeats);
    
-   for ( int i = 0; i < P; i++ ) {
-      FREE(index.PERMUTE[i]);
-      FREE(index.order[i]);
+   // Process the queries
+   Query *queries;
+   int numqueries = read_queries( &queries );
+
+   fprintf(stderr, "\nProcessing %d queries:\n", numqueries);
+
+   // The index is read-only, so queries run concurrently. Each worker
+   // buffers a query's output and log in memory (no file descriptors, so
+   // a slow early query does not pile up open files), and finished
+   // queries are written out in query order.
+   int nworkers = 1;
+#ifdef _OPENMP
+   nworkers = omp_get_max_threads();
+#endif
+   int buffered = ( nworkers > 1 && numqueries > 1 );
+   QueryOutput *outputs = (QueryOutput *) CALLOC( numqueries+1, sizeof(QueryOutput) );
+   int nextq = 0;
+
+   MatchWriter mw;
+   QueryMatches *kept = NULL;
+   if ( matchfile ) {
+      matchio_open_write(&mw, matchfile, MATCH_LAYOUT_KWS, 4, 2);
+      kept = (QueryMatches *) CALLOC( numqueries+1, sizeof(QueryMatches) );
    }
-   FREE(index.PERMUTE);
-   FREE(index.order);
+
+#pragma omp parallel for schedule(dynamic,1) if(buffered)
+   for ( int iq = 0; iq < numqueries; iq++ ) {
+      FILE *out = stdout, *log = stderr;
+      QueryOutput *qo = &outputs[iq];
+      if ( buffered ) {
+	 out = open_memstream(&qo->out, &qo->outlen);
+	 log = open_memstream(&qo->log, &qo->loglen);
+	 if ( !out || !log ) fatal("\nERROR: cannot create query buffers");
+      }
+
+      QueryMatches *keep = kept ? &kept[iq] : NULL;
+      run_query( &index, fileranges, &queries[iq], iq, numqueries, out, log, keep );
+
+      if ( buffered ) {
+	 fclose(out);
+	 fclose(log);
+#pragma omp critical (flush)
+	 {
+	    qo->done = 1;
+	    while ( nextq < numqueries && outputs[nextq].done ) {
+	       flush_query(outputs[nextq].log, outputs[nextq].loglen, stderr);
+	       flush_query(outputs[nextq].out, outputs[nextq].outlen, stdout);
+	       if ( kept )
+		  flush_matches(&mw, &index, fileranges, &queries[nextq], &kept[nextq]);
+	       nextq++;
+	    }
+	 }
+      } else if ( keep ) {
+	 flush_matches(&mw, &index, fileranges, &queries[iq], keep);
+      }
+   }
+
+   if ( matchfile ) {
+      matchio_close_write(&mw);
+      FREE(kept);
+   }
+   FREE(outputs);
+   FREE(queries);
+
+   fprintf(stderr, "Freeing index: "); tic();
+   // Free the index
+   free_index(&index, P);
    FREE(fileranges);
 
    fprintf(stderr, "%f s\n",toc());
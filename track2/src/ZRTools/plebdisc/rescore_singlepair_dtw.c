@@ -6,33 +6,22 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
-#include <limits.h>
 #include "util.h"
-#include "icsilog.h"
+#include "dtw.h"
+#include "matchio.h"
 
-#define MAXCOST 1e10
-#define MAXFRAMES 500
 #define MAXCHAR 200
 
 char *matchlist = NULL;
 char *file1 = NULL;
 char *file2 = NULL;
-float simmx[MAXFRAMES*MAXFRAMES];
-float costmx[MAXFRAMES*MAXFRAMES];
-int aacntmx[MAXFRAMES*MAXFRAMES];
-int lenmx[MAXFRAMES*MAXFRAMES];
+char *matchfile = NULL;
 int D = 39;
-int maxrun = INT_MAX;
-int kldiv = 0;
-int sym = 0;
-int wmvn = 0;
-float *LOOKUP_TABLE = NULL;
-int nbits_log = 14;
-int sakoe = 0;
+DtwParams dtwp;
 
 void usage()
 {
-  printf("usage: univ_rescore_dtw -matchlist <str> (REQUIRED)]\
+  printf("usage: univ_rescore_dtw -matchlist <str> (text or binary match file, REQUIRED)]\
 \n\t[-file1 <str> (REQUIRED)]\
 \n\t[-file2 <str> (REQUIRED)]\
 \n\t[-D <n> (defaults to 39)]\
@@ -40,7 +29,8 @@ void usage()
 \n\t[-sakoe <n> (defaults to 0)]\
 \n\t[-kldiv <n> (defaults to 0=cosine)]\
 \n\t[-sym <n> (defaults to 0=not symmetrized)]\
-\n\t[-wmvn <n> (defaults to 0=not word-level mvn)]\n");
+\n\t[-wmvn <n> (defaults to 0=not word-level mvn)]\
+\n\t[-matchfile <str> (write a binary match file instead of text)]\n");
 }
 
 void parse_args(int argc, char **argv)
@@ -52,11 +42,12 @@ void parse_args(int argc, char **argv)
      else if ( strcmp(argv[i], "-file1") == 0 ) file1 = argv[++i];
      else if ( strcmp(argv[i], "-file2") == 0 ) file2 = argv[++i];
      else if ( strcmp(argv[i], "-D") == 0 ) D = atoi(argv[++i]);
-     else if ( strcmp(argv[i], "-maxrun") == 0 ) maxrun = atoi(argv[++i]);
-     else if ( strcmp(argv[i], "-sakoe") == 0 ) sakoe = atoi(argv[++i]);
-     else if ( strcmp(argv[i], "-kldiv") == 0 ) kldiv = atoi(argv[++i]);
-     else if ( strcmp(argv[i], "-sym") == 0 ) sym = atoi(argv[++i]);
-     else if ( strcmp(argv[i], "-wmvn") == 0 ) wmvn = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-maxrun") == 0 ) dtwp.maxrun = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-sakoe") == 0 ) dtwp.sakoe = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-kldiv") == 0 ) dtwp.kldiv = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-sym") == 0 ) dtwp.sym = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-wmvn") == 0 ) dtwp.wmvn = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-matchfile") == 0 ) matchfile = argv[++i];
      else {
        fprintf(stderr, "unknown arg: %s\n", argv[i]);
        usage();
@@ -80,201 +71,125 @@ void parse_args(int argc, char **argv)
 
 }
 
-float dtw( float *X1, int N1, float *X2, int N2, int D )
-{  
-   float norm1[D][2];
-   float norm2[D][2];
-   for ( int d = 0; d < D; d++ ) {
-      norm1[d][0] = 0;
-      norm1[d][1] = 1;
-      norm2[d][0] = 0;
-      norm2[d][1] = 1;
-   }
-   
-   if ( wmvn ) {
-      for ( int d = 0; d < D; d++ ) {
-	 norm1[d][1] = 0;
-	 for ( int j = 0; j < N1; j++ ) {
-	    float f = X1[j*D+d];
-	    norm1[d][0] += f;
-	    norm1[d][1] += f*f;
-	 }
-	 norm1[d][0] = norm1[d][0]/N1;
-	 norm1[d][1] = sqrt(norm1[d][1]/N1 - norm1[d][0]*norm1[d][0]);
-
-	 norm2[d][1] = 0;
-	 for ( int j = 0; j < N2; j++ ) {
-	    float f = X2[j*D+d];
-	    norm2[d][0] += f;
-	    norm2[d][1] += f*f;
-	 }
-	 norm2[d][0] = norm2[d][0]/N2;
-	 norm2[d][1] = sqrt(norm2[d][1]/N2 - norm2[d][0]*norm2[d][0]);
+// Base name of a feature file: last path component up to the first '.'
+// (the group names plebdisc writes)
+void file_base( char *path, char *base )
+{
+   char *start = strrchr(path, '/');
+   start = start ? start+1 : path;
+   int len = MIN((int) strcspn(start, "."), MATCHIO_MAXNAME-1);
+   memcpy(base, start, len);
+   base[len] = '\0';
+}
 
-      }
+// Reads the records of a binary match file (plebdisc layout) that belong
+// to the group of base1 and base2; a file of a single group is read
+// whatever its names. Returns the count; name1 and name2 receive the
+// names of the group.
+int read_binary_matchlist( char *fn, MatchRecord **recs, char *base1, char *base2,
+			   char *name1, char *name2 )
+{
+   MatchReader r;
+   matchio_open_read(&r, fn);
+   if ( r.layout != MATCH_LAYOUT_PAIR || r.nflt < 2 )
+      fatal("ERROR: matchlist is not a plebdisc match file\n");
+
+   // Count the groups and look for the one of file1 and file2
+   MatchBlock blk;
+   matchio_block_init(&blk);
+   int ngroups = 0, found = 0;
+   while ( matchio_read_block(&r, &blk) ) {
+      if ( blk.cont ) continue;
+      ngroups++;
+      if ( strcmp(blk.name1, base1) == 0 && strcmp(blk.name2, base2) == 0 )
+	 found = 1;
    }
-
-   if ( kldiv ) {
-      if ( sym ) {
-	 for ( int i = 0; i < N1; i++ ) {
-	    for ( int j = 0; j < N2; j++ ) {
-	       simmx[i*N2+j] = 0;
-	       for ( int d = 0; d < D; d++ ) {
-		  simmx[i*N2+j] += 
-		     0.5*X1[i*D+d]*icsi_log(X1[i*D+d]/X2[j*D+d],
-					LOOKUP_TABLE,nbits_log) +
-		     0.5*X2[j*D+d]*icsi_log(X2[j*D+d]/X1[i*D+d],
-					LOOKUP_TABLE,nbits_log);
-	       }
-	    }
-	 } 
-      } else {
-	 for ( int i = 0; i < N1; i++ ) {
-	    for ( int j = 0; j < N2; j++ ) {
-	       simmx[i*N2+j] = 0;
-	       for ( int d = 0; d < D; d++ ) {
-		  simmx[i*N2+j] += 
-		     X1[i*D+d]*icsi_log(X1[i*D+d]/X2[j*D+d],
-					LOOKUP_TABLE,nbits_log);
-	       }
-	    }
-	 } 
-      }
-   } else {
-      for ( int i = 0; i < N1; i++ ) {
-	 for ( int j = 0; j < N2; j++ ) {
-	    float lenx = 0;
-	    float leny = 0;
-	    simmx[i*N2+j] = 0;
-	    for ( int d = 0; d < D; d++ ) {
-	       float x = (X1[i*D+d]-norm1[d][0])/norm1[d][1];
-	       float y = (X2[j*D+d]-norm2[d][0])/norm2[d][1];
-	       simmx[i*N2+j] += x*y;
-	       lenx += x*x;
-	       leny += y*y;
-	    }
-	    simmx[i*N2+j] = 1-simmx[i*N2+j]/sqrt(lenx*leny);
-	 }
-      } 
+   matchio_close_read(&r);
+   if ( !found && ngroups > 1 ) {
+      fprintf(stderr, "ERROR: %s holds %d file pairs, none of them %s %s\n", 
+	      fn, ngroups, base1, base2);
+      exit(1);
    }
 
-   N1++;
-   N2++;
-   for ( int i = 0; i < N1; i++ ) {
-      for ( int j = 0; j < N2; j++ ) {
-	 aacntmx[i*N2+j] = 0;
-	 costmx[i*N2+j] = 0;
-	 lenmx[i*N2+j] = 0;
+   matchio_open_read(&r, fn);
+   int n = 0, cap = 1024, keep = 0;
+   *recs = (MatchRecord *) MALLOC( cap*sizeof(MatchRecord) );
+   while ( matchio_read_block(&r, &blk) ) {
+      if ( !blk.cont )
+	 keep = !found || ( strcmp(blk.name1, base1) == 0 && strcmp(blk.name2, base2) == 0 );
+      if ( !keep ) continue;
+      if ( n + blk.nrec > cap ) {
+	 cap = MAX(2*cap, n + blk.nrec);
+	 MatchRecord *grown = (MatchRecord *) MALLOC( cap*sizeof(MatchRecord) );
+	 memcpy(grown, *recs, n*sizeof(MatchRecord));
+	 FREE(*recs);
+	 *recs = grown;
       }
+      memcpy(*recs + n, blk.recs, blk.nrec*sizeof(MatchRecord));
+      n += blk.nrec;
+      strcpy(name1, blk.name1);
+      strcpy(name2, blk.name2);
    }
+   matchio_block_free(&blk);
+   matchio_close_read(&r);
 
-   for ( int i = 0; i < N1; i++ ) {
-      aacntmx[i*N2] = i;
-      lenmx[i*N2] = i;
-      if ( i == 0 )
-	 costmx[i*N2] = 0;
-      else 
-	 costmx[i*N2] = MAXCOST;
-   }
-
-   for ( int j = 0; j < N2; j++ ) {
-      aacntmx[j] = j;
-      lenmx[j] = j;
-      if ( j == 0 )
-	 costmx[j] = 0;      
-      else
-	 costmx[j] = MAXCOST;
-   }
-
-   if ( !sakoe ) {
-      for ( int i = 1; i < N1; i++ ) {
-	 for ( int j = 1; j < N2; j++ ) {
-	    float dcost = costmx[(i-1)*N2+(j-1)] + simmx[(i-1)*(N2-1)+j-1];
-	    float vcost = costmx[(i-1)*N2+j] + simmx[(i-1)*(N2-1)+j-1];
-	    float hcost = costmx[i*N2+(j-1)] + simmx[(i-1)*(N2-1)+j-1];
-	    
-	    if ( aacntmx[(i-1)*N2+j] + 1 >= maxrun )
-	       vcost = MAXCOST;
-	    
-	    if ( aacntmx[i*N2+(j-1)] + 1 >= maxrun )
-	       hcost = MAXCOST;
-	    
-	    costmx[i*N2+j] = MIN( dcost, MIN(vcost, hcost) );
-	    
-	    if ( dcost <= vcost && dcost <= hcost ) {
-	       lenmx[i*N2+j] = lenmx[(i-1)*N2+(j-1)] + 1;
-	    } else if ( vcost <= hcost ) {
-	       lenmx[i*N2+j] = lenmx[(i-1)*N2+j] + 1;
-	    } else {
-	       lenmx[i*N2+j] = lenmx[i*N2+(j-1)] + 1;
-	    }
-	    
-	    if ( vcost < dcost || hcost < dcost ) {
-	       if ( vcost < hcost ) {
-		  aacntmx[i*N2+j] = aacntmx[(i-1)*N2+j] + 1;
-	       } else {
-		  aacntmx[i*N2+j] = aacntmx[i*N2+(j-1)] + 1;
-	       }
-	    } 
-	 }
-      } 
-   } else {
-      for ( int i = 1; i < N1; i++ ) {
-	 for ( int j = 1; j < N2; j++ ) {
-	    if ( i == 1 || j == 1 ) {
-	       float dcost = costmx[(i-1)*N2+(j-1)] + simmx[(i-1)*(N2-1)+j-1];
-	       float vcost = costmx[(i-1)*N2+j] + simmx[(i-1)*(N2-1)+j-1];
-	       float hcost = costmx[i*N2+(j-1)] + simmx[(i-1)*(N2-1)+j-1];
-	       
-	       costmx[i*N2+j] = MIN( dcost, MIN(vcost, hcost) );
-	    } else {
-	       float dcost = costmx[(i-1)*N2+(j-1)] + 2*simmx[(i-1)*(N2-1)+j-1];
-	       float vcost = costmx[(i-2)*N2+(j-1)] + 2*simmx[(i-2)*N2+(j-1)] 
-		  + simmx[(i-1)*(N2-1)+j-1];
-	       float hcost = costmx[(i-1)*N2+(j-2)] + 2*simmx[(i-1)*N2+(j-2)] + 
-		  simmx[(i-1)*(N2-1)+j-1];
-	       
-	       costmx[i*N2+j] = MIN( dcost, MIN(vcost, hcost) );
-	    }
-	 }
-      } 
-   }
-
-   return costmx[N1*N2-1]/(N1+N2-2);
+   return n;
 }
 
 int main(int argc, char **argv)
 { 
+   dtw_params_init(&dtwp);
    parse_args(argc, argv);
 
-   LOOKUP_TABLE = (float*) MALLOC(((int) pow(2,nbits_log))*sizeof(float));
-   fill_icsi_log_table(nbits_log,LOOKUP_TABLE); 
-
-   int Nmatch = file_line_count( matchlist );
+   assert_file_exist( matchlist );
+   int binary = matchio_is_binary( matchlist );
+   MatchRecord *recs = NULL;
+   char name1[MATCHIO_MAXNAME] = "", name2[MATCHIO_MAXNAME] = "";
+
+   int Nmatch;
+   if ( binary ) {
+      char base1[MATCHIO_MAXNAME], base2[MATCHIO_MAXNAME];
+      file_base( file1, base1 );
+      file_base( file2, base2 );
+      Nmatch = read_binary_matchlist( matchlist, &recs, base1, base2, name1, name2 );
+   }
+   else
+      Nmatch = file_line_count( matchlist );
    fprintf(stderr,"Total matches to rescore: %d\n",  Nmatch);
 
    // Read in the matchlist
    fprintf(stderr,"Reading matchlist: "); tic();
 
-   int *xA = (int *) MALLOC( Nmatch*sizeof(int) );
-   int *xB = (int *) MALLOC( Nmatch*sizeof(int) );
-   int *yA = (int *) MALLOC( Nmatch*sizeof(int) );
-   int *yB = (int *) MALLOC( Nmatch*sizeof(int) );
+   int *xA = (int *) MALLOC( MAX(Nmatch,1)*sizeof(int) );
+   int *xB = (int *) MALLOC( MAX(Nmatch,1)*sizeof(int) );
+   int *yA = (int *) MALLOC( MAX(Nmatch,1)*sizeof(int) );
+   int *yB = (int *) MALLOC( MAX(Nmatch,1)*sizeof(int) );
 
-   float *oldscore = (float *) MALLOC( Nmatch*sizeof(float) );
-   float *rho = (float *) MALLOC( Nmatch*sizeof(float) );
+   float *oldscore = (float *) MALLOC( MAX(Nmatch,1)*sizeof(float) );
+   float *rho = (float *) MALLOC( MAX(Nmatch,1)*sizeof(float) );
    
-   assert_file_exist( matchlist );
-   FILE *fptr = fopen(matchlist, "r");
-   int wcnt = 0;
-
-   while ( wcnt < Nmatch && 
-	   fscanf(fptr, "%d%d%d%d%f%f",
-		  &xA[wcnt], &xB[wcnt], &yA[wcnt], &yB[wcnt],
-		  &oldscore[wcnt], &rho[wcnt]) != EOF ) {
-      wcnt++;
+   if ( binary ) {
+      for ( int i = 0; i < Nmatch; i++ ) {
+	 xA[i] = recs[i].ival[0];
+	 xB[i] = recs[i].ival[1];
+	 yA[i] = recs[i].ival[2];
+	 yB[i] = recs[i].ival[3];
+	 oldscore[i] = recs[i].fval[0];
+	 rho[i] = recs[i].fval[1];
+      }
+      FREE(recs);
+   } else {
+      FILE *fptr = fopen(matchlist, "r");
+      int wcnt = 0;
+
+      while ( wcnt < Nmatch && 
+	      fscanf(fptr, "%d%d%d%d%f%f",
+		     &xA[wcnt], &xB[wcnt], &yA[wcnt], &yB[wcnt],
+		     &oldscore[wcnt], &rho[wcnt]) != EOF ) {
+	 wcnt++;
+      }
+      fclose(fptr);
    }
-   fclose(fptr);
    fprintf(stderr, "%f s\n",toc());
 
    // Read in the features
@@ -297,32 +212,32 @@ int main(int argc, char **argv)
 
    // Rescore the matches
    fprintf(stderr,"Rescoring the matchfile: %s\n", matchlist); tic();
+   DtwScratch ws;
+   dtw_scratch_init(&ws);
+   MatchWriter mw;
+   if ( matchfile ) {
+      matchio_open_write(&mw, matchfile, MATCH_LAYOUT_PAIR, 4, 3);
+      matchio_set_names(&mw, name1, name2, NULL);
+   }
    for ( int i = 0; i < Nmatch; i++ ) {
-      
-      xA[i] = MAX(xA[i],1);
-      yA[i] = MAX(yA[i],1);
-
-      if (xB[i] > N1+5) continue;
-
-      int dur1 = MIN(N1-xA[i]+1, xB[i]-xA[i]+1);
-      int dur2 = MIN(N2-yA[i]+1, yB[i]-yA[i]+1);
-
-      if ( dur1 > MAXFRAMES-1 || dur2 > MAXFRAMES-1 )
-	 continue;
-
-
-      float dtwdist = dtw( &feats1[(xA[i]-1)*D], dur1, 
-			   &feats2[(yA[i]-1)*D], dur2, D );      
-
-      if ( !kldiv && dtwdist > 2 ) continue;
-
-      if ( kldiv ) dtwdist /= 10;
-
-      printf("%d %d %d %d %f %f %f\n", 
-	     xA[i], xB[i], 
-	     yA[i], yB[i], 1-dtwdist/2, rho[i], oldscore[i]);      	 
+      // Match frames are 0-based, as plebdisc writes them
+      float sim = rescore_match( feats1, N1, feats2, N2, D, 
+				 xA[i], xB[i], yA[i], yB[i], &dtwp, &ws );
+      if ( isnan(sim) ) continue;
+
+      if ( matchfile ) {
+	 MatchRecord rec = { { xA[i], xB[i], yA[i], yB[i] }, 
+			     { sim, rho[i], oldscore[i] } };
+	 matchio_write(&mw, &rec);
+      } else {
+	 printf("%d %d %d %d %f %f %f\n", 
+		xA[i], xB[i], 
+		yA[i], yB[i], sim, rho[i], oldscore[i]);      	 
+      }
    }
    fprintf(stderr, " %f s\n",toc());
+   dtw_scratch_free(&ws);
+   if ( matchfile ) matchio_close_write(&mw);
    
    // FREE everything that was malloc-d
    FREE(feats1);
@@ -336,7 +251,7 @@ int main(int argc, char **argv)
    FREE(oldscore);
    FREE(rho);
 
-   FREE(LOOKUP_TABLE);
+   dtw_params_free(&dtwp);
 
    return 0;
 }
@@ -13,43 +13,6 @@
 #include "score_matches.h"
 
 #define MAXLINE 1024
-#define EMPTY 255
-
-inline int dot(struct signature *sig1, struct signature *sig2, float thr)
-{
-   return (approximate_cosine(sig1,sig2) > thr);
-}
-
-int dist1(int i, int j, int start1, int start2, int n1, int n2, struct signature *feats1, struct signature *feats2, int N1, int N2, float thr, unsigned char *distances)
-{
-  if(i >= n1 || j >= n2) return 0;
-  int ii = start1 + i;
-  int jj = start2 + j;
-  unsigned char *d = &distances[j * n1 + i];
-  if(*d != EMPTY) return *d;
-  unsigned char d0 = dot(&feats1[ii], &feats2[jj], thr) + dist1(i+1, j+1, start1, start2, n1, n2, feats1, feats2, N1, N2, thr, distances);
-  unsigned char d1 = dist1(i, j+1, start1, start2, n1, n2, feats1, feats2, N1, N2, thr, distances );
-  unsigned char d2 = dist1(i+1, j, start1, start2, n1, n2, feats1, feats2, N1, N2, thr, distances);
-  *d=0;
-  if(d0 > *d) *d=d0;
-  if(d1 > *d) *d=d1;
-  if(d2 > *d) *d=d2;
-  return *d;
-}
-
-int dist(struct signature *feats1, struct signature *feats2, int start1, int end1, int start2, int end2, int N1, int N2, float thr )
-{
-  int n1 = end1-start1;
-  int n2 = end2-start2;
-  unsigned char *distances = (unsigned char *)MALLOC(sizeof(unsigned char) * n1 * n2);
-  if(!distances) fatal("malloc failed");
-  for ( int i = 0; i < n1*n2; i++ ) {
-     distances[i] = EMPTY;
-  }
-  int result = dist1(0, 0, start1, start2, n1, n2, feats1, feats2, N1, N2, thr, distances);
-  FREE(distances);
-  return result;
-}
 
 double pointdist(int x0, int y0, int x1, int y1, int x2, int y2)
 {
@@ -71,67 +34,138 @@ int getbin(int x0, int y0, int n1, int n2)
   return bin;
 }
 
+bool *dot_table(float T)
+{
+   int nbits = 8*SIG_NUM_BYTES;
+   bool *isdot = (bool *)MALLOC(sizeof(bool) * (nbits+1));
+   for ( int h = 0; h <= nbits; h++ )
+      isdot[h] = ( COSINE_[h] > T );
+   return isdot;
+}
+
+// Length of the longest monotone path of dots through the rectangle
+// [start1,end1) x [start2,end2), and the histogram of its dots over the
+// NBINS distance bins from the diagonal. The path length is the LCS of the
+// two segments under the dot relation, computed one feats2 frame at a time
+// with the bit-parallel update V = (V + (V & M)) | (V & ~M) over feats1.
 void score_match(struct signature *feats1, struct signature *feats2, 
-		 int N1, int N2, int start1, int end1, int start2, int end2, float T, 
-		 int *d, int *dots, int *bins)
+		 int N1, int N2, int start1, int end1, int start2, int end2, 
+		 const bool *isdot, int *d, int *dots, int *bins)
 {
    memset(bins, 0, NBINS*sizeof(int));
 
-   if (end1 - start1 >= EMPTY ) end1 = start1+EMPTY-1;
-   if (end2 - start2 >= EMPTY ) end2 = start2+EMPTY-1;
-
    int n1 = end1 - start1;
    int n2 = end2 - start2;
 
-
-   *d = dist(feats1, feats2, start1, end1, start2, end2, N1-1, N2-1, T );
+   *d = 0;
    *dots = 0;
-
-   int i,j;
-   for ( j = end2-1; j >= start2; j-- ) {
-      for ( i = start1; i < end1; i++ ) {	 
-	 if ( dot(&feats1[i], &feats2[j], T) ) {
-	    bins[getbin(i-start1,j-start2,n1,n2)]++;
+   if ( n1 <= 0 || n2 <= 0 )
+      return;
+
+   int nw = (n1+63)/64;
+   uint64_t *V = (uint64_t *)MALLOC(sizeof(uint64_t) * nw);
+   uint64_t *M = (uint64_t *)MALLOC(sizeof(uint64_t) * nw);
+   int *dist = (int *)MALLOC(sizeof(int) * n1);
+   for ( int w = 0; w < nw; w++ )
+      V[w] = ~(uint64_t)0;
+
+   for ( int j = 0; j < n2; j++ ) {
+      hamming_run(feats2+start2+j, feats1+start1, 1, n1, dist);
+      memset(M, 0, sizeof(uint64_t) * nw);
+      for ( int i = 0; i < n1; i++ ) {
+	 if ( isdot[dist[i]] ) {
+	    M[i/64] |= (uint64_t)1 << (i%64);
+	    bins[getbin(i,j,n1,n2)]++;
 	    (*dots)++;
 	 }
       }
+
+      uint64_t carry = 0;
+      for ( int w = 0; w < nw; w++ ) {
+	 uint64_t u = V[w] & M[w];
+	 uint64_t sum = V[w] + u;
+	 uint64_t c = (sum < V[w]);
+	 sum += carry;
+	 c |= (sum < carry);
+	 carry = c;
+	 V[w] = sum | (V[w] & ~M[w]);
+      }
+   }
+
+   int ones = 0;
+   for ( int w = 0; w < nw; w++ ) {
+      uint64_t v = V[w];
+      if ( w == nw-1 && n1%64 )
+	 v &= ((uint64_t)1 << (n1%64)) - 1;
+      ones += __builtin_popcountll(v);
    }
+   *d = n1 - ones;
+
+   FREE(V);
+   FREE(M);
+   FREE(dist);
 }
 
 float dtw_score(struct signature *feats1, struct signature *feats2, 
-	       frameind N1, frameind N2, frameind start1, frameind end1, frameind start2, frameind end2)
+	       frameind N1, frameind N2, frameind start1, frameind end1, frameind start2, frameind end2,
+	       int band, float maxcost)
 {
    int n1 = end1 - start1 + 1;
    int n2 = end2 - start2 + 1;
-   
-   float simmx[n1*n2];
+   int w = ( band > 0 ) ? MAX(band, abs(n1-n2)) : MAX(n1, n2);
+
+   // Two rows of the accumulated cost over feats2; cells outside the band are INFINITY
+   float *prev = (float *)MALLOC(sizeof(float) * n2);
+   float *cur = (float *)MALLOC(sizeof(float) * n2);
+   float *cost = (float *)MALLOC(sizeof(float) * n2);
+   int *dist = (int *)MALLOC(sizeof(int) * n2);
 
    for ( int i = 0; i < n1; i++ ) {
-      for ( int j = 0; j < n2; j++ ) {
-	    simmx[i*n2+j] = (1-approximate_cosine(feats1+start1+i,
-						  feats2+start2+j))/2;
-      }
-   }
+      int lo = MAX(0, i-w);
+      int hi = MIN(n2-1, i+w);
 
-   for ( int i = 1; i < n1; i++ ) {
-      simmx[i*n2] += simmx[(i-1)*n2];
-   }
+      hamming_run(feats1+start1+i, feats2+start2+lo, 1, hi-lo+1, dist);
+      for ( int j = lo; j <= hi; j++ )
+	 cost[j] = (1-COSINE_[dist[j-lo]])/2;
 
-   for ( int j = 1; j < n2; j++ ) {
-      simmx[j] += simmx[j-1];
-   }
+      if ( lo > 0 ) cur[lo-1] = INFINITY;
+      if ( hi < n2-1 ) cur[hi+1] = INFINITY;
 
-   for ( int i = 1; i < n1; i++ ) {
-      for ( int j = 1; j < n2; j++ ) {
-	 float dcost = simmx[(i-1)*n2+(j-1)] + simmx[i*n2+j];
-	 float vcost = simmx[(i-1)*n2+j] + simmx[i*n2+j];
-	 float hcost = simmx[i*n2+(j-1)] + simmx[i*n2+j];
+      int j0 = lo;
+      if ( lo == 0 ) {
+	 cur[0] = ( i == 0 ) ? cost[0] : prev[0] + cost[0];
+	 j0 = 1;
+      }
 
-	 simmx[i*n2+j] = MIN( dcost, MIN(vcost, hcost) );
+      if ( i == 0 ) {
+	 for ( int j = j0; j <= hi; j++ )
+	    cur[j] = cur[j-1] + cost[j];
+      } else {
+	 // The min of the three moves plus the cost rounds exactly like the
+	 // min of the three sums; the vertical and diagonal moves vectorize
+	 for ( int j = j0; j <= hi; j++ )
+	    cur[j] = MIN(prev[j-1], prev[j]);
+	 for ( int j = j0; j <= hi; j++ )
+	    cur[j] = MIN(cur[j], cur[j-1]) + cost[j];
       }
-   } 
 
-   return simmx[n1*n2-1]/(n1+n2);
+      // Costs are nonnegative, so every path to the end costs at least the row minimum
+      if ( maxcost < 1 ) {
+	 float rowmin = INFINITY;
+	 for ( int j = lo; j <= hi; j++ )
+	    rowmin = MIN(rowmin, cur[j]);
+	 if ( rowmin/(n1+n2) > maxcost ) {
+	    FREE(prev); FREE(cur); FREE(cost); FREE(dist);
+	    return rowmin/(n1+n2);
+	 }
+      }
+
+      float *tmp = prev; prev = cur; cur = tmp;
+   }
+
+   float score = prev[n2-1]/(n1+n2);
+   FREE(prev); FREE(cur); FREE(cost); FREE(dist);
+   return score;
 }
 
 void chop(char *str)
@@ -9,11 +9,20 @@
 
 #define NBINS 20
 
+// Table over hamming distances 0..8*SIG_NUM_BYTES of the ones whose
+// cosine exceeds T, i.e. that make a dot (free with FREE)
+bool *dot_table(float T);
+
+// isdot comes from dot_table, built once per match list
 void score_match(struct signature *feats1, struct signature *feats2, 
-		 int N1, int N2, int start1, int end1, int start2, int end2, float T,
-		 int *d, int *dots, int *bins);
+		 int N1, int N2, int start1, int end1, int start2, int end2, 
+		 const bool *isdot, int *d, int *dots, int *bins);
 
+// Normalized DTW cost of the two segments, computed with two rows of
+// memory. band > 0 restricts the path to |i-j| <= max(band,|n1-n2|);
+// once the cost is sure to exceed maxcost (< 1), the lower bound reached
+// so far is returned instead.
 float dtw_score(struct signature *feats1, struct signature *feats2, 
 		frameind N1, frameind N2, frameind start1, frameind end1, 
-		frameind start2, frameind end2);
+		frameind start2, frameind end2, int band, float maxcost);
 #endif
@@ -6,99 +6,160 @@
 #include "signature.h"
 #include "util.h"
 
-void new_signature (struct signature *sig, int id) {
-  sig->id = id;
-  sig->byte_ = (byte*) MALLOC(sizeof(byte) * SIG_NUM_BYTES);
+int SIG_NUM_BYTES;
+int *PERMUTE_;
+
+double COSINE_[SIG_MAX_BITS+1];
+int SIG_NUM_WORDS;
+
+void set_signature_bits (int S) {
+  if ( S <= 0 || S % 8 != 0 || S > SIG_MAX_BITS )
+    fatal("\nERROR: signature bits must be a positive multiple of 8 (at most 4096)");
+  SIG_NUM_BYTES = S/8;
+  SIG_NUM_WORDS = (SIG_NUM_BYTES+7)/8;
+  for (int h = 0; h <= S; h++)
+    COSINE_[h] = cos(h * 3.1415926535897932384626433832795029/ (SIG_NUM_BYTES*8));
 }
 
-int hamming (struct signature* x, struct signature* y) {
-  int diff = 0;
-  for (int i = 0; i < SIG_NUM_BYTES; i++)
-    diff += BITS_IN_[x->byte_[i] ^ y->byte_[i]];
-  return diff;
+void new_signatures (struct signature *sig, int n) {
+  if ( n <= 0 ) return;
+  byte *block = (byte*) CALLOC((size_t)n * SIG_NUM_WORDS, sizeof(uint64_t));
+  for (int i = 0; i < n; i++) {
+    sig[i].id = i;
+    sig[i].byte_ = block + (size_t)i * SIG_NUM_WORDS * sizeof(uint64_t);
+  }
 }
 
-int numComparisons = 0;
+// Signature files mapped in place by map_signatures, released by free_signatures
+typedef struct {
+    byte *addr;
+    size_t len;
+} SigMap;
+
+static SigMap *SIGMAPS_ = NULL;
+static int NSIGMAPS_ = 0;
+static int MAXSIGMAPS_ = 0;
+
+static void add_sigmap (byte *addr, size_t len) {
+#pragma omp critical (sigmaps)
+  {
+    if ( NSIGMAPS_ == MAXSIGMAPS_ ) {
+      MAXSIGMAPS_ = MAXSIGMAPS_ ? 2*MAXSIGMAPS_ : 64;
+      SIGMAPS_ = (SigMap *) realloc(SIGMAPS_, sizeof(SigMap) * MAXSIGMAPS_);
+      if ( SIGMAPS_ == NULL ) fatal("add_sigmap: out of memory");
+    }
+    SIGMAPS_[NSIGMAPS_].addr = addr;
+    SIGMAPS_[NSIGMAPS_++].len = len;
+  }
+}
 
-double approximate_cosine (struct signature* x, struct signature* y) {
-  numComparisons++;
-  return cos(hamming(x,y) * 3.1415926535897932384626433832795029/ (SIG_NUM_BYTES*8));
+// unmaps the file holding p; returns false if p is not in a mapped file
+static bool remove_sigmap (byte *p) {
+  bool found = false;
+#pragma omp critical (sigmaps)
+  {
+    for ( int i = 0; i < NSIGMAPS_; i++ ) {
+      if ( p >= SIGMAPS_[i].addr && p < SIGMAPS_[i].addr + SIGMAPS_[i].len ) {
+	munmap_file((char *) SIGMAPS_[i].addr, SIGMAPS_[i].len);
+	SIGMAPS_[i] = SIGMAPS_[--NSIGMAPS_];
+	found = true;
+	break;
+      }
+    }
+    if ( NSIGMAPS_ == 0 ) {
+      free(SIGMAPS_);
+      SIGMAPS_ = NULL;
+      MAXSIGMAPS_ = 0;
+    }
+  }
+  return found;
 }
 
 void free_signatures ( struct signature *sig, int nsig ) 
 {
-   for ( int n = 0; n < nsig; n++ ) {
-      FREE(sig[n].byte_);
-   }
+   if ( nsig > 0 && !remove_sigmap(sig[0].byte_) )
+      FREE(sig[0].byte_);
 
    FREE(sig);
 }
 
-struct signature* read_signatures (char *filename, int *n) {
-    struct signature sig;
-    new_signature(&sig,0);
-    int bytes_read = 0;
-
-    // Read through file once to establish how many sigs there are
-    (*n) = 0;
+// counts the whole signatures in a file
+static int count_signatures (char *filename) {
     assert_file_exist( filename );
-    FILE *fp = fopen(filename, "r");
-    while (! feof(fp)) {
-      if (SIG_NUM_BYTES == (bytes_read = fread(sig.byte_, 1, SIG_NUM_BYTES, fp)))
-	(*n)++;
+    return lenchars_file(filename) / SIG_NUM_BYTES;
+}
+
+// reads n packed signatures from fp into the padded byte_ arrays of sig
+static void fread_signatures (struct signature *sig, int n, FILE *fp) {
+    if ( n <= 0 ) return;
+
+    byte *block = sig[0].byte_;
+    size_t stride = SIG_NUM_WORDS * sizeof(uint64_t);
+    int nread = fread(block, SIG_NUM_BYTES, n, fp);
+    if ( nread < n ) {
+      fprintf(stderr, "ERROR: in reading signature file, expected (%d) signatures but got (%d)\n",
+	      n, nread);
+      exit(-1);
     }
-    fclose(fp);
 
-    FREE(sig.byte_);
+    // spread out to the padded stride, last signature first
+    if ( stride != SIG_NUM_BYTES ) {
+      for (int i = n-1; i >= 0; i--) {
+	memmove(block + i*stride, block + i*SIG_NUM_BYTES, SIG_NUM_BYTES);
+	memset(block + i*stride + SIG_NUM_BYTES, 0, stride - SIG_NUM_BYTES);
+      }
+    }
+}
+
+// Points sig at signatures fA..fA+n-1 of filename, used in place from a
+// read-only mapping. Only possible when the packed record size is already the
+// padded stride (S a multiple of 64); returns false if the caller must read.
+static bool map_signatures (struct signature *sig, int n, char *filename, int fA) {
+    if ( n <= 0 || SIG_NUM_BYTES != SIG_NUM_WORDS * sizeof(uint64_t) )
+      return false;
+
+    size_t len;
+    byte *map = (byte *) mmap_file(filename, &len);
+    if ( map == NULL || (size_t)SIG_NUM_BYTES * ((size_t)fA + n) > len ) {
+      munmap_file((char *) map, len);
+      return false;
+    }
+    add_sigmap(map, len);
+
+    byte *block = map + (size_t)SIG_NUM_BYTES * fA;
+
+    for (int i = 0; i < n; i++) {
+      sig[i].id = i;
+      sig[i].byte_ = block + (size_t)i * SIG_NUM_BYTES;
+    }
+    return true;
+}
+
+struct signature* read_signatures (char *filename, int *n) {
+    (*n) = count_signatures(filename);
 
     // Initialize the array of signatures, now that we know how many there are
     struct signature *sig_ = (struct signature*) MALLOC((*n) * sizeof(struct signature));
+    if ( map_signatures(sig_, *n, filename, 0) )
+      return sig_;
+    new_signatures(sig_, *n);
 
     // Read in the signatures to the array
-    assert_file_exist( filename );
-    fp = fopen(filename, "r");
-    for (int i = 0; i < *n; i++) {
-      new_signature(&(sig_[i]), i);
-      if (SIG_NUM_BYTES > (bytes_read = fread(sig_[i].byte_, 1, SIG_NUM_BYTES, fp))) {
-	fprintf(stderr, "ERROR: in reading signature file, expected (%d) bytes but got (%d)\n",
-		SIG_NUM_BYTES, bytes_read);
-	exit(-1);
-      }
-    }
+    FILE *fp = fopen(filename, "r");
+    fread_signatures(sig_, *n, fp);
     fclose(fp);
 
     return sig_;
 }
 
 struct signature* readsigs_file (char *filename, int *fA, int *fB, int *n) {
-    struct signature sig;
-    new_signature(&sig,0);
-
-    int bytes_read = 0;
     int maxframes = *n;
 
-    // Read through file once to establish how many sigs there are
-    (*n) = 0;
-    assert_file_exist( filename );
-    FILE *fp = fopen(filename, "r");
-    while (! feof(fp) ) {
-      if (SIG_NUM_BYTES == (bytes_read = fread(sig.byte_, 1, SIG_NUM_BYTES, fp)))
-	(*n)++;
-    }
-    fclose(fp);
+    (*n) = count_signatures(filename);
     
     if ( maxframes == 0 )
        maxframes = *n;
 
-    FREE(sig.byte_);
-
-    // Initialize the array of signatures, now that we know how many there are
-    struct signature *sig_ = (struct signature*) MALLOC((*n) * sizeof(struct signature));
-
-    // Read in the signatures to the array
-    assert_file_exist( filename );
-    fp = fopen(filename, "r");
-    
     if ( *fA == -1 || *fA < 0 ) *fA = 0;
     if ( *fA >= maxframes ) {
       fprintf(stderr, "ERROR: fA is larger than total number of frames (or maxframes)\n");
@@ -116,18 +177,18 @@ struct signature* readsigs_file (char *filename, int *fA, int *fB, int *n) {
        *fB = *fA + maxframes - 1;
        *n = *fB - *fA + 1;
     }
+
+    // Initialize the array of signatures, now that we know how many there are
+    struct signature *sig_ = (struct signature*) MALLOC((*n) * sizeof(struct signature));
+    if ( map_signatures(sig_, *n, filename, *fA) )
+      return sig_;
+    new_signatures(sig_, *n);
     
-    int offset = SIG_NUM_BYTES*(*fA);
+    FILE *fp = fopen(filename, "r");
+    long offset = (long)SIG_NUM_BYTES*(*fA);
     if(fseek(fp, offset, SEEK_SET) == EOF) fprintf(stderr,"seek failed");
 
-    for (int i = 0; i < (*n); i++) {
-      new_signature(&(sig_[i]), i);
-      if (SIG_NUM_BYTES > (bytes_read = fread(sig_[i].byte_, 1, SIG_NUM_BYTES, fp))) {
-	fprintf(stderr, "ERROR: in reading signature file, expected (%d) bytes but got (%d)\n",
-		SIG_NUM_BYTES, bytes_read);
-	exit(-1);
-      }
-    }
+    fread_signatures(sig_, *n, fp);
     fclose(fp);
 
     return sig_;
@@ -140,38 +201,42 @@ void initialize_permute () {
 }
 
 void permute () {
-  int tmp;
-
   for (int i = 0; i < SIG_NUM_BYTES; i++)
     fprintf(stderr,"%d ",PERMUTE_[i]);
   fprintf(stderr,"(%f s)\n",toc());
 
+  next_permutation(PERMUTE_);
+}
+
+void next_permutation (int *perm) {
+  int tmp;
+
   // Reverse
   for (int i = 0; i < SIG_NUM_BYTES/2; i++) {
-    tmp = PERMUTE_[i];
-    PERMUTE_[i] = PERMUTE_[SIG_NUM_BYTES-1-i];
-    PERMUTE_[SIG_NUM_BYTES-1-i] = tmp;
+    tmp = perm[i];
+    perm[i] = perm[SIG_NUM_BYTES-1-i];
+    perm[SIG_NUM_BYTES-1-i] = tmp;
   }
 
   // If first item is odd then return
-  if (PERMUTE_[0] % 2 == 1)
+  if (perm[0] % 2 == 1)
     return;
 
   // Otherwise double permute
   for (int i = 0; i < SIG_NUM_BYTES; i+= 2) {
-    tmp = PERMUTE_[i];
-    PERMUTE_[i] = PERMUTE_[i+1];
-    PERMUTE_[i+1] = tmp;
+    tmp = perm[i];
+    perm[i] = perm[i+1];
+    perm[i+1] = tmp;
   }
 
   for (int i = 1; i < SIG_NUM_BYTES -1; i+= 2) {
-    tmp = PERMUTE_[i];
-    PERMUTE_[i] = PERMUTE_[i+1];
-    PERMUTE_[i+1] = tmp;
+    tmp = perm[i];
+    perm[i] = perm[i+1];
+    perm[i+1] = tmp;
   }
-  tmp = PERMUTE_[0];
-  PERMUTE_[0] = PERMUTE_[SIG_NUM_BYTES -1];
-  PERMUTE_[SIG_NUM_BYTES -1] = tmp;
+  tmp = perm[0];
+  perm[0] = perm[SIG_NUM_BYTES -1];
+  perm[SIG_NUM_BYTES -1] = tmp;
 }
 
 int signature_greater (const void *x, const void *y) {
@@ -230,123 +295,281 @@ int signature_ptr_equal (const void *x, const void *y) {
 }
 
 bool signature_is_zeroed (const struct signature* x) {
-  for (int i = 0; i < SIG_NUM_BYTES; i++)
-    if (x->byte_[i] != 0)
+  uint64_t w;
+  for (int i = 0; i < SIG_NUM_WORDS; i++) {
+    memcpy(&w, x->byte_ + 8*i, sizeof(uint64_t));
+    if (w != 0)
       return false;
+  }
   //printf("zeroed ");
   return true;
 }
 
-int pleb( struct signature *x_sig_, int x_size, struct signature *y_sig_, int y_size,
-	  int diffspeech, int P, int B, float T, int D, Dot *dotlist ) 
-{
-   int Nmax = max(x_size,y_size);
-   int dotcnt = 0;
-   
-   // Are we comparing a set of signatures to itself?
-   bool self_comparison = !diffspeech;
+// Word w of the sort key: LEX_RANK_ of the permuted bytes 8w..8w+7,
+// most significant first, so keys order like signature_greater
+static inline uint64_t signature_key (const struct signature *x, const int *perm, int w) {
+  uint64_t key = 0;
+  for (int i = 8*w; i < 8*w+8; i++) {
+    key <<= 8;
+    if (i < SIG_NUM_BYTES)
+      key |= LEX_RANK_[x->byte_[perm[i]]];
+  }
+  return key;
+}
 
-   struct signature **x_sig_ptr_ = (struct signature**) MALLOC(sizeof(struct signature*) * x_size);
-   for (int i = 0; i < x_size; i++) {
-      x_sig_ptr_[i] = &(x_sig_[i]);
-   }
-   
-   struct signature **y_sig_ptr_;
-   if (self_comparison) {
-      y_sig_ptr_ = x_sig_ptr_;
-   } else {
-      y_sig_ptr_ = (struct signature**) MALLOC(sizeof(struct signature*) * y_size);
-      for (int i = 0; i < y_size; i++)
-	 y_sig_ptr_[i] = &(y_sig_[i]);
+uint64_t signature_lead_key (const struct signature *x, const int *perm) {
+  return signature_key(x, perm, 0);
+}
+
+typedef struct {
+  uint64_t key;
+  int pos;
+} SigKey;
+
+// Stable LSD radix sort of a by key, one byte per pass; b is scratch.
+// Passes where every key shares the digit are skipped. Returns whichever
+// of the two arrays holds the result.
+static SigKey *radix_sort_keys (SigKey *a, SigKey *b, int n) {
+  int count[8][256];
+  memset(count, 0, sizeof(count));
+  for (int i = 0; i < n; i++)
+    for (int d = 0; d < 8; d++)
+      count[d][(a[i].key >> (8*d)) & 0xff]++;
+
+  for (int d = 0; d < 8; d++) {
+    if (count[d][(a[0].key >> (8*d)) & 0xff] == n)
+      continue;
+    int sum = 0;
+    for (int v = 0; v < 256; v++) {
+      int c = count[d][v];
+      count[d][v] = sum;
+      sum += c;
+    }
+    for (int i = 0; i < n; i++)
+      b[count[d][(a[i].key >> (8*d)) & 0xff]++] = a[i];
+    SigKey *tmp = a; a = b; b = tmp;
+  }
+  return a;
+}
+
+void sort_signature_ptrs (struct signature **ptr, int n, const int *perm, uint64_t *key) {
+  if (n <= 0) return;
+  int nwords = (SIG_NUM_BYTES+7)/8;
+  SigKey *a = (SigKey *) MALLOC(sizeof(SigKey) * n);
+  SigKey *b = (SigKey *) MALLOC(sizeof(SigKey) * n);
+  struct signature **tmp = (struct signature **) MALLOC(sizeof(struct signature*) * n);
+
+  // Least significant key word first; each pass is stable
+  for (int w = nwords-1; w >= 0; w--) {
+    for (int i = 0; i < n; i++) {
+      a[i].key = signature_key(ptr[i], perm, w);
+      a[i].pos = i;
+    }
+    SigKey *sorted = radix_sort_keys(a, b, n);
+    for (int i = 0; i < n; i++)
+      tmp[i] = ptr[sorted[i].pos];
+    memcpy(ptr, tmp, sizeof(struct signature*) * n);
+    if (w == 0 && key)
+      for (int i = 0; i < n; i++)
+	key[i] = sorted[i].key;
+  }
+
+  FREE(a);
+  FREE(b);
+  FREE(tmp);
+}
+
+// Three-way comparison of two signatures given their leading key words
+static inline int pleb_compare (struct signature *x, uint64_t xk, struct signature *y, uint64_t yk) {
+  if (xk != yk)
+    return xk > yk ? 1 : -1;
+  if (SIG_NUM_BYTES <= 8)
+    return 0;
+  return signature_greater(x, y);
+}
+
+// Advance the y cursor until x fits into the sort of Y
+static int pleb_advance( struct signature **x_sig_ptr_, uint64_t *x_key, int x, 
+			 struct signature **y_sig_ptr_, uint64_t *y_key, int y_size, int y_current )
+{
+   int start;
+   struct signature *xs = x_sig_ptr_[x];
+   uint64_t xk = x_key[x];
+   if (pleb_compare(xs, xk, y_sig_ptr_[y_current], y_key[y_current]) > 0) {
+      y_current++;
+      while ((y_current < y_size) && (pleb_compare(xs, xk, y_sig_ptr_[y_current], y_key[y_current]) > 0))
+	 y_current++;
+      start = y_current;
+      // if there is a run of equal elements, then center y_current within those elements
+      while ((y_current < y_size) && (pleb_compare(xs, xk, y_sig_ptr_[y_current], y_key[y_current]) == 0))
+	 y_current++;
+      if (y_current == y_size)
+	 y_current--;
+      y_current = (y_current + start) / 2;
    }
-   
-   int y_current;  
+   return y_current;
+}
+
+// Beam scan over sorted x entries [xstart,xend) starting from cursor y_current
+static void pleb_scan( struct signature *x_sig_, int x_size, struct signature *y_sig_, int y_size,
+		      struct signature **x_sig_ptr_, uint64_t *x_key,
+		      struct signature **y_sig_ptr_, uint64_t *y_key, 
+		      int xstart, int xend, int y_current, bool self_comparison,
+		      int B, float T, int D, DotBuffer *dots )
+{
+   int Nmax = max(x_size,y_size);
    double cosine;
    int gap = B/2;
-   int start;
-   for (int i = 0; i < P; i++) {
-      // Sort the pointer arrays
-      qsort(x_sig_ptr_, x_size, sizeof(struct signature*), signature_ptr_greater);
+   for (int x = xstart; x < xend; x++) {
+      if ( signature_is_zeroed(x_sig_ptr_[x]) ) 
+	 continue;
 
-      if (! self_comparison)
-	 qsort(y_sig_ptr_, y_size, sizeof(struct signature*), signature_ptr_greater);
-      
-      // Find nearest neighbors
-      y_current = 0;
-      for (int x = 0; x < x_size; x++) {
-	 if (! signature_is_zeroed(x_sig_ptr_[x]) ) {
+      y_current = pleb_advance(x_sig_ptr_, x_key, x, y_sig_ptr_, y_key, y_size, y_current);
+
+      for (int y = MAX(0,y_current-gap); y < MIN(y_size, y_current + gap); y++) {
+	 // We're either not self comparing,
+	 // or we are ignoring similar points that have nearby IDs
+	 if ((!self_comparison) ||
+	     ((abs(x_sig_ptr_[x]->id - y_sig_ptr_[y]->id) > 50))) {
 	    
-	    // Increment y_current until x fits into the sort of Y
-	    if (signature_greater(x_sig_ptr_[x], y_sig_ptr_[y_current]) > 0) {
-	       y_current++;
-	       while ((y_current < y_size) && (signature_greater(x_sig_ptr_[x], y_sig_ptr_[y_current]) > 0))
-		  y_current++;
-	       start = y_current;
-	       // if there is a run of equal elements, then center y_current within those elements
-	       while ((y_current < y_size) && (signature_greater(x_sig_ptr_[x], y_sig_ptr_[y_current]) == 0))
-		  y_current++;
-	       if (y_current == y_size)
-		  y_current--;
-	       y_current = (y_current + start) / 2;
-	    }
+	    cosine = approximate_cosine(x_sig_ptr_[x], y_sig_ptr_[y]);
 
-	    for (int y = MAX(0,y_current-gap); y < MIN(y_size, y_current + gap); y++) {
-	       // We're either not self comparing,
-	       // or we are ignoring similar points that have nearby IDs
-	       if ((!self_comparison) ||
-		   ((abs(x_sig_ptr_[x]->id - y_sig_ptr_[y]->id) > 50))) {
+	    if (cosine > T) {
+	       int xp, yp;		     
+	       if (self_comparison) {
+		  if (x_sig_ptr_[x]->id < y_sig_ptr_[y]->id) {
+		     xp =  x_sig_ptr_[x]->id + y_sig_ptr_[y]->id;
+		     yp = -x_sig_ptr_[x]->id + y_sig_ptr_[y]->id;
+		  } else {
+		     xp =  y_sig_ptr_[y]->id + x_sig_ptr_[x]->id;
+		     yp = -y_sig_ptr_[y]->id + x_sig_ptr_[x]->id;
+		  }
+	       } else {
+		  xp =  x_sig_ptr_[x]->id + y_sig_ptr_[y]->id;
+		  yp = -x_sig_ptr_[x]->id + y_sig_ptr_[y]->id + Nmax;
+	       }
+
+	       if ( ! signature_is_zeroed(y_sig_ptr_[y]) ) {
+		  dotbuf_add(dots, xp, yp, cosine);
 		  
-		  cosine = approximate_cosine(x_sig_ptr_[x], y_sig_ptr_[y]);
-
-		  if (cosine > T) {
-		     int xp, yp;		     
-		     if (self_comparison) {
-			if (x_sig_ptr_[x]->id < y_sig_ptr_[y]->id) {
-			   xp =  x_sig_ptr_[x]->id + y_sig_ptr_[y]->id;
-			   yp = -x_sig_ptr_[x]->id + y_sig_ptr_[y]->id;
-			} else {
-			   xp =  y_sig_ptr_[y]->id + x_sig_ptr_[x]->id;
-			   yp = -y_sig_ptr_[y]->id + x_sig_ptr_[x]->id;
-			}
-		     } else {
-			xp =  x_sig_ptr_[x]->id + y_sig_ptr_[y]->id;
-			yp = -x_sig_ptr_[x]->id + y_sig_ptr_[y]->id + Nmax;
-		     }
-
-		     if ( ! signature_is_zeroed(x_sig_ptr_[x]) && ! signature_is_zeroed(y_sig_ptr_[y]) ) {
-			dotlist[dotcnt].val = cosine;
-			dotlist[dotcnt].xp = xp;
-			dotlist[dotcnt++].yp = yp;
-			
-			if (D > 0) {
-			   dotcnt = diagonal_probe(x_sig_, x_size, y_sig_, y_size,
-						   x_sig_ptr_[x]->id, y_sig_ptr_[y]->id, T, D, 
-						   self_comparison, dotcnt, dotlist);
-			}
-		     }
+		  if (D > 0) {
+		     diagonal_probe(x_sig_, x_size, y_sig_, y_size,
+				    x_sig_ptr_[x]->id, y_sig_ptr_[y]->id, T, D, 
+				    self_comparison, dots);
 		  }
 	       }
 	    }
 	 }
       }
+   }
+}
 
-      // Shuffle PERMUTE_
+int pleb( struct signature *x_sig_, int x_size, struct signature *y_sig_, int y_size,
+	  int diffspeech, int P, int B, float T, int D, DotBuffer *dots ) 
+{
+   // Are we comparing a set of signatures to itself?
+   bool self_comparison = !diffspeech;
+
+   // Fix the permutation sequence up front so passes can run in any order
+   int **perms = (int **) MALLOC(sizeof(int*) * P);
+   for (int p = 0; p < P; p++) {
+      perms[p] = (int *) MALLOC(sizeof(int) * SIG_NUM_BYTES);
+      memcpy(perms[p], PERMUTE_, sizeof(int) * SIG_NUM_BYTES);
       permute();
    }
 
+   // Work is split into (permutation, block of sorted x) tasks; each task
+   // fills its own buffer
+   int nchunks = (x_size + PLEB_CHUNK - 1) / PLEB_CHUNK;
+   int ntasks = P * nchunks;
+   struct signature ***x_ptrs = (struct signature ***) MALLOC(sizeof(struct signature**) * P);
+   struct signature ***y_ptrs = (struct signature ***) MALLOC(sizeof(struct signature**) * P);
+   uint64_t **x_keys = (uint64_t **) MALLOC(sizeof(uint64_t*) * P);
+   uint64_t **y_keys = (uint64_t **) MALLOC(sizeof(uint64_t*) * P);
+   int *cursor = (int *) MALLOC(sizeof(int) * (ntasks+1));
+   DotBuffer *taskdots = (DotBuffer *) MALLOC(sizeof(DotBuffer) * (ntasks+1));
+
+#pragma omp parallel
+   {
+      int *permute_save = PERMUTE_;
+
+      // Sort each permutation and record the y cursor at every block start
+#pragma omp for schedule(dynamic,1)
+      for (int p = 0; p < P; p++) {
+	 PERMUTE_ = perms[p];
+	 x_ptrs[p] = (struct signature**) MALLOC(sizeof(struct signature*) * x_size);
+	 x_keys[p] = (uint64_t *) MALLOC(sizeof(uint64_t) * x_size);
+	 for (int i = 0; i < x_size; i++)
+	    x_ptrs[p][i] = &(x_sig_[i]);
+	 sort_signature_ptrs(x_ptrs[p], x_size, perms[p], x_keys[p]);
+
+	 if (self_comparison) {
+	    y_ptrs[p] = x_ptrs[p];
+	    y_keys[p] = x_keys[p];
+	 } else {
+	    y_ptrs[p] = (struct signature**) MALLOC(sizeof(struct signature*) * y_size);
+	    y_keys[p] = (uint64_t *) MALLOC(sizeof(uint64_t) * y_size);
+	    for (int i = 0; i < y_size; i++)
+	       y_ptrs[p][i] = &(y_sig_[i]);
+	    sort_signature_ptrs(y_ptrs[p], y_size, perms[p], y_keys[p]);
+	 }
+
+	 int y_current = 0;
+	 for (int x = 0; x < x_size; x++) {
+	    if (x % PLEB_CHUNK == 0)
+	       cursor[p*nchunks + x/PLEB_CHUNK] = y_current;
+	    if ( ! signature_is_zeroed(x_ptrs[p][x]) )
+	       y_current = pleb_advance(x_ptrs[p], x_keys[p], x, y_ptrs[p], y_keys[p], y_size, y_current);
+	 }
+      }
+
+      // Beam scans
+#pragma omp for schedule(dynamic,1)
+      for (int t = 0; t < ntasks; t++) {
+	 int p = t / nchunks;
+	 int xstart = (t % nchunks) * PLEB_CHUNK;
+	 int xend = MIN(x_size, xstart + PLEB_CHUNK);
+	 PERMUTE_ = perms[p];
+	 dotbuf_init(&taskdots[t], 0);
+	 pleb_scan(x_sig_, x_size, y_sig_, y_size, 
+		   x_ptrs[p], x_keys[p], y_ptrs[p], y_keys[p],
+		   xstart, xend, cursor[t], self_comparison, B, T, D, &taskdots[t]);
+      }
+
+      PERMUTE_ = permute_save;
+   }
+
+   // Gather the task buffers in order
+   long dotcnt0 = dots->cnt;
+   for (int t = 0; t < ntasks; t++)
+      dotbuf_append(dots, &taskdots[t]);
+
+   for (int p = 0; p < P; p++) {
+      FREE(x_ptrs[p]);
+      FREE(x_keys[p]);
+      if ( diffspeech ) {
+	 FREE(y_ptrs[p]);
+	 FREE(y_keys[p]);
+      }
+      FREE(perms[p]);
+   }
+   FREE(x_ptrs);
+   FREE(y_ptrs);
+   FREE(x_keys);
+   FREE(y_keys);
+   FREE(perms);
+   FREE(cursor);
+   FREE(taskdots);
    FREE(PERMUTE_);
-   FREE(x_sig_ptr_);
-   if ( diffspeech )
-      FREE(y_sig_ptr_);
-   return dotcnt;
+   return dots->cnt - dotcnt0;
 }
 
 
 int plebkws( struct signature *x_sig_, int x_size, struct signature *y_sig_, int y_size,
-	     int diffspeech, int P, int B, float T, int D, Dot *dotlist ) 
+	     int diffspeech, int P, int B, float T, int D, DotBuffer *dots ) 
 {
    int Nmax = max(x_size,y_size);
-   int dotcnt = 0;
+   long dotcnt0 = dots->cnt;
    
    struct signature **both_sig_ptr_ = (struct signature**) MALLOC(sizeof(struct signature*) * (x_size + y_size));
    for (int i = 0; i < y_size; i++) {
@@ -363,7 +586,7 @@ int plebkws( struct signature *x_sig_, int x_size, struct signature *y_sig_, int
 
    for (int i = 0; i < P; i++) {
       // Sort the pointer array
-      qsort(both_sig_ptr_, x_size+y_size, sizeof(struct signature*), signature_ptr_greater);
+      sort_signature_ptrs(both_sig_ptr_, x_size+y_size, PERMUTE_, NULL);
 
       // Proxy for query field: ( both_sig_ptr_[i] >= y_sig_ && both_sig_ptr_[i] < y_sig_+y_size )
 
@@ -381,14 +604,12 @@ int plebkws( struct signature *x_sig_, int x_size, struct signature *y_sig_, int
 	       xp =  both_sig_ptr_[x]->id + both_sig_ptr_[y]->id;
 	       yp = -both_sig_ptr_[x]->id + both_sig_ptr_[y]->id + Nmax;
 	       	       
-	       dotlist[dotcnt].val = cosine;
-	       dotlist[dotcnt].xp = xp;
-	       dotlist[dotcnt++].yp = yp;
+	       dotbuf_add(dots, xp, yp, cosine);
 
 	       if (D > 0) {
-		  dotcnt = diagonal_probe(x_sig_, x_size, y_sig_, y_size,
-					  both_sig_ptr_[x]->id, both_sig_ptr_[y]->id, T, D, 
-					  0, dotcnt, dotlist);
+		  diagonal_probe(x_sig_, x_size, y_sig_, y_size,
+				 both_sig_ptr_[x]->id, both_sig_ptr_[y]->id, T, D, 
+				 0, dots);
 	       }
 	    }
 	 }
@@ -401,7 +622,7 @@ int plebkws( struct signature *x_sig_, int x_size, struct signature *y_sig_, int
    FREE(PERMUTE_);
    FREE(both_sig_ptr_);
 
-   return dotcnt;
+   return dots->cnt - dotcnt0;
 }
 
 void fprintf_signature( FILE * f, struct signature * s, int num_bytes ) 
@@ -412,28 +633,32 @@ void fprintf_signature( FILE * f, struct signature * s, int num_bytes )
 }
 
 #ifdef INDEXMODE
-int binary_search( struct signature *q, struct signature_index *index, int p, 
-		   frameind index_start, frameind index_length ) 
+// Returns the position of q (with leading key qk) in the sorted order of
+// sigs. This is the original recursive bisection unrolled: it makes the same
+// probes and so finds the same entry among equal signatures, but compares the
+// inline keys and only reads the signatures on a key tie when S > 64.
+frameind binary_search( struct signature *q, uint64_t qk, struct signature *sigs, 
+			frameind *order, uint64_t *keys, frameind n ) 
 {
-   if ( index_length == 1 ) {
-      return index_start;
+   frameind start = 0, len = n;
+   while ( len > 1 ) {
+      frameind midpt = start + len/2;
+      int diff = pleb_compare(q, qk, &sigs[order[midpt-1]], keys[midpt-1]);
+      if ( diff < 0 )
+	 len = midpt - start;
+      else if ( diff > 0 ) {
+	 len = start + len - midpt;
+	 start = midpt;
+      } else
+	 return midpt-1;
    }
-
-   frameind midpt = index_start+index_length/2;
-   int diff = signature_greater(q, &index->allfeats[index->order[p][midpt-1]] );
-
-   if ( diff < 0 )
-      return binary_search( q, index, p, index_start, midpt-index_start );
-   else if ( diff > 0 )
-      return binary_search( q, index, p, midpt, index_start+index_length-midpt );
-   else
-      return midpt-1;
+   return start;
 }
 
 int plebindex( struct signature_index *index, struct signature *y_sig_, int y_size,
-	       int P, int B, float T, int D, Dot *dotlist ) 
+	       int P, int B, float T, int D, DotBuffer *dots ) 
 {
-   int dotcnt = 0;
+   long startcnt = dots->cnt;
    int gap = B/2;
 
    for (int p = 0; p < P; p++) {
@@ -443,41 +668,57 @@ int plebindex( struct signature_index *index, struct signature *y_sig_, int y_si
 	 PERMUTE_[i] = index->PERMUTE[p][i];
       }
 
-      // loop over query signatures
-      for ( int y = 0; y < y_size; y++ ) {
-	 // skip if query signature is silence
-	 if ( signature_is_zeroed(&y_sig_[y]) ) 
+      // each segment is searched with its own beam
+      for ( int s = 0; s < index->Nsegs; s++ ) {
+	 frameind base = index->segstart[s];
+	 frameind n = index->segstart[s+1] - base;
+	 struct signature *sigs = index->allfeats + base;
+	 frameind *order = index->order[p*index->Nsegs + s];
+	 uint64_t *keys = index->keys[p*index->Nsegs + s];
+	 if ( n == 0 )
 	    continue;
 
-	 // find the i-th signature in the p-th index
-	 frameind pos = binary_search( &y_sig_[y], index, p, 0, index->Ntot );
+	 // loop over query signatures
+	 for ( int y = 0; y < y_size; y++ ) {
+	    // skip if query signature is silence
+	    if ( signature_is_zeroed(&y_sig_[y]) ) 
+	       continue;
 
-	 // Loop over beam in index
-	 for (int x = MAX(0,pos-gap); x <= MIN(index->Ntot, pos+gap); x++) {
-	    double cosine = approximate_cosine(&index->allfeats[index->order[p][x]], &y_sig_[y]);
-	    if (cosine > T) {
-	       dotlist[dotcnt].val = cosine;
-	       dotlist[dotcnt].xp = index->order[p][x] + y_sig_[y].id;
-	       dotlist[dotcnt++].yp = -index->order[p][x] + y_sig_[y].id + index->Ntot;
-	       
-	       if (D > 0) {
-		  dotcnt = diagonal_probe_index(index->allfeats, index->Ntot, y_sig_, y_size,
-						index->order[p][x], y_sig_[y].id, T, D, 
-						dotcnt, dotlist);
-	       }
-	    } 
+	    // find the i-th signature in the p-th index
+	    uint64_t qk = signature_lead_key(&y_sig_[y], PERMUTE_);
+	    frameind pos = binary_search( &y_sig_[y], qk, sigs, order, keys, n );
+
+	    // Loop over beam in index; up to 64 bits the keys hold the whole
+	    // signature, so the scan runs over the contiguous keys alone
+	    frameind xstart = pos > gap ? pos-gap : 0;
+	    frameind xend = MIN(n-1, pos+gap);
+	    for (frameind x = xstart; x <= xend; x++) {
+	       double cosine;
+	       if ( SIG_NUM_BYTES <= 8 )
+		  cosine = COSINE_[__builtin_popcountll(qk ^ keys[x])];
+	       else
+		  cosine = approximate_cosine(&sigs[order[x]], &y_sig_[y]);
+	       if (cosine > T) {
+		  frameind xi = base + order[x];
+		  dotbuf_add(dots, xi + y_sig_[y].id, -xi + y_sig_[y].id + index->Ntot, cosine);
+		  
+		  if (D > 0) {
+		     diagonal_probe_index(index->allfeats, index->Ntot, y_sig_, y_size,
+					  xi, y_sig_[y].id, T, D, dots);
+		  }
+	       } 
+	    }
 	 }
       }
    }      
    FREE(PERMUTE_);
 
-   return dotcnt;
+   return dots->cnt - startcnt;
 }
 
-int diagonal_probe_index( struct signature* x_sig_, frameind x_size,
-			  struct signature* y_sig_, frameind y_size,
-			  frameind x, frameind y, float T, int D, 
-			  int dotcnt, Dot *dotlist ) 
+void diagonal_probe_index( struct signature* x_sig_, frameind x_size,
+			   struct signature* y_sig_, frameind y_size,
+			   frameind x, frameind y, float T, int D, DotBuffer *dots ) 
 {    
    int d = 1;
    double cosine;
@@ -490,9 +731,7 @@ int diagonal_probe_index( struct signature* x_sig_, frameind x_size,
 
       cosine = approximate_cosine(&x_sig_[x-d], &y_sig_[y-d]);
       if (cosine > T) {
-	 dotlist[dotcnt].val = cosine;
-	 dotlist[dotcnt].xp = (x-d) + y_sig_[y-d].id;
-	 dotlist[dotcnt++].yp = -(x-d) + y_sig_[y-d].id + x_size;
+	 dotbuf_add(dots, (x-d) + y_sig_[y-d].id, -(x-d) + y_sig_[y-d].id + x_size, cosine);
       }
       d++;
    }
@@ -508,21 +747,17 @@ int diagonal_probe_index( struct signature* x_sig_, frameind x_size,
 
       cosine = approximate_cosine(&x_sig_[x+d], &y_sig_[y+d]);
       if (cosine > T) {
-	 dotlist[dotcnt].val = cosine;
-	 dotlist[dotcnt].xp = (x+d) + y_sig_[y+d].id;
-	 dotlist[dotcnt++].yp = -(x+d) + y_sig_[y+d].id + x_size;
+	 dotbuf_add(dots, (x+d) + y_sig_[y+d].id, -(x+d) + y_sig_[y+d].id + x_size, cosine);
       }
       d++;
    }
-   
-   return dotcnt;
 }
 #endif
 
-int diagonal_probe( struct signature* x_sig_, int x_size,
-		    struct signature* y_sig_, int y_size,
-		    int x, int y, float T, int D, bool self_comparison, 
-		    int dotcnt, Dot *dotlist ) 
+void diagonal_probe( struct signature* x_sig_, int x_size,
+		     struct signature* y_sig_, int y_size,
+		     int x, int y, float T, int D, bool self_comparison, 
+		     DotBuffer *dots ) 
 {    
    int Nmax = max(x_size,y_size);
    int d = 1;
@@ -550,9 +785,7 @@ int diagonal_probe( struct signature* x_sig_, int x_size,
 	    xp = x_sig_[x-d].id + y_sig_[y-d].id;
 	    yp = -x_sig_[x-d].id + y_sig_[y-d].id + Nmax;
 	 }
-	 dotlist[dotcnt].val = cosine;
-	 dotlist[dotcnt].xp = xp;
-	 dotlist[dotcnt++].yp = yp;
+	 dotbuf_add(dots, xp, yp, cosine);
       }
       d++;
    }
@@ -581,69 +814,136 @@ int diagonal_probe( struct signature* x_sig_, int x_size,
 	    xp = x_sig_[x+d].id + y_sig_[y+d].id;
 	    yp = -x_sig_[x+d].id + y_sig_[y+d].id + Nmax;
 	 }
-	 dotlist[dotcnt].val = cosine;
-	 dotlist[dotcnt].xp = xp;
-	 dotlist[dotcnt++].yp = yp;
+	 dotbuf_add(dots, xp, yp, cosine);
       }
       d++;
    }
-   
-   return dotcnt;
+}
+
+static void cast_scratch_init (CastScratch *cs, int R) {
+   cs->R = max(0, min(R, SPHW));
+   cs->W = 2*cs->R + 3;
+   cs->scr = (float *) MALLOC((SPHW+1) * cs->W * sizeof(float));
+   cs->path = (char *) MALLOC((SPHW+1) * cs->W * sizeof(char));
+   cs->cost = (float *) MALLOC((2*cs->R+1) * sizeof(float));
+   cs->dist = (int *) MALLOC((2*cs->R+1) * sizeof(int));
+   cs->yzero = (bool *) MALLOC((SPHW+1) * sizeof(bool));
+}
+
+static void cast_scratch_free (CastScratch *cs) {
+   FREE(cs->scr);
+   FREE(cs->path);
+   FREE(cs->cost);
+   FREE(cs->dist);
+   FREE(cs->yzero);
+}
+
+// Offset of cell (i,j) in the scratch rows, valid for |j-i| <= R+1
+static inline int cast_cell (const CastScratch *cs, int i, int j) {
+   return i*cs->W + 1 + cs->R + j - i;
+}
+
+static inline bool cast_in_band (const CastScratch *cs, int i, int j) {
+   return j-i >= -cs->R-1 && j-i <= cs->R+1;
+}
+
+void hamming_run (struct signature *x, struct signature *ys, int dir, int n, int *dist) {
+   if ( SIG_NUM_WORDS == 1 ) {
+      uint64_t a, b;
+      memcpy(&a, x->byte_, sizeof(uint64_t));
+      for ( int k = 0; k < n; k++ ) {
+	 memcpy(&b, ys[dir*k].byte_, sizeof(uint64_t));
+	 dist[k] = __builtin_popcountll(a ^ b);
+      }
+   } else {
+      for ( int k = 0; k < n; k++ )
+	 dist[k] = hamming(x, &ys[dir*k]);
+   }
+}
+
+// Substitution costs of x against the n frames feats2[y0], feats2[y0+dir], ...
+// where yzero flags the zeroed ones
+static void cast_band_costs (struct signature *x, struct signature *feats2, 
+			     int y0, int dir, int n, const bool *yzero, 
+			     int *dist, float *cost)
+{
+   if ( signature_is_zeroed(x) ) {
+      for ( int k = 0; k < n; k++ )
+	 cost[k] = 1;
+      return;
+   }
+
+   hamming_run(x, &feats2[y0], dir, n, dist);
+   for ( int k = 0; k < n; k++ ) {
+      float c = COSINE_[dist[k]];
+      cost[k] = yzero[k] ? 1 : (1-c)/2;
+   }
 }
 
 void sig_castpath( struct signature *feats1, int N1, 
 		   struct signature *feats2, int N2, 
 		   int dir, int xM, int yM, float castthr, float trimthr, 
-		   int R, int *xE, int *yE )
+		   CastScratch *cs, int *xE, int *yE )
 {
    float bound = 1e10;
-   float scr[SPHW+1][SPHW+1];
-   char path[SPHW+1][SPHW+1];
-      
-   for ( int i = 0; i < SPHW+1; i++ ) {
-      for ( int j = 0; j < SPHW+1; j++ ) {
-	 scr[i][j] = bound;
-	 path[i][j] = 0;
-      }
-   }
+   int R = cs->R;
 
-   scr[0][0] = 0;
+   // Columns whose frame lies inside feats2
+   int jylo = (dir > 0) ? 1-yM : yM+2-N2;
+   int jyhi = (dir > 0) ? N2-yM : yM+1;
+   int zeroed = 0; // yzero[1..zeroed] are filled
+
+   for ( int k = 0; k < cs->W; k++ ) {
+      cs->scr[k] = bound;
+      cs->path[k] = 0;
+   }
+   cs->scr[cast_cell(cs,0,0)] = 0;
    *xE = 0;
    *yE = 0;
 
    for (int i = 1; i < SPHW+1; i++ ) {
-      int cont = 0;
-      for ( int j = max(1,i-R); j <= min(SPHW,i+R); j++ ) {
-
-	 int x = dir*(i-1)+xM;
-	 int y = dir*(j-1)+yM;
+      float *row = cs->scr + i*cs->W;
+      char *prow = cs->path + i*cs->W;
+      for ( int k = 0; k < cs->W; k++ ) {
+	 row[k] = bound;
+	 prow[k] = 0;
+      }
 
-	 if ( x < 0 || x >= N1 || y < 0 || y >= N2 )
-	    continue;
+      int x = dir*(i-1)+xM;
+      if ( x < 0 || x >= N1 )
+	 break;
 
-	 float subst_cost = 0;;
+      int jlo = max(max(1,i-R), jylo);
+      int jhi = min(min(SPHW,i+R), jyhi);
+      if ( jlo > jhi )
+	 break;
 
-	 if ( signature_is_zeroed(&feats1[x]) || 
-	      signature_is_zeroed(&feats2[y]) ) {
-	    subst_cost = -1;//1;
-	 } else {
-	    subst_cost = approximate_cosine(&feats1[x], &feats2[y]);
-	 }
-	 subst_cost = (1-subst_cost)/2;
+      for ( zeroed = max(zeroed, jlo-1); zeroed < jhi; zeroed++ )
+	 cs->yzero[zeroed+1] = signature_is_zeroed(&feats2[dir*zeroed+yM]);
+      cast_band_costs(&feats1[x], feats2, dir*(jlo-1)+yM, dir, jhi-jlo+1, 
+		      cs->yzero+jlo, cs->dist, cs->cost);
 
-	 if ( scr[i-1][j-1] <= scr[i-1][j] && scr[i-1][j-1] <= scr[i][j-1] ) {
-	    scr[i][j] = scr[i-1][j-1] + subst_cost;
-	    path[i][j] = 1;
-	 } else if ( scr[i-1][j] <= scr[i][j-1] ) {
-	    scr[i][j] = scr[i-1][j] + subst_cost;
-	    path[i][j] = 2;
+      // scr[i][j] is s[j], scr[i-1][j] is u[j]
+      float *s = cs->scr + cast_cell(cs,i,0);
+      char *ps = cs->path + cast_cell(cs,i,0);
+      const float *u = cs->scr + cast_cell(cs,i-1,0);
+      int cont = 0;
+      for ( int j = jlo; j <= jhi; j++ ) {
+	 float subst_cost = cs->cost[j-jlo];
+
+	 if ( u[j-1] <= u[j] && u[j-1] <= s[j-1] ) {
+	    s[j] = u[j-1] + subst_cost;
+	    ps[j] = 1;
+	 } else if ( u[j] <= s[j-1] ) {
+	    s[j] = u[j] + subst_cost;
+	    ps[j] = 2;
 	 } else {
-	    scr[i][j] = scr[i][j-1] + subst_cost;
-	    path[i][j] = 3;
+	    s[j] = s[j-1] + subst_cost;
+	    ps[j] = 3;
 	 }
 
-	 if ( scr[i][j] > castthr )
-	    scr[i][j] = bound;
+	 if ( s[j] > castthr )
+	    s[j] = bound;
 	 else {
 	    cont = 1;
 	    if ( (i+1)*(i+1)+(j+1)*(j+1) > (*xE)*(*xE)+(*yE)*(*yE) ) {
@@ -659,11 +959,15 @@ void sig_castpath( struct signature *feats1, int N1,
 
    // Trim the loose ends
    while( *xE > 0 && *yE > 0 ) {
-      float last = scr[*xE-1][*yE-1];
-      int s = path[*xE-1][*yE-1];
+      int c = cast_cell(cs, *xE-1, *yE-1);
+      float last = cs->scr[c];
+      int s = cs->path[c];
       *xE = *xE - (s==2 || s==1);
       *yE = *yE - (s==3 || s==1);
-      if ( s == 0 || last-scr[*xE-1][*yE-1] < trimthr )
+      if ( s == 0 || *xE == 0 || *yE == 0 )
+	 break;
+      float prev = cast_in_band(cs, *xE-1, *yE-1) ? cs->scr[cast_cell(cs, *xE-1, *yE-1)] : bound;
+      if ( last-prev < trimthr )
 	 break;
    }
 }
@@ -674,27 +978,36 @@ void sig_secondpass( Match *matchlist, int matchcnt,
 		     struct signature *feats2, int N2, 
 		     int R, float castthr, float trimthr) 
 {
-   for(int n = 0; n < matchcnt; n++) {
-      int xM = 0.5*(matchlist[n].xA+matchlist[n].xB);
-      int yM = 0.5*(matchlist[n].yA+matchlist[n].yB);
+#pragma omp parallel
+   {
+      CastScratch cs;
+      cast_scratch_init(&cs, R);
+
+#pragma omp for schedule(dynamic,16)
+      for(int n = 0; n < matchcnt; n++) {
+	 int xM = 0.5*(matchlist[n].xA+matchlist[n].xB);
+	 int yM = 0.5*(matchlist[n].yA+matchlist[n].yB);
       
-      int xA = max(0,xM-SPHW);
-      int xB = min(N1-1,xM+SPHW);
-      int yA = max(0,yM-SPHW);
-      int yB = min(N2-1,yM+SPHW);
+	 int xA = max(0,xM-SPHW);
+	 int xB = min(N1-1,xM+SPHW);
+	 int yA = max(0,yM-SPHW);
+	 int yB = min(N2-1,yM+SPHW);
       
-      sig_castpath(feats1, N1, feats2, N2, -1, xM-1, yM-1, castthr, trimthr, R, &xA, &yA );
-      xA = xM-xA+1;
-      yA = yM-yA+1;
+	 sig_castpath(feats1, N1, feats2, N2, -1, xM-1, yM-1, castthr, trimthr, &cs, &xA, &yA );
+	 xA = xM-xA+1;
+	 yA = yM-yA+1;
       
-      sig_castpath(feats1, N1, feats2, N2, 1, xM-1, yM-1, castthr, trimthr, R, &xB, &yB );
-      xB = xM+xB-1;
-      yB = yM+yB-1;
+	 sig_castpath(feats1, N1, feats2, N2, 1, xM-1, yM-1, castthr, trimthr, &cs, &xB, &yB );
+	 xB = xM+xB-1;
+	 yB = yM+yB-1;
       
-      matchlist[n].xA = max(xA,0);
-      matchlist[n].xB = min(xB,N1-1);
-      matchlist[n].yA = max(yA,0);
-      matchlist[n].yB = min(yB,N2-1);
+	 matchlist[n].xA = max(xA,0);
+	 matchlist[n].xB = min(xB,N1-1);
+	 matchlist[n].yA = max(yA,0);
+	 matchlist[n].yB = min(yB,N2-1);
+      }
+
+      cast_scratch_free(&cs);
    }
 
    return;
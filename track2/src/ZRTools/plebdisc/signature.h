@@ -7,11 +7,15 @@
 #define SIGNATURE_H
 
 #define SPHW 250 // Second pass maximum halfwidth
+#define PLEB_CHUNK 4096 // Sorted frames per pleb work unit
+#define SIG_MAX_BITS 4096 // Widest supported signature
 
 #include <tgmath.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include <search.h>
 #include <stdbool.h>
 #include "util.h"
@@ -24,13 +28,11 @@
 
 typedef unsigned char byte;
 
-int numComparisons;
-
-int SIG_NUM_BYTES; // number of bytes in the signatures
-int *PERMUTE_; // permutation array for pleb search
-
-// based on http://infolab.stanford.edu/~manku/bitcount/bitcount.html
-const static int BITS_IN_[256] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
+extern int SIG_NUM_BYTES; // number of bytes in the signatures
+extern int SIG_NUM_WORDS; // number of 64-bit words holding a signature
+extern double COSINE_[SIG_MAX_BITS+1]; // approximate cosine indexed by hamming distance
+extern int *PERMUTE_; // permutation array for pleb search (one per thread)
+#pragma omp threadprivate(PERMUTE_)
 
 /* 
    (not based on any 3rd party)
@@ -51,7 +53,16 @@ struct signature_index {
     struct signature *allfeats;
     int P;
     int **PERMUTE;
-    frameind **order;
+    int Nsegs; // independently sorted segments (1 unless read from a manifest)
+    frameind *segstart; // Nsegs+1 offsets of the segments in allfeats
+    frameind **order; // order[p*Nsegs+s]: segment s sorted under permutation p
+    uint64_t **keys; // keys[p*Nsegs+s]: leading sort key of each order entry
+    char *map; // read-only mapping of the index file (see index.h)
+    size_t maplen;
+    byte *sigblock; // signature storage owned by the index (NULL if mapped)
+    bool order_mapped; // order arrays point into map
+    bool keys_owned; // keys arrays were computed at load
+    struct signature_index *segs; // segment indexes of a manifest
 };
 
 #ifdef INDEXMODE
@@ -70,13 +81,30 @@ struct signature {
 };
 #endif
 
-// Initializes the referenced signature
-// sig->byte_ is initialized based on the current value of SIG_NUM_BYTES
-void new_signature (struct signature *sig, int id);
+// Sets SIG_NUM_BYTES and SIG_NUM_WORDS for S bit signatures and fills COSINE_
+void set_signature_bits (int S);
 
-// returns the number of bits that differ between the byte_ arrays of x and y
-int hamming (struct signature* x, struct signature* y);
+// Initializes n signatures with ids 0..n-1; the byte_ arrays share one
+// contiguous block, each zero padded to SIG_NUM_WORDS 64-bit words
+void new_signatures (struct signature *sig, int n);
 
+// returns the number of bits that differ between the byte_ arrays of x and y
+static inline int hamming (struct signature* x, struct signature* y) {
+  int diff = 0;
+  uint64_t a, b;
+  for (int i = 0; i < SIG_NUM_WORDS; i++) {
+    memcpy(&a, x->byte_ + 8*i, sizeof(uint64_t));
+    memcpy(&b, y->byte_ + 8*i, sizeof(uint64_t));
+    diff += __builtin_popcountll(a ^ b);
+  }
+  return diff;
+}
+
+// Writes to dist the hamming distances between x and the n signatures
+// ys[0], ys[dir], ..., ys[(n-1)*dir]
+void hamming_run (struct signature *x, struct signature *ys, int dir, int n, int *dist);
+
+// frees an array built by new_signatures (or the readers below)
 void free_signatures ( struct signature *sig, int nsig );
 
 // reads in a binary file of byte arrays of length SIG_NUM_BYTES
@@ -95,44 +123,76 @@ void initialize_permute ();
 //  unique permutations, then will cycle)
 void permute ();
 
+// applies the permute() shuffle to an arbitrary permutation array
+void next_permutation (int *perm);
+
 // comparator that says, e.g., 11111111 > 00000000
 int signature_greater (const void *x, const void *y);
 
 // comparator for pointers to signatures
 int signature_ptr_greater (const void *x, const void *y);
 
+// Stable sort of n signature pointers into signature_greater order under
+// the permutation perm, using an LSD radix sort of extracted key words.
+// If key is not NULL it receives the leading 64-bit key of each entry.
+void sort_signature_ptrs (struct signature **ptr, int n, const int *perm, uint64_t *key);
+
+// Leading 64-bit sort key of x under perm: LEX_RANK_ of the first eight
+// permuted bytes, most significant first (zero filled when S < 64). Keys
+// order like signature_greater, and since LEX_RANK_ only reverses the bits
+// of each byte, the popcount of two keys' xor is their hamming distance
+// whenever S <= 64.
+uint64_t signature_lead_key (const struct signature *x, const int *perm);
+
 // returns true when all bytes have the value 0
 bool signature_is_zeroed (const struct signature* x);
 
-double approximate_cosine (struct signature* x, struct signature* y);
+static inline double approximate_cosine (struct signature* x, struct signature* y) {
+  return COSINE_[hamming(x,y)];
+}
 
+// Runs the P permutation passes in parallel and appends the dots to
+// dots; returns the number added. Output does not depend on the thread count.
 int pleb( struct signature *x_sig_, int x_size, 
 	  struct signature *y_sig_, int y_size, 
-	  int diffspeech, int P, int B, float T, int D, Dot *dotlist );
+	  int diffspeech, int P, int B, float T, int D, DotBuffer *dots );
 
 int plebkws( struct signature *x_sig_, int x_size, 
 	     struct signature *y_sig_, int y_size, 
-	     int diffspeech, int P, int B, float T, int D, Dot *dotlist );
+	     int diffspeech, int P, int B, float T, int D, DotBuffer *dots );
 
 #ifdef INDEXMODE
+// Appends the dots of y_sig_ against every segment of index to dots;
+// returns the number added
 int plebindex( struct signature_index *index, struct signature *y_sig_, int y_size,
-	       int P, int B, float T, int D, Dot *dotlist );
+	       int P, int B, float T, int D, DotBuffer *dots );
 
-int diagonal_probe_index( struct signature* x_sig_, frameind x_size, 
-			  struct signature* y_sig_, frameind y_size, 
-			  frameind x, frameind y, float T, int D, 
-			  int dotcnt, Dot *dotlist);
+void diagonal_probe_index( struct signature* x_sig_, frameind x_size, 
+			   struct signature* y_sig_, frameind y_size, 
+			   frameind x, frameind y, float T, int D, DotBuffer *dots );
 #endif
 
-int diagonal_probe( struct signature* x_sig_, int x_size, 
-		    struct signature* y_sig_, int y_size, 
-		    int x, int y, float T, int D, 
-		    bool self_comparison, int dotcnt, Dot *dotlist);
+void diagonal_probe( struct signature* x_sig_, int x_size, 
+		     struct signature* y_sig_, int y_size, 
+		     int x, int y, float T, int D, 
+		     bool self_comparison, DotBuffer *dots);
+
+// Per-thread scratch of sig_castpath: the DP rows keep only the band of
+// halfwidth R around the diagonal, plus a bound sentinel on each side
+typedef struct {
+    int R; // band halfwidth (at most SPHW)
+    int W; // row stride, 2R+3
+    float *scr;
+    char *path;
+    float *cost; // substitution costs of the current row's band
+    int *dist; // hamming distances of the current row's band
+    bool *yzero; // yzero[j]: frame of column j is zeroed
+} CastScratch;
 
 void sig_castpath( struct signature *feats1, int N1, 
 		   struct signature *feats2, int N2, 
 		   int dir, int xM, int yM, float castthr, float trimthr, 
-		   int R, int *xE, int *yE );
+		   CastScratch *cs, int *xE, int *yE );
 
 void sig_kwspass( Match *matchlist, int matchcnt, 
 		  struct signature *feats1, frameind N1, 
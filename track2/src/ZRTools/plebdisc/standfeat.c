@@ -75,61 +75,20 @@ int main(int argc, char **argv)
    fprintf(stderr, "infile = %s; N = %d frames\n", infile, N);
 
    // Extract the mean and stdev vectors
-   int framecnt=0;
    float std[D];
    float mean[D];
 
    // If statsfile provided, get the sample mean and variance from it
    // Else get if from the data
    if ( statsfile ) {
-      defnegA = -1;
-      defnegB = -1;
-      int nlines;
-      double *stats = readfeats_file_d( statsfile, D, &defnegA, &defnegB, 
-				        &nlines );
-      if ( nlines != 80 ) {
-	 fprintf(stderr,"Improperly formatted stats file\n");
-	 exit(1);
-      }
-      
-      for ( int d = 0; d < D; d++ ) {
-	 std[d] = (float) sqrt(stats[d*80+d]);
-	 mean[d] = (float) stats[d*80+D];
-      }
-
-      FREE(stats);
+      feat_readstats(statsfile, D, mean, std);
    } else {
       int *vadA = NULL;
       int *vadB = NULL;
       int vadcnt = 0;
       
       if ( vadfile ) {
-	 assert_file_exist( vadfile );
-	 FILE *fptr = fopen(vadfile,"r");
-	 
-	 // Count entries in vad file
-	 char c; int lines = 0;
-	 while ((c = fgetc(fptr)) != EOF) {
-	    if ( c == '\n' ) lines++;
-	 }
-	 fseek(fptr,-1,SEEK_END);
-	 if ( fgetc(fptr) != '\n' )
-	    lines++;
-	 
-	 // Fill vad arrays
-	 if ( lines > 0 ) {
-	    fseek(fptr,0,SEEK_SET);
-	    
-	    vadA = (int *) MALLOC( lines*sizeof(int) );
-	    vadB = (int *) MALLOC( lines*sizeof(int) );
-	    vadcnt = lines;
-	    
-	    for ( int i = 0; i < lines; i++ ) {
-	       fscanf(fptr, "%d%d", &vadA[i], &vadB[i]);
-	    }
-	 } 
-	 
-	 fclose(fptr);
+	 vadcnt = feat_readvad(vadfile, &vadA, &vadB);
       } else {
 	 vadA = (int *) MALLOC( sizeof(int) );
 	 vadB = (int *) MALLOC( sizeof(int) );
@@ -138,29 +97,12 @@ int main(int argc, char **argv)
 	 vadB[0] = 100000000;
       }
 
-      for ( int d = 0; d < D; d++ ) {
-	 mean[d] = 0;
-	 std[d] = 0;
-      }
+      feat_vadstats(feats, N, D, vadA, vadB, vadcnt, mean, std);
 
-      for ( int v = 0; v < vadcnt; v++ ) {
-	 for ( int n = vadA[v]; n < MIN(N,vadB[v]+1); n++ ) {
-	    framecnt++;
-	    for ( int d = 0; d < D; d++ ) {
-	       mean[d] += feats[n*D+d];
-	       std[d] += feats[n*D+d]*feats[n*D+d];
-	    }
-	 }
+      if ( vadcnt > 0 ) {
+	 FREE(vadA);
+	 FREE(vadB);	 
       }
-	       
-      for ( int d = 0; d < D; d++ ) {
-	 mean[d] /= framecnt;
-	 std[d] /= framecnt;
-	 std[d] = sqrtf(std[d] - mean[d]*mean[d]);
-      }
-
-      FREE(vadA);
-      FREE(vadB);	 
    } 
 
    // Standardize features and write to file
@@ -0,0 +1,195 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdint.h>
+#include "feat.h"
+#include "util.h"
+
+char *statsfile = NULL;
+char *infile = NULL;
+char *projfile = NULL;
+char *sigfile = NULL;
+char *outfile = NULL;
+char *vadfile = NULL;
+
+int D = 39;
+int S = 64;
+
+#define STANDLSH_CHUNK 4096 // Frames standardized and projected per pass
+
+
+void usage()
+{
+  fatal("usage: standlsh [-infile <str> (REQUIRED)]\
+\n\t[-projfile <str> (REQUIRED)]\
+\n\t[-sigfile <str> (REQUIRED)]\
+\n\t[-outfile <str> (standardized features, defaults to none)]\
+\n\t[-statsfile <str>]\
+\n\t[-vadfile <str>]\
+\n\t[-D <n> (defaults to 39)]\
+\n\t[-S <n> (multiple of 32, defaults to 64)]");
+}
+
+void parse_args(int argc, char **argv)
+{
+  int i;
+  for( i = 1; i < argc; i++ )
+  {
+     if( strcmp(argv[i], "-statsfile") == 0 ) statsfile = argv[++i];
+     else if ( strcmp(argv[i], "-infile") == 0 ) infile = argv[++i];
+     else if ( strcmp(argv[i], "-projfile") == 0 ) projfile = argv[++i];
+     else if ( strcmp(argv[i], "-sigfile") == 0 ) sigfile = argv[++i];
+     else if ( strcmp(argv[i], "-outfile") == 0 ) outfile = argv[++i];
+     else if ( strcmp(argv[i], "-vadfile") == 0 ) vadfile = argv[++i];
+     else if ( strcmp(argv[i], "-D") == 0 ) D = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-S") == 0 ) S = atoi(argv[++i]);
+     else {
+       fprintf(stderr, "unknown arg: %s\n", argv[i]);
+       usage();
+     }
+  }
+
+  if ( !infile ) {
+     usage();
+     fatal("\nERROR: infile arg is required");
+  }
+
+  if ( !projfile ) {
+     usage();
+     fatal("\nERROR: projfile arg is required");
+  }
+
+  if ( !sigfile ) {
+     usage();
+     fatal("\nERROR: sigfile arg is required");
+  }
+
+  if ( S <= 0 || S % 32 != 0 ) {
+     usage();
+     fatal("\nERROR: unsupported number of bits");
+  }
+
+  fprintf(stderr, "\nRun Parameters\n--------------\n\
+statsfile = %s, \n\
+vadfile = %s, \n\
+infile = %s, \n\
+projfile = %s, \n\
+sigfile = %s, \n\
+outfile = %s, \n\
+S = %d, D = %d\n\n",
+	  statsfile, vadfile, infile, projfile, sigfile, outfile, S, D);
+}
+
+int main(int argc, char **argv)
+{
+   parse_args(argc, argv);
+
+   // Map the feature matrix; both passes read it from the mapping
+   assert_file_exist( infile );
+   size_t len;
+   char *map = mmap_file(infile, &len);
+   if ( len % (D*sizeof(float)) != 0 )
+      fatal("ERROR: Feature dimension inconsistent with file\n");
+   int N = len/(D*sizeof(float));
+   float *feats = (float *) map;
+   fprintf(stderr, "infile = %s; N = %d frames\n", infile, N);
+
+   // Read the projection matrix and transpose it to D x S
+   int defnegA = -1;
+   int defnegB = -1;
+   int Sfile;
+   float *T = readfeats_file(projfile, D, &defnegA, &defnegB, &Sfile);
+   if ( S != Sfile ) {
+      fprintf(stderr,"Sfile = %d inconsistent with projfile length\n", Sfile);
+      exit(1);
+   }
+   fprintf(stderr, "projfile = %s; D = %d, S = %d bits\n", projfile, D, Sfile);
+
+   float *Tt = (float *) MALLOC( D*S*sizeof(float) );
+   for ( int b = 0; b < S; b++ )
+      for ( int d = 0; d < D; d++ )
+	 Tt[d*S+b] = T[b*D+d];
+
+   // Read the vad file once for both passes
+   int *vadA = NULL;
+   int *vadB = NULL;
+   int vadcnt = 0;
+   if ( vadfile ) vadcnt = feat_readvad(vadfile, &vadA, &vadB);
+
+   // First pass: the mean and stdev vectors, from the statsfile if given,
+   // else from the vad regions of the data (as standfeat computes them)
+   float std[D];
+   float mean[D];
+
+   if ( statsfile ) {
+      feat_readstats(statsfile, D, mean, std);
+   } else if ( vadfile ) {
+      feat_vadstats(feats, N, D, vadA, vadB, vadcnt, mean, std);
+   } else {
+      int allA = 0, allB = N-1;
+      feat_vadstats(feats, N, D, &allA, &allB, 1, mean, std);
+   }
+
+   // Second pass: standardize each chunk, optionally write it out, and
+   // project it to signatures (skipping frames outside the vad regions
+   // the way lsh does)
+   FILE *sfptr = fopen( sigfile, "w" );
+   if ( !sfptr ) fatal("ERROR: unable to open sigfile\n");
+   FILE *ofptr = NULL;
+   if ( outfile ) {
+      ofptr = fopen( outfile, "w" );
+      if ( !ofptr ) fatal("ERROR: unable to open outfile\n");
+   }
+
+   float *sfeats = (float *) MALLOC( STANDLSH_CHUNK*D*sizeof(float) );
+   unsigned int *sigs = (unsigned int *) MALLOC( STANDLSH_CHUNK*(S/8) );
+   char *skip = (char *) MALLOC( STANDLSH_CHUNK );
+
+   int currV = 0;
+   for ( int n0 = 0; n0 < N; n0 += STANDLSH_CHUNK ) {
+      int n = MIN(STANDLSH_CHUNK, N-n0);
+
+      for ( int i = 0; i < n; i++ ) {
+	 for ( int d = 0; d < D; d++ ) {
+	    sfeats[i*D+d] = (feats[(long)(n0+i)*D+d]-mean[d])/std[d];
+	 }
+      }
+
+      if ( ofptr && fwrite(sfeats, D*sizeof(float), n, ofptr) != n )
+	 fatal("ERROR: failed writing outfile\n");
+
+      currV = feat_vadskip(n0, n, vadA, vadB, vadcnt, currV, skip);
+      feat_lshproj(sfeats, n, D, Tt, S, skip, sigs);
+
+      if ( fwrite(sigs, S/8, n, sfptr) != n )
+	 fatal("ERROR: failed writing sigfile\n");
+   }
+
+   fclose(sfptr);
+   if ( ofptr ) {
+      fclose(ofptr);
+      fprintf(stderr, "Wrote %d frames to %s\n", N, outfile);
+   }
+   fprintf(stderr, "Wrote %d signatures to %s\n", N, sigfile);
+
+   FREE(sfeats);
+   FREE(sigs);
+   FREE(skip);
+   FREE(Tt);
+   FREE(T);
+   if ( vadcnt > 0 ) {
+      FREE(vadA);
+      FREE(vadB);
+   }
+   munmap_file(map, len);
+
+   int mc = get_malloc_count();
+   if(mc != 0) fprintf(stderr,"WARNING: %d malloc'd items not free'd\n", mc);
+
+   return 0;
+}
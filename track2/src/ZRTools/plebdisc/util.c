@@ -44,23 +44,32 @@ void make_cumhist_long(unsigned long *cumhist, int *hist, int n)
     cumhist[i+1] = cumhist[i] + hist[i];
 }
 
-char *mmap_file(char *fn, int *len)
+char *mmap_file(char *fn, size_t *len)
 {
   char *result;
   struct stat stat_buf;
   int fd = open(fn, O_RDONLY);
 
-  if(fstat(fd, &stat_buf) == EOF) {
+  if(fd == EOF || fstat(fd, &stat_buf) == EOF) {
     fprintf(stderr, "mmapfile: can't stat %s\n", fn);
     fatal("mmapfile failed");
   }
   *len = stat_buf.st_size;
+  if(*len == 0) {
+    close(fd);
+    return NULL;
+  }
   result = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
-  if(result == (char *) EOF) fatal("mmapfile failed");
+  if(result == (char *) MAP_FAILED) fatal("mmapfile failed");
   close(fd);
   return result;
 }
 
+void munmap_file(char *addr, size_t len)
+{
+  if(addr != NULL) munmap(addr, len);
+}
+
 int lenchars_file(char *fn)
 {
    assert_file_exist( fn );
@@ -149,7 +158,8 @@ void *MALLOC(size_t sz)
    void *ptr = malloc(sz);
 
    if(NULL == ptr) fatal("malloc failed\n");
-   else malloc_count++;
+#pragma omp atomic
+   malloc_count++;
 
    return ptr;
 }
@@ -159,7 +169,8 @@ void *CALLOC(size_t nmemb, size_t sz)
    void *ptr = calloc(nmemb,sz);
 
    if(NULL == ptr) fatal("calloc failed\n");
-   else malloc_count++;
+#pragma omp atomic
+   malloc_count++;
 
    return ptr;
 }
@@ -169,6 +180,7 @@ void FREE(void *ptr)
    if (NULL == ptr) fatal("Attempt to free NULL pointer\n");
    else free(ptr);
 
+#pragma omp atomic
    malloc_count--;
    return;
 }
@@ -218,6 +230,7 @@ void threshold_vector(float *vec, int n, double T)
 }
 
 static double lasttime = -1;
+#pragma omp threadprivate(lasttime)
 
 void tic( void )
 {
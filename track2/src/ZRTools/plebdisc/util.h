@@ -28,7 +28,10 @@ void threshold_vector(float *vec, int n, double T);
 
 float *readfeats_file(char *fn, int D, int *fA, int *fB, int *N);
 double *readfeats_file_d(char *fn, int D, int *fA, int *fB, int *N);
-char *mmap_file(char *fn, int *len);
+// maps fn read-only (NULL for an empty file); len receives the file size
+char *mmap_file(char *fn, size_t *len);
+void munmap_file(char *addr, size_t len);
+int lenchars_file(char *fn);
 
 void tic(void);
 float toc(void);
@@ -0,0 +1,190 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "featarchive.h"
+
+#define FEATARCHIVE_HEADER 24
+#define FEATARCHIVE_ENTRY 16
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+   for ( int i = 0; i < 4; i++ ) p[i] = (v >> (8*i)) & 0xff;
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+   for ( int i = 0; i < 8; i++ ) p[i] = (v >> (8*i)) & 0xff;
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+   uint32_t v = 0;
+   for ( int i = 0; i < 4; i++ ) v |= (uint32_t)p[i] << (8*i);
+   return v;
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+   uint64_t v = 0;
+   for ( int i = 0; i < 8; i++ ) v |= (uint64_t)p[i] << (8*i);
+   return v;
+}
+
+void token_file_name(char *fn, size_t len, char *dir, int i)
+{
+   char base[20];
+   sprintf( base, "%06d.binary", i+1 );
+   snprintf( fn, len, "%s/%.3s/%s", dir, base, base );
+}
+
+static void write_bytes(FILE *fp, void *buf, size_t n)
+{
+   if ( fwrite(buf, 1, n, fp) != n )
+      fatal("featarchive: write failed");
+}
+
+void featarchive_open_write(FeatArchiveWriter *w, char *fn, int kind, int ntok)
+{
+   w->fp = fopen(fn, "wb");
+   if ( !w->fp ) {
+      fprintf(stderr, "featarchive: can't create %s\n", fn);
+      fatal("open failed");
+   }
+   w->kind = kind;
+   w->D = 0;
+   w->ntok = ntok;
+   w->n = 0;
+   w->table = (unsigned char *) MALLOC( (size_t) MAX(ntok,1)*FEATARCHIVE_ENTRY );
+   memset(w->table, 0, (size_t) MAX(ntok,1)*FEATARCHIVE_ENTRY);
+
+   // The header and table are rewritten at close
+   unsigned char hdr[FEATARCHIVE_HEADER];
+   memset(hdr, 0, sizeof(hdr));
+   write_bytes(w->fp, hdr, sizeof(hdr));
+   if ( ntok > 0 )
+      write_bytes(w->fp, w->table, (size_t) ntok*FEATARCHIVE_ENTRY);
+   w->offset = FEATARCHIVE_HEADER + (uint64_t) ntok*FEATARCHIVE_ENTRY;
+}
+
+void featarchive_add(FeatArchiveWriter *w, void *data, int N, int D)
+{
+   if ( w->n >= w->ntok )
+      fatal("featarchive: more examples than declared");
+   if ( w->n == 0 )
+      w->D = D;
+   else if ( D != w->D )
+      fatal("featarchive: feature dimension differs between examples");
+
+   unsigned char *e = w->table + (size_t) w->n*FEATARCHIVE_ENTRY;
+   put_u64(e, w->offset);
+   put_u32(e+8, N);
+
+   size_t nbytes = (size_t) N*D*4;
+   write_bytes(w->fp, data, nbytes);
+   w->offset += nbytes;
+   w->n++;
+}
+
+void featarchive_close_write(FeatArchiveWriter *w)
+{
+   if ( w->n != w->ntok )
+      fatal("featarchive: fewer examples than declared");
+
+   unsigned char hdr[FEATARCHIVE_HEADER];
+   memset(hdr, 0, sizeof(hdr));
+   memcpy(hdr, "ZRFA", 4);
+   put_u32(hdr+4, FEATARCHIVE_VERSION);
+   put_u32(hdr+8, w->kind);
+   put_u32(hdr+12, w->D);
+   put_u32(hdr+16, w->ntok);
+
+   if ( fseek(w->fp, 0, SEEK_SET) != 0 )
+      fatal("featarchive: seek failed");
+   write_bytes(w->fp, hdr, sizeof(hdr));
+   if ( w->ntok > 0 )
+      write_bytes(w->fp, w->table, (size_t) w->ntok*FEATARCHIVE_ENTRY);
+   if ( fclose(w->fp) != 0 )
+      fatal("featarchive: close failed");
+
+   FREE(w->table);
+   w->fp = NULL;
+}
+
+void featarchive_open(FeatArchive *a, char *fn, int kind, int ntok)
+{
+   int fd = open(fn, O_RDONLY);
+   struct stat st;
+   if ( fd < 0 || fstat(fd, &st) != 0 ) {
+      fprintf(stderr, "featarchive: can't open %s\n", fn);
+      fatal("open failed");
+   }
+   a->len = st.st_size;
+   if ( a->len < FEATARCHIVE_HEADER )
+      fatal("featarchive: file too short");
+   a->map = (unsigned char *) mmap(NULL, a->len, PROT_READ, MAP_SHARED, fd, 0);
+   if ( a->map == MAP_FAILED )
+      fatal("featarchive: mmap failed");
+   close(fd);
+
+   if ( memcmp(a->map, "ZRFA", 4) != 0 ) {
+      fprintf(stderr, "featarchive: %s is not a feature archive\n", fn);
+      fatal("bad magic");
+   }
+   if ( get_u32(a->map+4) != FEATARCHIVE_VERSION )
+      fatal("featarchive: unsupported version");
+
+   a->kind = get_u32(a->map+8);
+   a->D = get_u32(a->map+12);
+   a->ntok = get_u32(a->map+16);
+   if ( a->kind != kind )
+      fatal("featarchive: archive holds the wrong kind of examples (see -token)");
+   if ( a->ntok < ntok ) {
+      fprintf(stderr, "featarchive: %s holds %d examples, the word list %d\n", fn, a->ntok, ntok);
+      fatal("archive too short");
+   }
+   if ( a->D <= 0 || FEATARCHIVE_HEADER + (size_t) a->ntok*FEATARCHIVE_ENTRY > a->len )
+      fatal("featarchive: corrupt header");
+}
+
+void featarchive_close(FeatArchive *a)
+{
+   munmap(a->map, a->len);
+   a->map = NULL;
+}
+
+// Copy of the N*D*4 bytes of example i
+static void *featarchive_copy(FeatArchive *a, int i, int *N)
+{
+   if ( i < 0 || i >= a->ntok )
+      fatal("featarchive: example index out of range");
+
+   unsigned char *e = a->map + FEATARCHIVE_HEADER + (size_t) i*FEATARCHIVE_ENTRY;
+   uint64_t offset = get_u64(e);
+   *N = get_u32(e+8);
+   size_t nbytes = (size_t) (*N)*a->D*4;
+   if ( offset > a->len || nbytes > a->len - offset )
+      fatal("featarchive: example extends past the end of the file");
+
+   void *data = MALLOC( MAX(nbytes,1) );
+   memcpy(data, a->map + offset, nbytes);
+   return data;
+}
+
+float *featarchive_feats(FeatArchive *a, int i, int *N)
+{
+   return (float *) featarchive_copy(a, i, N);
+}
+
+int *featarchive_tokens(FeatArchive *a, int i, int *N)
+{
+   return (int *) featarchive_copy(a, i, N);
+}
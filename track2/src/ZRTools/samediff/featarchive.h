@@ -0,0 +1,64 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#ifndef FEATARCHIVE_H
+#define FEATARCHIVE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Packed word example archives
+//
+// An archive holds the examples of a word list in one file, in place of
+// the per-token <dir>/<nnn>/<nnnnnn>.binary tree. It starts with a 24 byte
+// header: the magic "ZRFA", the format version, the kind of the examples,
+// the feature dimension (1 for tokens), the number of examples and a
+// reserved word. Then follows a table with one 16 byte entry per example,
+// holding the file offset of its frames and its frame count, and then the
+// frames themselves. The header and table are little endian; the frames
+// keep the native layout of the .binary files. Readers map the file once
+// and copy examples out of the mapping, so a subset job opens one file.
+
+#define FEATARCHIVE_VERSION 1
+
+enum {
+   FEATARCHIVE_FEATS = 1, // float frames of D dimensions
+   FEATARCHIVE_TOKENS = 2 // int tokens
+};
+
+typedef struct FeatArchiveWriter {
+   FILE *fp;
+   int kind, D, ntok;
+   int n; // examples added so far
+   uint64_t offset; // bytes written so far
+   unsigned char *table;
+} FeatArchiveWriter;
+
+typedef struct FeatArchive {
+   unsigned char *map;
+   size_t len;
+   int kind, D, ntok;
+} FeatArchive;
+
+// Path of example i (from 0) in the per-token directory layout
+void token_file_name(char *fn, size_t len, char *dir, int i);
+
+// Creates fn for ntok examples of the given kind
+void featarchive_open_write(FeatArchiveWriter *w, char *fn, int kind, int ntok);
+
+// Appends the next example: N frames of D values (D = 1 for tokens)
+void featarchive_add(FeatArchiveWriter *w, void *data, int N, int D);
+
+// Writes the header and table; all ntok examples must have been added
+void featarchive_close_write(FeatArchiveWriter *w);
+
+// Maps fn and checks that it holds at least ntok examples of the kind
+void featarchive_open(FeatArchive *a, char *fn, int kind, int ntok);
+void featarchive_close(FeatArchive *a);
+
+// Copies of the frames of example i (free with FREE)
+float *featarchive_feats(FeatArchive *a, int i, int *N);
+int *featarchive_tokens(FeatArchive *a, int i, int *N);
+
+#endif
@@ -0,0 +1,75 @@
+//
+// Copyright 2011-2012  Johns Hopkins University (Author: Aren Jansen)
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "util.h"
+#include "featarchive.h"
+
+char *wordlist = NULL;
+char *filedir = NULL;
+char *output = NULL;
+int token = 0;
+
+void usage()
+{
+  printf("usage: packfeats -wordlist <str> (REQUIRED)]\
+\n\t[-filedir <str> (REQUIRED)]\
+\n\t[-output <str> (REQUIRED)]\
+\n\t[-token <n> (defaults to 0)]\n");
+}
+
+void parse_args(int argc, char **argv)
+{
+  int i;
+  for( i = 1; i < argc; i++ ) 
+  {
+     if ( strcmp(argv[i], "-wordlist") == 0 ) wordlist = argv[++i];
+     else if ( strcmp(argv[i], "-filedir") == 0 ) filedir = argv[++i];
+     else if ( strcmp(argv[i], "-output") == 0 ) output = argv[++i];
+     else if ( strcmp(argv[i], "-token") == 0 ) token = atoi(argv[++i]);
+     else {
+       fprintf(stderr, "unknown arg: %s\n", argv[i]);
+       usage();
+     }
+  }
+
+  if ( !wordlist || !filedir || !output ) {
+     usage();
+     fatal("\nERROR: wordlist, filedir and output args are required");
+  }
+}
+
+int main(int argc, char **argv)
+{
+   parse_args(argc, argv);
+
+   // One example per word list line, as wordsim numbers them
+   int Nwords = file_line_count( wordlist );
+   fprintf(stderr, "Packing %d word examples from %s: ", Nwords, filedir); tic();
+
+   FeatArchiveWriter w;
+   featarchive_open_write( &w, output, token ? FEATARCHIVE_TOKENS : FEATARCHIVE_FEATS, Nwords );
+   for ( int i = 0; i < Nwords; i++ ) {
+      char featfile[200];
+      token_file_name( featfile, sizeof(featfile), filedir, i );
+
+      int N, D = 1;
+      void *data;
+      if ( token )
+	 data = readtokens_file( featfile, -1, -1, &N );
+      else
+	 data = readfeats_file2( featfile, -1, -1, &N, &D );
+      featarchive_add( &w, data, N, D );
+      FREE(data);
+   }
+   featarchive_close_write( &w );
+   fprintf(stderr, "%f s\n", toc());
+
+   int mc = get_malloc_count();
+   if(mc != 0) fprintf(stderr,"WARNING: %d malloc'd items not free'd\n", mc);
+
+   return 0;
+}
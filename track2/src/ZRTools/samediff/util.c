@@ -207,7 +207,8 @@ void *MALLOC(size_t sz)
    void *ptr = malloc(sz);
 
    if(NULL == ptr) fatal("malloc failed\n");
-   else malloc_count++;
+#pragma omp atomic
+   malloc_count++;
 
    return ptr;
 }
@@ -217,6 +218,7 @@ void FREE(void *ptr)
    if (NULL == ptr) fatal("Attempt to free NULL pointer\n");
    else free(ptr);
 
+#pragma omp atomic
    malloc_count--;
    return;
 }
@@ -9,22 +9,24 @@
 #include <limits.h>
 #include "util.h"
 #include "icsilog.h"
+#include "framedist.h"
+#include "featarchive.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define NDIV 15
 #define MAXCOST 1e10
-#define MAXFRAMES 800
 #define MAXCHAR 30
 #define N_3D 104
+#define TILE 64 // Word pairs are computed in TILE x TILE blocks
+#define LB_SLACK 1e-3 // Margin of the lower bounds for rounding
 
 char *wordlist = NULL;
 char *filedir = NULL;
 char *filedir2 = NULL;
-float simmx[MAXFRAMES*MAXFRAMES];
-float costmx[MAXFRAMES*MAXFRAMES];
-int pathmx[MAXFRAMES*MAXFRAMES];
-float costmx3D[N_3D*MAXFRAMES*MAXFRAMES];
-int pathmx3D[N_3D*MAXFRAMES*MAXFRAMES];
-int aacntmx[MAXFRAMES*MAXFRAMES];
+char *archive = NULL;
+char *archive2 = NULL;
 int subset = 0;
 int printinds = 0;
 int maxrun = INT_MAX;
@@ -42,12 +44,47 @@ float delta = 1.0;
 float *LOOKUP_TABLE = NULL;
 int nbits_log = 14;
 float spvec[N_3D];
+int nthreads = 0;
+int prune = 1;
+
+// Per-thread DTW work buffers, grown on demand. dtw and stredit keep
+// FD_ROWS rows of distances and two rows of the cost and run matrices
+// (and the backtrace only for -segnorm); dtw3D keeps the distance
+// matrix, two cost layers and the backtrace cube. X2T is the second
+// example transposed for the frame distance kernels.
+typedef struct DtwScratch {
+   float *simmx;
+   float *costmx;
+   int *aacntmx;
+   unsigned char *pathmx;
+   float *X2T;
+   float *lbrest;
+   long simcap, costcap, aacntcap, pathcap, X2Tcap, lbcap;
+   long npruned, nabandoned;
+} DtwScratch;
+
+// The word examples being compared
+typedef struct WordSet {
+   char **words;
+   int *spkr;
+   int D;
+   int *N;
+   int *N2;
+   float **examples;
+   float **examples2;
+   float **snfacts;
+   int **tokens;
+   float **env; // Lower and upper frame envelopes (see word_envelopes)
+   float **env2;
+} WordSet;
 
 void usage()
 {
   printf("usage: wordsim -wordlist <str> (REQUIRED)]\
-\n\t[-filedir <str> (REQUIRED)]\
+\n\t[-filedir <str> (REQUIRED, unless -archive)]\
 \n\t[-filedir2 <str>]\
+\n\t[-archive <str> (packfeats archive read instead of filedir)]\
+\n\t[-archive2 <str> (packfeats archive read instead of filedir2)]\
 \n\t[-subset <n> (defaults to no splitting)]\
 \n\t[-maxrun <n> (defaults to INT_MAX)]\
 \n\t[-distthr <n> (defaults to FLOAT_MAX)]\
@@ -61,7 +98,9 @@ void usage()
 \n\t[-3D <n> (defaults to 0)]\
 \n\t[-segnorm <n> (defaults to 0)]\
 \n\t[-dtw_dur_norm <n> (defaults to 1)]\
-\n\t[-printinds <n> (defaults to 0)]\n");
+\n\t[-printinds <n> (defaults to 0)]\
+\n\t[-nthreads <n> (defaults to OMP_NUM_THREADS)]\
+\n\t[-prune <n> (defaults to 1=skip pairs bounded above distthr)]\n");
 }
 
 void parse_args(int argc, char **argv)
@@ -72,6 +111,8 @@ void parse_args(int argc, char **argv)
      if ( strcmp(argv[i], "-wordlist") == 0 ) wordlist = argv[++i];
      else if ( strcmp(argv[i], "-filedir") == 0 ) filedir = argv[++i];
      else if ( strcmp(argv[i], "-filedir2") == 0 ) filedir2 = argv[++i];
+     else if ( strcmp(argv[i], "-archive") == 0 ) archive = argv[++i];
+     else if ( strcmp(argv[i], "-archive2") == 0 ) archive2 = argv[++i];
      else if ( strcmp(argv[i], "-subset") == 0 ) subset = atoi(argv[++i]);
      else if ( strcmp(argv[i], "-maxrun") == 0 ) maxrun = atoi(argv[++i]);
      else if ( strcmp(argv[i], "-distthr") == 0 ) distthr = atof(argv[++i]);
@@ -86,6 +127,8 @@ void parse_args(int argc, char **argv)
      else if ( strcmp(argv[i], "-segnorm") == 0 ) segnorm = atoi(argv[++i]);
      else if ( strcmp(argv[i], "-dtw_dur_norm") == 0 ) dtw_dur_norm = atoi(argv[++i]);
      else if ( strcmp(argv[i], "-printinds") == 0 ) printinds = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-nthreads") == 0 ) nthreads = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-prune") == 0 ) prune = atoi(argv[++i]);
      else {
        fprintf(stderr, "unknown arg: %s\n", argv[i]);
        usage();
@@ -97,9 +140,9 @@ void parse_args(int argc, char **argv)
      fatal("\nERROR: wordlist arg is required");
   }
 
-  if ( !filedir ) {
+  if ( !filedir && !archive ) {
      usage();
-     fatal("\nERROR: filedir arg is required");
+     fatal("\nERROR: filedir or archive arg is required");
   }
 
   if ( subset > NDIV*NDIV )
@@ -113,51 +156,141 @@ void parse_args(int argc, char **argv)
   }     
 }
 
-float dtw3D( float *X1, int N1, float *X2, int N2, int D, int dump )
-{  
-   for ( int i = 0; i < N1; i++ ) {
-      for ( int j = 0; j < N2; j++ ) {
-	 simmx[i*N2+j] = 0;
-	 for ( int d = 0; d < D; d++ ) {
-	    simmx[i*N2+j] += X1[i*D+d]*X2[j*D+d];
-	 }
-	 simmx[i*N2+j] = (1-simmx[i*N2+j])/2;
-	 if ( simmx[i*N2+j] > delta )
-	    simmx[i*N2+j] = 1.0e6;
-      } 
+void dtw_scratch_init( DtwScratch *ws )
+{
+   ws->simmx = NULL;
+   ws->costmx = NULL;
+   ws->aacntmx = NULL;
+   ws->pathmx = NULL;
+   ws->X2T = NULL;
+   ws->lbrest = NULL;
+   ws->simcap = ws->costcap = ws->aacntcap = ws->pathcap = ws->X2Tcap = ws->lbcap = 0;
+   ws->npruned = ws->nabandoned = 0;
+}
+
+void dtw_scratch_free( DtwScratch *ws )
+{
+   if ( ws->simmx ) FREE(ws->simmx);
+   if ( ws->costmx ) FREE(ws->costmx);
+   if ( ws->aacntmx ) FREE(ws->aacntmx);
+   if ( ws->pathmx ) FREE(ws->pathmx);
+   if ( ws->X2T ) FREE(ws->X2T);
+   if ( ws->lbrest ) FREE(ws->lbrest);
+   dtw_scratch_init(ws);
+}
+
+// Returns buf with room for n elements of sz bytes (the old contents are
+// dropped when it grows)
+void *reserve( void *buf, long *cap, long n, size_t sz )
+{
+   if ( n <= *cap )
+      return buf;
+   if ( buf ) FREE(buf);
+   *cap = MAX(n, 2*(*cap));
+   return MALLOC( (*cap)*sz );
+}
+
+// Distance between the frames x and y under the selected measure
+float frame_dist( float *x, float *y, int D )
+{
+   float s = 0;
+
+   if ( euclidean ) {
+      for ( int d = 0; d < D; d++ )
+	 s += powf(x[d]-y[d],2);
+      s = sqrt(s);
+   } else if ( kldiv ) {
+      if ( sym ) {
+	 for ( int d = 0; d < D; d++ )
+	    s += 0.5*(x[d]-y[d])*icsi_log(x[d]/y[d],LOOKUP_TABLE,nbits_log);
+      } else {
+	 for ( int d = 0; d < D; d++ )
+	    s += x[d]*icsi_log(x[d]/y[d],LOOKUP_TABLE,nbits_log);
+      }
+   } else if ( mit ) {
+      for ( int d = 0; d < D; d++ )
+	 s += x[d]*y[d];
+      s = -icsi_log(s,LOOKUP_TABLE,nbits_log);
+   } else {
+      for ( int d = 0; d < D; d++ )
+	 s += x[d]*y[d];
+      s = (1-s)/2;
+      if ( s > delta )
+	 s = 1.0e6;
    }
 
-   for ( int i = 0; i < N1; i++ ) {
-      for ( int j = 0; j < N2; j++ ) {
-	 for ( int k = 0; k < N_3D; k++ ) {
-	    costmx3D[k*N1*N2+i*N2+j] = 100;
-	 }
+   return s;
+}
+
+// Distances of the nrows frames of X1 to the N2 frames of X2 (X2T is
+// X2 transposed) into sim, one row of N2 per frame of X1
+void frame_dist_rows( float *sim, float *X1, int nrows, float *X2, float *X2T, int N2, int D )
+{
+   long n = (long) nrows*N2;
+
+   if ( euclidean ) {
+      frames_sqdist( sim, N2, X1, nrows, X2T, N2, D );
+      for ( long k = 0; k < n; k++ )
+	 sim[k] = sqrt(sim[k]);
+   } else if ( kldiv ) {
+      for ( int r = 0; r < nrows; r++ )
+	 for ( int j = 0; j < N2; j++ )
+	    sim[r*N2+j] = frame_dist( X1+r*D, X2+j*D, D );
+   } else if ( mit ) {
+      frames_dot( sim, N2, X1, nrows, X2T, N2, D );
+      for ( long k = 0; k < n; k++ )
+	 sim[k] = -icsi_log(sim[k],LOOKUP_TABLE,nbits_log);
+   } else {
+      frames_dot( sim, N2, X1, nrows, X2T, N2, D );
+      for ( long k = 0; k < n; k++ ) {
+	 sim[k] = (1-sim[k])/2;
+	 if ( sim[k] > delta )
+	    sim[k] = 1.0e6;
       }
    }
+}
+
+float dtw3D( float *X1, int N1, float *X2, int N2, int D, int dump, DtwScratch *ws )
+{  
+   // The full distance matrix and backtrace cube, but only the layers k-1
+   // and k of the cost cube
+   long NN = (long) N1*N2;
+   ws->simmx = (float *) reserve( ws->simmx, &ws->simcap, NN, sizeof(float) );
+   ws->costmx = (float *) reserve( ws->costmx, &ws->costcap, 2*NN, sizeof(float) );
+   ws->pathmx = (unsigned char *) reserve( ws->pathmx, &ws->pathcap, N_3D*NN, 1 );
+   ws->X2T = (float *) reserve( ws->X2T, &ws->X2Tcap, (long) frames_stride(N2)*D, sizeof(float) );
+   float *simmx = ws->simmx;
+   float *cost[2] = { ws->costmx, ws->costmx+NN };
+   unsigned char *pathmx3D = ws->pathmx;
+
+   // Always the cosine distance
+   frames_transpose( ws->X2T, X2, N2, D );
+   frames_dot( simmx, N2, X1, N1, ws->X2T, N2, D );
+   for ( long k = 0; k < NN; k++ ) {
+      simmx[k] = (1-simmx[k])/2;
+      if ( simmx[k] > delta )
+	 simmx[k] = 1.0e6;
+   }
 
-   // Initialize edges of the cube
-   costmx3D[0] = spvec[0]*simmx[0];
+   // Initialize the i-j side of the cube
+   float *c = cost[0];
+   c[0] = spvec[0]*simmx[0];
 
    for ( int i = 1; i < N1; i++ ) {
-      costmx3D[i*N2] = costmx3D[(i-1)*N2] + spvec[0]*simmx[i*N2];
+      c[i*N2] = c[(i-1)*N2] + spvec[0]*simmx[i*N2];
    }
 
    for ( int j = 1; j < N2; j++ ) {
-      costmx3D[j] = costmx3D[j-1] + spvec[0]*simmx[j];
+      c[j] = c[j-1] + spvec[0]*simmx[j];
    }
 
-   for ( int k = 1; k < N_3D; k++ ) {
-      costmx3D[k*N1*N2] = 100; // Illegal to increment k without incrementing i or j
-   }
-
-   // Initialize i-j size of the cube
    for ( int i = 1; i < N1; i++ ) {
       for ( int j = 1; j < N2; j++ ) {
-	 float dcost = costmx3D[(i-1)*N2+(j-1)] + spvec[0]*simmx[i*N2+j];
-	 float vcost = costmx3D[(i-1)*N2+j] + spvec[0]*simmx[i*N2+j];
-	 float hcost = costmx3D[i*N2+(j-1)] + spvec[0]*simmx[i*N2+j];
+	 float dcost = c[(i-1)*N2+(j-1)] + spvec[0]*simmx[i*N2+j];
+	 float vcost = c[(i-1)*N2+j] + spvec[0]*simmx[i*N2+j];
+	 float hcost = c[i*N2+(j-1)] + spvec[0]*simmx[i*N2+j];
 
-	 costmx3D[i*N2+j] = MIN(dcost, MIN(hcost, vcost));
+	 c[i*N2+j] = MIN(dcost, MIN(hcost, vcost));
 
 	 if ( dcost <= vcost && dcost <= hcost )
 	    pathmx3D[i*N2+j] = 4;
@@ -168,65 +301,66 @@ float dtw3D( float *X1, int N1, float *X2, int N2, int D, int dump )
       }
    }
 
-   // Initialize i-k size of the cube
    for ( int k = 1; k < N_3D; k++ ) {
+      float *cp = cost[(k-1)&1];
+      c = cost[k&1];
+      unsigned char *path = pathmx3D + k*NN;
+
+      c[0] = 100; // Illegal to increment k without incrementing i or j
+
+      // i-k side of the cube
       for ( int i = 1; i < N1; i++ ) {
-	 float dcost = costmx3D[(k-1)*N1*N2+(i-1)*N2] + spvec[k]*simmx[i*N2];
-	 float hcost = costmx3D[k*N1*N2+(i-1)*N2] + spvec[k]*simmx[i*N2];
+	 float dcost = cp[(i-1)*N2] + spvec[k]*simmx[i*N2];
+	 float hcost = c[(i-1)*N2] + spvec[k]*simmx[i*N2];
 
-	 costmx3D[k*N1*N2+i*N2] = MIN(hcost, dcost);
+	 c[i*N2] = MIN(hcost, dcost);
 
 	 if ( dcost <= hcost )
-	    pathmx3D[k*N1*N2+i*N2] = 3;
+	    path[i*N2] = 3;
 	 else
-	    pathmx3D[k*N1*N2+i*N2] = 6;
+	    path[i*N2] = 6;
       }
-   }
 
-   // Initialize j-k size of the cube
-   for ( int k = 1; k < N_3D; k++ ) {
+      // j-k side of the cube
       for ( int j = 1; j < N2; j++ ) {
-	 float dcost = costmx3D[(k-1)*N1*N2+(j-1)] + spvec[k]*simmx[j];
-	 float hcost = costmx3D[k*N1*N2+(j-1)] + spvec[k]*simmx[j];
+	 float dcost = cp[j-1] + spvec[k]*simmx[j];
+	 float hcost = c[j-1] + spvec[k]*simmx[j];
 
-	 costmx3D[k*N1*N2+j] = MIN(dcost, hcost);
+	 c[j] = MIN(dcost, hcost);
 
 	 if ( dcost <= hcost )
-	    pathmx3D[k*N1*N2+j] = 2;
+	    path[j] = 2;
 	 else
-	    pathmx3D[k*N1*N2+j] = 5;
+	    path[j] = 5;
       }
-   }
 
-     
-   for ( int k = 1; k < N_3D; k++ ) {
       for ( int i = 1; i < N1; i++ ) {
 	 for ( int j = 1; j < N2; j++ ) {
-	    float dcostA = costmx3D[(k-1)*N1*N2+(i-1)*N2+(j-1)] + spvec[k]*simmx[i*N2+j];
-	    float vcostA = costmx3D[(k-1)*N1*N2+(i-1)*N2+j] + spvec[k]*simmx[i*N2+j];
-	    float hcostA = costmx3D[(k-1)*N1*N2+i*N2+(j-1)] + spvec[k]*simmx[i*N2+j];
+	    float dcostA = cp[(i-1)*N2+(j-1)] + spvec[k]*simmx[i*N2+j];
+	    float vcostA = cp[(i-1)*N2+j] + spvec[k]*simmx[i*N2+j];
+	    float hcostA = cp[i*N2+(j-1)] + spvec[k]*simmx[i*N2+j];
 
-	    float dcostB = costmx3D[k*N1*N2+(i-1)*N2+(j-1)] + spvec[k]*simmx[i*N2+j];  
-	    float vcostB = costmx3D[k*N1*N2+(i-1)*N2+j] + spvec[k]*simmx[i*N2+j];
-	    float hcostB = costmx3D[k*N1*N2+i*N2+(j-1)] + spvec[k]*simmx[i*N2+j];
+	    float dcostB = c[(i-1)*N2+(j-1)] + spvec[k]*simmx[i*N2+j];  
+	    float vcostB = c[(i-1)*N2+j] + spvec[k]*simmx[i*N2+j];
+	    float hcostB = c[i*N2+(j-1)] + spvec[k]*simmx[i*N2+j];
 
-	    costmx3D[k*N1*N2+i*N2+j] = MIN( MIN( dcostA, MIN(vcostA, hcostA) ), 
-					    MIN( dcostB, MIN(vcostB, hcostB) ) );
+	    c[i*N2+j] = MIN( MIN( dcostA, MIN(vcostA, hcostA) ), 
+			     MIN( dcostB, MIN(vcostB, hcostB) ) );
 
 	    if ( MIN( dcostA, MIN(vcostA, hcostA)) <= MIN( dcostB, MIN(vcostB, hcostB) ) ) {
 	       if ( dcostA <= vcostA && dcostA <= hcostA )
-		  pathmx3D[k*N1*N2+i*N2+j] = 1;
+		  path[i*N2+j] = 1;
 	       else if ( hcostA <= vcostA )
-		  pathmx3D[k*N1*N2+i*N2+j] = 2;
+		  path[i*N2+j] = 2;
 	       else
-		  pathmx3D[k*N1*N2+i*N2+j] = 3;
+		  path[i*N2+j] = 3;
 	    } else {
 	       if ( dcostB <= vcostB && dcostB <= hcostB )
-		  pathmx3D[k*N1*N2+i*N2+j] = 4;
+		  path[i*N2+j] = 4;
 	       else if ( hcostB <= vcostB )
-		  pathmx3D[k*N1*N2+i*N2+j] = 5;
+		  path[i*N2+j] = 5;
 	       else
-		  pathmx3D[k*N1*N2+i*N2+j] = 6;	       
+		  path[i*N2+j] = 6;	       
 	    }
 	 }
       }
@@ -238,7 +372,7 @@ float dtw3D( float *X1, int N1, float *X2, int N2, int D, int dump )
    float sum1=0;
    float sum2=0;
    while ( curri && currj && currk ) {
-      int p = pathmx3D[currk*N1*N2+curri*N2+currj];
+      int p = pathmx3D[currk*NN+curri*N2+currj];
       if ( p == 1 ) {
 	 currk--; curri--; currj--;
       } else if ( p == 2 ) {
@@ -265,150 +399,92 @@ float dtw3D( float *X1, int N1, float *X2, int N2, int D, int dump )
    float p = sum1/(sum1+sum2);
    float entcorr = -p*log2(p) - (1-p)*log2(1-p);
 
-   return costmx3D[N_3D*N1*N2-1]/((N_3D-1)/2)/entcorr;
+   return c[NN-1]/((N_3D-1)/2)/entcorr;
 }
 
-float dtw( float *X1, int N1, float *X2, int N2, int D, float *fact1, float *fact2 )
+// With rest set, the recursion stops and returns INFINITY as soon as
+// the cheapest path through row i plus rest[i], a lower bound on the
+// cost of the remaining frames of X1, exceeds limit
+float dtw( float *X1, int N1, float *X2, int N2, int D, float *fact1, float *fact2, 
+	   float *rest, float limit, DtwScratch *ws )
 {   
-   if ( euclidean ) {
-      for ( int i = 0; i < N1; i++ ) {
-	 for ( int j = 0; j < N2; j++ ) {
-	    simmx[i*N2+j] = 0;
-	    for ( int d = 0; d < D; d++ ) {
-	       simmx[i*N2+j] += powf(X1[i*D+d]-X2[j*D+d],2);
-	    }
-	    simmx[i*N2+j] = sqrt(simmx[i*N2+j]);
-	 }
-      } 
-   } else if ( kldiv ) {
-      if ( sym ) {
-	 for ( int i = 0; i < N1; i++ ) {
-	    for ( int j = 0; j < N2; j++ ) {
-	       simmx[i*N2+j] = 0;
-	       for ( int d = 0; d < D; d++ ) {
-		  simmx[i*N2+j] += 
-		     0.5*(X1[i*D+d]-X2[j*D+d])*icsi_log(X1[i*D+d]/X2[j*D+d],
-							LOOKUP_TABLE,nbits_log);
-	       }
-	    }
-	 } 
-      } else {
-	 for ( int i = 0; i < N1; i++ ) {
-	    for ( int j = 0; j < N2; j++ ) {
-	       simmx[i*N2+j] = 0;
-	       for ( int d = 0; d < D; d++ ) {
-		  simmx[i*N2+j] += 
-		     X1[i*D+d]*icsi_log(X1[i*D+d]/X2[j*D+d],
-					LOOKUP_TABLE,nbits_log);
-	       }
-	    }
-	 } 
-      }
-   } else if ( mit ) {
-      for ( int i = 0; i < N1; i++ ) {
-	 for ( int j = 0; j < N2; j++ ) {
-	    simmx[i*N2+j] = 0;
-	    for ( int d = 0; d < D; d++ ) {
-	       simmx[i*N2+j] += X1[i*D+d]*X2[j*D+d];
-	    }
-	    simmx[i*N2+j] = -icsi_log(simmx[i*N2+j],
-				      LOOKUP_TABLE,nbits_log);
-	 }
-      } 
-   } else {
-      for ( int i = 0; i < N1; i++ ) {
-	 for ( int j = 0; j < N2; j++ ) {
-	    simmx[i*N2+j] = 0;
-	    for ( int d = 0; d < D; d++ ) {
-	       simmx[i*N2+j] += X1[i*D+d]*X2[j*D+d];
-	    }
-	    simmx[i*N2+j] = (1-simmx[i*N2+j])/2;
-	    if ( simmx[i*N2+j] > delta )
-	       simmx[i*N2+j] = 1.0e6;	    
-	 }
-      } 
+   // A block of FD_ROWS rows of distances and two rows of the cost and
+   // run matrices; the backtrace is kept only when -segnorm follows the
+   // path
+   ws->simmx = (float *) reserve( ws->simmx, &ws->simcap, (long) FD_ROWS*N2, sizeof(float) );
+   ws->X2T = (float *) reserve( ws->X2T, &ws->X2Tcap, (long) frames_stride(N2)*D, sizeof(float) );
+   ws->costmx = (float *) reserve( ws->costmx, &ws->costcap, 2*(N2+1), sizeof(float) );
+   ws->aacntmx = (int *) reserve( ws->aacntmx, &ws->aacntcap, 2*(N2+1), sizeof(int) );
+   unsigned char *pathmx = NULL;
+   if ( segnorm ) {
+      ws->pathmx = (unsigned char *) reserve( ws->pathmx, &ws->pathcap, (long)(N1+1)*(N2+1), 1 );
+      pathmx = ws->pathmx;
    }
+   frames_transpose( ws->X2T, X2, N2, D );
 
    N1++;
    N2++;
-   for ( int i = 0; i < N1; i++ ) {
-      for ( int j = 0; j < N2; j++ ) {
-	 aacntmx[i*N2+j] = 0;
-	 costmx[i*N2+j] = 0;
-	 pathmx[i*N2+j] = 0;
-      }
-   }
-
-   for ( int i = 0; i < N1; i++ ) {
-      aacntmx[i*N2] = i;
-      if ( i == 0 )
-	 costmx[i*N2] = 0;
-      else {
-	 costmx[i*N2] = MAXCOST;
-	 pathmx[i*N2] = 0;
-      }
-   }
+   float *cost[2] = { ws->costmx, ws->costmx+N2 };
+   int *aacnt[2] = { ws->aacntmx, ws->aacntmx+N2 };
 
    for ( int j = 0; j < N2; j++ ) {
-      aacntmx[j] = j;
+      aacnt[0][j] = j;
       if ( j == 0 )
-	 costmx[j] = 0;      
-      else {
-	 costmx[j] = MAXCOST;
-	 pathmx[j] = 0;
-      }      
+	 cost[0][j] = 0;      
+      else
+	 cost[0][j] = MAXCOST;
    }
       
    for ( int i = 1; i < N1; i++ ) {
+      float *c = cost[i&1], *cp = cost[(i-1)&1];
+      int *a = aacnt[i&1], *ap = aacnt[(i-1)&1];
+
+      // Distances of frames i-1 onwards, FD_ROWS frames at a time
+      if ( (i-1) % FD_ROWS == 0 )
+	 frame_dist_rows( ws->simmx, X1+(i-1)*D, MIN(FD_ROWS, N1-i), X2, ws->X2T, N2-1, D );
+      float *simrow = ws->simmx + ((i-1) % FD_ROWS)*(N2-1);
+
+      c[0] = MAXCOST;
+      a[0] = i;
+      float rowmin = MAXCOST;
       for ( int j = 1; j < N2; j++ ) {
-	 float dcost = costmx[(i-1)*N2+(j-1)] + simmx[(i-1)*(N2-1)+j-1];
-	 float vcost = costmx[(i-1)*N2+j] + simmx[(i-1)*(N2-1)+j-1];
-	 float hcost = costmx[i*N2+(j-1)] + simmx[(i-1)*(N2-1)+j-1];
+	 float dcost = cp[j-1] + simrow[j-1];
+	 float vcost = cp[j] + simrow[j-1];
+	 float hcost = c[j-1] + simrow[j-1];
 
-	 if ( aacntmx[(i-1)*N2+j] + 1 >= maxrun )
+	 if ( ap[j] + 1 >= maxrun )
 	    vcost = MAXCOST;
 
-	 if ( aacntmx[i*N2+(j-1)] + 1 >= maxrun )
+	 if ( a[j-1] + 1 >= maxrun )
 	    hcost = MAXCOST;
 
-	 costmx[i*N2+j] = MIN( dcost, MIN(vcost, hcost) );
+	 c[j] = MIN( dcost, MIN(vcost, hcost) );
+	 rowmin = MIN(rowmin, c[j]);
 
+	 a[j] = 0;
 	 if ( vcost < dcost || hcost < dcost ) {
 	    if ( vcost < hcost ) {
-	       aacntmx[i*N2+j] = aacntmx[(i-1)*N2+j] + 1;
+	       a[j] = ap[j] + 1;
 	    } else {
-	       aacntmx[i*N2+j] = aacntmx[i*N2+(j-1)] + 1;
+	       a[j] = a[j-1] + 1;
 	    }
 	 } 
 
-	 if ( dcost <= vcost && dcost <= hcost )
-	    pathmx[i*N2+j] = 1;
-	 else if ( hcost <= vcost )
-	    pathmx[i*N2+j] = 2;
-	 else
-	    pathmx[i*N2+j] = 3;
-      }
-   } 
-
-   if ( 0 ) {
-      for ( int i = 0; i < N1; i++ ) {
-	 for ( int j = 0; j < N2; j++ ) {
-	    printf( "%d ", pathmx[i*N2+j] );
+	 if ( pathmx ) {
+	    if ( dcost <= vcost && dcost <= hcost )
+	       pathmx[i*N2+j] = 1;
+	    else if ( hcost <= vcost )
+	       pathmx[i*N2+j] = 2;
+	    else
+	       pathmx[i*N2+j] = 3;
 	 }
-	 printf("\n");
-      } 
-      fatal("");
-   }
+      }
 
-   if ( 0 ) {
-      for ( int i = 0; i < N1; i++ ) {
-	 for ( int j = 0; j < N2; j++ ) {
-	    printf( "%f ", costmx[i*N2+j] );
-	 }
-	 printf("\n");
-      } 
-      fatal("");
-   }
+      if ( rest && rowmin + rest[i] > limit ) {
+	 ws->nabandoned++;
+	 return INFINITY;
+      }
+   } 
 
    if ( segnorm ) {
       int curri = N1-1;
@@ -418,7 +494,8 @@ float dtw( float *X1, int N1, float *X2, int N2, int D, float *fact1, float *fac
       float pathlen = 0;
       while ( curri && currj ) {
 	 pathlen++;
-	 num += simmx[(curri-1)*(N2-1)+(currj-1)]*sqrt(powf(fact1[curri-1],2)+powf(fact2[currj-1],2)); 
+	 float sim = frame_dist( X1+(curri-1)*D, X2+(currj-1)*D, D );
+	 num += sim*sqrt(powf(fact1[curri-1],2)+powf(fact2[currj-1],2)); 
 	 den += sqrt(powf(fact1[curri-1],2)+powf(fact2[currj-1],2)); 
 
 	 int p = pathmx[curri*N2+currj];
@@ -436,79 +513,287 @@ float dtw( float *X1, int N1, float *X2, int N2, int D, float *fact1, float *fac
    }
 
    if ( dtw_dur_norm )      
-      return costmx[N1*N2-1]/(N1+N2-2);
+      return cost[(N1-1)&1][N2-1]/(N1+N2-2);
    else
-      return costmx[N1*N2-1];
+      return cost[(N1-1)&1][N2-1];
 }
 
-float stredit( int *X1, int N1, int *X2, int N2 )
+float stredit( int *X1, int N1, int *X2, int N2, DtwScratch *ws )
 {   
+   // Two rows of the cost and run matrices
+   ws->costmx = (float *) reserve( ws->costmx, &ws->costcap, 2*(N2+1), sizeof(float) );
+   ws->aacntmx = (int *) reserve( ws->aacntmx, &ws->aacntcap, 2*(N2+1), sizeof(int) );
+
    N1++;
    N2++;
-   for ( int i = 0; i < N1; i++ ) {
-      for ( int j = 0; j < N2; j++ ) {
-	 aacntmx[i*N2+j] = 0;
-	 costmx[i*N2+j] = 0;
-      }
-   }
-
-   for ( int i = 0; i < N1; i++ ) {
-      aacntmx[i*N2] = i;
-      if ( i == 0 )
-	 costmx[i*N2] = 0;
-      else 
-	 costmx[i*N2] = MAXCOST;
-   }
+   float *cost[2] = { ws->costmx, ws->costmx+N2 };
+   int *aacnt[2] = { ws->aacntmx, ws->aacntmx+N2 };
 
    for ( int j = 0; j < N2; j++ ) {
-      aacntmx[j] = j;
+      aacnt[0][j] = j;
       if ( j == 0 )
-	 costmx[j] = 0;      
+	 cost[0][j] = 0;      
       else
-	 costmx[j] = MAXCOST;
+	 cost[0][j] = MAXCOST;
    }
       
    for ( int i = 1; i < N1; i++ ) {
+      float *c = cost[i&1], *cp = cost[(i-1)&1];
+      int *a = aacnt[i&1], *ap = aacnt[(i-1)&1];
+
+      c[0] = MAXCOST;
+      a[0] = i;
       for ( int j = 1; j < N2; j++ ) {
-	 float dcost = costmx[(i-1)*N2+(j-1)] + (X1[i] != X2[j]);
-	 float vcost = costmx[(i-1)*N2+j] + (X1[i] != X2[j]);
-	 float hcost = costmx[i*N2+(j-1)] + (X1[i] != X2[j]);
+	 float dcost = cp[j-1] + (X1[i] != X2[j]);
+	 float vcost = cp[j] + (X1[i] != X2[j]);
+	 float hcost = c[j-1] + (X1[i] != X2[j]);
 
-	 if ( aacntmx[(i-1)*N2+j] + 1 >= maxrun )
+	 if ( ap[j] + 1 >= maxrun )
 	    vcost = MAXCOST;
 
-	 if ( aacntmx[i*N2+(j-1)] + 1 >= maxrun )
+	 if ( a[j-1] + 1 >= maxrun )
 	    hcost = MAXCOST;
 
-	 costmx[i*N2+j] = MIN( dcost, MIN(vcost, hcost) );
+	 c[j] = MIN( dcost, MIN(vcost, hcost) );
 
+	 a[j] = 0;
 	 if ( vcost < dcost || hcost < dcost ) {
 	    if ( vcost < hcost ) {
-	       aacntmx[i*N2+j] = aacntmx[(i-1)*N2+j] + 1;
+	       a[j] = ap[j] + 1;
 	    } else {
-	       aacntmx[i*N2+j] = aacntmx[i*N2+(j-1)] + 1;
+	       a[j] = a[j-1] + 1;
 	    }
 	 } 
       }
    } 
 
-   if ( 0 ) {
-      for ( int i = 0; i < N1; i++ ) {
-	 for ( int j = 0; j < N2; j++ ) {
-	    printf( "%f ", costmx[i*N2+j] );
+   return cost[(N1-1)&1][N2-1]/(N1+N2-2);
+}
+
+// Per-dimension minimum (first D values) and maximum (last D values) over
+// the N frames of X, or NULL when X holds non-finite values
+float *frame_envelope( float *X, int N, int D )
+{
+   for ( long k = 0; k < (long) N*D; k++ )
+      if ( !isfinite(X[k]) )
+	 return NULL;
+
+   float *env = (float *) MALLOC( 2*D*sizeof(float) );
+   for ( int d = 0; d < D; d++ ) {
+      env[d] = env[D+d] = X[d];
+      for ( int n = 1; n < N; n++ ) {
+	 env[d] = MIN(env[d], X[n*D+d]);
+	 env[D+d] = MAX(env[D+d], X[n*D+d]);
+      }
+   }
+   return env;
+}
+
+// Lower bound on the distance from frame x to any frame within env
+float frame_lb( float *x, float *env, int D )
+{
+   float *L = env;
+   float *U = env+D;
+   float s = 0;
+
+   if ( euclidean ) {
+      for ( int d = 0; d < D; d++ ) {
+	 float e = MAX(L[d]-x[d], 0) + MAX(x[d]-U[d], 0);
+	 s += e*e;
+      }
+      return sqrt(s);
+   }
+
+   // Largest inner product with a unit frame in the box
+   for ( int d = 0; d < D; d++ )
+      s += MAX(x[d]*U[d], x[d]*L[d]);
+   s = (1-s)/2;
+   if ( s > delta + LB_SLACK )
+      return 1.0e6;
+   return MAX(s, 0);
+}
+
+// Whether the lower bounds apply: they need distances that are never
+// negative (Euclidean, or cosine between unit frames) and a path cost
+// that is a plain sum of them. Overflowed distances print as 1+jitter, so
+// only a threshold below 1 lets a pair be dropped unseen.
+int use_bounds()
+{
+   return prune && distthr < 1 && !token && !usedtw3D && !segnorm && !kldiv && !mit 
+      && ( euclidean || normalize );
+}
+
+// Fills set->env (and set->env2) for the examples in the row and column
+// ranges
+void word_envelopes( WordSet *set, int rA, int rB, int cA, int cB, int Nwords )
+{
+   set->env = (float **) MALLOC( Nwords*sizeof(float *) );
+   memset(set->env,0,Nwords*sizeof(float *));
+   if ( set->examples2 ) {
+      set->env2 = (float **) MALLOC( Nwords*sizeof(float *) );
+      memset(set->env2,0,Nwords*sizeof(float *));
+   }
+
+   for ( int i = 0; i < Nwords; i++ ) {
+      if ( !( i >= rA && i < rB ) && !( i >= cA && i < cB ) )
+	 continue;
+      if ( set->examples[i] )
+	 set->env[i] = frame_envelope( set->examples[i], set->N[i], set->D );
+      if ( set->examples2 && set->examples2[i] )
+	 set->env2[i] = frame_envelope( set->examples2[i], set->N2[i], set->D );
+   }
+}
+
+void free_envelopes( WordSet *set, int Nwords )
+{
+   for ( int i = 0; i < Nwords; i++ ) {
+      if ( set->env[i] ) FREE(set->env[i]);
+      if ( set->env2 && set->env2[i] ) FREE(set->env2[i]);
+   }
+   FREE(set->env);
+   if ( set->env2 ) FREE(set->env2);
+   set->env = set->env2 = NULL;
+}
+
+// Distance between word examples i and j. With envelopes, a pair whose
+// distance provably exceeds distthr returns INFINITY without (or partway
+// through) its DTW.
+float word_dist( WordSet *set, int i, int j, DtwScratch *ws )
+{
+   if ( token )
+      return stredit( set->tokens[i], set->N[i], set->tokens[j], set->N[j], ws );
+
+   float *fact1 = set->snfacts[i];
+   float *fact2 = set->snfacts[j];
+
+   if ( usedtw3D )
+      return dtw3D( set->examples[i], set->N[i], set->examples[j], set->N[j], set->D, 0, ws );
+
+   int D = set->D;
+   float *X1 = set->examples[i];
+   float *X2 = set->examples2 ? set->examples2[j] : set->examples[j];
+   int N1 = set->N[i];
+   int N2 = set->examples2 ? set->N2[j] : set->N[j];
+   float *env1 = set->env ? set->env[i] : NULL;
+   float *env2 = set->env ? ( set->examples2 ? set->env2[j] : set->env[j] ) : NULL;
+
+   if ( !env1 || !env2 )
+      return dtw( X1, N1, X2, N2, D, fact1, fact2, NULL, 0, ws );
+
+   float limit = distthr*(1+LB_SLACK) + LB_SLACK;
+   if ( dtw_dur_norm )
+      limit *= N1+N2;
+
+   // A path with runs shorter than maxrun between diagonal steps cannot
+   // stretch a word by more than maxrun, and costs at least MAXCOST
+   if ( MAX(N1,N2) > (long) MIN(N1,N2)*maxrun ) {
+      ws->npruned++;
+      return INFINITY;
+   }
+
+   // Every frame of either word is on the path, at no less than its
+   // distance to the envelope of the other word
+   ws->lbrest = (float *) reserve( ws->lbrest, &ws->lbcap, N1+1, sizeof(float) );
+   float *rest = ws->lbrest;
+   rest[N1] = 0;
+   for ( int n = N1-1; n >= 0; n-- )
+      rest[n] = rest[n+1] + frame_lb( X1+n*D, env2, D );
+   float colsum = 0;
+   for ( int n = 0; n < N2 && colsum <= limit; n++ )
+      colsum += frame_lb( X2+n*D, env1, D );
+
+   if ( rest[0] > limit || colsum > limit ) {
+      ws->npruned++;
+      return INFINITY;
+   }
+
+   return dtw( X1, N1, X2, N2, D, fact1, fact2, rest, limit, ws );
+}
+
+// Prints the distances of the pairs i < j in (rA,rB) x (cA,cB), row by
+// row. Each block of TILE rows is split into TILE-column tiles that the
+// threads compute into a buffer; the block is then printed in order, so
+// the output does not depend on the thread count.
+void compute_similarities( WordSet *set, int rA, int rB, int cA, int cB )
+{
+   int nworkers = 1;
+#ifdef _OPENMP
+   nworkers = omp_get_max_threads();
+#endif
+   DtwScratch *scratch = (DtwScratch *) MALLOC( nworkers*sizeof(DtwScratch) );
+   for ( int w = 0; w < nworkers; w++ )
+      dtw_scratch_init(&scratch[w]);
+
+   int ncols = MAX(cB-cA, 1);
+   float *dist = (float *) MALLOC( TILE*ncols*sizeof(float) );
+   long npairs = 0;
+
+   int pctstep = MAX((rB-rA)/10, 1);
+   for ( int i0 = rA; i0 < rB; i0 += TILE ) {
+      int i1 = MIN(rB, i0+TILE);
+      int jA = MAX(cA, i0+1);
+      int ntiles = jA < cB ? (cB-jA+TILE-1)/TILE : 0;
+
+#pragma omp parallel for schedule(dynamic,1)
+      for ( int t = 0; t < ntiles; t++ ) {
+	 int w = 0;
+#ifdef _OPENMP
+	 w = omp_get_thread_num();
+#endif
+	 int j0 = jA + t*TILE;
+	 int j1 = MIN(cB, j0+TILE);
+	 for ( int i = i0; i < i1; i++ )
+	    for ( int j = MAX(j0, i+1); j < j1; j++ )
+	       dist[(i-i0)*ncols+(j-cA)] = word_dist( set, i, j, &scratch[w] );
+      }
+
+      for ( int i = i0; i < i1; i++ ) {
+	 if ( ((i-rA+1) % pctstep) == 0 )
+	    fprintf(stderr,".");
+
+	 for ( int j = MAX(cA, i+1); j < cB; j++ ) {
+	    float d = dist[(i-i0)*ncols+(j-cA)];
+	    npairs++;
+
+	    if ( !token ) {
+	       if ( d > 1000 ) 
+		  d = 1+(((float)rand())/RAND_MAX)*0.001;
+
+	       if ( d > distthr )
+		  continue;
+	    }
+
+	    int sw = !strcmp( set->words[i], set->words[j] );
+	    int sp = set->spkr[i] == set->spkr[j];
+	    if ( printinds )
+	       printf("%f %d %d %d %d\n", d, sw, sp, i+1, j+1);
+	    else
+	       printf("%f %d %d\n", d, sw, sp);
 	 }
-	 printf("\n");
-      } 
-      fatal("");
+      }
+   }
+
+   FREE(dist);
+   long npruned = 0, nabandoned = 0;
+   for ( int w = 0; w < nworkers; w++ ) {
+      npruned += scratch[w].npruned;
+      nabandoned += scratch[w].nabandoned;
+      dtw_scratch_free(&scratch[w]);
    }
-   
-   return costmx[N1*N2-1]/(N1+N2-2);
+   FREE(scratch);
+
+   if ( set->env )
+      fprintf(stderr, " (%ld of %ld pairs pruned, %ld abandoned)", npruned, npairs, nabandoned);
 }
 
 int main(int argc, char **argv)
 { 
    parse_args(argc, argv);
 
+#ifdef _OPENMP
+   if ( nthreads > 0 ) omp_set_num_threads(nthreads);
+#endif
+
    //fprintf(stderr,"spvec: ");
    for ( int k = 0; k < N_3D; k++ ) {
       spvec[k] = ((k+1) % 5) == 0;
@@ -573,9 +858,17 @@ int main(int argc, char **argv)
       float **snfacts = (float **) MALLOC( Nwords*sizeof(float *) );
       memset(snfacts,0,Nwords*sizeof(float *));
 
+      // An archive is mapped once; examples are copied out of it since
+      // they are normalized in place
+      FeatArchive fa, fa2;
+      if ( archive )
+	 featarchive_open( &fa, archive, FEATARCHIVE_FEATS, Nwords );
+      if ( archive2 )
+	 featarchive_open( &fa2, archive2, FEATARCHIVE_FEATS, Nwords );
+
       float **examples2 = NULL;
       int *N2 = NULL;
-      if ( filedir2 ) {
+      if ( filedir2 || archive2 ) {
 	 N2 = (int *) MALLOC( Nwords*sizeof(int *) );
 	 examples2 = (float **) MALLOC( Nwords*sizeof(float *) );
 	 memset(examples2,0,Nwords*sizeof(float *));
@@ -585,16 +878,14 @@ int main(int argc, char **argv)
 	 if ( !( i >= rA && i < rB ) && !( i >= cA && i < cB ) )
 	    continue;
 	 
-	 char featbase[20];
-	 char featpref[20];
-	 sprintf( featbase, "%06d.binary", i+1 );
-	 sprintf( featpref, "%06d.binary", i+1 );
-	 featpref[3] = '\0';
-	 
-	 char featfile[200];
-	 sprintf( featfile, "%s/%s/%s", filedir, featpref, featbase );
-	 
-	 examples[i] = readfeats_file2( featfile, -1, -1, &N[i], &D );
+	 if ( archive ) {
+	    examples[i] = featarchive_feats( &fa, i, &N[i] );
+	    D = fa.D;
+	 } else {
+	    char featfile[200];
+	    token_file_name( featfile, sizeof(featfile), filedir, i );
+	    examples[i] = readfeats_file2( featfile, -1, -1, &N[i], &D );
+	 }
 
 	 snfacts[i] = (float *) MALLOC( N[i]*sizeof(float) );
 	 for ( int j = 0; j < N[i]; j++ ) {
@@ -605,9 +896,13 @@ int main(int argc, char **argv)
 	    snfacts[i][j] = powf(snfacts[i][j],0.5);
 	 }
 
-	 char featfile2[200];
-	 if ( examples2 ) {
-	    sprintf( featfile2, "%s/%s/%s", filedir2, featpref, featbase );
+	 if ( archive2 ) {
+	    examples2[i] = featarchive_feats( &fa2, i, &N2[i] );
+	    if ( fa2.D != D )
+	       fatal("archive2 feature dimension differs from the examples");
+	 } else if ( examples2 ) {
+	    char featfile2[200];
+	    token_file_name( featfile2, sizeof(featfile2), filedir2, i );
 	    examples2[i] = readfeats_file2( featfile2, -1, -1, &N2[i], &D );
 	 }
 
@@ -637,63 +932,22 @@ int main(int argc, char **argv)
 	    }	    
 	 }
 
-	 if ( N[i] > MAXFRAMES-1 ) {
-	    fprintf(stderr,
-		    "\nWARNING: %s (%d frames) exceeds MAXFRAMES=%d",
-		    featfile, N[i], MAXFRAMES); 
-	    N[i] = MAXFRAMES-1;
-	 }
-	 
-	 if ( N2 && N2[i] > MAXFRAMES-1 ) {
-	    fprintf(stderr,
-		    "\nWARNING: %s (%d frames) exceeds MAXFRAMES=%d",
-		    featfile, N2[i], MAXFRAMES); 
-	    N2[i] = MAXFRAMES-1;
-	 }
       }
+      if ( archive )
+	 featarchive_close( &fa );
+      if ( archive2 )
+	 featarchive_close( &fa2 );
       fprintf(stderr, "%f s\n",toc());
       fprintf(stderr,"Feature dimension: %d\n", D); tic();
       
       // Compute the example similarities
       fprintf(stderr,"Computing word example similarities: "); tic();
-      
-      int pctstep = (rB-rA)/10;
-      for ( int i = rA; i < rB; i++ ) {
-	 if ( ((i-rA+1) % pctstep) == 0 )
-	    fprintf(stderr,".");
-
-	 for ( int j = cA; j < cB; j++ ) {
-	    if ( j <= i ) 
-	       continue;
-
-	    float *fact1 = snfacts[i];
-	    float *fact2 = snfacts[j];
-
-	    float dtwdist;
-
-	    if ( NULL == examples2 ) {
-	       if ( usedtw3D )
-		  dtwdist = dtw3D( examples[i], N[i], examples[j], N[j], D, 0 );
-	       else 
-		  dtwdist = dtw( examples[i], N[i], examples[j], N[j], D, fact1, fact2 );
-	    } else {
-	       dtwdist = dtw( examples[i], N[i], examples2[j], N2[j], D, fact1, fact2 );
-	    }
-	    
-	    if ( dtwdist > 1000 ) 
-	       dtwdist = 1+(((float)rand())/RAND_MAX)*0.001;
-
-	    if ( dtwdist > distthr )
-	       continue;
-	    
-	    int sw = !strcmp( words[i], words[j] );
-	    int sp = spkr[i] == spkr[j];
-	    if ( printinds )
-	       printf("%f %d %d %d %d\n", dtwdist, sw, sp, i+1, j+1);
-	    else
-	       printf("%f %d %d\n", dtwdist, sw, sp);
-	 }
-      }
+      WordSet set = { words, spkr, D, N, N2, examples, examples2, snfacts, NULL, NULL, NULL };
+      if ( use_bounds() )
+	 word_envelopes( &set, rA, rB, cA, cB, Nwords );
+      compute_similarities( &set, rA, rB, cA, cB );
+      if ( set.env )
+	 free_envelopes( &set, Nwords );
       fprintf(stderr, " %f s\n",toc());
       FREE(N);
       if (N2) FREE(N2);
@@ -717,52 +971,31 @@ int main(int argc, char **argv)
       int **examples = (int **) MALLOC( Nwords*sizeof(int *) );
       memset(examples,0,Nwords*sizeof(int *));
 
+      FeatArchive fa;
+      if ( archive )
+	 featarchive_open( &fa, archive, FEATARCHIVE_TOKENS, Nwords );
+
       for ( int i = 0; i < Nwords; i++ ) {
 	 if ( !( i >= rA && i < rB ) && !( i >= cA && i < cB ) )
 	    continue;
 	 
-	 char featbase[20];
-	 char featpref[20];
-	 sprintf( featbase, "%06d.binary", i+1 );
-	 sprintf( featpref, "%06d.binary", i+1 );
-	 featpref[3] = '\0';
-	 
-	 char featfile[100];
-	 sprintf( featfile, "%s/%s/%s", filedir, featpref, featbase );
-	 
-	 examples[i] = readtokens_file( featfile, -1, -1, &N[i] );
-
-	 if ( N[i] > MAXFRAMES-1 ) {
-	    fprintf(stderr,
-		    "\nWARNING: %s (%d frames) exceeds MAXFRAMES=%d",
-		    featfile, N[i], MAXFRAMES); 
-	    N[i] = MAXFRAMES-1;
+	 if ( archive ) {
+	    examples[i] = featarchive_tokens( &fa, i, &N[i] );
+	 } else {
+	    char featfile[200];
+	    token_file_name( featfile, sizeof(featfile), filedir, i );
+	    examples[i] = readtokens_file( featfile, -1, -1, &N[i] );
 	 }
+
       }
+      if ( archive )
+	 featarchive_close( &fa );
       fprintf(stderr, "%f s\n",toc());
       
       // Compute the example similarities
       fprintf(stderr,"Computing word example similarities: "); tic();
-      
-      int pctstep = (rB-rA)/10;
-      for ( int i = rA; i < rB; i++ ) {
-	 if ( ((i-rA+1) % pctstep) == 0 )
-	    fprintf(stderr,".");
-
-	 for ( int j = cA; j < cB; j++ ) {
-	    if ( j <= i ) 
-	       continue;
-	    
-	    float editdist = stredit( examples[i], N[i], examples[j], N[j] );
-	    
-	    int sw = !strcmp( words[i], words[j] );
-	    int sp = spkr[i] == spkr[j];
-	    if ( printinds )
-	       printf("%f %d %d %d %d\n", editdist, sw, sp, i+1, j+1 );
-	    else
-	       printf("%f %d %d\n", editdist, sw, sp);
-	 }
-      }
+      WordSet set = { words, spkr, 0, N, NULL, NULL, NULL, NULL, examples, NULL, NULL };
+      compute_similarities( &set, rA, rB, cA, cB );
       fprintf(stderr, " %f s\n",toc());
       FREE(N);
       for ( int i = 0; i < Nwords; i++ ) {
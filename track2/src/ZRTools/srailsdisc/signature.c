@@ -6,59 +6,65 @@
 #include "signature.h"
 #include "util.h"
 
-void new_signature (struct signature *sig, int id) {
-  sig->id = id;
-  sig->byte_ = (byte*) MALLOC(sizeof(byte) * SIG_NUM_BYTES);
+int SIG_NUM_BYTES;
+int *PERMUTE_;
+
+double COSINE_[SIG_MAX_BITS+1];
+int SIG_NUM_WORDS;
+
+void set_signature_bits (int S) {
+  if ( S <= 0 || S % 8 != 0 || S > SIG_MAX_BITS )
+    fatal("\nERROR: signature bits must be a positive multiple of 8 (at most 4096)");
+  SIG_NUM_BYTES = S/8;
+  SIG_NUM_WORDS = (SIG_NUM_BYTES+7)/8;
+  for (int h = 0; h <= S; h++)
+    COSINE_[h] = cos(h * 3.1415926535897932384626433832795029/ (SIG_NUM_BYTES*8));
 }
 
-int hamming (struct signature* x, struct signature* y) {
-  int diff = 0;
-  for (int i = 0; i < SIG_NUM_BYTES; i++)
-    diff += BITS_IN_[x->byte_[i] ^ y->byte_[i]];
-  return diff;
-}
-
-int numComparisons = 0;
-
-double approximate_cosine (struct signature* x, struct signature* y) {
-  numComparisons++;
-  return cos(hamming(x,y) * 3.1415926535897932384626433832795029/ (SIG_NUM_BYTES*8));
+void new_signatures (struct signature *sig, int n) {
+  if ( n <= 0 ) return;
+  byte *block = (byte*) CALLOC((size_t)n * SIG_NUM_WORDS, sizeof(uint64_t));
+  for (int i = 0; i < n; i++) {
+    sig[i].id = i;
+    sig[i].byte_ = block + (size_t)i * SIG_NUM_WORDS * sizeof(uint64_t);
+  }
 }
 
 void free_signatures ( struct signature *sig, int nsig ) 
 {
-   for ( int n = 0; n < nsig; n++ ) {
-      FREE(sig[n].byte_);
-   }
+   if ( nsig > 0 )
+      FREE(sig[0].byte_);
 
    FREE(sig);
 }
 
-struct signature* read_signatures (char *filename, int *n) {
-    struct signature sig;
-    new_signature(&sig,0);
-    int bytes_read = 0;
-
-    // Read through file once to establish how many sigs there are
-    (*n) = 0;
+// counts the whole signatures in a file
+static int count_signatures (char *filename) {
+    byte buf[SIG_MAX_BITS/8];
+    int n = 0;
     assert_file_exist( filename );
     FILE *fp = fopen(filename, "r");
-    while (! feof(fp)) {
-      if (SIG_NUM_BYTES == (bytes_read = fread(sig.byte_, 1, SIG_NUM_BYTES, fp)))
-	(*n)++;
+    while (! feof(fp) ) {
+      if (SIG_NUM_BYTES == fread(buf, 1, SIG_NUM_BYTES, fp))
+	n++;
     }
     fclose(fp);
+    return n;
+}
 
-    FREE(sig.byte_);
+struct signature* read_signatures (char *filename, int *n) {
+    int bytes_read = 0;
+
+    // Read through file once to establish how many sigs there are
+    (*n) = count_signatures(filename);
 
     // Initialize the array of signatures, now that we know how many there are
     struct signature *sig_ = (struct signature*) MALLOC((*n) * sizeof(struct signature));
+    new_signatures(sig_, *n);
 
     // Read in the signatures to the array
-    assert_file_exist( filename );
-    fp = fopen(filename, "r");
+    FILE *fp = fopen(filename, "r");
     for (int i = 0; i < *n; i++) {
-      new_signature(&(sig_[i]), i);
       if (SIG_NUM_BYTES > (bytes_read = fread(sig_[i].byte_, 1, SIG_NUM_BYTES, fp))) {
 	fprintf(stderr, "ERROR: in reading signature file, expected (%d) bytes but got (%d)\n",
 		SIG_NUM_BYTES, bytes_read);
@@ -71,33 +77,17 @@ struct signature* read_signatures (char *filename, int *n) {
 }
 
 struct signature* readsigs_file (char *filename, int *fA, int *fB, int *n) {
-    struct signature sig;
-    new_signature(&sig,0);
-
     int bytes_read = 0;
     int maxframes = *n;
 
     // Read through file once to establish how many sigs there are
-    (*n) = 0;
-    assert_file_exist( filename );
-    FILE *fp = fopen(filename, "r");
-    while (! feof(fp) ) {
-      if (SIG_NUM_BYTES == (bytes_read = fread(sig.byte_, 1, SIG_NUM_BYTES, fp)))
-	(*n)++;
-    }
-    fclose(fp);
+    (*n) = count_signatures(filename);
     
     if ( maxframes == 0 )
        maxframes = *n;
 
-    FREE(sig.byte_);
-
-    // Initialize the array of signatures, now that we know how many there are
-    struct signature *sig_ = (struct signature*) MALLOC((*n) * sizeof(struct signature));
-
     // Read in the signatures to the array
-    assert_file_exist( filename );
-    fp = fopen(filename, "r");
+    FILE *fp = fopen(filename, "r");
     
     if ( *fA == -1 || *fA < 0 ) *fA = 0;
     if ( *fA >= maxframes ) {
@@ -116,12 +106,15 @@ struct signature* readsigs_file (char *filename, int *fA, int *fB, int *n) {
        *fB = *fA + maxframes - 1;
        *n = *fB - *fA + 1;
     }
+
+    // Initialize the array of signatures, now that we know how many there are
+    struct signature *sig_ = (struct signature*) MALLOC((*n) * sizeof(struct signature));
+    new_signatures(sig_, *n);
     
     int offset = SIG_NUM_BYTES*(*fA);
     if(fseek(fp, offset, SEEK_SET) == EOF) fprintf(stderr,"seek failed");
 
     for (int i = 0; i < (*n); i++) {
-      new_signature(&(sig_[i]), i);
       if (SIG_NUM_BYTES > (bytes_read = fread(sig_[i].byte_, 1, SIG_NUM_BYTES, fp))) {
 	fprintf(stderr, "ERROR: in reading signature file, expected (%d) bytes but got (%d)\n",
 		SIG_NUM_BYTES, bytes_read);
@@ -230,9 +223,12 @@ int signature_ptr_equal (const void *x, const void *y) {
 }
 
 bool signature_is_zeroed (const struct signature* x) {
-  for (int i = 0; i < SIG_NUM_BYTES; i++)
-    if (x->byte_[i] != 0)
+  uint64_t w;
+  for (int i = 0; i < SIG_NUM_WORDS; i++) {
+    memcpy(&w, x->byte_ + 8*i, sizeof(uint64_t));
+    if (w != 0)
       return false;
+  }
   //printf("zeroed ");
   return true;
 }
@@ -6,10 +6,14 @@
 #ifndef SIGNATURE_H
 #define SIGNATURE_H
 
+#define SIG_MAX_BITS 4096 // Widest supported signature
+
 #include <tgmath.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include <search.h>
 #include <stdbool.h>
 #include "dot.h"
@@ -17,13 +21,10 @@
 
 typedef unsigned char byte;
 
-int numComparisons;
-
-int SIG_NUM_BYTES; // number of bytes in the signatures
-int *PERMUTE_; // permutation array for pleb search
-
-// based on http://infolab.stanford.edu/~manku/bitcount/bitcount.html
-const static int BITS_IN_[256] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
+extern int SIG_NUM_BYTES; // number of bytes in the signatures
+extern int SIG_NUM_WORDS; // number of 64-bit words holding a signature
+extern double COSINE_[SIG_MAX_BITS+1]; // approximate cosine indexed by hamming distance
+extern int *PERMUTE_; // permutation array for pleb search
 
 /* 
    (not based on any 3rd party)
@@ -40,13 +41,26 @@ struct signature {
     byte query;
 };
 
-// Initializes the referenced signature
-// sig->byte_ is initialized based on the current value of SIG_NUM_BYTES
-void new_signature (struct signature *sig, int id);
+// Sets SIG_NUM_BYTES and SIG_NUM_WORDS for S bit signatures and fills COSINE_
+void set_signature_bits (int S);
 
-// returns the number of bits that differ between the byte_ arrays of x and y
-int hamming (struct signature* x, struct signature* y);
+// Initializes n signatures with ids 0..n-1; the byte_ arrays share one
+// contiguous block, each zero padded to SIG_NUM_WORDS 64-bit words
+void new_signatures (struct signature *sig, int n);
 
+// returns the number of bits that differ between the byte_ arrays of x and y
+static inline int hamming (struct signature* x, struct signature* y) {
+  int diff = 0;
+  uint64_t a, b;
+  for (int i = 0; i < SIG_NUM_WORDS; i++) {
+    memcpy(&a, x->byte_ + 8*i, sizeof(uint64_t));
+    memcpy(&b, y->byte_ + 8*i, sizeof(uint64_t));
+    diff += __builtin_popcountll(a ^ b);
+  }
+  return diff;
+}
+
+// frees an array built by new_signatures (or the readers below)
 void free_signatures ( struct signature *sig, int nsig );
 
 // reads in a binary file of byte arrays of length SIG_NUM_BYTES
@@ -74,7 +88,9 @@ int signature_ptr_greater (const void *x, const void *y);
 // returns true when all bytes have the value 0
 bool signature_is_zeroed (const struct signature* x);
 
-double approximate_cosine (struct signature* x, struct signature* y);
+static inline double approximate_cosine (struct signature* x, struct signature* y) {
+  return COSINE_[hamming(x,y)];
+}
 
 int pleb( struct signature *x_sig_, int x_size, 
 	  struct signature *y_sig_, int y_size, 
@@ -11,6 +11,7 @@
 #include "util.h"
 #include "dot.h"
 #include "signature.h"
+#include "matchio.h"
 
 // PLEB parameters
 int P = 8;
@@ -24,6 +25,7 @@ char *sigfile2 = NULL;
 char *seglist1 = NULL;
 char *seglist2 = NULL;
 int diffspeech = 0;
+char *matchfile = NULL;
 
 void usage()
 {
@@ -34,7 +36,8 @@ void usage()
 \n\t[-P <n> (defaults to 8)]\
 \n\t[-B <n> (defaults to 10)]\
 \n\t[-T <n> (defaults to 0.95)]\
-\n\t[-S <n> (defaults to 64)]\n");
+\n\t[-S <n> (defaults to 64)]\
+\n\t[-matchfile <str> (write the matches to a binary match file)]\n");
 }
 
 void parse_args(int argc, char **argv)
@@ -50,6 +53,7 @@ void parse_args(int argc, char **argv)
      else if ( strcmp(argv[i], "-B") == 0 ) B = atoi(argv[++i]);
      else if ( strcmp(argv[i], "-T") == 0 ) T = atof(argv[++i]);
      else if ( strcmp(argv[i], "-S") == 0 ) S = atoi(argv[++i]);
+     else if ( strcmp(argv[i], "-matchfile") == 0 ) matchfile = argv[++i];
      else {
        fprintf(stderr, "unknown arg: %s\n", argv[i]);
        usage();
@@ -80,7 +84,29 @@ P = %d, B = %d, T = %f, S = %d\n\n",
 	  sigfile1, seglist1, sigfile2, seglist2,
 	  P, B, T, S);
 
-  SIG_NUM_BYTES = S/8;
+  set_signature_bits(S);
+}
+
+// Binary counterpart of dump_matchlist, grouped under the signature files
+void write_matchlist( char *fn, Dot *dotlist, int dotcnt, Segment *segs1, Segment *segs2 )
+{
+   MatchWriter mw;
+   matchio_open_write(&mw, fn, MATCH_LAYOUT_SRAILS, 6, 1);
+   matchio_set_names(&mw, sigfile1, sigfile2, NULL);
+
+   MatchRecord rec;
+   for ( int n = 0; n < dotcnt; n++ ) {
+      rec.ival[0] = segs1[dotlist[n].xp].xA;
+      rec.ival[1] = segs1[dotlist[n].xp].xB;
+      rec.ival[2] = segs2[dotlist[n].yp].xA;
+      rec.ival[3] = segs2[dotlist[n].yp].xB;
+      rec.ival[4] = dotlist[n].xp+1;
+      rec.ival[5] = dotlist[n].yp+1;
+      rec.fval[0] = dotlist[n].val;
+      matchio_write(&mw, &rec);
+   }
+
+   matchio_close_write(&mw);
 }
 
 int main(int argc, char **argv)
@@ -156,7 +182,10 @@ int main(int argc, char **argv)
 
    // Generating the matchlist
    fprintf(stderr,"Dumping %d matches\n",dotcnt);
-   dump_matchlist(dotlist, dotcnt, segs1, segs2);
+   if ( matchfile )
+      write_matchlist(matchfile, dotlist, dotcnt, segs1, segs2);
+   else
+      dump_matchlist(dotlist, dotcnt, segs1, segs2);
 
    // Free the heap
    FREE(dotlist);